@@ -19,6 +19,86 @@
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
 /** @endcond*/
 
+/**
+ * @brief Milliseconds azx_apn caches the ICCID of the SIM for, 60000 if not defined.
+ */
+/* #define AZX_APN_CCID_CACHE_MS 60000 */
+
+/**
+ * @brief Size in bytes of the azx_buffer ring. Must be a power of 2, 16 KB if not defined.
+ */
+/* #define AZX_BUFFER_SIZE (16 * 1024) */
+
+/**
+ * @brief Blocks of each azx_pool size class, from 16 to 2048 bytes.
+ */
+/* #define AZX_POOL_CLASS_BLOCKS 64, 64, 32, 32, 16, 8, 4, 2 */
+
+/**
+ * @brief Place the azx_pool slabs in static memory rather than on the heap.
+ */
+/* #define AZX_POOL_STATIC_BACKING */
+
+/**
+ * @brief Have AZX_LOG_INIT() switch on asynchronous logging.
+ */
+/* #define AZX_LOG_ASYNC */
+
+/**
+ * @brief Size in bytes of the asynchronous log ring. Must be a power of 2, 8 KB if not defined.
+ */
+/* #define AZX_LOG_ASYNC_BUFFER_SIZE (8 * 1024) */
+
+/**
+ * @brief Lowest log level compiled in. Calls below it are removed by the preprocessor.
+ */
+/* #define AZX_LOG_MIN_LEVEL AZX_LOG_LEVEL_INFO */
+
+/**
+ * @brief Bytes of file logs cached before they are written out, 4 KB if not defined.
+ */
+/* #define AZX_LOG_FILE_FLUSH_BYTES (4 * 1024) */
+
+/**
+ * @brief Most milliseconds file logs are cached before they are written out, 2000 if not defined.
+ */
+/* #define AZX_LOG_FILE_FLUSH_MS 2000 */
+
+/**
+ * @brief Number of call sites azx_log_setRateLimit() keeps track of, 16 if not defined.
+ */
+/* #define AZX_LOG_RATE_SITES 16 */
+
+/**
+ * @brief Largest key/value log frame written by AZX_LOG_KV(), 256 bytes if not defined.
+ */
+/* #define AZX_LOG_KV_MAX_SIZE 256 */
+
+/**
+ * @brief Milliseconds a task message payload can be held before it counts as leaked, 10000 if not defined.
+ */
+/* #define AZX_TASKS_MSG_LEAK_MS 10000 */
+
+/**
+ * @brief Most timers that can be initialized at the same time, 64 if not defined.
+ */
+/* #define AZX_TIMER_MAX_TIMERS 64 */
+
+/**
+ * @brief Milliseconds between the checks for expired timers, 10 if not defined.
+ */
+/* #define AZX_TIMER_TICK_MS 10 */
+
+/**
+ * @brief Log window of the azx_log_gzip deflate (9 to 15), 10 if not defined.
+ */
+/* #define AZX_LOG_GZIP_WINDOW_BITS 10 */
+
+/**
+ * @brief Memory level of the azx_log_gzip deflate (1 to 9), 3 if not defined.
+ */
+/* #define AZX_LOG_GZIP_MEM_LEVEL 3 */
+
 
 
 
@@ -5,7 +5,7 @@
 #define LIBS_HDR_APN_H_
 /**
  * @file azx_apn.h
- * @version 1.0.2
+ * @version 1.0.3
  * @dependencies core/azx_ati core/azx_string
  * @author Demetris Constantinou
  * @author Sorin Basca
@@ -169,7 +169,8 @@ void azx_apn_init(void);
  * @brief Checks the SIM status again and may update the APN.
  *
  * This function checks the SIM presence and the ICCID value and will select the optimal APN for
- * that value.
+ * that value. The ICCID is cached by azx_ati, and only read again from the SIM once it has been
+ * found missing, or after `AZX_APN_CCID_CACHE_MS` (60 s if not defined in `app_cfg.h`).
  *
  * The function just stores the APN in memory and the new value can be retrieved through
  * azx_apn_getInfo. The APN does not get registered with the modem. This is useful if the APN is
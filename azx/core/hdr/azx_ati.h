@@ -5,8 +5,8 @@
 #define UUID_713c3323_6a68_43dd_80ac_e7dddf0013e8
 /**
  * @file azx_ati.h
- * @version 1.0.2
- * @dependencies core/azx_buffer core/azx_log core/azx_utils
+ * @version 1.7.2
+ * @dependencies core/azx_log core/azx_utils core/azx_timer
  * @author Sorin Basca
  * @date 10/02/2019
  *
@@ -21,7 +21,21 @@
  * automatically go to instance 0, so you don't need to specify it in each call
  *
  * All the azx_ati_sendCommand() functions are synchronous. They only return
- * once a response has been received, or the timeout triggered.
+ * once a response has been received, or the timeout triggered. If the caller
+ * should not block, azx_ati_sendCommandAsyncEx() queues the command instead and
+ * reports the response through a callback.
+ *
+ * Each instance receives responses into one window and hands them out from a
+ * second one, so they are returned without copying. A response stays valid
+ * until the next command on the instance, whatever else is received in the
+ * meantime. To keep a response for longer, either hold on to a handle from
+ * azx_ati_sendCommandHandleEx() and check it with azx_ati_getResponse(), or let
+ * azx_ati_sendCommandToBufferEx() copy it into a buffer of your own.
+ *
+ * Responses must fit in a 2 KB receive window. Commands returning bigger
+ * payloads (like `AT#SRECV` or `AT#M2MREAD`) can use
+ * azx_ati_sendCommandStreamEx(), which hands the payload to a callback as it
+ * arrives.
  *
  * To receive unsolicited responses, use azx_ati_addUrcHandler(). If you want
  * some unsolicited message ignored (so it does not risk leaking into an
@@ -29,11 +43,24 @@
  *
  * Each AT instance will have its own URC handlers, so if you use multiple
  * instances, make sure to register handlers on both as appropriate.
+ *
+ * If it doesn't matter which instance runs a command, the
+ * azx_ati_pool_sendCommand() functions send it on the least busy instance,
+ * opening more instances as needed. Flows which span several commands on the
+ * same instance can take one out of the pool with azx_ati_pool_pin().
+ *
+ * Every command sent is accounted per command name (like `AT+CSQ`): how many
+ * were sent, timed out or failed, and how long they took, with the time spent
+ * waiting for the instance kept apart from the time the modem took. See
+ * azx_ati_getCommandStats() and azx_ati_setCommandStatsDump().
+ *
+ * Queries whose answer doesn't change (like `AT+CGSN`) can be answered from a
+ * cache instead of the modem, see azx_ati_cacheResponses().
  */
 #include "m2mb_types.h"
 #include "azx_log.h"
-#include "azx_buffer.h"
 #include "azx_utils.h"
+#include "azx_timer.h"
 
 /**
  * @brief If unsure about what timeout to use, you can use this default value.
@@ -53,6 +80,115 @@ struct AzxBinaryData
   const UINT8* data;
 };
 
+/**
+ * @brief How many buckets there are in the latency histogram of a command
+ */
+#define AZX_ATI_LATENCY_BUCKETS 12
+
+/**
+ * @brief The maximum length of a command name in the stats, including the terminator
+ */
+#define AZX_ATI_STATS_PREFIX_SIZE 32
+
+/**
+ * @brief Statistics of one command
+ *
+ * The modem time is from sending the command to its final result code. The
+ * wait time is spent before that, waiting for the AT instance to become
+ * available. Latencies are only accounted for commands which got a response.
+ *
+ * Bucket 0 of the histogram counts modem times below 8 ms. Each following
+ * bucket is twice as wide as the previous one (8-15 ms, 16-31 ms, ...) and the
+ * last one counts everything above.
+ *
+ * @see azx_ati_getCommandStats
+ */
+typedef struct
+{
+  CHAR prefix[AZX_ATI_STATS_PREFIX_SIZE];      /**< The command name, e.g. "AT+CSQ" */
+  UINT32 count;                                /**< How many were sent */
+  UINT32 timeouts;                             /**< How many got no response in time */
+  UINT32 errors;                               /**< How many ended in ERROR, +CME/+CMS ERROR or NO CARRIER */
+  UINT32 min_ms;                               /**< Shortest modem time */
+  UINT32 max_ms;                               /**< Longest modem time */
+  UINT32 total_ms;                             /**< Sum of the modem times */
+  UINT32 max_wait_ms;                          /**< Longest wait for the instance */
+  UINT32 total_wait_ms;                        /**< Sum of the waits for the instance */
+  UINT32 histogram[AZX_ATI_LATENCY_BUCKETS];   /**< Modem times on a log scale */
+} AZX_ATI_CMD_STATS_T;
+
+/**
+ * @brief Handle to a stored response
+ *
+ * It goes stale once another command is sent on the instance, after which
+ * azx_ati_getResponse() returns NULL instead of someone else's data.
+ */
+typedef UINT32 AZX_ATI_RESPONSE_HANDLE;
+
+/**
+ * @brief The handle that never refers to a response
+ */
+#define AZX_ATI_NO_RESPONSE 0
+
+/**
+ * @brief Callback receiving a streamed payload piece by piece.
+ *
+ * It is called from the AT instance context, without the instance being held,
+ * so other tasks can queue commands and register URC handlers meanwhile. The
+ * rest of the response, and any URC of the instance, is only read once it
+ * returns though, so it must not:
+ * - send AT commands on the same instance, or wait for anything that does:
+ *   the command being streamed holds the instance until its response is
+ *   complete, so they would deadlock
+ * - take longer than the modem can buffer what follows; a sink that writes to
+ *   flash should write what it gets in one go rather than byte by byte
+ *
+ * @param[in] ctx The context from the stream description
+ * @param[in] data The next bytes of the payload
+ * @param[in] size How many bytes there are in data
+ *
+ * @see azx_ati_sendCommandStreamEx
+ */
+typedef void (*azx_ati_payload_sink_cb)(void* ctx, const UINT8* data, UINT32 size);
+
+/**
+ * @brief Describes where the payload is in a streamed response
+ *
+ * The payload starts right after the first occurrence of the marker. If
+ * size_in_header is set, the marker starts a header line instead, the payload
+ * starts after the end of that line, and the last number on the line is the
+ * actual payload size.
+ *
+ * @see azx_ati_sendCommandStreamEx
+ */
+typedef struct
+{
+  const CHAR* marker;           /**< The text preceding the payload, e.g. "<<<" or "#SRECV:" */
+  UINT32 size;                  /**< The maximum payload size */
+  BOOLEAN size_in_header;       /**< TRUE if the marker line ends with the payload size */
+  azx_ati_payload_sink_cb sink; /**< Where the payload goes */
+  void* ctx;                    /**< Passed to the sink */
+  UINT32 received;              /**< Filled in with how many payload bytes were passed to the sink */
+} AZX_ATI_STREAM_T;
+
+/**
+ * @brief One command of a batch
+ *
+ * The caller fills in the command and its timeout, the rest is filled in by
+ * azx_ati_sendBatchEx().
+ *
+ * @see azx_ati_sendBatchEx
+ */
+typedef struct
+{
+  const CHAR* cmd;              /**< The full command, without the line terminator */
+  INT32 timeout_ms;             /**< How long to wait for the response of this command */
+  struct AzxBinaryData response; /**< The response. Size 0, NULL data if timed out or dropped */
+  AZX_ATI_RESPONSE_HANDLE handle; /**< Handle to the response, to check it is still valid */
+  BOOLEAN ok;                   /**< TRUE if the response ended with OK */
+  UINT32 elapsed_ms;            /**< Time from sending the command to its final result code */
+} AZX_ATI_BATCH_CMD_T;
+
 /**
  * @name Convenience macros that default to using AT instance 0
  * @{
@@ -61,7 +197,13 @@ struct AzxBinaryData
 #define azx_ati_sendCommandExpectOk(...) azx_ati_sendCommandExpectOkEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandExpectOkEx */
 #define azx_ati_sendCommandBinary(...) azx_ati_sendCommandBinaryEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandBinaryEx */
 #define azx_ati_sendCommandAndLog(...) azx_ati_sendCommandAndLogEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandAndLogEx */
+#define azx_ati_sendCommandHandle(...) azx_ati_sendCommandHandleEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandHandleEx */
+#define azx_ati_sendCommandToBuffer(...) azx_ati_sendCommandToBufferEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandToBufferEx */
+#define azx_ati_sendCommandStream(...) azx_ati_sendCommandStreamEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandStreamEx */
+#define azx_ati_sendCommandAsync(...) azx_ati_sendCommandAsyncEx(0, __VA_ARGS__) /**< @see azx_ati_sendCommandAsyncEx */
+#define azx_ati_sendBatch(...) azx_ati_sendBatchEx(0, __VA_ARGS__) /**< @see azx_ati_sendBatchEx */
 #define azx_ati_addUrcHandler(...) azx_ati_addUrcHandlerEx(0, __VA_ARGS__) /**< @see azx_ati_addUrcHandlerEx */
+#define azx_ati_invalidateCacheOnUrc(...) azx_ati_invalidateCacheOnUrcEx(0, __VA_ARGS__) /**< @see azx_ati_invalidateCacheOnUrcEx */
 #define azx_ati_deinit(...) azx_ati_deinitEx(0) /**< @see azx_ati_deinitEx */
 /** @} */
 
@@ -180,6 +322,378 @@ const struct AzxBinaryData* azx_ati_sendCommandBinaryEx(UINT8 instance, INT32 ti
  */
 const CHAR* azx_ati_sendCommandAndLogEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd, ...);
 
+/**
+ * @brief Sends an AT command and returns a handle to its response.
+ *
+ * Unlike the pointer returned by azx_ati_sendCommandBinaryEx(), the handle can
+ * be kept around safely. Once another command has been sent on the instance,
+ * azx_ati_getResponse() reports it as gone rather than returning unrelated
+ * data.
+ *
+ * Example:
+ *
+ *     AZX_ATI_RESPONSE_HANDLE h = azx_ati_sendCommandHandleEx(0, AZX_ATI_DEFAULT_TIMEOUT, "AT+CCID");
+ *     ...
+ *     const struct AzxBinaryData* ccid = azx_ati_getResponse(h);
+ *     if(ccid)
+ *     {
+ *       // Parse the response
+ *     }
+ *
+ * @param[in] instance The AT instance to use (0 or 1).
+ * @param[in] timeout_ms How long to wait for a response
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return The handle of the response, or @ref AZX_ATI_NO_RESPONSE if there was
+ *     no response before timeout.
+ *
+ * @see azx_ati_getResponse
+ */
+AZX_ATI_RESPONSE_HANDLE azx_ati_sendCommandHandleEx(UINT8 instance, INT32 timeout_ms,
+    const CHAR* cmd, ...);
+
+/**
+ * @brief Looks up the response a handle refers to.
+ *
+ * @param[in] handle A handle from azx_ati_sendCommandHandleEx() or a batch
+ *     descriptor.
+ *
+ * @return The response, or NULL if its storage has been reused since. The
+ *     returned pointer itself is only valid until the next command on the
+ *     same instance.
+ */
+const struct AzxBinaryData* azx_ati_getResponse(AZX_ATI_RESPONSE_HANDLE handle);
+
+/**
+ * @brief Sends an AT command and copies its response into the given buffer.
+ *
+ * The copy is made while the instance is still held, so the response cannot
+ * be overwritten by another task in the meantime. The copy is always NUL
+ * terminated.
+ *
+ * @param[in] instance The AT instance to use (0 or 1).
+ * @param[in] timeout_ms How long to wait for a response
+ * @param[out] buf Where to copy the response
+ * @param[in] buf_size The size of buf, including room for the terminator
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return The full size of the response, which is bigger than what was copied
+ *     if buf was too small. -1 if there was no response before timeout.
+ */
+SSIZE_T azx_ati_sendCommandToBufferEx(UINT8 instance, INT32 timeout_ms, UINT8* buf,
+    UINT32 buf_size, const CHAR* cmd, ...);
+
+/**
+ * @brief Sends an AT command and streams the payload of its response.
+ *
+ * The payload is passed to the sink of the stream as it is received, so it is
+ * not limited by the size of the receive buffer. Only the rest of the response
+ * (the header and the final result code) is buffered and returned.
+ *
+ * Example:
+ *
+ *     static void write_to_file(void* ctx, const UINT8* data, UINT32 size)
+ *     {
+ *       fwrite(data, 1, size, (FILE*)ctx);
+ *     }
+ *
+ *     AZX_ATI_STREAM_T stream = {
+ *       .marker = "#SRECV:", .size = 65536, .size_in_header = TRUE,
+ *       .sink = write_to_file, .ctx = file
+ *     };
+ *     const struct AzxBinaryData* rsp = azx_ati_sendCommandStreamEx(0, 30000, &stream,
+ *         "AT#SRECV=1,%u", stream.size);
+ *
+ * @param[in] instance The AT instance to use (0 or 1).
+ * @param[in] timeout_ms How long to wait for the whole response
+ * @param[in,out] stream Where the payload is and where it goes. The number of
+ *     payload bytes received is written back.
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return The response without the payload. It is valid until the next call to
+ *     any azx_ati_sendCommand() on the same instance. If there was no response
+ *     before timeout, `NULL` is returned.
+ *
+ * @see AZX_ATI_STREAM_T
+ */
+const struct AzxBinaryData* azx_ati_sendCommandStreamEx(UINT8 instance, INT32 timeout_ms,
+    AZX_ATI_STREAM_T* stream, const CHAR* cmd, ...);
+
+/**
+ * @brief Sends a sequence of AT commands back to back.
+ *
+ * The instance is held for the whole batch, so no other command can be
+ * interleaved and each command is sent as soon as the previous final result
+ * code arrives.
+ *
+ * The responses stored in the descriptors stay valid until the next command
+ * on the instance, as long as they all fit in the 2 KB window along with the
+ * commands. Otherwise the earliest ones are dropped to make room: their
+ * response is set back to size 0 and NULL data, and their handle to
+ * @ref AZX_ATI_NO_RESPONSE, while `ok` still tells how the command ended.
+ *
+ * Example:
+ *
+ *     AZX_ATI_BATCH_CMD_T cmds[] = {
+ *       { .cmd = "AT+CGSN", .timeout_ms = AZX_ATI_DEFAULT_TIMEOUT },
+ *       { .cmd = "AT+CCID", .timeout_ms = AZX_ATI_DEFAULT_TIMEOUT },
+ *       { .cmd = "AT#CGPADDR=1", .timeout_ms = AZX_ATI_DEFAULT_TIMEOUT },
+ *     };
+ *     UINT16 done = azx_ati_sendBatchEx(0, cmds, 3, TRUE);
+ *
+ * @param[in] instance The AT instance to use (0 or 1).
+ * @param[in,out] cmds The commands to send. The results are written back.
+ * @param[in] count How many commands there are in cmds
+ * @param[in] stop_on_error If TRUE, the batch stops at the first command
+ *     which doesn't end with OK (error or timeout)
+ *
+ * @return How many commands were sent. The last one sent is the failing one
+ *     if the batch stopped on error.
+ *
+ * @see AZX_ATI_BATCH_CMD_T
+ */
+UINT16 azx_ati_sendBatchEx(UINT8 instance, AZX_ATI_BATCH_CMD_T* cmds, UINT16 count,
+    BOOLEAN stop_on_error);
+
+/**
+ * @brief Callback notifying the completion of an asynchronous AT command.
+ *
+ * It is issued either from the AT instance callback, or from the timer task
+ * when the command timed out. Keep the processing short and never call the
+ * synchronous azx_ati_sendCommand() functions from it: queue further commands
+ * with azx_ati_sendCommandAsyncEx() or hand the work over to another task.
+ *
+ * @param[in] ctx The context that was passed to azx_ati_sendCommandAsyncEx()
+ * @param[in] response The response, including the final result code. It is only
+ *     valid for the duration of the callback. `NULL` if the command timed out
+ *     or could not be sent.
+ *
+ * @see azx_ati_sendCommandAsyncEx
+ */
+typedef void (*azx_ati_response_cb)(void* ctx, const struct AzxBinaryData* response);
+
+/**
+ * @brief Queues an AT command and returns straight away.
+ *
+ * Each instance keeps a FIFO of asynchronous commands. As soon as the final
+ * result code of a command arrives, the next queued one is sent and only then
+ * is the response delivered to its callback. Synchronous callers on the same
+ * instance wait until the queue has drained.
+ *
+ * The timeout is handled through an azx_timer, so azx_tasks_init() must have
+ * been called before using this.
+ *
+ * Example:
+ *
+ *     static void csq_cb(void* ctx, const struct AzxBinaryData* response)
+ *     {
+ *       if(response)
+ *       {
+ *         // Parse "+CSQ: %d,%d"
+ *       }
+ *     }
+ *
+ *     azx_ati_sendCommandAsyncEx(0, AZX_ATI_DEFAULT_TIMEOUT, &csq_cb, NULL, "AT+CSQ");
+ *
+ * @param[in] instance The AT instance to use (0 or 1).
+ * @param[in] timeout_ms How long to wait for a response once the command is sent
+ * @param[in] cb The function receiving the response. Can be NULL.
+ * @param[in] ctx Passed to cb as is
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *     The resolved command must fit in 125 characters.
+ *
+ * @return TRUE if the command was queued, FALSE if the queue is full, the
+ *     command is too long, or the instance cannot be opened.
+ *
+ * @see azx_ati_response_cb
+ * @see azx_ati_sendCommandEx
+ */
+BOOLEAN azx_ati_sendCommandAsyncEx(UINT8 instance, INT32 timeout_ms, azx_ati_response_cb cb,
+    void* ctx, const CHAR* cmd, ...);
+
+/**
+ * @brief Sends an AT command on the least busy AT instance.
+ *
+ * Instances are opened lazily: a new one is only opened when all the open ones
+ * are busy. Pinned instances are not used.
+ *
+ * @param[in] timeout_ms How long to wait for a response
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return The response string. It is valid until the next call to any
+ *     azx_ati_sendCommand() on the same instance, so parse or copy it straight
+ *     away. If there was no response before timeout, `NULL` is returned.
+ *
+ * @see azx_ati_sendCommandEx
+ */
+const CHAR* azx_ati_pool_sendCommand(INT32 timeout_ms, const CHAR* cmd, ...);
+
+/**
+ * @brief Sends an AT command on the least busy AT instance and checks that OK
+ * is received.
+ *
+ * @param[in] timeout_ms How long to wait for a response
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return TRUE if OK was received, FALSE if a timeout, or error occurred.
+ *
+ * @see azx_ati_sendCommandExpectOkEx
+ */
+BOOLEAN azx_ati_pool_sendCommandExpectOk(INT32 timeout_ms, const CHAR* cmd, ...);
+
+/**
+ * @brief Sends an AT command on the least busy AT instance and returns its
+ * binary response.
+ *
+ * @param[in] timeout_ms How long to wait for a response
+ * @param[in] cmd The command format followed by any parameters to resolve it.
+ *
+ * @return The response data, or `NULL` if there was no response before timeout.
+ *
+ * @see azx_ati_sendCommandBinaryEx
+ */
+const struct AzxBinaryData* azx_ati_pool_sendCommandBinary(INT32 timeout_ms,
+    const CHAR* cmd, ...);
+
+/**
+ * @brief Takes the least busy AT instance out of the pool.
+ *
+ * Use this for stateful flows, like sending an SMS with `AT+CMGS` and its
+ * prompt, which must run on a single instance. The pool won't route commands to
+ * the instance until azx_ati_pool_unpin() is called. Send the commands with the
+ * *Ex functions on the returned instance.
+ *
+ * Example:
+ *
+ *     INT16 at = azx_ati_pool_pin();
+ *     if(at >= 0)
+ *     {
+ *       azx_ati_sendCommandEx(at, AZX_ATI_DEFAULT_TIMEOUT, "AT+CMGS=\"%s\"", number);
+ *       azx_ati_sendCommandEx(at, 30000, "%s\x1A", text);
+ *       azx_ati_pool_unpin(at);
+ *     }
+ *
+ * @return The pinned instance, or -1 if all instances are pinned or cannot be
+ *     opened.
+ *
+ * @see azx_ati_pool_unpin
+ */
+INT16 azx_ati_pool_pin(void);
+
+/**
+ * @brief Returns an instance taken by azx_ati_pool_pin() to the pool.
+ *
+ * @param[in] instance The instance returned by azx_ati_pool_pin()
+ */
+void azx_ati_pool_unpin(INT16 instance);
+
+/**
+ * @brief Gets the statistics of a command.
+ *
+ * Commands are grouped by their name, which is everything before the
+ * parameters or the query mark, so `AT+CGDCONT=1,"IP"` and `AT+CGDCONT?` are
+ * both accounted as `AT+CGDCONT`. Once 23 different names are tracked, the rest
+ * are accounted as "(other)".
+ *
+ * @param[in] prefix The command name, e.g. "AT+CSQ"
+ * @param[out] stats Where to copy the statistics
+ *
+ * @return TRUE if the command has been sent at least once
+ *
+ * @see AZX_ATI_CMD_STATS_T
+ */
+BOOLEAN azx_ati_getCommandStats(const CHAR* prefix, AZX_ATI_CMD_STATS_T* stats);
+
+/**
+ * @brief Gets the statistics of all the commands sent so far.
+ *
+ * @param[out] stats Where to copy the statistics
+ * @param[in] max_count How many entries fit in stats
+ *
+ * @return How many entries were copied
+ */
+UINT16 azx_ati_getAllCommandStats(AZX_ATI_CMD_STATS_T* stats, UINT16 max_count);
+
+/**
+ * @brief Clears the statistics of all the commands.
+ */
+void azx_ati_resetCommandStats(void);
+
+/**
+ * @brief Logs the statistics of all the commands, one line per command.
+ */
+void azx_ati_logCommandStats(void);
+
+/**
+ * @brief Logs the statistics of all the commands periodically.
+ *
+ * @param[in] period_ms How often to log them. 0 stops the periodic logging.
+ *
+ * @return FALSE if the timer could not be created
+ *
+ * @see azx_ati_logCommandStats
+ */
+BOOLEAN azx_ati_setCommandStatsDump(UINT32 period_ms);
+
+/**
+ * @brief Answers a command from a cache once it has succeeded.
+ *
+ * The first time the command ends with OK, its response is stored. Until it
+ * expires or is invalidated, azx_ati_sendCommand(), its variants and the pool
+ * functions return the stored response without sending anything to the modem.
+ * Only use this for queries without side effects.
+ *
+ * The command must match exactly once formatted, without the line
+ * terminator. Up to 8 commands can be cached, with responses shorter than 128
+ * bytes. A cached response is handed out as a copy, valid like any other
+ * response until the next command is sent on the instance.
+ *
+ * Example:
+ *
+ *     azx_ati_cacheResponses("AT+CGSN", 0);
+ *     azx_ati_cacheResponses("AT+CSQ", 5000);
+ *
+ * @param[in] cmd The command, e.g. "AT+CCID"
+ * @param[in] ttl_ms How long a response stays valid. 0 means until it is
+ *     invalidated. Calling it again for the same command updates the TTL.
+ *
+ * @return FALSE if the cache is full or the command too long
+ *
+ * @see azx_ati_invalidateCache
+ * @see azx_ati_invalidateCacheOnUrcEx
+ */
+BOOLEAN azx_ati_cacheResponses(const CHAR* cmd, UINT32 ttl_ms);
+
+/**
+ * @brief Drops a cached response, so the next command goes to the modem.
+ *
+ * @param[in] cmd The command, as passed to azx_ati_cacheResponses(). NULL
+ *     drops all of them.
+ */
+void azx_ati_invalidateCache(const CHAR* cmd);
+
+/**
+ * @brief Drops a cached response whenever a URC is received.
+ *
+ * For example, the address of a PDP context can be dropped when the network
+ * reports a change on it (with `AT+CGEREP` enabled):
+ *
+ *     azx_ati_cacheResponses("AT+CGPADDR=1", 0);
+ *     azx_ati_invalidateCacheOnUrcEx(0, "+CGEV:", "AT+CGPADDR=1");
+ *
+ * The URC is removed from responses like any other registered URC, so the
+ * header must not also start a line of some command response (like `#QSS:`
+ * does for `AT#QSS?`). It can still have a handler registered with
+ * azx_ati_addUrcHandlerEx().
+ *
+ * @param[in] instance The AT instance the URC is received on
+ * @param[in] msg_header The start of the URC
+ * @param[in] cmd The command, as passed to azx_ati_cacheResponses()
+ *
+ * @return FALSE if the command is not cached, or the URC can't be registered
+ */
+BOOLEAN azx_ati_invalidateCacheOnUrcEx(UINT8 instance, const CHAR* msg_header, const CHAR* cmd);
+
 /**
  * @brief Callback notifying of a new URC.
  *
@@ -201,6 +715,10 @@ typedef void (*azx_urc_received_cb)(const CHAR* msg);
  * Each handler is stored per instance, so if using multiple instances you need
  * to cover both of them.
  *
+ * There is no fixed limit on the number of handlers. Registering the same
+ * header again replaces its handler. If the headers of several handlers match
+ * a line (e.g. "+CREG:" and "+CREG: 5"), the longest one gets the URC.
+ *
  * Example:
  *
  *     // Get notified of SIM events
@@ -5,7 +5,7 @@
 #define BUFFER_QUEUE_H
 /**
  * @file azx_buffer.h
- * @version 1.0.1
+ * @version 1.1.0
  * @dependencies core/azx_log
  * @author Sorin Basca
  * @date 10/02/2017
@@ -39,14 +39,20 @@
  *       }
  *     }
  *
- * There is no need to clear the data once consumed, but there is a risk of the
- * data not being reliable. If for example too much data is passed like this
- * too quickly while it's not being processed fast enough, it may be the case
- * that new data will overwrite the old one.
+ * There is no need to clear the data once consumed. The buffer is a ring, so
+ * if too much data is passed like this while it's not being processed fast
+ * enough, new data will overwrite the old one. Every ID carries the position
+ * of its data, so once it is overwritten azx_buffer_get() returns an empty
+ * string and azx_buffer_getObj() returns NULL, rather than someone else's data.
+ * A consumer that could be outrun while reading should use
+ * azx_buffer_copyObj(), which detects an overwrite during the copy.
+ *
+ * Adding data takes no lock, so it can be done from any task at the same time.
  *
  * Therefore it is important that the design of the flow is done to allow for
  * lower insert rates than consume rates. Other times the errors can be avoided
- * by increasing the inner buffer.
+ * by increasing the inner buffer, by defining `AZX_BUFFER_SIZE` in `app_cfg.h`
+ * (16 KB by default, it must be a power of 2).
  */
 #include "m2mb_types.h"
 #include "azx_log.h"
@@ -59,7 +65,7 @@
  *     (until the NUL terminator) is to be stored, set this to -1
  *
  * @return An ID that is used to retrieve the string later. If the string cannot
- *     be stored, this will be -1.
+ *     be stored (it takes half of the buffer or more), this will be -1.
  *
  * @see azx_buffer_get
  */
@@ -100,13 +106,39 @@ INT32 azx_buffer_addObj(const void* obj, INT32 len);
  *     azx_buffer_addObj()
  *
  * @return The data that was stored. If anything is wrong (like the ID is -1),
- *     then NULL will be returned.
+ *     or the data has been overwritten since, then NULL will be returned.
  *
  * @see azx_buffer_add
  * @see AZX_BUFFER_GET
  */
 const void* azx_buffer_getObj(INT32 index);
 
+/**
+ * @brief Copies some data that has been stored
+ *
+ * Unlike reading through azx_buffer_getObj(), the copy is checked once it is
+ * done, so it cannot contain bytes of newer data.
+ *
+ * @param[in] index The ID where the data was stored, as returned by
+ *     azx_buffer_addObj()
+ * @param[out] dest Where to copy the data
+ * @param[in] max_len How many bytes fit in dest
+ *
+ * @return How many bytes were copied, or -1 if the data has been overwritten
+ *
+ * @see azx_buffer_getObj
+ */
+INT32 azx_buffer_copyObj(INT32 index, void* dest, INT32 max_len);
+
+/**
+ * @brief Checks whether some stored data has been overwritten
+ *
+ * @param[in] index The ID where the data was stored
+ *
+ * @return TRUE if the data is no longer available
+ */
+BOOLEAN azx_buffer_isExpired(INT32 index);
+
 /**
  * @name Convenience wrappers for copying and reading objects from the buffer
  * @{
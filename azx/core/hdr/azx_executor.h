@@ -0,0 +1,190 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#ifndef HDR_AZX_EXECUTOR_H_
+#define HDR_AZX_EXECUTOR_H_
+/**
+ * @file azx_executor.h
+ * @version 1.0.0
+ * @dependencies core/azx_log core/azx_tasks
+ * @date 17/10/2026
+ *
+ * @brief Pool of worker tasks running submitted jobs
+ *
+ * A task created with azx_tasks_createTask() has its own stack and mailbox,
+ * and there can be at most #AZX_TASKS_MAX_TASKS of them. That is a lot to pay
+ * for short jobs (parsing a URC, updating a sensor cache), which end up
+ * multiplexed onto a few tasks with hand written `switch(type)` handlers.
+ *
+ * An executor is a fixed set of worker tasks that run the jobs submitted to
+ * it. A job is a function and the context it is called with, plus an optional
+ * function called with its result once it is done. Jobs are picked by
+ * priority (see @ref AZX_EXECUTOR_PRIORITY_E), and in submission order within
+ * a priority.
+ *
+ * Each worker has its own queues. Jobs submitted by a worker go to its own
+ * queues, the others are spread over the workers in turn. A worker that runs
+ * out of jobs takes them from the busiest of the other workers, so a burst
+ * queued behind a long job is picked up by the idle ones.
+ *
+ * azx_tasks_init() must have been called before an executor is created. Each
+ * worker takes one of the azx_tasks slots.
+ */
+#include "m2mb_types.h"
+#include "azx_log.h"
+#include "azx_tasks.h"
+
+/** @brief The most executors that can exist at the same time. */
+#define AZX_EXECUTOR_MAX_EXECUTORS 4
+
+/** @brief The most workers an executor can have. */
+#define AZX_EXECUTOR_MAX_WORKERS 8
+
+/**
+ * @brief Executor related return codes
+ */
+typedef enum
+{
+  AZX_EXECUTOR_OK = 1,               /**<Success*/
+
+  AZX_EXECUTOR_INVALID_ERR = -1,     /**<An invalid parameter was passed*/
+  AZX_EXECUTOR_FULL_ERR = -2,        /**<All the queues for the priority are full*/
+  AZX_EXECUTOR_STOPPED_ERR = -3      /**<The executor is being destroyed*/
+} AZX_EXECUTOR_ERR_E;
+
+/**
+ * @brief Job priorities
+ *
+ * Workers always pick the most urgent job queued, even from the queues of
+ * other workers. A job that is already running is not interrupted.
+ */
+typedef enum
+{
+  AZX_EXECUTOR_PRIORITY_HIGH = 0,    /**<Run before any other job*/
+  AZX_EXECUTOR_PRIORITY_NORMAL,      /**<The default*/
+  AZX_EXECUTOR_PRIORITY_LOW,         /**<Run when nothing else is queued*/
+
+  AZX_EXECUTOR_PRIORITIES
+} AZX_EXECUTOR_PRIORITY_E;
+
+/**
+ * @brief The function a job runs
+ *
+ * @param[in] ctx The context passed to azx_executor_submit()
+ *
+ * @return The result passed to the @ref AZX_EXECUTOR_DONE_CB of the job, if any.
+ */
+typedef INT32 (*AZX_EXECUTOR_JOB_CB)(void* ctx);
+
+/**
+ * @brief The function called once a job is done
+ *
+ * It is called from the worker that ran the job. To hand the result over to
+ * a task, send it a message from here with azx_tasks_sendMessageToTask().
+ *
+ * @param[in] result What the job returned
+ * @param[in] ctx The completion context passed to azx_executor_submit()
+ */
+typedef void (*AZX_EXECUTOR_DONE_CB)(INT32 result, void* ctx);
+
+/** @brief An executor, as returned by azx_executor_create(). */
+typedef struct AZX_EXECUTOR_S AZX_EXECUTOR_T;
+
+/**
+ * @brief The statistics of an executor
+ *
+ * @see azx_executor_getStats
+ */
+typedef struct
+{
+  /** How many jobs were queued */
+  UINT32 submitted;
+  /** How many jobs have run */
+  UINT32 completed;
+  /** How many jobs ran on a worker other than the one they were queued to */
+  UINT32 stolen;
+  /** How many jobs were refused because the queues were full */
+  UINT32 rejected;
+  /** How many jobs are queued now */
+  UINT32 queued;
+  /** The most jobs that were queued at the same time */
+  UINT32 high_water;
+} AZX_EXECUTOR_STATS_T;
+
+/**
+ * @brief Creates an executor and starts its workers.
+ *
+ * @param[in] name The name of the workers, which are called `<name>0`,
+ *     `<name>1` and so on. Max length 16.
+ * @param[in] workers The number of worker tasks, from 1 to
+ *     #AZX_EXECUTOR_MAX_WORKERS
+ * @param[in] stack_size The stack size of each worker, see azx_tasks_createTask()
+ * @param[in] priority The task priority of the workers, see azx_tasks_createTask()
+ * @param[in] queue_size How many jobs of each priority each worker can have
+ *     queued
+ *
+ * @return The executor, or NULL if it could not be created.
+ *
+ * **Example**
+ *
+ *     static INT32 parse_urc(void* ctx)
+ *     {
+ *       ...
+ *     }
+ *
+ *     AZX_EXECUTOR_T* exec = azx_executor_create("Work", 3, AZX_TASKS_STACK_M, 10, 16);
+ *     azx_executor_submit(exec, AZX_EXECUTOR_PRIORITY_HIGH, parse_urc, urc, NULL, NULL);
+ */
+AZX_EXECUTOR_T* azx_executor_create(const CHAR* name, UINT8 workers, INT32 stack_size,
+    INT32 priority, UINT16 queue_size);
+
+/**
+ * @brief Queues a job.
+ *
+ * This does not wait for room in the queues: it returns
+ * @ref AZX_EXECUTOR_FULL_ERR straight away when there is none. It can be
+ * called from any task, including the workers themselves and the callbacks of
+ * azx_timer_initWithCb(), which run on a task. It briefly takes the lock of a
+ * worker's queues though, so it must not be called from interrupt context.
+ *
+ * @param[in] executor The executor to run the job
+ * @param[in] priority The priority of the job
+ * @param[in] fn The function to run
+ * @param[in] ctx What to pass to @p fn
+ * @param[in] done The function to call with the result of @p fn, or NULL
+ * @param[in] done_ctx What to pass to @p done
+ *
+ * @return One of
+ *     @ref AZX_EXECUTOR_OK
+ *     @ref AZX_EXECUTOR_INVALID_ERR
+ *     @ref AZX_EXECUTOR_FULL_ERR
+ *     @ref AZX_EXECUTOR_STOPPED_ERR
+ */
+INT32 azx_executor_submit(AZX_EXECUTOR_T* executor, AZX_EXECUTOR_PRIORITY_E priority,
+    AZX_EXECUTOR_JOB_CB fn, void* ctx, AZX_EXECUTOR_DONE_CB done, void* done_ctx);
+
+/**
+ * @brief Gets the statistics of an executor
+ *
+ * @param[in] executor The executor
+ * @param[out] stats Where to store the statistics
+ */
+void azx_executor_getStats(AZX_EXECUTOR_T* executor, AZX_EXECUTOR_STATS_T* stats);
+
+/**
+ * @brief Stops the workers and releases the executor.
+ *
+ * Jobs that are already queued are run first. Jobs submitted meanwhile are
+ * refused. This blocks until the workers have stopped, so it must not be
+ * called from one of them. The executor is freed, so nothing may submit to it
+ * once this returns.
+ *
+ * @param[in] executor The executor to destroy
+ *
+ * @return One of
+ *     @ref AZX_EXECUTOR_OK
+ *     @ref AZX_EXECUTOR_INVALID_ERR
+ */
+INT32 azx_executor_destroy(AZX_EXECUTOR_T* executor);
+
+#endif /* HDR_AZX_EXECUTOR_H_ */
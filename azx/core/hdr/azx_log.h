@@ -5,7 +5,7 @@
 #define HDR_AZX_LOG_H_
 /**
  * @file azx_log.h
- * @version 1.0.8
+ * @version 1.6.2
  * @dependencies 
  * @author Fabio Pintus
  * @author Ioannis Demetriou
@@ -15,6 +15,26 @@
  *
  * This library code will give user the possibility to print debug messages on
  * their application.
+ *
+ * By default a log is written out by the task that issues it, which waits for
+ * the output channel and the log file. With azx_log_setAsync() logs are instead
+ * queued in a ring (`AZX_LOG_ASYNC_BUFFER_SIZE` bytes, 8 KB by default) and
+ * written out by a low priority task, so logging costs little more than the
+ * formatting. Logs issued while the ring is full are dropped and counted.
+ *
+ * Every source file belongs to a module (see @ref AZX_LOG_MODULE_E), set by
+ * defining `AZX_LOG_MODULE` before including any header:
+ *
+ *     #define AZX_LOG_MODULE AZX_LOG_MODULE_USER_FIRST
+ *     #include "azx_log.h"
+ *
+ * Logs below `AZX_LOG_MIN_LEVEL` are compiled out, along with the evaluation
+ * of their arguments. It can be set for the whole build (e.g.
+ * `CPPFLAGS += -DAZX_LOG_MIN_LEVEL=AZX_LOG_LEVEL_INFO` in `Makefile.in`), or for
+ * a single file by defining `AZX_LOG_MODULE_MIN_LEVEL` before including any
+ * header. At runtime, azx_log_setModuleLevel() overrides the level set with
+ * azx_log_setLevel() for a module, so one module can log at TRACE level while
+ * the others stay at INFO.
  */
 #include "m2mb_types.h"
 
@@ -50,6 +70,40 @@ typedef enum
 } AZX_LOG_LEVEL_E;
 
 
+/**
+ * @brief Modules that can have their own log level
+ * \ingroup logConf
+ *
+ * @see azx_log_setModuleLevel
+ */
+typedef enum
+{
+  AZX_LOG_MODULE_APP,          /**<Code that sets no module (the default)*/
+  AZX_LOG_MODULE_ADC,          /**<core/azx_adc*/
+  AZX_LOG_MODULE_APN,          /**<core/azx_apn*/
+  AZX_LOG_MODULE_ATI,          /**<core/azx_ati*/
+  AZX_LOG_MODULE_BASE64,       /**<core/azx_base64*/
+  AZX_LOG_MODULE_BUFFER,       /**<core/azx_buffer*/
+  AZX_LOG_MODULE_CONNECTIVITY, /**<core/azx_connectivity*/
+  AZX_LOG_MODULE_EXECUTOR,     /**<core/azx_executor*/
+  AZX_LOG_MODULE_GPIO,         /**<core/azx_gpio*/
+  AZX_LOG_MODULE_I2C,          /**<core/azx_i2c*/
+  AZX_LOG_MODULE_POOL,         /**<core/azx_pool*/
+  AZX_LOG_MODULE_SPI,          /**<core/azx_spi*/
+  AZX_LOG_MODULE_STRING,       /**<core/azx_string*/
+  AZX_LOG_MODULE_STRING_UTILS, /**<core/azx_string_utils*/
+  AZX_LOG_MODULE_TASKS,        /**<core/azx_tasks*/
+  AZX_LOG_MODULE_TIMER,        /**<core/azx_timer*/
+  AZX_LOG_MODULE_UART,         /**<core/azx_uart*/
+  AZX_LOG_MODULE_UTILS,        /**<core/azx_utils*/
+  AZX_LOG_MODULE_WATCHDOG,     /**<core/azx_watchdog*/
+  AZX_LOG_MODULE_SPI_FLASH,    /**<libraries/spi_flash*/
+  AZX_LOG_MODULE_USER_FIRST,   /**<The first of the IDs free for application modules*/
+
+  AZX_LOG_MODULES = 32         /**<The number of module IDs*/
+} AZX_LOG_MODULE_E;
+
+
 /**
  * @brief Logging errors
  * \ingroup logUsage
@@ -83,6 +137,35 @@ typedef enum
 } AZX_LOG_HANDLE_E;
 
 
+/**
+ * @brief How logs are stored and written out
+ * \ingroup logConf
+ *
+ * @see azx_log_setFormat
+ */
+typedef enum
+{
+  AZX_LOG_FORMAT_TEXT,     /**<Logs are formatted by the task that issues them (default)*/
+  AZX_LOG_FORMAT_DEFERRED, /**<The arguments are stored and formatted by the writer task*/
+  AZX_LOG_FORMAT_BINARY    /**<The arguments are stored and written out as binary frames*/
+} AZX_LOG_FORMAT_E;
+
+/**
+ * @brief The types of the fields of a key/value log.
+ *
+ * @see AZX_LOG_KV
+ */
+typedef enum
+{
+  AZX_LOG_KV_TYPE_END = 0, /**<Ends the list of fields*/
+  AZX_LOG_KV_TYPE_INT,     /**<Signed integer, up to 64 bits*/
+  AZX_LOG_KV_TYPE_UINT,    /**<Unsigned integer, up to 64 bits*/
+  AZX_LOG_KV_TYPE_FLOAT,   /**<Floating point number*/
+  AZX_LOG_KV_TYPE_STR,     /**<String, up to 255 characters*/
+  AZX_LOG_KV_TYPE_BOOL     /**<Boolean*/
+} AZX_LOG_KV_TYPE_E;
+
+
 /**
  * @brief Logging configuration structure
  *
@@ -106,9 +189,9 @@ typedef struct
  * This function will try to output the provided message (in the same format as
  * `printf`) to the selected output channel.
  *
- * If the specified log level bit is not greater than the one specified by
- * @ref AZX_LOG_LEVEL_E, the function will return without printing anything.
- * Depending on log level, additional information will be printed.
+ * The log level is not checked here, the log macros check it against the
+ * level of their module. Depending on log level, additional information will
+ * be printed.
  *
  * **Example**
  *
@@ -123,7 +206,7 @@ typedef struct
  * @param[in] line Line number in the source file of the calling function
  * @param[in] fmt The message format - the same accepted by `printf`
  *
- * @return Number of bytes written, 0 if the log level is disabled
+ * @return Number of bytes written
  *
  * @see azx_log_init()
  * @see AZX_LOG_LEVEL_E
@@ -131,6 +214,9 @@ typedef struct
 INT32 azx_log_formatted(AZX_LOG_LEVEL_E level,
     const CHAR *function, const CHAR *file, int line, const CHAR *fmt, ... );
 
+/** @private The effective level of each module, checked by the log macros */
+extern volatile UINT8 _azx_log_levels[AZX_LOG_MODULES];
+
 /* Public functions ==========================================================*/
 
 /**
@@ -165,7 +251,8 @@ void azx_log_init(AZX_LOG_CFG_T *cfg);
  * @brief Deinitializes the log functionality
  *
  * This function deinitializes the log functionality. After it is called, the
- * `AZX_LOG_*` macros will not work.
+ * `AZX_LOG_*` macros will not work. If async logging was used, what is queued
+ * is written out first, then the writer task is stopped.
  *
  * @return One of
  *     @ref AZX_LOG_NOT_INIT - The azx_log_init() function was not call previously
@@ -194,6 +281,40 @@ INT32 azx_log_deinit(void);
  */
 void azx_log_setLevel(AZX_LOG_LEVEL_E level);
 
+/**
+ * @brief Sets the log level of a module, overriding azx_log_setLevel() for it.
+ *
+ * Logs below the compile-time floor (`AZX_LOG_MIN_LEVEL`) of a file are not
+ * there to be enabled.
+ *
+ * **Example**
+ *
+ *     azx_log_setLevel(AZX_LOG_LEVEL_INFO);
+ *     azx_log_setModuleLevel(AZX_LOG_MODULE_ATI, AZX_LOG_LEVEL_TRACE);
+ *
+ * @param[in] module The module
+ * @param[in] level The level of its logs to be printed
+ *
+ * @see azx_log_resetModuleLevel
+ */
+void azx_log_setModuleLevel(AZX_LOG_MODULE_E module, AZX_LOG_LEVEL_E level);
+
+/**
+ * @brief Makes a module follow the level set with azx_log_setLevel() again.
+ *
+ * @param[in] module The module
+ */
+void azx_log_resetModuleLevel(AZX_LOG_MODULE_E module);
+
+/**
+ * @brief Returns the log level in use for a module.
+ *
+ * @param[in] module The module
+ *
+ * @return The level set for the module, or the global one if there is none
+ */
+AZX_LOG_LEVEL_E azx_log_getModuleLevel(AZX_LOG_MODULE_E module);
+
 /**
  * @brief Returns the current value of the log level.
  *
@@ -221,7 +342,15 @@ AZX_LOG_LEVEL_E azx_log_getLevel(void);
  * all logs will go to the new file instead of the old one.
  *
  * The logging can be configured to be done in a circular way by setting circular_chunks to a value
- * greater than 0. Each chunk will have at most max_size_kb KB.
+ * greater than 0. Each chunk will have at most max_size_kb KB. Once the original file is full, the
+ * logs go to `filename.1`, `filename.2` and so on up to `filename.<circular_chunks>`, then back to
+ * `filename.1`, which is emptied first. The chunk in use is the one that is not full, the ones after
+ * it hold the oldest logs.
+ *
+ * The size of the file is only read here, after that it is tracked as logs are written. Logs are
+ * cached and written out once `AZX_LOG_FILE_FLUSH_BYTES` (4 KB if not defined in `app_cfg.h`) have
+ * gathered, or when a log finds the cache older than `AZX_LOG_FILE_FLUSH_MS` (2 seconds if not
+ * defined). In asynchronous mode the writer task also flushes a cache that gets that old.
  *
  * @param filename The name of the file to log to. If NULL, this function does nothing.
  * @param circular_chunks The number of chunks to store circularly (apart from the original one).
@@ -242,6 +371,153 @@ BOOLEAN azx_log_send_to_file(const CHAR* filename, UINT32 circular_chunks,
  */
 void azx_log_flush_to_file(void);
 
+/**
+ * @brief Called when a full segment of the log file has been handed over.
+ *
+ * @param path The name the segment was moved to, that is its own name with
+ * `.old` appended (`filename.old` for the original file, `filename.<segment>.old`
+ * for the numbered ones). The file is no longer touched by this library.
+ * @param segment 0 for the original file, 1 to circular_chunks for the others
+ *
+ * @see azx_log_setRotateCallback
+ */
+typedef void (*AZX_LOG_ROTATE_CB)(const CHAR* path, UINT32 segment);
+
+/**
+ * @brief Sets a function to take over the log file segments once they are full.
+ *
+ * With a callback set, a full segment (see azx_log_send_to_file()) is renamed
+ * before the rotation moves on, so it is not overwritten, and the callback is
+ * told its new name. It is then up to the callback to process and remove it, for
+ * example to compress it or upload it.
+ *
+ * The `.old` file must be removed before the rotation gets back to the same
+ * segment. If it is still there, the full segment is not handed over but
+ * overwritten like without a callback, and the new segment starts with a line
+ * telling so.
+ *
+ * The callback is called from the task that wrote the log that filled the
+ * segment (or the writer task in asynchronous mode), so it should only pass the
+ * work on to another task. Only the first 32 segments are handed over.
+ *
+ * @param cb The callback, or NULL to stop handing segments over.
+ */
+void azx_log_setRotateCallback(AZX_LOG_ROTATE_CB cb);
+
+/**
+ * @brief Switches the asynchronous logging on or off.
+ *
+ * In asynchronous mode the `AZX_LOG_*` macros only format the message into a
+ * ring and return. A low priority writer task (`AZX_LOG_ASYNC_TASK_PRIORITY`,
+ * 250 by default) prints the queued logs and writes them to the log file. If
+ * the ring is full the log is dropped, and the writer reports how many were
+ * dropped once it catches up.
+ *
+ * Switching it off waits (up to a second) for the queued logs to be written.
+ *
+ * Define `AZX_LOG_ASYNC` to have @ref AZX_LOG_INIT switch it on.
+ *
+ * @param[in] enable TRUE to queue the logs, FALSE to write them synchronously
+ *
+ * @return TRUE on success, FALSE if logging is not initialized or the writer
+ *     task cannot be started
+ *
+ * @see azx_log_getDropped
+ */
+BOOLEAN azx_log_setAsync(BOOLEAN enable);
+
+/**
+ * @brief Sets how the logs are stored and written out.
+ *
+ * Formatting is usually the bulk of the cost of a log. With
+ * @ref AZX_LOG_FORMAT_DEFERRED the `AZX_LOG_*` macros only store the format
+ * string address and the raw arguments (strings are copied, up to 255
+ * characters), and the writer task formats them.
+ *
+ * With @ref AZX_LOG_FORMAT_BINARY nothing is formatted on the module: each log
+ * is written to the channel and to the log file as a compact binary frame,
+ * holding the level, uptime, task id, the addresses of the format string,
+ * file and function, and the arguments. The frames are turned back into text
+ * on the host by `tools/azx_log_decode.py`, which reads the strings from the
+ * application ELF file.
+ *
+ * Both switch on the asynchronous mode if needed (see azx_log_setAsync()).
+ * They rely on format strings with conversions being string literals, logs
+ * without any conversion are stored as text.
+ *
+ * **Example**
+ *
+ *     azx_log_setFormat(AZX_LOG_FORMAT_BINARY);
+ *
+ * and on the host:
+ *
+ *     python tools/azx_log_decode.py m2mapz.elf < usb_capture.bin
+ *
+ * @param[in] format The new format
+ *
+ * @return TRUE on success, FALSE if the asynchronous mode cannot be started
+ */
+BOOLEAN azx_log_setFormat(AZX_LOG_FORMAT_E format);
+
+/**
+ * @brief Returns how many logs were dropped because the async ring was full.
+ *
+ * @return The number of logs dropped since start-up
+ *
+ * @see azx_log_setAsync
+ */
+UINT32 azx_log_getDropped(void);
+
+/**
+ * @brief Logs an event made of typed fields, see #AZX_LOG_KV
+ * @private
+ *
+ * @warning This is an internal function, and should not be used directly by user code.
+ *
+ * @param[in] level Log level of the event
+ * @param[in] event_id Identifies the event
+ * @param[in] ... The fields, ended by #AZX_LOG_KV_TYPE_END
+ *
+ * @return Number of bytes written, negative in case of error
+ */
+INT32 azx_log_kv(AZX_LOG_LEVEL_E level, UINT16 event_id, ...);
+
+/**
+ * @brief Limits how often a single log call can print.
+ *
+ * Every `AZX_LOG_*` call site of the given level gets a bucket of @p burst
+ * tokens, refilled at @p per_minute tokens a minute. A log takes a token, and is
+ * dropped if there is none left. When the call site gets through again, a line
+ * tells how many of its logs were suppressed.
+ *
+ * The buckets of up to `AZX_LOG_RATE_SITES` call sites (16 if not defined in
+ * `app_cfg.h`) are kept, a new one takes over the slot of another call site
+ * when they collide. Call sites are told apart by their source file and line,
+ * so the limit also applies to each `AZX_LOG_INFO` on its own.
+ *
+ * @param level The level to limit
+ * @param burst How many logs a call site can print in a row, 0 for no limit (the default)
+ * @param per_minute How many logs a call site can print per minute after that
+ *
+ * **Example**
+ *
+ *     azx_log_setRateLimit(AZX_LOG_LEVEL_WARN, 10, 6);
+ */
+void azx_log_setRateLimit(AZX_LOG_LEVEL_E level, UINT16 burst, UINT16 per_minute);
+
+/**
+ * @brief Collapses repeats of the same log into a count.
+ *
+ * When switched on for a level, a log that is the same as the one printed just
+ * before it (same call site and same message) is not printed. Instead, once a
+ * different log comes, or azx_log_flush_to_file() is called, or every 10
+ * seconds while the repeats go on, a line tells how many times it was repeated.
+ *
+ * @param level The level to collapse the repeats of
+ * @param collapse TRUE to collapse the repeats, FALSE to print them (the default)
+ */
+void azx_log_setCollapseRepeats(AZX_LOG_LEVEL_E level, BOOLEAN collapse);
+
 
 
 /**
@@ -261,6 +537,29 @@ void azx_log_flush_to_file(void);
 #else
 #define _LOG_COLOURS 0
 #endif
+
+#ifdef AZX_LOG_ASYNC
+#define _LOG_ASYNC TRUE
+#else
+#define _LOG_ASYNC FALSE
+#endif
+
+#ifndef AZX_LOG_MODULE
+#define AZX_LOG_MODULE AZX_LOG_MODULE_APP
+#endif
+
+#ifndef AZX_LOG_MIN_LEVEL
+#define AZX_LOG_MIN_LEVEL AZX_LOG_LEVEL_TRACE
+#endif
+
+#ifndef AZX_LOG_MODULE_MIN_LEVEL
+#define AZX_LOG_MODULE_MIN_LEVEL AZX_LOG_MIN_LEVEL
+#endif
+
+/* The first check is a constant, so logs below the floor compile to nothing */
+#define _AZX_LOG_IF(level, call) \
+  (((level) >= AZX_LOG_MODULE_MIN_LEVEL && (level) >= _azx_log_levels[AZX_LOG_MODULE]) ? \
+      (call) : 0)
 /** @endcond */
 /**
  * @brief Call this at your AZ entry point to easily configure logging
@@ -274,6 +573,10 @@ void azx_log_flush_to_file(void);
     /*.log_colours*/ _LOG_COLOURS\
   };\
   azx_log_init(&cfg);\
+  if(_LOG_ASYNC)\
+  {\
+    azx_log_setAsync(TRUE);\
+  }\
 } while(0)
 
 /** \addtogroup  logUsage
@@ -284,24 +587,63 @@ void azx_log_flush_to_file(void);
  * @brief These function-like macros can be used to print different messages with different log levels
  * @{ */
 
-#define AZX_LOG_CRITICAL(a...)  azx_log_formatted(AZX_LOG_LEVEL_CRITICAL, __FUNCTION__, __FILE__, __LINE__, a)
+#define AZX_LOG_CRITICAL(a...)  _AZX_LOG_IF(AZX_LOG_LEVEL_CRITICAL, \
+    azx_log_formatted(AZX_LOG_LEVEL_CRITICAL, __FUNCTION__, __FILE__, __LINE__, a))
 /**<Prints a critical error message.*/
 
-#define AZX_LOG_ERROR(a...)     azx_log_formatted(AZX_LOG_LEVEL_ERROR, __FUNCTION__, __FILE__, __LINE__, a)
+#define AZX_LOG_ERROR(a...)     _AZX_LOG_IF(AZX_LOG_LEVEL_ERROR, \
+    azx_log_formatted(AZX_LOG_LEVEL_ERROR, __FUNCTION__, __FILE__, __LINE__, a))
 /**<Prints an error message.*/
 
-#define AZX_LOG_WARN(a...)      azx_log_formatted(AZX_LOG_LEVEL_WARN, __FUNCTION__, __FILE__, __LINE__, a)
+#define AZX_LOG_WARN(a...)      _AZX_LOG_IF(AZX_LOG_LEVEL_WARN, \
+    azx_log_formatted(AZX_LOG_LEVEL_WARN, __FUNCTION__, __FILE__, __LINE__, a))
 /**<Prints a warning message.*/
 
-#define AZX_LOG_INFO(a...)      azx_log_formatted(AZX_LOG_LEVEL_INFO, "", "", 0, a)
-/**<Prints an informative message.*/
+#define AZX_LOG_INFO(a...)      _AZX_LOG_IF(AZX_LOG_LEVEL_INFO, \
+    azx_log_formatted(AZX_LOG_LEVEL_INFO, __FUNCTION__, __FILE__, __LINE__, a))
+/**<Prints an informative message, with no prefix on the output channel.*/
 
-#define AZX_LOG_DEBUG(a...)     azx_log_formatted(AZX_LOG_LEVEL_DEBUG, __FUNCTION__, __FILE__, __LINE__, a)
+#define AZX_LOG_DEBUG(a...)     _AZX_LOG_IF(AZX_LOG_LEVEL_DEBUG, \
+    azx_log_formatted(AZX_LOG_LEVEL_DEBUG, __FUNCTION__, __FILE__, __LINE__, a))
 /**<Prints a debug message.*/
 
-#define AZX_LOG_TRACE(a...)     azx_log_formatted(AZX_LOG_LEVEL_TRACE, __FUNCTION__, __FILE__, __LINE__, a)
+#define AZX_LOG_TRACE(a...)     _AZX_LOG_IF(AZX_LOG_LEVEL_TRACE, \
+    azx_log_formatted(AZX_LOG_LEVEL_TRACE, __FUNCTION__, __FILE__, __LINE__, a))
 /**<Prints a trace level message.*/
 
+/**
+ * @brief Logs an event made of typed fields, for machines rather than people.
+ *
+ * The fields are given with the `AZX_LOG_KV_<type>(key, value)` macros. The
+ * event is written as a binary frame holding the level, event id, uptime and
+ * the fields as a CBOR map (RFC 8949), which any CBOR library can read. The
+ * frames go into the log file (see azx_log_send_to_file()) next to the text
+ * logs, and also to the output channel in @ref AZX_LOG_FORMAT_BINARY.
+ * `tools/azx_log_decode.py --json` extracts them as JSON lines.
+ *
+ * An event takes at most `AZX_LOG_KV_MAX_SIZE` bytes (256 if not defined in
+ * `app_cfg.h`) and 23 fields, fields that do not fit are left out.
+ *
+ * **Example**
+ *
+ *     AZX_LOG_KV(AZX_LOG_LEVEL_INFO, EVENT_SIGNAL,
+ *         AZX_LOG_KV_INT("rssi", rssi), AZX_LOG_KV_STR("operator", name),
+ *         AZX_LOG_KV_BOOL("roaming", roaming));
+ */
+#define AZX_LOG_KV(level, event_id, fields...) _AZX_LOG_IF(level, \
+    azx_log_kv(level, event_id, fields, AZX_LOG_KV_TYPE_END))
+
+#define AZX_LOG_KV_INT(key, value)   AZX_LOG_KV_TYPE_INT, (const CHAR*)(key), (INT64)(value)
+/**<A signed integer field of #AZX_LOG_KV.*/
+#define AZX_LOG_KV_UINT(key, value)  AZX_LOG_KV_TYPE_UINT, (const CHAR*)(key), (UINT64)(value)
+/**<An unsigned integer field of #AZX_LOG_KV.*/
+#define AZX_LOG_KV_FLOAT(key, value) AZX_LOG_KV_TYPE_FLOAT, (const CHAR*)(key), (double)(value)
+/**<A floating point field of #AZX_LOG_KV.*/
+#define AZX_LOG_KV_STR(key, value)   AZX_LOG_KV_TYPE_STR, (const CHAR*)(key), (const CHAR*)(value)
+/**<A string field of #AZX_LOG_KV.*/
+#define AZX_LOG_KV_BOOL(key, value)  AZX_LOG_KV_TYPE_BOOL, (const CHAR*)(key), (INT32)((value) != 0)
+/**<A boolean field of #AZX_LOG_KV.*/
+
 /** @} */
 /** @} */
 
@@ -324,6 +666,7 @@ void azx_log_flush_to_file(void);
 #define AZX_LOG_INFO(a...)     m2mb_trace_file_line_printf(__FILE__, __LINE__, M2MB_TC_M2M_USER, M2MB_TL_LOG, (CHAR*)a)
 #define AZX_LOG_DEBUG(a...)    m2mb_trace_file_line_printf(__FILE__, __LINE__, M2MB_TC_M2M_USER, M2MB_TL_DEBUG, (CHAR*)a)
 #define AZX_LOG_TRACE(a...)
+#define AZX_LOG_KV(level, event_id, fields...)
 
 #endif /* AZX_LOG_ENABLE */
 /** @} */
@@ -0,0 +1,167 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#ifndef UUID_3f1c2a4e_8d4b_4f7a_9c61_5b0e2d7a9e13
+#define UUID_3f1c2a4e_8d4b_4f7a_9c61_5b0e2d7a9e13
+/**
+ * @file azx_pool.h
+ * @version 1.0.1
+ * @dependencies core/azx_log
+ * @date 17/10/2026
+ *
+ * @brief Fixed size-class memory allocator
+ *
+ * Small and short lived allocations (AT responses, JSON nodes, socket buffers)
+ * fragment the system heap and every call to it takes a kernel lock. This
+ * library serves them from slabs of fixed size blocks instead.
+ *
+ * There are #AZX_POOL_CLASSES size classes, from 16 to 2048 bytes (each twice
+ * the previous one). A request is served by the smallest class that fits it.
+ * Requests that are larger than the largest class, or that find their class
+ * exhausted, are passed on to m2mb_os_malloc(), so azx_pool_malloc() never fails
+ * where the heap would not.
+ *
+ * The number of blocks of each class can be set by defining
+ * `AZX_POOL_CLASS_BLOCKS` in `app_cfg.h` as a comma separated list of
+ * #AZX_POOL_CLASSES values (at most #AZX_POOL_MAX_CLASS_BLOCKS each). The slabs
+ * are allocated from the heap on first use, unless `AZX_POOL_STATIC_BACKING` is
+ * defined, in which case they are placed in static memory.
+ *
+ * Allocating and freeing take no lock, so they can be called from any task.
+ *
+ * Libraries opt into the pool through #AZX_MALLOC and #AZX_FREE. They map to
+ * the m2mb heap, unless `AZX_POOL_HOOK` is defined for the whole build (for
+ * example with `CPPFLAGS += -DAZX_POOL_HOOK` in `Makefile.in`). Memory that
+ * such a library hands to the application must then be released with
+ * #AZX_FREE rather than m2mb_os_free().
+ */
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+#include "azx_log.h"
+
+/** @brief The number of size classes. */
+#define AZX_POOL_CLASSES 8
+
+/** @brief The most blocks a single size class can have. */
+#define AZX_POOL_MAX_CLASS_BLOCKS 256
+
+/**
+ * @brief The usage statistics of a size class.
+ *
+ * @see azx_pool_getStats
+ */
+typedef struct
+{
+  /** The size of each block in the class */
+  UINT32 block_size;
+  /** How many blocks the class has */
+  UINT32 blocks;
+  /** How many blocks are currently allocated */
+  UINT32 in_use;
+  /** The most blocks that were allocated at the same time */
+  UINT32 high_water;
+  /** How many allocations were served by the class */
+  UINT32 allocs;
+  /** How many allocations found the class exhausted and went to the heap */
+  UINT32 failures;
+} AZX_POOL_CLASS_STATS_T;
+
+/**
+ * @brief The usage statistics of the whole pool.
+ *
+ * @see azx_pool_getStats
+ */
+typedef struct
+{
+  AZX_POOL_CLASS_STATS_T classes[AZX_POOL_CLASSES];
+  /** How many allocations were too large for any class and went to the heap */
+  UINT32 oversized;
+  /** How many allocations the heap could not serve either */
+  UINT32 heap_failures;
+} AZX_POOL_STATS_T;
+
+/**
+ * @brief Prepares the slabs
+ *
+ * Calling this is optional, the first allocation does it otherwise. It is
+ * useful to take the one-off cost (and the slab allocation) at start-up.
+ *
+ * @return TRUE if the slabs are available, FALSE if they could not be allocated
+ *     (then all requests go to the heap).
+ */
+BOOLEAN azx_pool_init(void);
+
+/**
+ * @brief Allocates memory
+ *
+ * @param[in] size The number of bytes needed
+ *
+ * @return The allocated memory, or NULL if neither the pool nor the heap can
+ *     provide it. The memory is not initialised.
+ *
+ * @see azx_pool_free
+ */
+void* azx_pool_malloc(UINT32 size);
+
+/**
+ * @brief Allocates memory that is set to 0
+ *
+ * @param[in] size The number of bytes needed
+ *
+ * @return The allocated memory, or NULL if neither the pool nor the heap can
+ *     provide it.
+ */
+void* azx_pool_calloc(UINT32 size);
+
+/**
+ * @brief Resizes an allocation
+ *
+ * If @p ptr is a pool block that already fits @p size, it is returned as it is.
+ * Otherwise the contents are copied up to the smaller of the old and new sizes.
+ *
+ * @param[in] ptr The memory to resize, or NULL to allocate new memory
+ * @param[in] size The number of bytes needed. If it is 0, @p ptr is freed.
+ *
+ * @return The resized memory, or NULL if it could not be allocated (in which
+ *     case @p ptr is freed anyway).
+ */
+void* azx_pool_realloc(void* ptr, UINT32 size);
+
+/**
+ * @brief Releases memory allocated by this library
+ *
+ * Only memory returned by this library can be passed, memory allocated with
+ * m2mb_os_malloc() must be released with m2mb_os_free().
+ *
+ * @param[in] ptr The memory to release. NULL is ignored.
+ *
+ * @return The same as m2mb_os_free() would.
+ */
+M2MB_OS_RESULT_E azx_pool_free(void* ptr);
+
+/**
+ * @brief Gets the usage statistics
+ *
+ * @param[out] stats Where to store the statistics
+ */
+void azx_pool_getStats(AZX_POOL_STATS_T* stats);
+
+/**
+ * @brief Logs the usage statistics of all the classes at info level
+ */
+void azx_pool_logStats(void);
+
+#ifdef AZX_POOL_HOOK
+/** @brief The allocator used by the libraries. */
+#define AZX_MALLOC(size) azx_pool_malloc(size)
+/** @brief The allocator of zeroed memory used by the libraries. */
+#define AZX_CALLOC(size) azx_pool_calloc(size)
+/** @brief The deallocator used by the libraries. */
+#define AZX_FREE(ptr) azx_pool_free(ptr)
+#else
+#define AZX_MALLOC(size) m2mb_os_malloc(size)
+#define AZX_CALLOC(size) m2mb_os_calloc(size)
+#define AZX_FREE(ptr) m2mb_os_free(ptr)
+#endif
+
+#endif /* !defined(UUID_3f1c2a4e_8d4b_4f7a_9c61_5b0e2d7a9e13) */
@@ -5,7 +5,7 @@
 #define HDR_AZX_TASKS_H_
 /**
  * @file azx_tasks.h
- * @version 1.0.4
+ * @version 1.3.1
  * @dependencies core/azx_log core/azx_utils
  * @author Alessio Quieti
  * @date 07/04/2018
@@ -17,6 +17,19 @@
  * much greater control of the tasks)
  *
  * The library is modelled after the way tasks were handled in the old M2M API.
+ *
+ * Messages only carry three integers. Larger data can be passed without
+ * copying it, or allocating it on the heap, through the message pool of the
+ * receiving task (see azx_tasks_createMessagePool()): the sender takes a
+ * buffer from the pool, fills it and sends it, and the buffer goes back to the
+ * pool when the receiver's callback returns.
+ *
+ * Messages are handled in the order they are sent. A task created with
+ * azx_tasks_createTaskWithLanes() has instead a queue for each priority lane
+ * (see @ref AZX_TASKS_LANE_E), so urgent messages are not held up by the
+ * routine ones queued before them. Such a task can also coalesce the messages
+ * of some types (see azx_tasks_setCoalescing()), keeping only the latest of
+ * each in the queue.
  */
 #include "m2mb_types.h"
 #include "m2mb_os_api.h"
@@ -58,9 +71,16 @@ typedef INT32 (*USER_TASK_CB)(INT32, INT32, INT32);
 
 #define AZX_TASKS_MAX_TASKS 32         /**< Maximum allowed tasks number */
 
-#define AZX_TASKS_QUEUE_MSG_SIZE 3     /**< Size in Words (4 bytes) of each queue message ->
-                                         `struct (INT32 type, INT32 param1, INT32 param2)` */
+#define AZX_TASKS_QUEUE_MSG_SIZE 4     /**< Size in Words (4 bytes) of each queue message ->
+                                         `struct (INT32 type, INT32 param1, INT32 param2)` plus
+                                         the time it was sent at */
 #define AZX_TASKS_TASK_NAME_SIZE 64    /**<Maximum task name length*/
+
+#define AZX_TASKS_MAX_POOL_BUFFERS 32  /**<Maximum number of buffers in a task message pool*/
+
+#define AZX_TASKS_TIME_BUCKETS 12      /**<Buckets of the time histograms in @ref AZX_TASKS_STATS_T*/
+
+#define AZX_TASKS_MAX_COALESCED_TYPES 8 /**<Maximum message types a task can coalesce*/
   /** @} */
 /** @} */
 
@@ -85,7 +105,9 @@ typedef enum
 
   AZX_TASKS_INVALID_ID_ERR = -20,     /**<Task id is not valid (out of bounds)*/
   AZX_TASKS_ID_NOT_DEFINED_ERR = -21, /**<Task id does not refer to a valid task*/
-  AZX_TASKS_MSG_SEND_ERR = -22        /**<Error when sending a message to task queue*/
+  AZX_TASKS_MSG_SEND_ERR = -22,       /**<Error when sending a message to task queue*/
+  AZX_TASKS_POOL_ERR = -23,           /**<The payload does not belong to the message pool of the task*/
+  AZX_TASKS_NO_LANES_ERR = -24        /**<The task was not created with lanes, or has no room for more coalesced types*/
 } AZX_TASKS_ERR_E;
 
 /**
@@ -116,6 +138,23 @@ typedef enum
    AZX_TASKS_MBOX_LIMIT = AZX_TASKS_MBOX_L /**<Consider this as a max limit */
 }AZX_TASKS_MBOX_SIZE;
 
+/**
+ * @brief Priority lanes of a task created with azx_tasks_createTaskWithLanes()
+ *
+ * A task handles the messages of a lane only when the more urgent lanes are
+ * empty, and the messages of each lane in the order they are sent.
+ *
+ * @ingroup taskUsage
+ */
+typedef enum
+{
+  AZX_TASKS_LANE_HIGH = 0,  /**<Urgent messages, such as a connection going down*/
+  AZX_TASKS_LANE_NORMAL,    /**<Where azx_tasks_sendMessageToTask() sends*/
+  AZX_TASKS_LANE_LOW,       /**<Routine updates*/
+
+  AZX_TASKS_LANES
+} AZX_TASKS_LANE_E;
+
 /**
  * @brief Structure holding the task message data
  *
@@ -132,12 +171,70 @@ typedef struct
    INT32  param2; /**<Parameter 2*/
 } AZX_TASKS_MESSAGE_T;
 
+/**
+ * @brief The statistics of a task message pool
+ *
+ * @see azx_tasks_getMessagePoolStats()
+ *
+ * @ingroup taskUsage
+ */
+typedef struct
+{
+  UINT32 payload_size; /**<The size of each buffer in bytes*/
+  UINT32 buffers;      /**<The number of buffers in the pool*/
+  UINT32 in_use;       /**<How many buffers are allocated, queued or kept now*/
+  UINT32 high_water;   /**<The most buffers that were in use at the same time*/
+  UINT32 sent;         /**<How many payloads were sent*/
+  UINT32 exhausted;    /**<How many allocations found no free buffer*/
+  UINT32 leaked;       /**<How many buffers have been allocated but not sent, or kept, for longer
+                           than `AZX_TASKS_MSG_LEAK_MS` (10 seconds if not defined)*/
+} AZX_TASKS_POOL_STATS_T;
+
+/**
+ * @brief The runtime statistics of a task
+ *
+ * Times are measured in system ticks and reported in milliseconds, so they
+ * are only as precise as the tick. The histograms count how many times fell in
+ * each range: bucket 0 counts those below 1 ms, bucket `i` those from
+ * `2^(i-1)` to `2^i - 1` ms and the last bucket those of
+ * `2^(AZX_TASKS_TIME_BUCKETS - 2)` ms or more.
+ *
+ * @see azx_tasks_getStats()
+ *
+ * @ingroup taskUsage
+ */
+typedef struct
+{
+  UINT32 handled;         /**<How many messages the callback handled*/
+  UINT32 queued;          /**<How many messages are queued now*/
+  UINT32 queue_size;      /**<The size of the message queue*/
+  UINT32 queue_high_water;/**<The most messages that were queued at the same time*/
+  UINT32 send_failures;   /**<How many messages could not be sent, mostly because the queue was full*/
+  UINT32 coalesced;       /**<How many messages replaced one of the same type already queued*/
+  UINT32 exec_max_ms;     /**<The longest time the callback took*/
+  UINT32 exec_total_ms;   /**<The time spent in the callback altogether*/
+  UINT32 latency_max_ms;  /**<The longest time a message waited in the queue*/
+  UINT32 exec_ms[AZX_TASKS_TIME_BUCKETS];    /**<Histogram of the callback times*/
+  UINT32 latency_ms[AZX_TASKS_TIME_BUCKETS]; /**<Histogram of the times messages waited in the queue*/
+} AZX_TASKS_STATS_T;
+
+/** @private */
+typedef struct AZX_TASKS_POOL_S AZX_TASKS_POOL_T;
+
+/** @private */
+typedef struct AZX_TASKS_LANES_S AZX_TASKS_LANES_T;
+
 /** @private */
 typedef struct
 {
   M2MB_OS_TASK_HANDLE Task_H;      /**<Task m2mb handler*/
   M2MB_OS_Q_HANDLE Task_Queue_H;   /**<Task queue m2mb handler*/
   USER_TASK_CB Task_UserCB;        /**<Task user provided callback function */
+  AZX_TASKS_POOL_T* Msg_Pool;      /**<Pool of the message payloads, if any*/
+  AZX_TASKS_LANES_T* Lanes;        /**<Priority lanes, if any*/
+  UINT32 Queue_Size;               /**<Task queue size in messages*/
+  volatile UINT32 Queued;          /**<Messages sent and not yet handled*/
+  AZX_TASKS_STATS_T Stats;         /**<Runtime statistics*/
   UINT8 SlotInUse;                 /**<Is task slot already in use?*/
   CHAR Task_NameBuf[AZX_TASKS_TASK_NAME_SIZE * sizeof(CHAR)];  /**<Task name*/
 } AZX_TASKS_SLOT_T;
@@ -207,6 +304,38 @@ INT32 azx_tasks_init(void);
 INT32 azx_tasks_createTask( CHAR *task_name, INT32 stack_size, INT32 priority,
     INT32 msg_q_size, USER_TASK_CB cb);
 
+/**
+ * @brief Creates a new user task with priority lanes.
+ *
+ * This is the same as azx_tasks_createTask(), but the messages wait in a
+ * separate queue for each lane. Messages are sent to a lane with
+ * azx_tasks_sendMessageToLane(), azx_tasks_sendMessageToTask() uses
+ * @ref AZX_TASKS_LANE_NORMAL.
+ *
+ * @param[in] task_name See azx_tasks_createTask()
+ * @param[in] stack_size See azx_tasks_createTask()
+ * @param[in] priority See azx_tasks_createTask()
+ * @param[in] lane_sizes The number of message slots of each lane, indexed by
+ *     @ref AZX_TASKS_LANE_E. A lane can have 0 slots, but the total must be in
+ *     the range @ref AZX_TASKS_MIN_QUEUE_SIZE - @ref AZX_TASKS_MAX_QUEUE_SIZE
+ * @param[in] cb See azx_tasks_createTask()
+ *
+ * @return The same as azx_tasks_createTask()
+ *
+ * **Example**
+ *
+ *     UINT8 lanes[AZX_TASKS_LANES] = { 4, 10, 4 };
+ *     INT32 id = azx_tasks_createTaskWithLanes("Net", AZX_TASKS_STACK_M, 5, lanes, netCB);
+ *     azx_tasks_setCoalescing(id, MSG_RSSI_CHANGED, TRUE);
+ *     ...
+ *     azx_tasks_sendMessageToLane(id, AZX_TASKS_LANE_LOW, MSG_RSSI_CHANGED, rssi, 0);
+ *     azx_tasks_sendMessageToLane(id, AZX_TASKS_LANE_HIGH, MSG_PDP_DOWN, cid, 0);
+ *
+ * @ingroup taskUsage
+ */
+INT32 azx_tasks_createTaskWithLanes(CHAR *task_name, INT32 stack_size, INT32 priority,
+    const UINT8 lane_sizes[AZX_TASKS_LANES], USER_TASK_CB cb);
+
 /**
  * @brief Destroys an user task.
  *
@@ -252,6 +381,56 @@ INT32 azx_tasks_destroyTask(INT8 task_id);
 INT32 azx_tasks_sendMessageToTask( INT8 task_id, INT32 type, INT32 param1, INT32 param2 );
 
 
+/**
+ * @brief Sends a message to a lane of a task
+ *
+ * For a task created without lanes this is the same as
+ * azx_tasks_sendMessageToTask(), whatever the lane.
+ *
+ * If the message type is coalesced (see azx_tasks_setCoalescing()) and a
+ * message of the same type is still queued in the lane, the parameters of that
+ * message are replaced instead, keeping its place in the queue.
+ *
+ * @param[in] task_id The task id to receive the message
+ *     range: 1 - @ref AZX_TASKS_MAX_TASKS
+ * @param[in] lane The lane to queue the message to
+ * @param[in] type User parameter
+ * @param[in] param1 User parameter
+ * @param[in] param2 User parameter
+ *
+ * @return The same as azx_tasks_sendMessageToTask(). @ref AZX_TASKS_MSG_SEND_ERR
+ *     is also returned if the lane is full or not valid.
+ *
+ * @ingroup taskUsage
+*/
+INT32 azx_tasks_sendMessageToLane( INT8 task_id, AZX_TASKS_LANE_E lane, INT32 type,
+    INT32 param1, INT32 param2 );
+
+/**
+ * @brief Sets whether the messages of a type are coalesced
+ *
+ * A coalesced message replaces the one of the same type that is still queued
+ * in its lane, if any, so only the latest value is handled. This suits
+ * messages that report a state, like a signal strength, rather than an event.
+ * If the replaced message carried a pool payload, the payload goes back to
+ * the pool.
+ *
+ * @param[in] task_id A task created with azx_tasks_createTaskWithLanes()
+ * @param[in] type The message type
+ * @param[in] coalesce TRUE to coalesce the messages of the type, FALSE to queue
+ *     each of them
+ *
+ * @return One of
+ *     @ref AZX_TASKS_OK
+ *     @ref AZX_TASKS_NOTINIT_ERR
+ *     @ref AZX_TASKS_INVALID_ID_ERR
+ *     @ref AZX_TASKS_ID_NOT_DEFINED_ERR
+ *     @ref AZX_TASKS_NO_LANES_ERR
+ *
+ * @ingroup taskUsage
+*/
+INT32 azx_tasks_setCoalescing( INT8 task_id, INT32 type, BOOLEAN coalesce );
+
 /**
  * @brief Retrieves the current task ID value
  *
@@ -289,4 +468,172 @@ CHAR* azx_tasks_getCurrentTaskName( CHAR *name );
  */
 INT32 azx_tasks_getEnqueuedCount( INT8 task_id );
 
+/**
+ * @brief Gets the runtime statistics of a task.
+ *
+ * @param[in] task_id The task
+ * @param[out] stats Where to store the statistics
+ *
+ * @return One of
+ *     @ref AZX_TASKS_OK
+ *     @ref AZX_TASKS_NOTINIT_ERR
+ *     @ref AZX_TASKS_INVALID_ID_ERR
+ *     @ref AZX_TASKS_ID_NOT_DEFINED_ERR
+ *
+ * @ingroup taskUsage
+ */
+INT32 azx_tasks_getStats(INT8 task_id, AZX_TASKS_STATS_T* stats);
+
+/**
+ * @brief Clears the runtime statistics of a task, apart from what is queued now.
+ *
+ * @param[in] task_id The task
+ *
+ * @ingroup taskUsage
+ */
+void azx_tasks_resetStats(INT8 task_id);
+
+/**
+ * @brief Logs the runtime statistics of all the tasks at info level.
+ *
+ * **Example**
+ *
+ *     Task 3 URCs: 1520 handled, queue 2/10 (high water 10), 14 send failures, 0 coalesced
+ *       exec ms: max 240, total 9310, <1:1402 <2:0 <4:0 <8:0 <16:96 <32:12 ...
+ *       wait ms: max 880, <1:1133 <2:0 <4:0 <8:0 <16:210 <32:88 ...
+ *
+ * @ingroup taskUsage
+ */
+void azx_tasks_logStats(void);
+
+/**
+ * @brief Creates the message pool of a task.
+ *
+ * The buffers are allocated once, here, and freed with the task.
+ *
+ * @param[in] task_id The task that will receive the payloads
+ * @param[in] payload_size The size of each buffer in bytes
+ * @param[in] buffers The number of buffers, at most @ref AZX_TASKS_MAX_POOL_BUFFERS
+ *
+ * @return One of
+ *     @ref AZX_TASKS_OK
+ *     @ref AZX_TASKS_NOTINIT_ERR
+ *     @ref AZX_TASKS_INVALID_ID_ERR
+ *     @ref AZX_TASKS_ID_NOT_DEFINED_ERR
+ *     @ref AZX_TASKS_MSG_Q_SIZE_ERR if @p buffers is out of range or the task
+ *     already has a pool
+ *     @ref AZX_TASKS_ALLOC_ERR
+ *
+ * @ingroup taskUsage
+ */
+INT32 azx_tasks_createMessagePool(INT8 task_id, UINT32 payload_size, UINT32 buffers);
+
+/**
+ * @brief Takes a buffer from the message pool of a task.
+ *
+ * The caller owns the buffer until it passes it to
+ * azx_tasks_sendPayloadToTask() or azx_tasks_freeMessage(). This does not
+ * block or take any lock.
+ *
+ * @param[in] task_id The task the payload will be sent to
+ * @param[in] size The size needed, at most the payload size of the pool
+ *
+ * @return The buffer, or NULL if the task has no pool, @p size is too large or
+ *     all the buffers are in use.
+ *
+ * @see AZX_TASKS_ALLOC_MESSAGE
+ *
+ * @ingroup taskUsage
+ */
+void* azx_tasks_allocMessage(INT8 task_id, UINT32 size);
+
+/**
+ * @brief Sends a payload to a task.
+ *
+ * The ownership of @p payload passes to the task, even if sending fails (then
+ * the buffer goes back to the pool at once). The callback of the task is
+ * called with `type`, the payload as `param1` (see @ref AZX_TASKS_PAYLOAD) and
+ * its size as `param2`. The buffer goes back to the pool when the callback
+ * returns, unless it calls azx_tasks_keepMessage().
+ *
+ * @param[in] task_id The task to receive the payload
+ * @param[in] type User parameter
+ * @param[in] payload A buffer from azx_tasks_allocMessage() for the same task
+ *
+ * @return One of
+ *     @ref AZX_TASKS_OK
+ *     @ref AZX_TASKS_INVALID_ID_ERR
+ *     @ref AZX_TASKS_ID_NOT_DEFINED_ERR
+ *     @ref AZX_TASKS_MSG_SEND_ERR
+ *     @ref AZX_TASKS_POOL_ERR
+ *
+ * **Example**
+ *
+ *     typedef struct { UINT8 data[64]; UINT32 len; } URC_T;
+ *
+ *     URC_T* urc = AZX_TASKS_ALLOC_MESSAGE(parser_task, URC_T);
+ *     if(urc)
+ *     {
+ *       urc->len = read_urc(urc->data, sizeof(urc->data));
+ *       azx_tasks_sendPayloadToTask(parser_task, MSG_URC, urc);
+ *     }
+ *
+ *     INT32 parser_cb(INT32 type, INT32 param1, INT32 param2)
+ *     {
+ *       URC_T* urc = AZX_TASKS_PAYLOAD(param1, URC_T);
+ *       ...
+ *     }
+ *
+ * @ingroup taskUsage
+ */
+INT32 azx_tasks_sendPayloadToTask(INT8 task_id, INT32 type, void* payload);
+
+/**
+ * @brief Keeps a received payload after the task callback returns.
+ *
+ * The callback then owns the buffer, and must release it with
+ * azx_tasks_freeMessage() (or send it on) once done.
+ *
+ * @param[in] payload The payload the callback received
+ *
+ * @ingroup taskUsage
+ */
+void azx_tasks_keepMessage(void* payload);
+
+/**
+ * @brief Returns a buffer that was not sent, or was kept, to its pool.
+ *
+ * @param[in] payload The buffer to release. NULL is ignored.
+ *
+ * @ingroup taskUsage
+ */
+void azx_tasks_freeMessage(void* payload);
+
+/**
+ * @brief Gets the statistics of the message pool of a task.
+ *
+ * @param[in] task_id The task
+ * @param[out] stats Where to store the statistics
+ *
+ * @return @ref AZX_TASKS_OK, or @ref AZX_TASKS_POOL_ERR if the task has no pool
+ *
+ * @ingroup taskUsage
+ */
+INT32 azx_tasks_getMessagePoolStats(INT8 task_id, AZX_TASKS_POOL_STATS_T* stats);
+
+/**
+ * @brief Takes a buffer for a payload of type @p type from the pool of @p task_id.
+ *
+ * @ingroup taskUsage
+ */
+#define AZX_TASKS_ALLOC_MESSAGE(task_id, type) \
+  ((type*)azx_tasks_allocMessage((task_id), sizeof(type)))
+
+/**
+ * @brief The payload of type @p type received as @p param1 by a task callback.
+ *
+ * @ingroup taskUsage
+ */
+#define AZX_TASKS_PAYLOAD(param1, type) ((type*)(MEM_W)(param1))
+
 #endif /* HDR_AZX_TASKS_H_ */
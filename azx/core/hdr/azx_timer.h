@@ -5,7 +5,7 @@
 #define UUID_9669089d_c8c5_4c9f_898b_37377eee8e07
 /**
  * @file azx_timer.h
- * @version 1.0.2
+ * @version 1.1.0
  * @dependencies core/azx_log core/azx_tasks core/azx_utils
  * @author Sorin Basca
  * @date 10/02/2019
@@ -19,6 +19,13 @@
  * on an existing task (see azx_tasks.h), or specify a custom callback using
  * azx_timer_initWithCb(). Timers can then be used with azx_timer_start().
  *
+ * All the timers share a single hardware timer. They are kept in a timing
+ * wheel, so starting and stopping a timer takes the same time however many
+ * there are, and the hardware timer only runs while some timer is running.
+ * Expiry is checked on ticks of `AZX_TIMER_TICK_MS` (10 ms if not defined in
+ * `app_cfg.h`), by the same internal task that calls the callbacks. There can
+ * be up to `AZX_TIMER_MAX_TIMERS` timers (64 if not defined in `app_cfg.h`).
+ *
  * Furthermore, timestamp related operations can be performed. For example you can
  * make a cool-down timer synchronously using azx_timer_getTimestampFromNow()
  * and the related functions.
@@ -54,6 +61,9 @@ typedef void (*azx_expiration_cb)(void* ctx, AZX_TIMER_ID timer_id);
 /**
  * @brief The value that signifies invalid timer ID.
  *
+ * IDs are not reused straight away, so the ID of a deleted timer does not
+ * match the timer that takes its place.
+ *
  * @see azx_timer_init
  * @see azx_timer_initWithCb
  */
@@ -66,7 +76,7 @@ typedef void (*azx_expiration_cb)(void* ctx, AZX_TIMER_ID timer_id);
  * message will be queued to the task provided. Do not expect that the task
  * will handle the expired notification at the exact time, as there may be some
  * delays introduced in handling the queued message. The only guarantee is that
- * at least the minimum duration has passed.
+ * at least the minimum duration has passed, rounded up to the next tick.
  *
  * The message sent on expiry will have the type as defined here, `param1` will
  * be the ID of the timer and `param2` will be unused.
@@ -149,6 +159,9 @@ void azx_timer_start(AZX_TIMER_ID id, UINT32 duration_ms, BOOLEAN restart);
 /**
  * @brief Stops a timer.
  *
+ * If the timer has expired, but its expiry has not been notified yet, it will
+ * not be.
+ *
  * @param[in] id The ID of the timer
  *
  * @see azx_timer_start
@@ -1,6 +1,8 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_APN
+
 #include <string.h>
 #include <stdio.h>
 #include "m2mb_types.h"
@@ -18,6 +20,10 @@
 #define LINE_LENGTH 100
 #define MAX_APN_LIST_SIZE 100
 
+#ifndef AZX_APN_CCID_CACHE_MS
+#define AZX_APN_CCID_CACHE_MS 60000
+#endif
+
 static CHAR currentCcid[40] = {0};
 
 static UINT16 myApnInfo = 0;
@@ -59,10 +65,20 @@ static BOOLEAN is_sim_inserted(void)
 static BOOLEAN get_ccid(void)
 {
   static const CHAR* ccid_fmt = "%*[^+]+CCID: %40[^ \r\n]";
+  static BOOLEAN ccid_cached = FALSE;
   const CHAR* response = NULL;
+
+  /* The ICCID only changes with the SIM. A missing SIM drops it straight away, a swapped one is
+   * noticed once the cached value expires */
+  if(!ccid_cached && azx_ati_cacheResponses("AT+CCID", AZX_APN_CCID_CACHE_MS))
+  {
+    ccid_cached = TRUE;
+  }
+
   if (!is_sim_inserted())
   {
     AZX_LOG_WARN("Unable to retrieve ICCIDs, SIM is not inserted\r\n");
+    azx_ati_invalidateCache("AT+CCID");
     currentCcid[0] = '\0';
     return FALSE;
   }
@@ -1,6 +1,8 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_ATI
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -11,46 +13,146 @@
 #include "m2mb_ati.h"
 
 #include "azx_log.h"
-#include "azx_buffer.h"
 #include "azx_utils.h"
+#include "azx_timer.h"
 
 #include "azx_ati.h"
 
 #define BUFFER_SIZE 2048
-#define WAIT_BETWEEN_READS_MS 20
+#define TIMEOUT_TICKS(ms) ((ms) > 0 ? M2MB_OS_MS2TICKS(ms) : 0)
 #define MAX_URC_HEADER 32
-#define MAX_URC_HANDLERS 20
 #define MAX_RESPONSES 10
 #define MAX_SILENT_CMDS 20
-
-typedef struct
+#define MAX_ASYNC_CMDS 8
+#define MAX_ASYNC_CMD_SIZE 128
+#define MAX_CMD_STATS 24
+#define MAX_CACHED_CMDS 8
+#define MAX_CACHED_CMD_SIZE 32
+#define MAX_CACHED_RSP_SIZE 128
+
+/* One character of a registered URC header. Siblings are alternatives for the same position */
+typedef struct UrcTrieNode
 {
-  CHAR hdr[MAX_URC_HEADER];
-  azx_urc_received_cb cb;
-} UrcHandler;
+  struct UrcTrieNode* child;
+  struct UrcTrieNode* sibling;
+  azx_urc_received_cb cb; /* Set if a header ends at this node */
+  UINT8 invalidates;      /* Cached responses dropped when a header ending here is received */
+  CHAR c;
+} UrcTrieNode;
 
 typedef struct
 {
   CHAR prefix[MAX_URC_HEADER];
 } SilentCmds;
 
+typedef struct
+{
+  const CHAR* text;
+  BOOLEAN whole_line; /* The line must end right after text, it is not just a prefix */
+} ResultCode;
+
+typedef struct
+{
+  UINT16 col;        /* Position in the current line */
+  UINT8 candidates;  /* Bit mask of ResultCodes still matching the current line */
+} ResultCodeDetector;
+
+typedef struct
+{
+  azx_ati_response_cb cb;
+  void* ctx;
+  INT32 timeout_ms;
+  UINT32 queued_at;
+  UINT16 cmd_len;
+  CHAR cmd[MAX_ASYNC_CMD_SIZE];
+} AsyncCmd;
+
+typedef enum
+{
+  STREAM_HEADER,  /* Buffering the response until the payload marker */
+  STREAM_PAYLOAD, /* Forwarding the payload to the sink */
+  STREAM_TRAILER  /* Buffering the rest of the response until the final result code */
+} StreamState;
+
+/* What a synchronous caller wants back besides the response pointer */
+typedef struct
+{
+  AZX_ATI_STREAM_T* stream;       /* If set, the payload goes to its sink instead of the buffer */
+  AZX_ATI_RESPONSE_HANDLE handle; /* Filled in with the handle of the response */
+  UINT8* buf;                     /* If set, the response is copied here before release */
+  UINT32 buf_size;
+  SSIZE_T copied;                 /* Full response size, or -1 if there was none */
+} CommandOptions;
+
+typedef enum
+{
+  MODULE_UNINIT = 0,
+  MODULE_INITIALISING,
+  MODULE_READY
+} ModuleState;
+
+static volatile UINT32 moduleState = MODULE_UNINIT;
+/* Serialises opening the instances, so no instance is opened twice */
+static M2MB_OS_MTX_HANDLE openMtx = M2MB_OS_MTX_INVALID;
+
 static SilentCmds silentCmds[MAX_SILENT_CMDS] = { 0 };
 static BOOLEAN silentMode = FALSE;
 static BOOLEAN fullySilentMode = FALSE;
 static BOOLEAN logNext = FALSE;
 
+/* Filled in order, the last entry collects whatever doesn't fit */
+static AZX_ATI_CMD_STATS_T cmdStats[MAX_CMD_STATS] = { 0 };
+static M2MB_OS_MTX_HANDLE statsMtx = M2MB_OS_MTX_INVALID;
+static AZX_TIMER_ID statsDumpTimer = NO_AZX_TIMER_ID;
+static UINT32 statsDumpPeriod = 0;
+
+typedef struct
+{
+  CHAR cmd[MAX_CACHED_CMD_SIZE];  /* Empty if the entry is unused */
+  UINT32 ttl_ticks;               /* 0 if it only expires when invalidated */
+  UINT32 stored_at;
+  UINT16 gen;                     /* Bumped on invalidation, so in-flight refills are discarded */
+  struct AzxBinaryData response;  /* Size 0 if nothing is cached */
+  UINT8 data[MAX_CACHED_RSP_SIZE];
+} CachedResponse;
+
+static CachedResponse cachedResponses[MAX_CACHED_CMDS] = { 0 };
+static UINT8 cachedCount = 0;
+static M2MB_OS_MTX_HANDLE cacheMtx = M2MB_OS_MTX_INVALID;
+
 typedef struct
 {
   M2MB_ATI_HANDLE h;
   const INT16 instanceID;
   BOOLEAN initialised;
   M2MB_OS_MTX_HANDLE mtx_hnd;
+  M2MB_OS_SEM_HANDLE rsp_sem;
+  M2MB_OS_SEM_HANDLE idle_sem;
   BOOLEAN processing;
+  UINT8 waiters;
+  BOOLEAN pinned;
   UINT16 next_response;
+  AsyncCmd async_cmds[MAX_ASYNC_CMDS];
+  UINT8 async_head;
+  UINT8 async_count;
+  BOOLEAN async_active;
+  BOOLEAN async_failed;  /* The outstanding async command could not be sent */
+  UINT32 async_start;
+  AZX_TIMER_ID async_timer;
   struct AzxBinaryData rsp[MAX_RESPONSES];
-  UrcHandler urc_handlers[MAX_URC_HANDLERS];
-  UINT8 readData[BUFFER_SIZE];
+  UINT16 rsp_gen[MAX_RESPONSES];
+  UrcTrieNode* urc_trie;
+  /* Responses are received into one window and handed out from the other, see keep_response() */
+  UINT8 window[2][BUFFER_SIZE];
+  UINT8 rx_window;
+  UINT16 held_size;        /* Bytes of the other window used by the responses handed out */
+  BOOLEAN append_response; /* The response goes after the ones held, for batches */
+  UINT8* readData;
   UINT16 readDataIdx;
+  AZX_ATI_STREAM_T* stream;
+  StreamState stream_state;
+  UINT32 stream_remaining;
+  ResultCodeDetector detector;
 } AtiData;
 
 
@@ -60,30 +162,49 @@ static AtiData ati_data[] = {
       .instanceID = 0,
       .initialised = FALSE,
       .mtx_hnd = M2MB_OS_MTX_INVALID,
+      .rsp_sem = M2MB_OS_SEM_INVALID,
+      .idle_sem = M2MB_OS_SEM_INVALID,
       .processing = FALSE,
       .next_response = 0,
+      .async_timer = NO_AZX_TIMER_ID,
     },
     {
       .h = NULL,
       .instanceID = 1,
       .initialised = FALSE,
       .mtx_hnd = M2MB_OS_MTX_INVALID,
+      .rsp_sem = M2MB_OS_SEM_INVALID,
+      .idle_sem = M2MB_OS_SEM_INVALID,
       .processing = FALSE,
       .next_response = 0,
+      .async_timer = NO_AZX_TIMER_ID,
     },
     {
       .h = NULL,
       .instanceID = 2,
       .initialised = FALSE,
       .mtx_hnd = M2MB_OS_MTX_INVALID,
+      .rsp_sem = M2MB_OS_SEM_INVALID,
+      .idle_sem = M2MB_OS_SEM_INVALID,
       .processing = FALSE,
       .next_response = 0,
+      .async_timer = NO_AZX_TIMER_ID,
     }
 };
 
 #define MAX_AT_INSTANCES (sizeof(ati_data)/sizeof(AtiData))
 
 static BOOLEAN is_silent_command(const CHAR* cmd);
+static void complete_async_command(AtiData* data, const struct AzxBinaryData* response,
+    BOOLEAN timed_out);
+static BOOLEAN is_response_ok(const struct AzxBinaryData* response);
+static void advance_response(AtiData* data);
+static void async_timeout_cb(void* ctx, AZX_TIMER_ID timer_id);
+static void reset_result_code_detector(ResultCodeDetector* det);
+static void invalidate_cached_responses(UINT8 mask);
+
+M2MB_RESULT_E ati_send_cmd( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte );
+SSIZE_T ati_rcv_resp( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte );
 
 static AtiData* get_ati_data(UINT8 instance)
 {
@@ -97,6 +218,11 @@ static AtiData* get_ati_data(UINT8 instance)
   return NULL;
 }
 
+static AZX_ATI_RESPONSE_HANDLE make_response_handle(const AtiData* data, UINT16 rsp_id)
+{
+  return ((UINT32)data->rsp_gen[rsp_id] << 16) | ((UINT32)data->instanceID << 8) | (rsp_id + 1);
+}
+
 static UINT8 get_index_of_instance(const AtiData* data)
 {
   return data - &ati_data[0];
@@ -123,125 +249,196 @@ static void unlock(AtiData* data)
   }
 }
 
-static UINT8* find_hdr(SSIZE_T size, UINT8* bytes, const UINT8* hdr)
+/* Wakes up the task waiting in wait_for_response(). Must be called with the instance locked */
+static void signal_response(AtiData* data)
+{
+  if(data->rsp_sem && M2MB_OS_SUCCESS != m2mb_os_sem_put(data->rsp_sem))
+  {
+    AZX_LOG_WARN("Unable to signal AT response completion\r\n");
+  }
+}
+
+/* Drops a completion signal left behind by a response that arrived after its timeout */
+static void clear_response_signal(AtiData* data)
+{
+  if(data->rsp_sem)
+  {
+    m2mb_os_sem_get(data->rsp_sem, M2MB_OS_NO_WAIT);
+  }
+}
+
+/* Drops a stored response, so any handle to it goes stale */
+static void expire_response(AtiData* data, UINT16 rsp_id)
+{
+  data->rsp[rsp_id].size = 0;
+  data->rsp[rsp_id].data = NULL;
+  ++data->rsp_gen[rsp_id];
+}
+
+/* Drops the responses stored in the given window, before it gets overwritten */
+static void expire_window(AtiData* data, UINT8 w)
 {
   UINT16 i = 0;
-  UINT16 hdr_idx = 0;
 
-  while(i < size && hdr[hdr_idx] != '\0')
+  for(i = 0; i < MAX_RESPONSES; ++i)
   {
-    if(bytes[i] == hdr[hdr_idx])
-    {
-      ++hdr_idx;
-      ++i;
-      continue;
-    }
-    /* Start of line doesn't match so go to next line */
-    hdr_idx = 0;
-    while(i < size && (bytes[i] != '\r' && bytes[i] != '\n'))
-    {
-      ++i;
-    }
-    while(i < size && (bytes[i] == '\r' || bytes[i] == '\n'))
+    const UINT8* rsp_data = data->rsp[i].data;
+    if(rsp_data >= data->window[w] && rsp_data < data->window[w] + BUFFER_SIZE)
     {
-      ++i;
+      expire_response(data, i);
     }
   }
+}
+
+static void reset_read_buffer(AtiData* data)
+{
+  data->readData = data->window[data->rx_window];
+  data->readDataIdx = 0;
+  reset_result_code_detector(&data->detector);
+}
+
+/**
+ * Gives the space where the next synchronous command is formatted, in the window holding the
+ * responses handed out. Those are out of date once a new command is sent, unless the command is
+ * part of a batch and they fit along with it.
+ *
+ * @return The command buffer, whose size is written to size
+ */
+static CHAR* get_command_buffer(AtiData* data, BOOLEAN keep_responses, UINT16 cmd_len,
+    UINT16* size)
+{
+  const UINT8 held = data->rx_window ^ 1;
+
+  data->append_response = keep_responses;
+  if(!keep_responses || data->held_size + cmd_len + 3 > BUFFER_SIZE)
+  {
+    expire_window(data, held);
+    data->held_size = 0;
+  }
+  *size = BUFFER_SIZE - data->held_size;
+  return (CHAR*)&data->window[held][data->held_size];
+}
+
+/**
+ * Hands out the response of a synchronous command (including its NUL terminator) without copying
+ * it: the windows swap roles, so nothing received afterwards overwrites it. Within a batch the
+ * response is appended to the ones already held instead, as long as it fits.
+ */
+static const UINT8* keep_response(AtiData* data, UINT16 size)
+{
+  UINT8* held = data->window[data->rx_window ^ 1];
+  const UINT8* response = data->readData;
 
-  if(hdr[hdr_idx] != '\0')
+  if(data->append_response && data->held_size + size + 1 <= BUFFER_SIZE)
   {
-    return NULL;
+    memcpy(&held[data->held_size], data->readData, size + 1);
+    response = &held[data->held_size];
+    data->held_size += size + 1;
   }
-  if(!silentMode)
+  else
   {
-    AZX_LOG_TRACE("Found URC header '%s' (i=%u, hdr_idx=%u)\r\n", hdr, i, hdr_idx);
+    data->rx_window ^= 1;
+    expire_window(data, data->rx_window);
+    data->held_size = size + 1;
   }
-  return &bytes[i-hdr_idx];
+  reset_read_buffer(data);
+  return response;
 }
 
-static struct AzxBinaryData handle_urc_lines(AtiData* data, SSIZE_T size, UINT8* bytes)
+/**
+ * Finds the handler of the longest registered header the line starts with, and collects the
+ * cached responses invalidated by any registered header it starts with.
+ */
+static azx_urc_received_cb match_urc(const UrcTrieNode* node, const UINT8* line, SSIZE_T len,
+    UINT8* invalidates)
 {
-  UINT8 i = 0;
-  struct AzxBinaryData response = {0};
+  azx_urc_received_cb cb = NULL;
+  SSIZE_T i = 0;
 
-  for(i = 0; i < MAX_URC_HANDLERS && size > 0; ++i)
+  *invalidates = 0;
+  while(node && i < len)
   {
-    UrcHandler* hnd = &data->urc_handlers[i];
-    UINT8* p = NULL;
-    if(!hnd->cb)
+    while(node && (UINT8)node->c != line[i])
+    {
+      node = node->sibling;
+    }
+    if(!node)
     {
       break;
     }
-    if(!silentMode)
+    if(node->cb)
+    {
+      cb = node->cb;
+    }
+    *invalidates |= node->invalidates;
+    node = node->child;
+    ++i;
+  }
+  return cb;
+}
+
+/**
+ * Splits the received bytes into lines in a single pass. Lines starting with a registered URC
+ * header are reported and dropped, the others are compacted towards the start of the buffer.
+ * At the start of a response, the leading line terminators are dropped too.
+ */
+static struct AzxBinaryData handle_urc_lines(AtiData* data, SSIZE_T size, UINT8* bytes,
+    BOOLEAN at_start)
+{
+  struct AzxBinaryData response = {0};
+  UINT8* const end = bytes + size;
+  UINT8* read = bytes;
+  UINT8* write = bytes;
+
+  while(read < end)
+  {
+    UINT8* line = read;
+    UINT8* eol = line;
+    azx_urc_received_cb cb = NULL;
+    UINT8 invalidates = 0;
+
+    while(eol < end && *eol != '\r' && *eol != '\n')
     {
-      AZX_LOG_TRACE("Checking URC with header %s\r\n", hnd->hdr);
+      ++eol;
     }
-    while(NULL != (p = find_hdr(size, bytes, (const UINT8*)hnd->hdr)))
+    read = eol;
+    while(read < end && (*read == '\r' || *read == '\n'))
     {
-      UINT8* end = p;
-      UINT8* buf_end = bytes+size;
+      ++read;
+    }
 
-      if(!silentMode)
-      {
-        AZX_LOG_TRACE("Finding end of URC\r\n");
-      }
-      while(end < buf_end && *end != '\r' && *end != '\n')
-      {
-        ++end;
-      }
-      if(!silentMode)
-      {
-        AZX_LOG_TRACE("Found end of URC\r\n");
-      }
-      if(end[0] == '\r' && end[1] == '\n')
-      {
-        ++end;
-      }
-      else if(end[0] == '\0')
-      {
-        --end;
-      }
-      else
-      {
-        *end = '\0';
-      }
-      if(!silentMode)
-      {
-        AZX_LOG_TRACE("Cutting out URC\r\n");
-      }
-      AZX_LOG_DEBUG("Reporting URC: %s\r\n", (const CHAR*)p);
-      hnd->cb((const CHAR*)p);
-      if(!silentMode)
-      {
-        AZX_LOG_TRACE("Completely removing out URC (p=%p, end=%p, bytes=%p,size=%d)\r\n", p, end, bytes, size);
-      }
-      ++end;
-      while(end < buf_end)
-      {
-        *p++ = *end++;
-      }
-      size -= (end-p);
-      if(!silentMode)
-      {
-        AZX_LOG_TRACE("New size is %d\r\n", size);
-      }
-      if(size < 0)
+    if(eol > line)
+    {
+      cb = match_urc(data->urc_trie, line, eol - line, &invalidates);
+    }
+
+    if(invalidates)
+    {
+      invalidate_cached_responses(invalidates);
+    }
+
+    if(cb || invalidates)
+    {
+      /* The line terminators are dropped with the URC, so the first one can end the string */
+      *eol = '\0';
+      if(cb)
       {
-        size = 0;
+        AZX_LOG_DEBUG("Reporting URC: %s\r\n", (const CHAR*)line);
+        cb((const CHAR*)line);
       }
-      bytes[size] = '\0';
-      if(!silentMode)
+    }
+    else if(eol > line || !at_start || write != bytes)
+    {
+      if(write != line)
       {
-        AZX_LOG_TRACE("Done handling URC\r\n");
+        memmove(write, line, read - line);
       }
+      write += read - line;
     }
   }
 
-  while(size > 0  && (*bytes == '\r' || *bytes == '\n'))
-  {
-    ++bytes;
-    --size;
-  }
+  size = write - bytes;
+  bytes[size] = '\0';
 
   response.size = size;
   response.data = bytes;
@@ -254,64 +451,86 @@ static struct AzxBinaryData handle_urc_lines(AtiData* data, SSIZE_T size, UINT8*
   return response;
 }
 
-static const CHAR* const MessageEndings[] = {
-  "OK\r",
-  "ERROR\r",
-  "+CME ERROR:",
-  "> ",
-  "CONNECT",
-  "NO CARRIER",
-  NULL
+static const ResultCode ResultCodes[] = {
+  { "OK", TRUE },
+  { "ERROR", TRUE },
+  { "+CME ERROR:", FALSE },
+  { "+CMS ERROR:", FALSE },
+  { "> ", FALSE },
+  { "CONNECT", FALSE },
+  { "NO CARRIER", FALSE },
 };
 
-static BOOLEAN starts_with(const UINT8* buf, UINT16 size, const CHAR* str)
+#define RESULT_CODES_COUNT (sizeof(ResultCodes)/sizeof(ResultCodes[0]))
+#define ALL_RESULT_CODES ((UINT8)((1u << RESULT_CODES_COUNT) - 1))
+
+static void reset_result_code_detector(ResultCodeDetector* det)
 {
-  UINT16 idx = 0;
-  while(*str != '\0')
-  {
-    if(idx == size)
-    {
-      return FALSE;
-    }
-    if(buf[idx] != (UINT8)*str)
-    {
-      return FALSE;
-    }
-    ++idx;
-    ++str;
-  }
-  return TRUE;
+  det->col = 0;
+  det->candidates = ALL_RESULT_CODES;
 }
 
-static BOOLEAN is_message_complete(const struct AzxBinaryData* msg)
+/**
+ * Feeds newly received bytes to the detector. Each byte is compared once against the result codes
+ * that still match the start of the current line, so the cost is linear in the size of the
+ * response no matter how many chunks it arrives in.
+ *
+ * @return TRUE once a final result code (or the prompt) has been seen
+ */
+static BOOLEAN detect_result_code(ResultCodeDetector* det, const UINT8* bytes, SSIZE_T size)
 {
-  UINT16 idx = 0;
-  UINT16 i = 0;
-  for(idx = 0; idx < msg->size; ++idx)
+  SSIZE_T i = 0;
+  UINT8 j = 0;
+
+  for(i = 0; i < size; ++i)
   {
-    if(!silentMode)
+    const UINT8 c = bytes[i];
+
+    if(c == '\r' || c == '\n')
+    {
+      for(j = 0; j < RESULT_CODES_COUNT && det->candidates; ++j)
+      {
+        if((det->candidates & (1u << j)) && ResultCodes[j].whole_line &&
+            ResultCodes[j].text[det->col] == '\0')
+        {
+          return TRUE;
+        }
+      }
+      reset_result_code_detector(det);
+      continue;
+    }
+
+    if(!det->candidates)
     {
-      AZX_LOG_TRACE("Checking completeness from '%.*s'\r\n",
-          msg->size - idx, (const CHAR*)&(msg->data[idx]));
+      /* Nothing can match on this line anymore, skip to the next one */
+      continue;
     }
-    for(i = 0; MessageEndings[i] != NULL; ++i)
+
+    for(j = 0; j < RESULT_CODES_COUNT; ++j)
     {
-      if(!silentMode)
+      const CHAR* text = ResultCodes[j].text;
+      if(!(det->candidates & (1u << j)))
+      {
+        continue;
+      }
+      if(text[det->col] == '\0' || (UINT8)text[det->col] != c)
       {
-        AZX_LOG_TRACE("Comparing with %s\r\n", MessageEndings[i]);
+        det->candidates &= ~(1u << j);
       }
-      if(starts_with(&(msg->data[idx]), msg->size - idx, MessageEndings[i]))
+      else if(!ResultCodes[j].whole_line && text[det->col + 1] == '\0')
       {
         return TRUE;
       }
     }
+    ++det->col;
   }
   return FALSE;
 }
 
 static UINT16 process_ati_response(AtiData* data, SSIZE_T size, UINT8* bytes, UINT16 idx)
 {
-  struct AzxBinaryData response = handle_urc_lines(data, size, &bytes[idx]);
+  struct AzxBinaryData response = handle_urc_lines(data, size, &bytes[idx], idx == 0);
+  struct AzxBinaryData async_response = {0};
 
   if(response.size <= 0)
   {
@@ -325,22 +544,30 @@ static UINT16 process_ati_response(AtiData* data, SSIZE_T size, UINT8* bytes, UI
     {
       AZX_LOG_TRACE("No outstanding AT command ignoring\r\n");
     }
+    reset_result_code_detector(&data->detector);
     idx = 0;
     goto end;
   }
 
   idx += response.size;
-  if(is_message_complete(&response))
+  if(detect_result_code(&data->detector, response.data, response.size))
   {
     if(!silentMode)
     {
       AZX_LOG_TRACE("AT response is complete (size=%u)\r\n", idx);
     }
-    data->rsp[data->next_response].data = (const UINT8*)(
-        azx_buffer_getObj(azx_buffer_addObj(bytes, idx)));
-    if(data->rsp[data->next_response].data)
+    if(data->async_active)
     {
+      /* Only valid during the callback, the next reception can reuse the window */
+      async_response.data = data->readData;
+      async_response.size = idx;
+      reset_result_code_detector(&data->detector);
+    }
+    else
+    {
+      data->rsp[data->next_response].data = keep_response(data, idx);
       data->rsp[data->next_response].size = idx;
+      signal_response(data);
     }
     idx = 0;
   }
@@ -354,64 +581,175 @@ static UINT16 process_ati_response(AtiData* data, SSIZE_T size, UINT8* bytes, UI
 
 end:
   unlock(data);
+
+  if(async_response.size > 0)
+  {
+    complete_async_command(data, &async_response, FALSE);
+  }
   return idx;
 }
 
-static void ati_cb( M2MB_ATI_HANDLE h, M2MB_ATI_EVENTS_E ati_event,
-    UINT16 resp_size, void *resp_struct, void *userdata )
+/**
+ * Looks for the start of the payload in the first len bytes of the receive window. If the size is
+ * in the header, the header line must be complete and its last number is the payload size.
+ *
+ * @return The offset of the payload, or -1 if the header has not been received yet
+ */
+static INT32 find_payload_start(AtiData* data, const AZX_ATI_STREAM_T* stream, UINT16 len)
 {
-  AtiData* data = (AtiData*)userdata;
-  UINT16 size = 0;
-  SSIZE_T read_size = 0;
+  const UINT8* bytes = data->readData;
+  const UINT16 marker_len = (UINT16)strlen(stream->marker);
+  UINT32 size = 0;
+  UINT32 digit = 1;
+  UINT16 start = 0;
+  UINT16 eol = 0;
+
+  while(start + marker_len <= len && memcmp(&bytes[start], stream->marker, marker_len) != 0)
+  {
+    ++start;
+  }
+  if(start + marker_len > len)
+  {
+    return -1;
+  }
+  start += marker_len;
 
-  if(!data || ati_event != M2MB_RX_DATA_EVT || data->h != h)
+  data->stream_remaining = stream->size;
+  if(!stream->size_in_header)
   {
-    return;
+    return start;
   }
 
-  if(!silentMode)
+  for(eol = start; eol + 1 < len && !(bytes[eol] == '\r' && bytes[eol+1] == '\n'); ++eol)
   {
-    AZX_LOG_TRACE("Received AT RX event with size %u (struct=%p)\r\n", resp_size, resp_struct);
+  }
+  if(eol + 1 >= len)
+  {
+    return -1;
   }
 
-  if(resp_size < 2 || !resp_struct)
+  while(eol > start && bytes[eol-1] >= '0' && bytes[eol-1] <= '9')
   {
-    return;
+    size += (bytes[--eol] - '0') * digit;
+    digit *= 10;
+  }
+  if(size < data->stream_remaining)
+  {
+    data->stream_remaining = size;
   }
 
-  size = *((const UINT16*)resp_struct);
-  if(!silentMode)
+  while(bytes[eol] != '\r')
   {
-    AZX_LOG_TRACE("Outstanding %u bytes\r\n", size);
+    ++eol;
+  }
+  return eol + 2;
+}
+
+/**
+ * Splits newly received bytes between the buffered response and the sink of the streamed payload.
+ * Only the header and trailer of the response are kept in the receive window.
+ *
+ * @return The new index in the receive window
+ */
+static UINT16 process_stream(AtiData* data, SSIZE_T size)
+{
+  UINT8* bytes = data->readData;
+  UINT16 idx = data->readDataIdx;
+  AZX_ATI_STREAM_T* stream = NULL;
+  INT32 payload = 0;
+  UINT32 chunk = 0;
+  UINT8 first = 0;
+
+  lock(data);
+  stream = data->stream;
+  if(stream && data->stream_state == STREAM_HEADER)
+  {
+    payload = find_payload_start(data, stream, idx + size);
+    if(payload < 0)
+    {
+      unlock(data);
+      return process_ati_response(data, size, bytes, idx);
+    }
+
+    data->stream_state = (data->stream_remaining > 0) ? STREAM_PAYLOAD : STREAM_TRAILER;
+    unlock(data);
+    /* Whatever follows the header goes through the same path as a fresh chunk */
+    size = idx + size - payload;
+    first = bytes[payload]; /* The header processing terminates its string right there */
+    idx = process_ati_response(data, payload - idx, bytes, idx);
+    bytes[payload] = first;
+    memmove(&bytes[idx], &bytes[payload], size);
+    bytes[idx + size] = '\0';
+    lock(data);
+    stream = data->stream;
+  }
+
+  if(stream && data->stream_state == STREAM_PAYLOAD)
+  {
+    chunk = ((UINT32)size < data->stream_remaining) ? (UINT32)size : data->stream_remaining;
+    if(stream->sink && chunk > 0)
+    {
+      /* The sink may be slow (e.g. writing to flash), the instance is not held meanwhile. Only
+       * this callback writes to the receive window, so the bytes stay put. */
+      unlock(data);
+      stream->sink(stream->ctx, &bytes[idx], chunk);
+      lock(data);
+    }
+    /* The command may have timed out while the sink was running */
+    if(data->stream == stream)
+    {
+      stream->received += chunk;
+      data->stream_remaining -= chunk;
+    }
+    size -= chunk;
+    memmove(&bytes[idx], &bytes[idx + chunk], size);
+    bytes[idx + size] = '\0';
+    if(data->stream_remaining == 0)
+    {
+      data->stream_state = STREAM_TRAILER;
+    }
+  }
+  unlock(data);
+
+  if(size > 0)
+  {
+    idx = process_ati_response(data, size, bytes, idx);
   }
+  return idx;
+}
+
+/**
+ * Reads up to size bytes of the outstanding response into the receive window and processes them.
+ *
+ * @return How many bytes were read
+ */
+static SSIZE_T receive_chunk(AtiData* data, M2MB_ATI_HANDLE h, UINT16 size)
+{
+  SSIZE_T read_size = 0;
 
   while(size >= BUFFER_SIZE-data->readDataIdx-1)
   {
     if(data->readDataIdx > 0)
     {
       AZX_LOG_WARN("AT response is bigger in size than the buffer size. Dropping old buffer\r\n");
-      data->readDataIdx = 0;
+      reset_read_buffer(data);
     }
     else
     {
       AZX_LOG_WARN("AT response is still bigger in size than the buffer size\r\n");
-      return;
+      return 0;
     }
   }
 
-  if(data->readDataIdx == 0)
-  {
-    memset(data->readData, 0, sizeof(data->readData));
-  }
   if(!silentMode)
   {
     AZX_LOG_TRACE("Receive AT buffer at index %u\r\n", data->readDataIdx);
   }
-  read_size = m2mb_ati_rcv_resp(h, (void*)&data->readData[data->readDataIdx], size);
+  read_size = ati_rcv_resp(h, (void*)&data->readData[data->readDataIdx], size);
   if(read_size <= 0)
   {
     AZX_LOG_WARN("Unable to perform AT read\r\n");
-    return;
+    return 0;
   }
 
   data->readData[data->readDataIdx + read_size] = '\0';
@@ -421,26 +759,76 @@ static void ati_cb( M2MB_ATI_HANDLE h, M2MB_ATI_EVENTS_E ati_event,
         (const CHAR*)&data->readData[data->readDataIdx]);
   }
 
-  data->readDataIdx = process_ati_response(data, read_size, data->readData, data->readDataIdx);
+  if(data->stream)
+  {
+    data->readDataIdx = process_stream(data, read_size);
+  }
+  else
+  {
+    data->readDataIdx = process_ati_response(data, read_size, data->readData, data->readDataIdx);
+  }
+  return read_size;
 }
 
-__attribute__((weak)) M2MB_RESULT_E ati_send_cmd( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
+static void ati_cb( M2MB_ATI_HANDLE h, M2MB_ATI_EVENTS_E ati_event,
+    UINT16 resp_size, void *resp_struct, void *userdata )
 {
-  return m2mb_ati_send_cmd(handle, buf, nbyte);
-}
+  AtiData* data = (AtiData*)userdata;
+  UINT16 size = 0;
+  UINT16 chunk = 0;
+  SSIZE_T read_size = 0;
 
-__attribute__((weak)) SSIZE_T ati_rcv_resp( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
-{
-  return m2mb_ati_rcv_resp(handle, buf, nbyte);
-}
+  if(!data || ati_event != M2MB_RX_DATA_EVT || data->h != h)
+  {
+    return;
+  }
 
-void azx_urc_noop_cb(const CHAR* msg)
-{
-  AZX_LOG_DEBUG("Ignoring URC: %s\r\n", msg);
-  (void)msg;
-}
+  if(!silentMode)
+  {
+    AZX_LOG_TRACE("Received AT RX event with size %u (struct=%p)\r\n", resp_size, resp_struct);
+  }
 
-static void send_initial_config_commands(const AtiData* data)
+  if(resp_size < 2 || !resp_struct)
+  {
+    return;
+  }
+
+  size = *((const UINT16*)resp_struct);
+  if(!silentMode)
+  {
+    AZX_LOG_TRACE("Outstanding %u bytes\r\n", size);
+  }
+
+  do
+  {
+    chunk = size;
+    if(data->stream && chunk >= BUFFER_SIZE-data->readDataIdx-1 && data->readDataIdx < BUFFER_SIZE-2)
+    {
+      /* The payload is handed to the sink as it arrives, so it can be read in pieces */
+      chunk = BUFFER_SIZE-data->readDataIdx-2;
+    }
+    read_size = receive_chunk(data, h, chunk);
+    size -= (read_size < size) ? read_size : size;
+  } while(read_size > 0 && size > 0 && data->stream);
+}
+
+__attribute__((weak)) M2MB_RESULT_E ati_send_cmd( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
+{
+  return m2mb_ati_send_cmd(handle, buf, nbyte);
+}
+
+__attribute__((weak)) SSIZE_T ati_rcv_resp( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
+{
+  return m2mb_ati_rcv_resp(handle, buf, nbyte);
+}
+
+void azx_urc_noop_cb(const CHAR* msg)
+{
+  AZX_LOG_DEBUG("Ignoring URC: %s\r\n", msg);
+  (void)msg;
+}
+
+static void send_initial_config_commands(const AtiData* data)
 {
   BOOLEAN rc = FALSE;
   UINT8 instance = get_index_of_instance(data);
@@ -454,307 +842,1544 @@ static void send_initial_config_commands(const AtiData* data)
   }
 }
 
-/**
- * Opens ATI instance to be used sending commands.
- *
- * @warning This instance will have echo disabled
- */
-static BOOLEAN open_ati_handle(AtiData* data)
+static BOOLEAN create_mutex(M2MB_OS_MTX_HANDLE* mtx, const CHAR* name)
+{
+  UINT32 inheritVal = 1;
+  M2MB_OS_RESULT_E osRes;
+  M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
+
+  osRes = m2mb_os_mtx_setAttrItem_( &mtxAttrHandle,
+      M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
+      M2MB_OS_MTX_SEL_CMD_NAME, name,
+      M2MB_OS_MTX_SEL_CMD_USRNAME, name,
+      M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal);
+  if(osRes != M2MB_OS_SUCCESS)
+  {
+    AZX_LOG_WARN("Unable to create mutex attr %s (err = %d)\r\n", name, osRes);
+    return FALSE;
+  }
+  osRes = m2mb_os_mtx_init(mtx, &mtxAttrHandle);
+  if(!*mtx || osRes != M2MB_OS_SUCCESS)
+  {
+    AZX_LOG_WARN("Unable to create mutex %s (err = %d)\r\n", name, osRes);
+    return FALSE;
+  }
+  AZX_LOG_TRACE("Created mutex %s\r\n", name);
+  return TRUE;
+}
+
+static BOOLEAN create_semaphore(M2MB_OS_SEM_HANDLE* sem, const CHAR* name)
+{
+  M2MB_OS_RESULT_E osRes;
+  M2MB_OS_SEM_ATTR_HANDLE semAttrHandle;
+
+  osRes = m2mb_os_sem_setAttrItem(&semAttrHandle,
+      CMDS_ARGS(
+        M2MB_OS_SEM_SEL_CMD_CREATE_ATTR, NULL,
+        M2MB_OS_SEM_SEL_CMD_COUNT, 0 /*IPC*/,
+        M2MB_OS_SEM_SEL_CMD_TYPE, M2MB_OS_SEM_BINARY,
+        M2MB_OS_SEM_SEL_CMD_NAME, name));
+  if(osRes != M2MB_OS_SUCCESS)
+  {
+    AZX_LOG_WARN("Unable to create semaphore attr %s (err = %d)\r\n", name, osRes);
+    return FALSE;
+  }
+  osRes = m2mb_os_sem_init(sem, &semAttrHandle);
+  if(!*sem || osRes != M2MB_OS_SUCCESS)
+  {
+    AZX_LOG_WARN("Unable to create semaphore %s (err = %d)\r\n", name, osRes);
+    return FALSE;
+  }
+  AZX_LOG_TRACE("Created semaphore %s\r\n", name);
+  return TRUE;
+}
+
+/**
+ * Creates what is shared by all the instances. Only the first caller does it, tasks racing with
+ * it wait until it is done.
+ */
+static BOOLEAN init_module(void)
+{
+  while(moduleState == MODULE_INITIALISING)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(1));
+  }
+  if(!__sync_bool_compare_and_swap(&moduleState, MODULE_UNINIT, MODULE_INITIALISING))
+  {
+    return moduleState == MODULE_READY;
+  }
+
+  if((!openMtx && !create_mutex(&openMtx, "atOpenMtx")) ||
+      (!statsMtx && !create_mutex(&statsMtx, "atStatsMtx")) ||
+      (!cacheMtx && !create_mutex(&cacheMtx, "atCacheMtx")))
+  {
+    AZX_LOG_ERROR("Unable to initialise the AT library\r\n");
+    moduleState = MODULE_UNINIT;
+    return FALSE;
+  }
+  __sync_synchronize();
+  moduleState = MODULE_READY;
+  return TRUE;
+}
+
+/* Creates the timer of the async command timeouts. Must be called with openMtx held */
+static BOOLEAN create_async_timer(AtiData* data)
+{
+  if(data->async_timer == NO_AZX_TIMER_ID)
+  {
+    data->async_timer = azx_timer_initWithCb(&async_timeout_cb, data, AZX_ATI_DEFAULT_TIMEOUT);
+  }
+  return data->async_timer != NO_AZX_TIMER_ID;
+}
+
+/* Creates the resources of the instance and opens it. Must be called with openMtx held */
+static BOOLEAN init_ati_handle(AtiData* data)
+{
+  AZX_LOG_TRACE("Opening ATI %d \r\n", data->instanceID);
+
+  if(!data->mtx_hnd && !create_mutex(&data->mtx_hnd, "atMtx"))
+  {
+    AZX_LOG_WARN("Unable to create mutex to protect AT instance\r\n");
+    return FALSE;
+  }
+
+  if(!data->rsp_sem && !create_semaphore(&data->rsp_sem, "atRspSem"))
+  {
+    AZX_LOG_WARN("Unable to create semaphore for AT responses\r\n");
+    return FALSE;
+  }
+
+  if(!data->idle_sem && !create_semaphore(&data->idle_sem, "atIdleSem"))
+  {
+    AZX_LOG_WARN("Unable to create semaphore for AT instance availability\r\n");
+    return FALSE;
+  }
+
+  /* Only needed by async commands, which try again if azx_tasks is not initialised yet */
+  if(!create_async_timer(data))
+  {
+    AZX_LOG_DEBUG("No timer for async AT commands yet\r\n");
+  }
+
+  memset(data->rsp, 0, sizeof(data->rsp));
+  data->rx_window = 0;
+  data->held_size = 0;
+  reset_read_buffer(data);
+
+  if(M2MB_RESULT_SUCCESS != m2mb_ati_init(&data->h, data->instanceID, &ati_cb, data))
+  {
+    return FALSE;
+  }
+
+  __sync_synchronize();
+  data->initialised = TRUE;
+  return TRUE;
+}
+
+/**
+ * Opens ATI instance to be used sending commands.
+ *
+ * @warning This instance will have echo disabled
+ */
+static BOOLEAN open_ati_handle(AtiData* data)
+{
+  BOOLEAN opened = FALSE;
+
+  if(data->initialised)
+  {
+    return TRUE;
+  }
+  if(!init_module())
+  {
+    return FALSE;
+  }
+
+  m2mb_os_mtx_get(openMtx, M2MB_OS_WAIT_FOREVER);
+  /* Another task may have opened it while this one was waiting */
+  if(data->initialised)
+  {
+    m2mb_os_mtx_put(openMtx);
+    return TRUE;
+  }
+  opened = init_ati_handle(data);
+  m2mb_os_mtx_put(openMtx);
+
+  if(opened)
+  {
+    /* Since the starting state of the AT instance cannot be guaranteed,
+     * this function executes several AT instance profile commands to
+     * bring it to a known state.*/
+    send_initial_config_commands(data);
+  }
+  return opened;
+}
+
+/* The cache key is the command without its line terminator */
+static BOOLEAN is_cache_key(const CachedResponse* entry, const CHAR* cmd)
+{
+  const SIZE_T len = strlen(entry->cmd);
+  return strncmp(entry->cmd, cmd, len) == 0 && (cmd[len] == '\0' || cmd[len] == '\r');
+}
+
+static void invalidate_cached_responses(UINT8 mask)
+{
+  UINT8 i = 0;
+
+  if(!cacheMtx)
+  {
+    return;
+  }
+
+  m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < MAX_CACHED_CMDS; ++i)
+  {
+    if(mask & (1u << i))
+    {
+      cachedResponses[i].response.size = 0;
+      ++cachedResponses[i].gen;
+    }
+  }
+  m2mb_os_mtx_put(cacheMtx);
+}
+
+/**
+ * Looks the command up in the cache. A hit is copied to the window of the responses handed out by
+ * the instance, so it stays valid like a response from the modem, whatever happens to the entry.
+ * On a miss of a cacheable command, slot and gen tell store_cached_response() where the response
+ * goes. Must be called with the instance acquired and locked.
+ *
+ * @return The cached response, or NULL on a miss
+ */
+static const struct AzxBinaryData* find_cached_response(AtiData* data, const CHAR* cmd,
+    INT16* slot, UINT16* gen)
+{
+  const struct AzxBinaryData* response = NULL;
+  CachedResponse* entry = NULL;
+  UINT8* held = NULL;
+  UINT16 room = 0;
+  UINT8 i = 0;
+
+  *slot = -1;
+  m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < cachedCount; ++i)
+  {
+    entry = &cachedResponses[i];
+    if(!is_cache_key(entry, cmd))
+    {
+      continue;
+    }
+
+    if(entry->response.size > 0 && entry->ttl_ticks > 0 &&
+        m2mb_os_getSysTicks() - entry->stored_at >= entry->ttl_ticks)
+    {
+      entry->response.size = 0;
+      ++entry->gen;
+    }
+
+    if(entry->response.size > 0)
+    {
+      held = (UINT8*)get_command_buffer(data, FALSE, 0, &room);
+      memcpy(held, entry->data, entry->response.size + 1);
+      data->held_size = entry->response.size + 1;
+      data->rsp[data->next_response].data = held;
+      data->rsp[data->next_response].size = entry->response.size;
+      response = &data->rsp[data->next_response];
+      advance_response(data);
+    }
+    else
+    {
+      *slot = i;
+      *gen = entry->gen;
+    }
+    break;
+  }
+  m2mb_os_mtx_put(cacheMtx);
+  return response;
+}
+
+static void store_cached_response(INT16 slot, UINT16 gen, const struct AzxBinaryData* response)
+{
+  CachedResponse* entry = &cachedResponses[slot];
+
+  if(response->size >= MAX_CACHED_RSP_SIZE)
+  {
+    AZX_LOG_DEBUG("Response of %s is too big to be cached\r\n", entry->cmd);
+    return;
+  }
+
+  m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+  /* Skip it if the entry got invalidated while the command was running */
+  if(entry->gen == gen)
+  {
+    memcpy(entry->data, response->data, response->size);
+    entry->data[response->size] = '\0';
+    entry->response.data = entry->data;
+    entry->response.size = response->size;
+    entry->stored_at = m2mb_os_getSysTicks();
+  }
+  m2mb_os_mtx_put(cacheMtx);
+}
+
+static INT16 find_cache_entry(const CHAR* cmd)
+{
+  UINT8 i = 0;
+
+  for(i = 0; i < cachedCount; ++i)
+  {
+    if(strcmp(cachedResponses[i].cmd, cmd) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* The command name is everything up to its parameters or the query mark */
+static void get_command_key(const CHAR* cmd, CHAR* key)
+{
+  UINT16 i = 0;
+
+  while(i < AZX_ATI_STATS_PREFIX_SIZE - 1 && cmd[i] != '\0' && cmd[i] != '=' && cmd[i] != '?' &&
+      cmd[i] != '\r')
+  {
+    key[i] = cmd[i];
+    ++i;
+  }
+  key[i] = '\0';
+}
+
+static BOOLEAN is_response_error(const struct AzxBinaryData* response)
+{
+  SSIZE_T end = response->size;
+  SSIZE_T start = 0;
+  const CHAR* line = NULL;
+
+  while(end > 0 && (response->data[end-1] == '\r' || response->data[end-1] == '\n'))
+  {
+    --end;
+  }
+  start = end;
+  while(start > 0 && response->data[start-1] != '\r' && response->data[start-1] != '\n')
+  {
+    --start;
+  }
+
+  line = (const CHAR*)&response->data[start];
+  return strncmp(line, "ERROR", 5) == 0 || strncmp(line, "+CME ERROR", 10) == 0 ||
+      strncmp(line, "+CMS ERROR", 10) == 0 || strncmp(line, "NO CARRIER", 10) == 0;
+}
+
+/* Bucket 0 is below 8 ms, each following bucket is twice as wide as the previous one */
+static UINT8 get_latency_bucket(UINT32 ms)
+{
+  UINT8 bucket = 0;
+
+  ms >>= 3;
+  while(ms > 0 && bucket < AZX_ATI_LATENCY_BUCKETS - 1)
+  {
+    ms >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+/**
+ * Accounts a command which has been sent. A NULL response means it timed out. The time spent
+ * waiting for the instance is kept apart from the time the modem took to respond.
+ */
+static void record_command_stats(const CHAR* cmd, UINT32 wait_ticks, UINT32 modem_ticks,
+    const struct AzxBinaryData* response)
+{
+  const FLOAT32 ms_per_tick = m2mb_os_getSysTickDuration_ms();
+  const UINT32 wait_ms = (UINT32)(wait_ticks * ms_per_tick);
+  const UINT32 modem_ms = (UINT32)(modem_ticks * ms_per_tick);
+  AZX_ATI_CMD_STATS_T* stats = NULL;
+  CHAR key[AZX_ATI_STATS_PREFIX_SIZE];
+  UINT16 i = 0;
+
+  if(!statsMtx)
+  {
+    return;
+  }
+
+  get_command_key(cmd, key);
+  m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < MAX_CMD_STATS - 1; ++i)
+  {
+    if(cmdStats[i].prefix[0] == '\0')
+    {
+      snprintf(cmdStats[i].prefix, sizeof(cmdStats[i].prefix), "%s", key);
+    }
+    if(strcmp(cmdStats[i].prefix, key) == 0)
+    {
+      stats = &cmdStats[i];
+      break;
+    }
+  }
+  if(!stats)
+  {
+    stats = &cmdStats[MAX_CMD_STATS - 1];
+    snprintf(stats->prefix, sizeof(stats->prefix), "(other)");
+  }
+
+  ++stats->count;
+  stats->total_wait_ms += wait_ms;
+  if(wait_ms > stats->max_wait_ms)
+  {
+    stats->max_wait_ms = wait_ms;
+  }
+
+  if(!response)
+  {
+    ++stats->timeouts;
+  }
+  else
+  {
+    if(is_response_error(response))
+    {
+      ++stats->errors;
+    }
+    if(stats->count - stats->timeouts == 1 || modem_ms < stats->min_ms)
+    {
+      stats->min_ms = modem_ms;
+    }
+    if(modem_ms > stats->max_ms)
+    {
+      stats->max_ms = modem_ms;
+    }
+    stats->total_ms += modem_ms;
+    ++stats->histogram[get_latency_bucket(modem_ms)];
+  }
+  m2mb_os_mtx_put(statsMtx);
+}
+
+/**
+ * Sends the command at the head of the async queue. Must be called with the instance locked and
+ * not processing anything else.
+ *
+ * @return TRUE if an async command is now outstanding, FALSE if the queue is empty
+ */
+static BOOLEAN dispatch_next_async(AtiData* data)
+{
+  AsyncCmd* next = NULL;
+
+  if(data->async_count == 0)
+  {
+    return FALSE;
+  }
+
+  next = &data->async_cmds[data->async_head];
+  data->processing = TRUE;
+  data->async_active = TRUE;
+  data->async_failed = FALSE;
+  data->async_start = m2mb_os_getSysTicks();
+  reset_read_buffer(data);
+
+  if(!is_silent_command(next->cmd))
+  {
+    AZX_LOG_DEBUG("Sending (async): %.*s\r\n", next->cmd_len - 2, next->cmd);
+  }
+
+  azx_timer_start(data->async_timer, next->timeout_ms, TRUE);
+  if(M2MB_RESULT_SUCCESS != ati_send_cmd(data->h, next->cmd, next->cmd_len))
+  {
+    AZX_LOG_ERROR("Unable to send command: %s\r\n", next->cmd);
+    /* Let the timer report the failure straight away, so the queue keeps moving. The flag keeps
+     * complete_async_command() from taking the early expiry for a stale one */
+    data->async_failed = TRUE;
+    azx_timer_start(data->async_timer, 1, TRUE);
+  }
+  return TRUE;
+}
+
+/**
+ * Marks the instance as free. Queued async commands get the instance first, otherwise a task
+ * blocked in send_at_command_v() is woken up. Must be called with the instance locked.
+ */
+static void release_instance(AtiData* data)
+{
+  data->processing = FALSE;
+  if(!dispatch_next_async(data))
+  {
+    m2mb_os_sem_put(data->idle_sem);
+  }
+}
+
+/**
+ * Waits until no other command is outstanding on the instance and takes it over. Returns with the
+ * instance locked.
+ */
+static void acquire_instance(AtiData* data)
+{
+  lock(data);
+  ++data->waiters;
+  while(data->processing)
+  {
+    unlock(data);
+    m2mb_os_sem_get(data->idle_sem, M2MB_OS_WAIT_FOREVER);
+    lock(data);
+  }
+  --data->waiters;
+  data->processing = TRUE;
+}
+
+static void advance_response(AtiData* data)
+{
+  if(++data->next_response == MAX_RESPONSES)
+  {
+    data->next_response = 0;
+  }
+}
+
+/**
+ * Pops the outstanding async command, dispatches the next one and only then reports the result,
+ * so the modem is already busy with the next command while the user callback runs.
+ */
+static void complete_async_command(AtiData* data, const struct AzxBinaryData* response,
+    BOOLEAN timed_out)
+{
+  const AsyncCmd* done = NULL;
+  azx_ati_response_cb cb = NULL;
+  void* ctx = NULL;
+
+  lock(data);
+  if(!data->async_active)
+  {
+    unlock(data);
+    return;
+  }
+
+  done = &data->async_cmds[data->async_head];
+  if(timed_out && !data->async_failed && (INT32)(m2mb_os_getSysTicks() - data->async_start) + 1 <
+      (INT32)TIMEOUT_TICKS(done->timeout_ms))
+  {
+    /* Expiry of a command that has already completed, the current one is still in time */
+    unlock(data);
+    return;
+  }
+
+  /* Like the synchronous commands, one which was never sent is not accounted */
+  if(!data->async_failed)
+  {
+    record_command_stats(done->cmd, data->async_start - done->queued_at,
+        m2mb_os_getSysTicks() - data->async_start, timed_out ? NULL : response);
+  }
+
+  if(timed_out)
+  {
+    if(!data->async_failed && !is_silent_command(done->cmd))
+    {
+      AZX_LOG_ERROR("No AT response received before timeout\r\n");
+    }
+  }
+  else
+  {
+    azx_timer_stop(data->async_timer);
+    if(!is_silent_command(done->cmd))
+    {
+      AZX_LOG_DEBUG("Received response (async): %s\r\n", (const CHAR*)response->data);
+    }
+  }
+
+  cb = done->cb;
+  ctx = done->ctx;
+  data->async_head = (data->async_head + 1) % MAX_ASYNC_CMDS;
+  --data->async_count;
+  data->async_active = FALSE;
+  release_instance(data);
+  unlock(data);
+
+  if(cb)
+  {
+    cb(ctx, response);
+  }
+}
+
+static void async_timeout_cb(void* ctx, AZX_TIMER_ID timer_id)
+{
+  (void)timer_id;
+  complete_async_command((AtiData*)ctx, NULL, TRUE);
+}
+
+/**
+ * Blocks until process_ati_response() signals the completion of the outstanding command, or until
+ * timeout_ms elapses. The semaphore is only a wake-up hint, the response slot is always checked
+ * under the lock, so a stale signal just results in another wait for the remaining time.
+ *
+ * The instance stays acquired, the caller must release it.
+ */
+static const struct AzxBinaryData* wait_for_response(AtiData* data, INT32 timeout_ms)
+{
+  const UINT32 deadline = m2mb_os_getSysTicks() + TIMEOUT_TICKS(timeout_ms);
+  UINT16 rsp_id = data->next_response;
+  INT32 remaining = 0;
+
+  do
+  {
+    lock(data);
+    if ( data->rsp[rsp_id].size > 0 )
+    {
+      if(!silentMode)
+      {
+        AZX_LOG_DEBUG("Received response: %s\r\n", (const CHAR*)(data->rsp[rsp_id].data));
+      }
+      if(logNext && silentMode)
+      {
+        AZX_LOG_INFO("%s\r\n", (const CHAR*)(data->rsp[rsp_id].data));
+      }
+      advance_response(data);
+      unlock(data);
+      return &data->rsp[rsp_id];
+    }
+    unlock(data);
+
+    remaining = (INT32)(deadline - m2mb_os_getSysTicks());
+    if(remaining <= 0)
+    {
+      break;
+    }
+    m2mb_os_sem_get(data->rsp_sem, (UINT32)remaining);
+  } while(1);
+
+  if(!silentMode)
+  {
+    AZX_LOG_ERROR("No AT response received before timeout\r\n");
+  }
+  if(logNext && silentMode)
+  {
+    AZX_LOG_DEBUG("<Timed out>");
+  }
+  return NULL;
+}
+
+/**
+ * Terminates and sends the command formatted in the buffer from get_command_buffer(), which must
+ * have room for the line terminator. Must be called with the instance acquired and locked.
+ */
+static BOOLEAN send_command_locked(AtiData* data, CHAR* cmd, INT32 cmd_len)
+{
+  cmd[cmd_len] = '\0';
+  if(is_silent_command(cmd))
+  {
+    silentMode = TRUE;
+  }
+  else
+  {
+    AZX_LOG_DEBUG("Sending: %s\r\n", cmd);
+  }
+
+  cmd[cmd_len++] = '\r';
+  cmd[cmd_len++] = '\n';
+  cmd[cmd_len] = '\0';
+
+  expire_response(data, data->next_response);
+  reset_read_buffer(data);
+  clear_response_signal(data);
+  if(M2MB_RESULT_SUCCESS != ati_send_cmd(data->h, cmd, cmd_len))
+  {
+    AZX_LOG_ERROR("Unable to send command: %s\r\n", cmd);
+    return FALSE;
+  }
+  if(logNext && silentMode)
+  {
+    AZX_LOG_INFO("%s", cmd);
+  }
+  return TRUE;
+}
+
+static void fill_command_options(AtiData* data, const struct AzxBinaryData* result,
+    CommandOptions* opts)
+{
+  UINT32 copy_size = 0;
+
+  opts->handle = AZX_ATI_NO_RESPONSE;
+  opts->copied = -1;
+  if(!result)
+  {
+    return;
+  }
+
+  opts->handle = make_response_handle(data, (UINT16)(result - data->rsp));
+  opts->copied = result->size;
+  if(opts->buf && opts->buf_size > 0)
+  {
+    copy_size = ((UINT32)result->size < opts->buf_size) ? (UINT32)result->size : opts->buf_size - 1;
+    memcpy(opts->buf, result->data, copy_size);
+    opts->buf[copy_size] = '\0';
+  }
+}
+
+static const struct AzxBinaryData* send_at_command_v(UINT8 instance, INT32 timeout_ms,
+    CommandOptions* opts, const CHAR* cmd_fmt, va_list args)
+{
+  AtiData* data = get_ati_data(instance);
+  const struct AzxBinaryData* result = 0;
+  const UINT32 queued_at = m2mb_os_getSysTicks();
+  UINT32 sent_at = 0;
+  CHAR key[MAX_CACHED_CMD_SIZE];
+  CHAR stats_key[AZX_ATI_STATS_PREFIX_SIZE];
+  CHAR* cmd = NULL;
+  UINT16 cmd_size = 0;
+  INT16 cache_slot = -1;
+  UINT16 cache_gen = 0;
+  BOOLEAN cacheable = FALSE;
+  va_list key_args;
+
+  if(!data)
+  {
+    AZX_LOG_ERROR("Instance %d is not registered with the library.\r\n");
+    return NULL;
+  }
+
+  if(!opts && cachedCount > 0)
+  {
+    va_copy(key_args, args);
+    cacheable = vsnprintf(key, sizeof(key), cmd_fmt, key_args) < (INT32)sizeof(key);
+    va_end(key_args);
+  }
+
+  if(!open_ati_handle(data))
+  {
+    AZX_LOG_ERROR("Unable to open AT handle\r\n");
+    return NULL;
+  }
+
+  acquire_instance(data);
+
+  if(cacheable && NULL != (result = find_cached_response(data, key, &cache_slot, &cache_gen)))
+  {
+    if(!silentMode && !is_silent_command(key))
+    {
+      AZX_LOG_DEBUG("Cached response for %s: %s\r\n", key, (const CHAR*)result->data);
+    }
+    release_instance(data);
+    unlock(data);
+    silentMode = FALSE;
+    return result;
+  }
+
+  cmd = get_command_buffer(data, FALSE, 0, &cmd_size);
+  vsnprintf(cmd, cmd_size-2, cmd_fmt, args);
+  /* The command buffer is reused once the response arrives */
+  get_command_key(cmd, stats_key);
+
+  if(opts && opts->stream)
+  {
+    opts->stream->received = 0;
+    data->stream = opts->stream;
+    data->stream_state = STREAM_HEADER;
+  }
+
+  sent_at = m2mb_os_getSysTicks();
+  if(send_command_locked(data, cmd, strlen(cmd)))
+  {
+    unlock(data);
+    result = wait_for_response(data, timeout_ms);
+    lock(data);
+    record_command_stats(stats_key, sent_at - queued_at, m2mb_os_getSysTicks() - sent_at,
+        result);
+    if(cache_slot >= 0 && is_response_ok(result))
+    {
+      store_cached_response(cache_slot, cache_gen, result);
+    }
+  }
+  data->stream = NULL;
+  if(opts)
+  {
+    /* Still holding the instance, so nothing can overwrite the response in the meantime */
+    fill_command_options(data, result, opts);
+  }
+  release_instance(data);
+  unlock(data);
+
+  silentMode = FALSE;
+  return result;
+}
+
+const CHAR* azx_ati_sendCommandEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  va_list va;
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(instance, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  return (response ? (const CHAR*)response->data : NULL);
+}
+
+static BOOLEAN is_response_ok(const struct AzxBinaryData* response)
+{
+  UINT16 size = 0;
+  if(!response)
+  {
+    return FALSE;
+  }
+
+  size = response->size;
+
+  while(size > 0 && (response->data[size-1] == '\r' || response->data[size-1] == '\n'))
+  {
+    --size;
+  }
+
+  if(size >= 2 && response->data[size-2] == 'O' &&
+      response->data[size-1] == 'K')
+  {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+BOOLEAN azx_ati_sendCommandExpectOkEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  va_list va;
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(instance, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  if(!is_response_ok(response))
+  {
+    if(fullySilentMode)
+    {
+      /* Log only in full silent mode to aid debugging. If not in full silent mode and a command was
+       * explicitly set to silent, then the outcome is expected to be handled by caller */
+      AZX_LOG_DEBUG("Command with format '%s' got unwanted response: %s\r\n",
+          cmd_fmt, (response ? (const CHAR*)response->data : "<time out>"));
+    }
+    return FALSE;
+  }
+  return TRUE;
+}
+
+const struct AzxBinaryData* azx_ati_sendCommandBinaryEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  va_list va;
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(instance, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  return response;
+}
+
+const CHAR* azx_ati_sendCommandAndLogEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  va_list va;
+
+  logNext = TRUE;
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(instance, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  logNext = FALSE;
+
+  return (response ? (const CHAR*)response->data : NULL);
+}
+
+AZX_ATI_RESPONSE_HANDLE azx_ati_sendCommandHandleEx(UINT8 instance, INT32 timeout_ms,
+    const CHAR* cmd_fmt, ...)
+{
+  CommandOptions opts = { 0 };
+  va_list va;
+
+  va_start(va, cmd_fmt);
+  send_at_command_v(instance, timeout_ms, &opts, cmd_fmt, va);
+  va_end(va);
+
+  return opts.handle;
+}
+
+SSIZE_T azx_ati_sendCommandToBufferEx(UINT8 instance, INT32 timeout_ms, UINT8* buf,
+    UINT32 buf_size, const CHAR* cmd_fmt, ...)
+{
+  CommandOptions opts = { 0 };
+  va_list va;
+
+  opts.buf = buf;
+  opts.buf_size = buf_size;
+
+  va_start(va, cmd_fmt);
+  send_at_command_v(instance, timeout_ms, &opts, cmd_fmt, va);
+  va_end(va);
+
+  return opts.copied;
+}
+
+const struct AzxBinaryData* azx_ati_sendCommandStreamEx(UINT8 instance, INT32 timeout_ms,
+    AZX_ATI_STREAM_T* stream, const CHAR* cmd_fmt, ...)
+{
+  CommandOptions opts = { 0 };
+  const struct AzxBinaryData* response = NULL;
+  va_list va;
+
+  if(!stream || !stream->marker || !stream->marker[0])
+  {
+    AZX_LOG_ERROR("Invalid stream description\r\n");
+    return NULL;
+  }
+  opts.stream = stream;
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(instance, timeout_ms, &opts, cmd_fmt, va);
+  va_end(va);
+
+  return response;
+}
+
+/* Must be called with the instance locked */
+static const struct AzxBinaryData* find_response(AtiData* data, AZX_ATI_RESPONSE_HANDLE handle)
+{
+  const UINT16 rsp_id = (UINT16)(handle & 0xFF) - 1;
+
+  if(rsp_id < MAX_RESPONSES && data->rsp_gen[rsp_id] == (UINT16)(handle >> 16) &&
+      data->rsp[rsp_id].size > 0)
+  {
+    return &data->rsp[rsp_id];
+  }
+  return NULL;
+}
+
+const struct AzxBinaryData* azx_ati_getResponse(AZX_ATI_RESPONSE_HANDLE handle)
+{
+  AtiData* data = get_ati_data((UINT8)((handle >> 8) & 0xFF));
+  const struct AzxBinaryData* response = NULL;
+
+  if(!data || !data->initialised)
+  {
+    return NULL;
+  }
+
+  lock(data);
+  response = find_response(data, handle);
+  unlock(data);
+
+  return response;
+}
+
+/**
+ * Clears the responses of the commands of a batch which were dropped to make room for the later
+ * ones, so no descriptor points at overwritten bytes. Must be called with the instance locked.
+ */
+static void clear_dropped_responses(AtiData* data, AZX_ATI_BATCH_CMD_T* cmds, UINT16 count)
+{
+  UINT16 i = 0;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(cmds[i].handle != AZX_ATI_NO_RESPONSE && !find_response(data, cmds[i].handle))
+    {
+      cmds[i].response.size = 0;
+      cmds[i].response.data = NULL;
+      cmds[i].handle = AZX_ATI_NO_RESPONSE;
+    }
+  }
+}
+
+UINT16 azx_ati_sendBatchEx(UINT8 instance, AZX_ATI_BATCH_CMD_T* cmds, UINT16 count,
+    BOOLEAN stop_on_error)
+{
+  const FLOAT32 ms_per_tick = m2mb_os_getSysTickDuration_ms();
+  AtiData* data = get_ati_data(instance);
+  const struct AzxBinaryData* response = NULL;
+  const UINT32 queued_at = m2mb_os_getSysTicks();
+  UINT32 batch_start = 0;
+  UINT32 start = 0;
+  CHAR stats_key[AZX_ATI_STATS_PREFIX_SIZE];
+  CHAR* buf = NULL;
+  UINT16 buf_size = 0;
+  UINT16 sent = 0;
+
+  if(!data || !cmds)
+  {
+    AZX_LOG_ERROR("Invalid batch on instance %d\r\n", instance);
+    return 0;
+  }
+
+  if(!open_ati_handle(data))
+  {
+    AZX_LOG_ERROR("Unable to open AT handle\r\n");
+    return 0;
+  }
+
+  /* The instance is held for the whole batch, so commands go out back to back */
+  acquire_instance(data);
+  batch_start = m2mb_os_getSysTicks();
+
+  for(sent = 0; sent < count; ++sent)
+  {
+    AZX_ATI_BATCH_CMD_T* cmd = &cmds[sent];
+
+    cmd->response.size = 0;
+    cmd->response.data = NULL;
+    cmd->handle = AZX_ATI_NO_RESPONSE;
+    cmd->ok = FALSE;
+    cmd->elapsed_ms = 0;
+    response = NULL;
+    start = m2mb_os_getSysTicks();
+
+    /* The responses of the earlier commands are kept along with the next ones */
+    buf = get_command_buffer(data, sent > 0, (UINT16)strlen(cmd->cmd), &buf_size);
+    snprintf(buf, buf_size-2, "%s", cmd->cmd);
+    get_command_key(buf, stats_key);
+    if(send_command_locked(data, buf, strlen(buf)))
+    {
+      unlock(data);
+      response = wait_for_response(data, cmd->timeout_ms);
+      lock(data);
+      /* Only the first command of the batch waits for the instance */
+      record_command_stats(stats_key, (sent == 0) ? batch_start - queued_at : 0,
+          m2mb_os_getSysTicks() - start, response);
+    }
+    silentMode = FALSE;
+
+    cmd->elapsed_ms = (UINT32)((m2mb_os_getSysTicks() - start) * ms_per_tick);
+    if(response)
+    {
+      cmd->response = *response;
+      cmd->handle = make_response_handle(data, (UINT16)(response - data->rsp));
+    }
+    cmd->ok = is_response_ok(response);
+    clear_dropped_responses(data, cmds, sent);
+
+    if(!cmd->ok && stop_on_error)
+    {
+      ++sent;
+      break;
+    }
+  }
+
+  data->append_response = FALSE;
+  release_instance(data);
+  unlock(data);
+
+  AZX_LOG_DEBUG("Batch of %u/%u commands took %u ms\r\n", sent, count,
+      (UINT32)((m2mb_os_getSysTicks() - batch_start) * ms_per_tick));
+  return sent;
+}
+
+BOOLEAN azx_ati_sendCommandAsyncEx(UINT8 instance, INT32 timeout_ms, azx_ati_response_cb cb,
+    void* ctx, const CHAR* cmd_fmt, ...)
+{
+  AtiData* data = get_ati_data(instance);
+  AsyncCmd* cmd = NULL;
+  INT32 cmd_len = 0;
+  va_list va;
+
+  if(!data)
+  {
+    AZX_LOG_ERROR("Instance %d is not registered with the library.\r\n", instance);
+    return FALSE;
+  }
+
+  if(!open_ati_handle(data))
+  {
+    AZX_LOG_ERROR("Unable to open AT handle\r\n");
+    return FALSE;
+  }
+
+  if(data->async_timer == NO_AZX_TIMER_ID)
+  {
+    m2mb_os_mtx_get(openMtx, M2MB_OS_WAIT_FOREVER);
+    if(!create_async_timer(data))
+    {
+      m2mb_os_mtx_put(openMtx);
+      AZX_LOG_ERROR("Unable to create the timer for async AT commands\r\n");
+      return FALSE;
+    }
+    m2mb_os_mtx_put(openMtx);
+  }
+
+  lock(data);
+  if(data->async_count == MAX_ASYNC_CMDS)
+  {
+    unlock(data);
+    AZX_LOG_WARN("Async AT queue is full, dropping command %s\r\n", cmd_fmt);
+    return FALSE;
+  }
+
+  cmd = &data->async_cmds[(data->async_head + data->async_count) % MAX_ASYNC_CMDS];
+  va_start(va, cmd_fmt);
+  cmd_len = vsnprintf(cmd->cmd, MAX_ASYNC_CMD_SIZE, cmd_fmt, va);
+  va_end(va);
+
+  if(cmd_len < 0 || cmd_len > MAX_ASYNC_CMD_SIZE - 3)
+  {
+    unlock(data);
+    AZX_LOG_ERROR("Async AT command too long: %s\r\n", cmd_fmt);
+    return FALSE;
+  }
+
+  cmd->cmd[cmd_len++] = '\r';
+  cmd->cmd[cmd_len++] = '\n';
+  cmd->cmd[cmd_len] = '\0';
+  cmd->cmd_len = cmd_len;
+  cmd->cb = cb;
+  cmd->ctx = ctx;
+  cmd->timeout_ms = timeout_ms;
+  cmd->queued_at = m2mb_os_getSysTicks();
+  ++data->async_count;
+
+  if(!data->processing)
+  {
+    dispatch_next_async(data);
+  }
+  unlock(data);
+  return TRUE;
+}
+
+/**
+ * Picks the instance with the least outstanding work, opening instances only as long as no idle
+ * one has been found. The load is read without locking, it is just a hint: the instance is still
+ * acquired normally afterwards.
+ */
+static AtiData* select_pool_instance(void)
+{
+  AtiData* best = NULL;
+  UINT32 best_load = 0xFFFFFFFF;
+  UINT32 load = 0;
+  UINT8 i = 0;
+
+  for(i = 0; i < MAX_AT_INSTANCES; ++i)
+  {
+    AtiData* data = &ati_data[i];
+    if(data->pinned || !open_ati_handle(data))
+    {
+      continue;
+    }
+
+    load = (data->processing ? 1 : 0) + data->waiters + data->async_count;
+    if(load < best_load)
+    {
+      best = data;
+      best_load = load;
+      if(load == 0)
+      {
+        break;
+      }
+    }
+  }
+
+  if(!best)
+  {
+    AZX_LOG_ERROR("No AT instance available in the pool\r\n");
+  }
+  return best;
+}
+
+const CHAR* azx_ati_pool_sendCommand(INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  AtiData* data = select_pool_instance();
+  va_list va;
+
+  if(!data)
+  {
+    return NULL;
+  }
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(data->instanceID, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  return (response ? (const CHAR*)response->data : NULL);
+}
+
+BOOLEAN azx_ati_pool_sendCommandExpectOk(INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+{
+  const struct AzxBinaryData* response = NULL;
+  AtiData* data = select_pool_instance();
+  va_list va;
+
+  if(!data)
+  {
+    return FALSE;
+  }
+
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(data->instanceID, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
+
+  return is_response_ok(response);
+}
+
+const struct AzxBinaryData* azx_ati_pool_sendCommandBinary(INT32 timeout_ms,
+    const CHAR* cmd_fmt, ...)
 {
-  if(data->initialised)
+  const struct AzxBinaryData* response = NULL;
+  AtiData* data = select_pool_instance();
+  va_list va;
+
+  if(!data)
   {
-    return TRUE;
+    return NULL;
   }
 
-  AZX_LOG_TRACE("Opening ATI %d \r\n", data->instanceID);
+  va_start(va, cmd_fmt);
+  response = send_at_command_v(data->instanceID, timeout_ms, NULL, cmd_fmt, va);
+  va_end(va);
 
-  if(!data->mtx_hnd)
-  {
-    UINT32 inheritVal = 1;
-    M2MB_OS_RESULT_E osRes;
-    M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
+  return response;
+}
 
-    osRes = m2mb_os_mtx_setAttrItem_( &mtxAttrHandle,
-        M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
-        M2MB_OS_MTX_SEL_CMD_NAME, "atMtx",
-        M2MB_OS_MTX_SEL_CMD_USRNAME, "atMtx",
-        M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal);
-    if(osRes != M2MB_OS_SUCCESS)
-    {
-      AZX_LOG_WARN("Unable to create mutex attr to protect AT instance (err = %d)\r\n", osRes);
-      return FALSE;
-    }
-    osRes = m2mb_os_mtx_init(&data->mtx_hnd, &mtxAttrHandle);
-    if(!data->mtx_hnd || osRes != M2MB_OS_SUCCESS)
+INT16 azx_ati_pool_pin(void)
+{
+  AtiData* data = NULL;
+
+  /* Another task can pin the same instance in between, so retry until the flag is ours */
+  while(NULL != (data = select_pool_instance()))
+  {
+    lock(data);
+    if(!data->pinned)
     {
-      AZX_LOG_WARN("Unable to create mutex to protect AT instance (err = %d)\r\n", osRes);
-      return FALSE;
+      data->pinned = TRUE;
+      unlock(data);
+      AZX_LOG_TRACE("Pinned AT instance %d\r\n", data->instanceID);
+      return data->instanceID;
     }
-    AZX_LOG_TRACE("Created mutex to protect the AT instance\r\n");
+    unlock(data);
   }
+  return -1;
+}
 
-  if(M2MB_RESULT_SUCCESS != m2mb_ati_init(&data->h, data->instanceID, &ati_cb, data))
+void azx_ati_pool_unpin(INT16 instance)
+{
+  AtiData* data = (instance >= 0) ? get_ati_data((UINT8)instance) : NULL;
+
+  if(!data || !data->initialised)
   {
-    return FALSE;
+    AZX_LOG_ERROR("Instance %d is not pinned\r\n", instance);
+    return;
   }
 
-  data->initialised = TRUE;
-  memset(data->rsp, 0, sizeof(data->rsp));
-  data->readDataIdx = 0;
-
-  /* Since the starting state of the AT instance cannot be guaranteed,
-   * this function executes several AT instance profile commands to
-   * bring it to a known state.*/
-  send_initial_config_commands(data);
-
-  return TRUE;
+  lock(data);
+  data->pinned = FALSE;
+  unlock(data);
+  AZX_LOG_TRACE("Unpinned AT instance %d\r\n", instance);
 }
 
-static void enable_next_response(AtiData* data, BOOLEAN advance)
+BOOLEAN azx_ati_getCommandStats(const CHAR* prefix, AZX_ATI_CMD_STATS_T* stats)
 {
-  if(advance)
+  BOOLEAN found = FALSE;
+  UINT16 i = 0;
+
+  if(!prefix || !stats || !statsMtx)
+  {
+    return FALSE;
+  }
+
+  m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < MAX_CMD_STATS && cmdStats[i].prefix[0] != '\0'; ++i)
   {
-    if(++data->next_response == MAX_RESPONSES)
+    if(strcmp(cmdStats[i].prefix, prefix) == 0)
     {
-      data->next_response = 0;
+      *stats = cmdStats[i];
+      found = TRUE;
+      break;
     }
   }
-  data->processing = FALSE;
+  m2mb_os_mtx_put(statsMtx);
+  return found;
 }
 
-static const struct AzxBinaryData* wait_for_response(AtiData* data, INT32 timeout_ms)
+UINT16 azx_ati_getAllCommandStats(AZX_ATI_CMD_STATS_T* stats, UINT16 max_count)
 {
-  INT32 retries = (timeout_ms / WAIT_BETWEEN_READS_MS) + 1;
-  UINT16 rsp_id = data->next_response;
+  UINT16 i = 0;
+  UINT16 count = 0;
 
-  for(; retries > 0; --retries)
+  if(!stats || !statsMtx)
   {
-    lock(data);
-    if ( data->rsp[rsp_id].size > 0 )
-    {
-      if(!silentMode)
-      {
-        AZX_LOG_DEBUG("Received response: %s\r\n", (const CHAR*)(data->rsp[rsp_id].data));
-      }
-      if(logNext && silentMode)
-      {
-        AZX_LOG_INFO("%s\r\n", (const CHAR*)(data->rsp[rsp_id].data));
-      }
-      enable_next_response(data, TRUE);
-      unlock(data);
-      return &data->rsp[rsp_id];
-    }
-    unlock(data);
-    azx_sleep_ms(WAIT_BETWEEN_READS_MS);
+    return 0;
   }
 
-  if(!silentMode)
+  m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < MAX_CMD_STATS && count < max_count; ++i)
   {
-    AZX_LOG_ERROR("No AT response received before timeout\r\n");
+    if(cmdStats[i].prefix[0] != '\0')
+    {
+      stats[count++] = cmdStats[i];
+    }
   }
-  if(logNext && silentMode)
+  m2mb_os_mtx_put(statsMtx);
+  return count;
+}
+
+void azx_ati_resetCommandStats(void)
+{
+  if(!statsMtx)
   {
-    AZX_LOG_DEBUG("<Timed out>");
+    return;
   }
-  enable_next_response(data, FALSE);
-  return NULL;
+
+  m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+  memset(cmdStats, 0, sizeof(cmdStats));
+  m2mb_os_mtx_put(statsMtx);
 }
 
-static const struct AzxBinaryData* send_at_command_v(UINT8 instance, INT32 timeout_ms,
-    const CHAR* cmd_fmt, va_list args)
+void azx_ati_logCommandStats(void)
 {
-  static CHAR cmd[BUFFER_SIZE];
-  INT32 cmd_len = 0;
-  AtiData* data = get_ati_data(instance);
-  const struct AzxBinaryData* result = 0;
+  AZX_ATI_CMD_STATS_T stats;
+  CHAR histogram[AZX_ATI_LATENCY_BUCKETS * 11 + 1];
+  UINT32 responses = 0;
+  UINT16 i = 0;
+  UINT16 j = 0;
+  INT32 len = 0;
 
-  if(!data)
+  if(!statsMtx)
   {
-    AZX_LOG_ERROR("Instance %d is not registered with the library.\r\n");
-    return NULL;
+    return;
   }
 
-  if(!open_ati_handle(data))
+  for(i = 0; i < MAX_CMD_STATS; ++i)
   {
-    AZX_LOG_ERROR("Unable to open AT handle\r\n");
-    return NULL;
+    m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+    stats = cmdStats[i];
+    m2mb_os_mtx_put(statsMtx);
+    if(stats.prefix[0] == '\0')
+    {
+      continue;
+    }
+
+    len = 0;
+    for(j = 0; j < AZX_ATI_LATENCY_BUCKETS; ++j)
+    {
+      len += snprintf(&histogram[len], sizeof(histogram) - len, " %u", stats.histogram[j]);
+    }
+
+    responses = stats.count - stats.timeouts;
+    AZX_LOG_INFO("%s: sent=%u timeouts=%u errors=%u modem min/avg/max=%u/%u/%u ms "
+        "wait avg/max=%u/%u ms hist=[%s ]\r\n", stats.prefix, stats.count, stats.timeouts,
+        stats.errors, stats.min_ms, responses ? stats.total_ms / responses : 0, stats.max_ms,
+        stats.count ? stats.total_wait_ms / stats.count : 0, stats.max_wait_ms, histogram);
   }
+}
 
-  lock(data);
-  while(data->processing)
+static void stats_dump_cb(void* ctx, AZX_TIMER_ID timer_id)
+{
+  (void)ctx;
+  azx_ati_logCommandStats();
+  if(statsDumpPeriod > 0)
   {
-    unlock(data);
-    azx_sleep_ms(WAIT_BETWEEN_READS_MS);
-    lock(data);
+    azx_timer_start(timer_id, statsDumpPeriod, TRUE);
   }
-  data->processing = TRUE;
+}
 
-  vsnprintf(cmd, BUFFER_SIZE-2, cmd_fmt, args);
+BOOLEAN azx_ati_setCommandStatsDump(UINT32 period_ms)
+{
+  BOOLEAN result = TRUE;
 
-  cmd_len = strlen(cmd);
-  cmd[cmd_len] = '\0';
-  if(is_silent_command(cmd))
+  if(!init_module())
   {
-    silentMode = TRUE;
-  }
-  else
-  {
-    AZX_LOG_DEBUG("Sending: %s\r\n", cmd);
+    return FALSE;
   }
 
-  cmd[cmd_len++] = '\r';
-  cmd[cmd_len++] = '\n';
-  cmd[cmd_len] = '\0';
-
-  data->rsp[data->next_response].size = 0;
-  data->rsp[data->next_response].data = NULL;
-  data->readDataIdx = 0;
-  if(M2MB_RESULT_SUCCESS != ati_send_cmd(data->h, cmd, cmd_len))
+  /* Tasks setting the period at the same time must not both create the timer */
+  m2mb_os_mtx_get(statsMtx, M2MB_OS_WAIT_FOREVER);
+  statsDumpPeriod = period_ms;
+  if(period_ms == 0)
   {
-    AZX_LOG_ERROR("Unable to send command: %s\r\n", cmd);
-    enable_next_response(data, FALSE);
-    unlock(data);
-    result = NULL;
-    goto end;
+    if(statsDumpTimer != NO_AZX_TIMER_ID)
+    {
+      azx_timer_stop(statsDumpTimer);
+    }
   }
-  if(logNext && silentMode)
+  else
   {
-    AZX_LOG_INFO("%s", cmd);
+    if(statsDumpTimer == NO_AZX_TIMER_ID)
+    {
+      statsDumpTimer = azx_timer_initWithCb(&stats_dump_cb, NULL, period_ms);
+    }
+    if(statsDumpTimer == NO_AZX_TIMER_ID)
+    {
+      AZX_LOG_ERROR("Unable to create the timer for dumping AT stats\r\n");
+      result = FALSE;
+    }
+    else
+    {
+      azx_timer_start(statsDumpTimer, period_ms, TRUE);
+    }
   }
-  unlock(data);
-
-  result = wait_for_response(data, timeout_ms);
-
-end:
-  silentMode = FALSE;
+  m2mb_os_mtx_put(statsMtx);
   return result;
 }
 
-const CHAR* azx_ati_sendCommandEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+/**
+ * Finds the trie node where the header ends, adding the missing nodes. Must be called with openMtx
+ * held, so concurrent registrations do not append at the same link.
+ *
+ * @return The node, or NULL if out of memory
+ */
+static UrcTrieNode* add_urc_node(AtiData* data, const CHAR* msg_header)
 {
-  const struct AzxBinaryData* response = NULL;
-  va_list va;
-
-  va_start(va, cmd_fmt);
-  response = send_at_command_v(instance, timeout_ms, cmd_fmt, va);
-  va_end(va);
-
-  return (response ? (const CHAR*)response->data : NULL);
+  UrcTrieNode** link = NULL;
+  UrcTrieNode* node = NULL;
+  const CHAR* c = msg_header;
+
+  /* New nodes are fully initialised before being linked in, so the ATI callback can keep walking
+   * the trie while it grows */
+  link = &data->urc_trie;
+  for(; *c != '\0'; ++c)
+  {
+    node = *link;
+    while(node && node->c != *c)
+    {
+      link = &node->sibling;
+      node = *link;
+    }
+    if(!node)
+    {
+      node = (UrcTrieNode*)m2mb_os_malloc(sizeof(UrcTrieNode));
+      if(!node)
+      {
+        return NULL;
+      }
+      node->child = NULL;
+      node->sibling = NULL;
+      node->cb = NULL;
+      node->invalidates = 0;
+      node->c = *c;
+      __sync_synchronize();
+      *link = node;
+    }
+    link = &node->child;
+  }
+  return node;
 }
 
-static BOOLEAN is_response_ok(const struct AzxBinaryData* response)
+void azx_ati_addUrcHandlerEx(UINT8 instance, const CHAR* msg_header, azx_urc_received_cb cb)
 {
-  UINT16 size = 0;
-  if(!response)
+  UrcTrieNode* node = NULL;
+  AtiData* data = get_ati_data(instance);
+
+  if(!data || !msg_header || *msg_header == '\0')
   {
-    return FALSE;
+    AZX_LOG_WARN("Unable to add handler for URC '%s'\r\n", (msg_header ? msg_header : ""));
+    return;
   }
 
-  size = response->size;
-
-  while(size > 0 && (response->data[size-1] == '\r' || response->data[size-1] == '\n'))
+  if(!init_module())
   {
-    --size;
+    return;
   }
 
-  if(size >= 2 && response->data[size-2] == 'O' &&
-      response->data[size-1] == 'K')
+  m2mb_os_mtx_get(openMtx, M2MB_OS_WAIT_FOREVER);
+  node = add_urc_node(data, msg_header);
+  if(node)
   {
-    return TRUE;
+    node->cb = cb;
+  }
+  m2mb_os_mtx_put(openMtx);
+  if(!node)
+  {
+    AZX_LOG_WARN("Unable to add handler for URC '%s', out of memory\r\n", msg_header);
+    return;
   }
 
-  return FALSE;
+  AZX_LOG_DEBUG("Added handler for URC '%s': %p\r\n", msg_header, cb);
 }
 
-BOOLEAN azx_ati_sendCommandExpectOkEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+BOOLEAN azx_ati_cacheResponses(const CHAR* cmd, UINT32 ttl_ms)
 {
-  const struct AzxBinaryData* response = NULL;
-  va_list va;
-
-  va_start(va, cmd_fmt);
-  response = send_at_command_v(instance, timeout_ms, cmd_fmt, va);
-  va_end(va);
+  INT16 slot = -1;
 
-  if(!is_response_ok(response))
+  if(!cmd || *cmd == '\0' || strlen(cmd) >= MAX_CACHED_CMD_SIZE)
   {
-    if(fullySilentMode)
-    {
-      /* Log only in full silent mode to aid debugging. If not in full silent mode and a command was
-       * explicitly set to silent, then the outcome is expected to be handled by caller */
-      AZX_LOG_DEBUG("Command with format '%s' got unwanted response: %s\r\n",
-          cmd_fmt, (response ? (const CHAR*)response->data : "<time out>"));
-    }
+    AZX_LOG_WARN("Unable to cache responses of '%s'\r\n", (cmd ? cmd : ""));
     return FALSE;
   }
-  return TRUE;
-}
 
-const struct AzxBinaryData* azx_ati_sendCommandBinaryEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
-{
-  const struct AzxBinaryData* response = NULL;
-  va_list va;
+  if(!init_module())
+  {
+    return FALSE;
+  }
 
-  va_start(va, cmd_fmt);
-  response = send_at_command_v(instance, timeout_ms, cmd_fmt, va);
-  va_end(va);
+  m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+  slot = find_cache_entry(cmd);
+  if(slot < 0 && cachedCount < MAX_CACHED_CMDS)
+  {
+    slot = cachedCount;
+    snprintf(cachedResponses[slot].cmd, MAX_CACHED_CMD_SIZE, "%s", cmd);
+    cachedResponses[slot].response.size = 0;
+    ++cachedCount;
+  }
+  if(slot >= 0)
+  {
+    cachedResponses[slot].ttl_ticks = (ttl_ms > 0) ? TIMEOUT_TICKS(ttl_ms) : 0;
+  }
+  m2mb_os_mtx_put(cacheMtx);
 
-  return response;
+  if(slot < 0)
+  {
+    AZX_LOG_WARN("Cannot cache responses of '%s', the cache is full\r\n", cmd);
+    return FALSE;
+  }
+  return TRUE;
 }
 
-const CHAR* azx_ati_sendCommandAndLogEx(UINT8 instance, INT32 timeout_ms, const CHAR* cmd_fmt, ...)
+void azx_ati_invalidateCache(const CHAR* cmd)
 {
-  const struct AzxBinaryData* response = NULL;
-  va_list va;
+  INT16 slot = -1;
 
-  logNext = TRUE;
-  va_start(va, cmd_fmt);
-  response = send_at_command_v(instance, timeout_ms, cmd_fmt, va);
-  va_end(va);
+  if(!cacheMtx)
+  {
+    return;
+  }
 
-  logNext = FALSE;
+  if(!cmd)
+  {
+    invalidate_cached_responses((UINT8)((1u << MAX_CACHED_CMDS) - 1));
+    return;
+  }
 
-  return (response ? (const CHAR*)response->data : NULL);
+  m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+  slot = find_cache_entry(cmd);
+  m2mb_os_mtx_put(cacheMtx);
+  if(slot >= 0)
+  {
+    invalidate_cached_responses((UINT8)(1u << slot));
+  }
 }
 
-
-void azx_ati_addUrcHandlerEx(UINT8 instance, const CHAR* msg_header, azx_urc_received_cb cb)
+BOOLEAN azx_ati_invalidateCacheOnUrcEx(UINT8 instance, const CHAR* msg_header, const CHAR* cmd)
 {
-  UrcHandler* hnd = NULL;
-  UINT16 i = 0;
+  UrcTrieNode* node = NULL;
   AtiData* data = get_ati_data(instance);
+  INT16 slot = -1;
 
-  if(!data)
+  if(cacheMtx)
   {
-    AZX_LOG_WARN("Unable to add handler for URC '%s'\r\n", msg_header);
-    return;
+    m2mb_os_mtx_get(cacheMtx, M2MB_OS_WAIT_FOREVER);
+    slot = find_cache_entry(cmd ? cmd : "");
+    m2mb_os_mtx_put(cacheMtx);
   }
 
-  for(i = 0; i < MAX_URC_HANDLERS && hnd == NULL; ++i)
+  if(!data || !msg_header || *msg_header == '\0' || slot < 0)
   {
-    if(data->urc_handlers[i].cb == NULL)
-    {
-      if(!hnd)
-      {
-        hnd = &data->urc_handlers[i];
-      }
-    }
-    else if(0 == strcmp(data->urc_handlers[i].hdr, msg_header) &&
-        (!hnd || hnd->cb == NULL))
-    {
-      hnd = &data->urc_handlers[i];
-    }
+    AZX_LOG_WARN("Unable to invalidate '%s' on URC '%s'\r\n", (cmd ? cmd : ""),
+        (msg_header ? msg_header : ""));
+    return FALSE;
   }
 
-  if(!hnd)
+  m2mb_os_mtx_get(openMtx, M2MB_OS_WAIT_FOREVER);
+  node = add_urc_node(data, msg_header);
+  if(node)
   {
-    AZX_LOG_WARN("Unable to add handler for URC '%s'\r\n", msg_header);
-    return;
+    node->invalidates |= (UINT8)(1u << slot);
+  }
+  m2mb_os_mtx_put(openMtx);
+  if(!node)
+  {
+    AZX_LOG_WARN("Unable to add URC '%s', out of memory\r\n", msg_header);
+    return FALSE;
   }
 
-  snprintf(hnd->hdr, MAX_URC_HEADER, "%s", msg_header);
-  hnd->cb = cb;
-
-  AZX_LOG_DEBUG("Added handler for URC '%s': %p\r\n", msg_header, cb);
+  AZX_LOG_DEBUG("URC '%s' invalidates cached '%s'\r\n", msg_header, cmd);
+  return TRUE;
 }
 
 void azx_ati_disable_log_for_cmd(const CHAR* prefix)
@@ -801,16 +2426,32 @@ void azx_ati_disable_logs()
 void azx_ati_deinitEx(UINT8 instance)
 {
   AtiData* data = get_ati_data(instance);
-  if(!data)
+  if(!data || !openMtx)
   {
     return;
   }
+  m2mb_os_mtx_get(openMtx, M2MB_OS_WAIT_FOREVER);
   m2mb_ati_deinit(data->h);
   data->h = NULL;
   data->initialised = FALSE;
   m2mb_os_mtx_deinit(data->mtx_hnd);
   data->mtx_hnd = M2MB_OS_MTX_INVALID;
+  m2mb_os_sem_deinit(data->rsp_sem);
+  data->rsp_sem = M2MB_OS_SEM_INVALID;
+  m2mb_os_sem_deinit(data->idle_sem);
+  data->idle_sem = M2MB_OS_SEM_INVALID;
+  if(data->async_timer != NO_AZX_TIMER_ID)
+  {
+    azx_timer_deinit(data->async_timer);
+    data->async_timer = NO_AZX_TIMER_ID;
+  }
+  data->async_head = 0;
+  data->async_count = 0;
+  data->async_active = FALSE;
   data->processing = FALSE;
+  data->waiters = 0;
+  data->pinned = FALSE;
   data->next_response = 0;
+  m2mb_os_mtx_put(openMtx);
 }
 
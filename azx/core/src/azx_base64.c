@@ -1,6 +1,8 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_BASE64
+
 /* Include files =============================================================*/
 #include "m2mb_types.h"
 
@@ -1,69 +1,52 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_BUFFER
+
 #include <string.h>
 #include "m2mb_types.h"
 #include "m2mb_os_api.h"
-#include "m2mb_os_mtx.h"
 
+#include "app_cfg.h"
 #include "azx_log.h"
 
 #include "azx_buffer.h"
 
-#define MAX_STRING 256
-#define MAX_MSG_SIZE MAX_STRING
-#define MAX_MSG_COUNT 64
-#define BUFFER_SIZE (MAX_MSG_SIZE * MAX_MSG_COUNT)
-#define MARKER 0x80000000
+#ifndef AZX_BUFFER_SIZE
+#define AZX_BUFFER_SIZE (16 * 1024)
+#endif
 
-static CHAR bufferedMessages[BUFFER_SIZE];
-static INT32 nextMessageIndex = 0;
+/* Positions are free running, so the ring must divide 2^32 for them to wrap consistently */
+typedef char azx_buffer_size_must_be_a_power_of_2[
+    ((AZX_BUFFER_SIZE & (AZX_BUFFER_SIZE - 1)) == 0) ? 1 : -1];
 
-M2MB_OS_MTX_HANDLE mtxHnd = M2MB_OS_MTX_INVALID;
+#define RECORD_ALIGN 8
+#define ALIGN_UP(n) (((n) + RECORD_ALIGN - 1) & ~(UINT32)(RECORD_ALIGN - 1))
 
-static void lock()
+/*
+ * Every record starts with a header. The producer sets the tag last, to the position of the record
+ * with the lowest bit set (so an all zero buffer never looks committed).
+ */
+typedef struct
 {
-  M2MB_OS_RESULT_E osRes;
-  if(!mtxHnd)
-  {
-    UINT32 inheritVal = 1;
-    M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
-    osRes = m2mb_os_mtx_setAttrItem_( &mtxAttrHandle,
-        M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
-        M2MB_OS_MTX_SEL_CMD_NAME, "bufMtx",
-        M2MB_OS_MTX_SEL_CMD_USRNAME, "bufMtx",
-        M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal);
-    if(osRes != M2MB_OS_SUCCESS)
-    {
-      AZX_LOG_WARN("Unable to create mutex attr to protect the buffer queue (err = %d)\r\n", osRes);
-      return;
-    }
-    osRes = m2mb_os_mtx_init(&mtxHnd, &mtxAttrHandle);
-    if(!mtxHnd || osRes != M2MB_OS_SUCCESS)
-    {
-      AZX_LOG_WARN("Unable to create mutex to protect the buffer queue (err = %d)\r\n", osRes);
-      return;
-    }
-    AZX_LOG_TRACE("Created mutex to protect the buffer queue\r\n");
-  }
-  if(M2MB_OS_SUCCESS != (osRes = m2mb_os_mtx_get(mtxHnd, 0xFFFFFFFF)))
-  {
-    AZX_LOG_WARN("Unable to lock mutex to protect the buffer queue (err = %d)\r\n", osRes);
-  }
-}
+  volatile UINT32 tag;
+  UINT32 len;
+} RecordHeader;
+
+static UINT32 bufferedMessages[AZX_BUFFER_SIZE / sizeof(UINT32)];
+/* Free running position of the end of the last reservation */
+static volatile UINT32 reserved = 0;
 
-static void unlock()
+static RecordHeader* get_header(UINT32 pos)
 {
-  if(!mtxHnd)
-  {
-    return;
-  }
-  if(M2MB_OS_SUCCESS != m2mb_os_mtx_put(mtxHnd))
-  {
-    AZX_LOG_WARN("Unable to unlock mutex to protect the buffer queue\r\n");
-  }
+  return (RecordHeader*)((UINT8*)bufferedMessages + (pos & (AZX_BUFFER_SIZE - 1)));
 }
 
+/* A record is intact as long as no reservation reached its bytes on the next lap */
+static BOOLEAN is_expired(UINT32 pos)
+{
+  return (UINT32)(reserved - pos) > AZX_BUFFER_SIZE;
+}
 
 INT32 azx_buffer_add(const CHAR* msg, INT32 len)
 {
@@ -87,37 +70,86 @@ const CHAR* azx_buffer_get(INT32 idx)
 
 INT32 azx_buffer_addObj(const void* obj, INT32 len)
 {
-  INT32 idx = 0;
+  RecordHeader* header = NULL;
+  UINT32 total = 0;
+  UINT32 pos = 0;
 
-  if(len >= BUFFER_SIZE)
+  if(len < 0 || (UINT32)len >= AZX_BUFFER_SIZE / 2)
   {
-    /* Don't buffer messages larger than the whole buffer. */
+    /* Don't buffer messages that would take over most of the buffer. */
     return -1;
   }
+  total = sizeof(RecordHeader) + ALIGN_UP((UINT32)len + 1);
 
-  lock();
-  idx = nextMessageIndex;
-
-  nextMessageIndex += len+1;
-
-  if(nextMessageIndex >= BUFFER_SIZE)
+  /* Producers only race on the reservation, after that each one owns its bytes */
+  for(;;)
   {
-    idx = 0;
-    nextMessageIndex = len+1;
+    pos = __sync_fetch_and_add(&reserved, total);
+    if((pos & (AZX_BUFFER_SIZE - 1)) + total <= AZX_BUFFER_SIZE)
+    {
+      break;
+    }
+    /* It would straddle the end of the ring, so the tail is left unused and it goes again */
   }
-  unlock();
 
-  memcpy(&(bufferedMessages[idx]), obj, len);
-  bufferedMessages[idx + len] = '\0';
-  return idx;
+  header = get_header(pos);
+  header->tag = 0;
+  header->len = (UINT32)len;
+  memcpy(header + 1, obj, len);
+  ((UINT8*)(header + 1))[len] = '\0';
+  __sync_synchronize();
+  header->tag = pos | 1;
+
+  return (INT32)(pos / RECORD_ALIGN);
 }
 
 const void* azx_buffer_getObj(INT32 idx)
 {
-  if(idx < 0 || idx >= BUFFER_SIZE)
+  const UINT32 pos = (UINT32)idx * RECORD_ALIGN;
+  const RecordHeader* header = NULL;
+
+  if(idx < 0)
+  {
+    return NULL;
+  }
+
+  header = get_header(pos);
+  if(header->tag != (pos | 1))
   {
+    /* Not written yet, or another record took its place */
     return NULL;
   }
-  return &(bufferedMessages[idx]);
+  __sync_synchronize();
+  if(is_expired(pos))
+  {
+    return NULL;
+  }
+  return header + 1;
 }
 
+INT32 azx_buffer_copyObj(INT32 idx, void* dest, INT32 max_len)
+{
+  const RecordHeader* header = (const RecordHeader*)azx_buffer_getObj(idx);
+  INT32 len = 0;
+
+  if(!header || !dest || max_len < 0)
+  {
+    return -1;
+  }
+
+  --header;
+  len = ((INT32)header->len < max_len) ? (INT32)header->len : max_len;
+  memcpy(dest, header + 1, len);
+  __sync_synchronize();
+  /* A producer may have lapped the ring while copying, in which case the copy is garbage */
+  if(is_expired((UINT32)idx * RECORD_ALIGN))
+  {
+    return -1;
+  }
+  return len;
+}
+
+BOOLEAN azx_buffer_isExpired(INT32 idx)
+{
+  return azx_buffer_getObj(idx) == NULL;
+}
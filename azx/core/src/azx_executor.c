@@ -0,0 +1,432 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#define AZX_LOG_MODULE AZX_LOG_MODULE_EXECUTOR
+
+#include <stdio.h>
+#include <string.h>
+#include "m2mb_types.h"
+#include "m2mb_os_types.h"
+#include "m2mb_os_api.h"
+#include "m2mb_os_sem.h"
+#include "m2mb_os_mtx.h"
+
+#include "app_cfg.h"
+#include "azx_log.h"
+#include "azx_tasks.h"
+
+#include "azx_executor.h"
+
+#define NAME_SIZE 16
+#define STOP_POLL_MS 10
+
+enum
+{
+  EXECUTOR_RUN = 1
+};
+
+typedef struct
+{
+  AZX_EXECUTOR_JOB_CB fn;
+  void* ctx;
+  AZX_EXECUTOR_DONE_CB done;
+  void* done_ctx;
+} ExecutorJob;
+
+/* A circular queue of jobs, only accessed with the lock of its worker held */
+typedef struct
+{
+  ExecutorJob* jobs;
+  UINT16 head;
+  volatile UINT16 count;
+} JobQueue;
+
+typedef struct
+{
+  M2MB_OS_MTX_HANDLE lock;
+  M2MB_OS_TASK_HANDLE handle;
+  INT32 task_id;
+  volatile BOOLEAN running;
+  JobQueue queues[AZX_EXECUTOR_PRIORITIES];
+} ExecutorWorker;
+
+struct AZX_EXECUTOR_S
+{
+  /* Counts the jobs queued (plus one for each worker once stopping), which wakes the workers */
+  M2MB_OS_SEM_HANDLE work;
+  UINT8 index;
+  UINT8 count;
+  UINT16 queue_size;
+  volatile BOOLEAN stopping;
+  volatile UINT32 next;
+  volatile UINT32 submitted;
+  volatile UINT32 completed;
+  volatile UINT32 stolen;
+  volatile UINT32 rejected;
+  volatile UINT32 queued;
+  volatile UINT32 high_water;
+  ExecutorWorker workers[AZX_EXECUTOR_MAX_WORKERS];
+};
+
+static AZX_EXECUTOR_T* volatile executors[AZX_EXECUTOR_MAX_EXECUTORS] = { NULL };
+
+static BOOLEAN push_job(AZX_EXECUTOR_T* exec, ExecutorWorker* w, AZX_EXECUTOR_PRIORITY_E priority,
+    const ExecutorJob* job)
+{
+  JobQueue* q = &w->queues[priority];
+  UINT32 queued;
+  UINT32 high;
+
+  if(q->count == exec->queue_size)
+  {
+    return FALSE;
+  }
+  m2mb_os_mtx_get(w->lock, M2MB_OS_WAIT_FOREVER);
+  if(q->count == exec->queue_size)
+  {
+    m2mb_os_mtx_put(w->lock);
+    return FALSE;
+  }
+  q->jobs[(q->head + q->count) % exec->queue_size] = *job;
+  ++q->count;
+  queued = __sync_add_and_fetch(&exec->queued, 1);
+  m2mb_os_mtx_put(w->lock);
+
+  high = exec->high_water;
+  while(queued > high && !__sync_bool_compare_and_swap(&exec->high_water, high, queued))
+  {
+    high = exec->high_water;
+  }
+  return TRUE;
+}
+
+static BOOLEAN pop_job(AZX_EXECUTOR_T* exec, ExecutorWorker* w, UINT32 priority, ExecutorJob* job)
+{
+  JobQueue* q = &w->queues[priority];
+
+  if(q->count == 0)
+  {
+    return FALSE;
+  }
+  m2mb_os_mtx_get(w->lock, M2MB_OS_WAIT_FOREVER);
+  if(q->count == 0)
+  {
+    m2mb_os_mtx_put(w->lock);
+    return FALSE;
+  }
+  *job = q->jobs[q->head];
+  q->head = (q->head + 1) % exec->queue_size;
+  --q->count;
+  __sync_fetch_and_sub(&exec->queued, 1);
+  m2mb_os_mtx_put(w->lock);
+  return TRUE;
+}
+
+/* The most urgent job: from the worker's own queue first, then from the busiest other worker */
+static BOOLEAN take_job(AZX_EXECUTOR_T* exec, ExecutorWorker* self, ExecutorJob* job)
+{
+  UINT32 priority;
+  UINT32 i;
+
+  for(priority = 0; priority < AZX_EXECUTOR_PRIORITIES; ++priority)
+  {
+    ExecutorWorker* busiest = NULL;
+
+    if(pop_job(exec, self, priority, job))
+    {
+      return TRUE;
+    }
+    for(i = 0; i < exec->count; ++i)
+    {
+      ExecutorWorker* w = &exec->workers[i];
+      if(w != self && w->queues[priority].count > 0 &&
+          (!busiest || w->queues[priority].count > busiest->queues[priority].count))
+      {
+        busiest = w;
+      }
+    }
+    if(busiest && pop_job(exec, busiest, priority, job))
+    {
+      __sync_fetch_and_add(&exec->stolen, 1);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static INT32 worker_cb(INT32 type, INT32 param1, INT32 param2)
+{
+  AZX_EXECUTOR_T* exec;
+  ExecutorWorker* self;
+  ExecutorJob job;
+  BOOLEAN found;
+  INT32 result;
+
+  if(type != EXECUTOR_RUN)
+  {
+    return 0;
+  }
+  exec = executors[param1];
+  self = &exec->workers[param2];
+  self->handle = m2mb_os_taskGetId();
+
+  while(1)
+  {
+    m2mb_os_sem_get(exec->work, M2MB_OS_WAIT_FOREVER);
+
+    /* Each count of the semaphore stands for a queued job, but another worker may have taken
+     * the one this worker was about to. Then the job it was woken for is still somewhere. */
+    found = FALSE;
+    while(exec->queued > 0 && !(found = take_job(exec, self, &job)))
+    {
+    }
+    if(!found)
+    {
+      if(exec->stopping)
+      {
+        break;
+      }
+      continue;
+    }
+
+    result = job.fn(job.ctx);
+    if(job.done)
+    {
+      job.done(result, job.done_ctx);
+    }
+    __sync_fetch_and_add(&exec->completed, 1);
+  }
+
+  self->running = FALSE;
+  return 0;
+}
+
+static BOOLEAN create_worker_lock(ExecutorWorker* w)
+{
+  M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
+  UINT32 inheritVal = 1;
+
+  if(M2MB_OS_SUCCESS != m2mb_os_mtx_setAttrItem_(&mtxAttrHandle,
+      M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
+      M2MB_OS_MTX_SEL_CMD_NAME, "ExecMtx",
+      M2MB_OS_MTX_SEL_CMD_USRNAME, "ExecMtx",
+      M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal))
+  {
+    return FALSE;
+  }
+  return M2MB_OS_SUCCESS == m2mb_os_mtx_init(&w->lock, &mtxAttrHandle) && w->lock;
+}
+
+static BOOLEAN create_work_semaphore(AZX_EXECUTOR_T* exec)
+{
+  M2MB_OS_SEM_ATTR_HANDLE semAttrHandle;
+
+  if(M2MB_OS_SUCCESS != m2mb_os_sem_setAttrItem(&semAttrHandle,
+      CMDS_ARGS(M2MB_OS_SEM_SEL_CMD_CREATE_ATTR, NULL,
+          M2MB_OS_SEM_SEL_CMD_COUNT, 0,
+          M2MB_OS_SEM_SEL_CMD_TYPE, M2MB_OS_SEM_GEN,
+          M2MB_OS_SEM_SEL_CMD_NAME, "ExecSem")))
+  {
+    return FALSE;
+  }
+  return M2MB_OS_SUCCESS == m2mb_os_sem_init(&exec->work, &semAttrHandle) && exec->work;
+}
+
+/* Stops the workers that were started, after they run what is queued, and frees the rest */
+static void release_executor(AZX_EXECUTOR_T* exec)
+{
+  UINT32 i, p;
+
+  exec->stopping = TRUE;
+  for(i = 0; i < exec->count; ++i)
+  {
+    if(exec->workers[i].running)
+    {
+      m2mb_os_sem_put(exec->work);
+    }
+  }
+  for(i = 0; i < exec->count; ++i)
+  {
+    ExecutorWorker* w = &exec->workers[i];
+    while(w->running)
+    {
+      m2mb_os_taskSleep(M2MB_OS_MS2TICKS(STOP_POLL_MS));
+    }
+    if(w->task_id > 0)
+    {
+      azx_tasks_destroyTask(w->task_id);
+    }
+    if(w->lock)
+    {
+      m2mb_os_mtx_deinit(w->lock);
+    }
+    for(p = 0; p < AZX_EXECUTOR_PRIORITIES; ++p)
+    {
+      if(w->queues[p].jobs)
+      {
+        m2mb_os_free(w->queues[p].jobs);
+      }
+    }
+  }
+  if(exec->work)
+  {
+    m2mb_os_sem_deinit(exec->work);
+  }
+  executors[exec->index] = NULL;
+  m2mb_os_free(exec);
+}
+
+AZX_EXECUTOR_T* azx_executor_create(const CHAR* name, UINT8 workers, INT32 stack_size,
+    INT32 priority, UINT16 queue_size)
+{
+  AZX_EXECUTOR_T* exec;
+  CHAR task_name[NAME_SIZE + 4];
+  UINT32 i, p;
+
+  if(!name || workers == 0 || workers > AZX_EXECUTOR_MAX_WORKERS || queue_size == 0)
+  {
+    AZX_LOG_ERROR("Invalid executor parameters\r\n");
+    return NULL;
+  }
+
+  exec = (AZX_EXECUTOR_T*)m2mb_os_calloc(sizeof(AZX_EXECUTOR_T));
+  if(!exec)
+  {
+    AZX_LOG_ERROR("Cannot allocate the executor\r\n");
+    return NULL;
+  }
+  for(i = 0; i < AZX_EXECUTOR_MAX_EXECUTORS; ++i)
+  {
+    if(__sync_bool_compare_and_swap(&executors[i], NULL, exec))
+    {
+      break;
+    }
+  }
+  if(i == AZX_EXECUTOR_MAX_EXECUTORS)
+  {
+    AZX_LOG_ERROR("No free executor slots\r\n");
+    m2mb_os_free(exec);
+    return NULL;
+  }
+  exec->index = i;
+  exec->count = workers;
+  exec->queue_size = queue_size;
+
+  if(!create_work_semaphore(exec))
+  {
+    AZX_LOG_ERROR("Cannot create the executor semaphore\r\n");
+    release_executor(exec);
+    return NULL;
+  }
+  for(i = 0; i < workers; ++i)
+  {
+    ExecutorWorker* w = &exec->workers[i];
+    for(p = 0; p < AZX_EXECUTOR_PRIORITIES; ++p)
+    {
+      w->queues[p].jobs = (ExecutorJob*)m2mb_os_malloc(queue_size * sizeof(ExecutorJob));
+      if(!w->queues[p].jobs)
+      {
+        AZX_LOG_ERROR("Cannot allocate the queues of %s%u\r\n", name, i);
+        release_executor(exec);
+        return NULL;
+      }
+    }
+    if(!create_worker_lock(w))
+    {
+      AZX_LOG_ERROR("Cannot create the lock of %s%u\r\n", name, i);
+      release_executor(exec);
+      return NULL;
+    }
+  }
+
+  for(i = 0; i < workers; ++i)
+  {
+    ExecutorWorker* w = &exec->workers[i];
+    snprintf(task_name, sizeof(task_name), "%.*s%u", NAME_SIZE, name, i);
+    w->task_id = azx_tasks_createTask(task_name, stack_size, priority, AZX_TASKS_MIN_QUEUE_SIZE,
+        worker_cb);
+    if(w->task_id <= 0)
+    {
+      AZX_LOG_ERROR("Cannot create %s: %d\r\n", task_name, w->task_id);
+      release_executor(exec);
+      return NULL;
+    }
+    w->running = TRUE;
+    if(AZX_TASKS_OK != azx_tasks_sendMessageToTask(w->task_id, EXECUTOR_RUN, exec->index, i))
+    {
+      w->running = FALSE;
+      release_executor(exec);
+      return NULL;
+    }
+  }
+  AZX_LOG_DEBUG("Executor %s started with %u workers\r\n", name, workers);
+  return exec;
+}
+
+INT32 azx_executor_submit(AZX_EXECUTOR_T* executor, AZX_EXECUTOR_PRIORITY_E priority,
+    AZX_EXECUTOR_JOB_CB fn, void* ctx, AZX_EXECUTOR_DONE_CB done, void* done_ctx)
+{
+  M2MB_OS_TASK_HANDLE current = m2mb_os_taskGetId();
+  ExecutorJob job;
+  UINT32 first;
+  UINT32 i;
+
+  if(!executor || !fn || (UINT32)priority >= AZX_EXECUTOR_PRIORITIES)
+  {
+    return AZX_EXECUTOR_INVALID_ERR;
+  }
+  if(executor->stopping)
+  {
+    return AZX_EXECUTOR_STOPPED_ERR;
+  }
+
+  job.fn = fn;
+  job.ctx = ctx;
+  job.done = done;
+  job.done_ctx = done_ctx;
+
+  /* A worker queues to itself, the job is likely to use what it just worked on */
+  for(first = 0; first < executor->count; ++first)
+  {
+    if(executor->workers[first].handle == current)
+    {
+      break;
+    }
+  }
+  if(first == executor->count)
+  {
+    first = __sync_fetch_and_add(&executor->next, 1) % executor->count;
+  }
+
+  for(i = 0; i < executor->count; ++i)
+  {
+    if(push_job(executor, &executor->workers[(first + i) % executor->count], priority, &job))
+    {
+      __sync_fetch_and_add(&executor->submitted, 1);
+      m2mb_os_sem_put(executor->work);
+      return AZX_EXECUTOR_OK;
+    }
+  }
+  __sync_fetch_and_add(&executor->rejected, 1);
+  return AZX_EXECUTOR_FULL_ERR;
+}
+
+void azx_executor_getStats(AZX_EXECUTOR_T* executor, AZX_EXECUTOR_STATS_T* stats)
+{
+  stats->submitted = executor->submitted;
+  stats->completed = executor->completed;
+  stats->stolen = executor->stolen;
+  stats->rejected = executor->rejected;
+  stats->queued = executor->queued;
+  stats->high_water = executor->high_water;
+}
+
+INT32 azx_executor_destroy(AZX_EXECUTOR_T* executor)
+{
+  if(!executor || executor->stopping)
+  {
+    return AZX_EXECUTOR_INVALID_ERR;
+  }
+  release_executor(executor);
+  return AZX_EXECUTOR_OK;
+}
@@ -4,6 +4,7 @@
 /* Include files =============================================================*/
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -24,6 +25,63 @@
 #define LOG_BUFFER_SIZE 2048
 #define MAX_FILE_LOG_CACHE 10000
 
+#ifndef AZX_LOG_FILE_FLUSH_BYTES
+#define AZX_LOG_FILE_FLUSH_BYTES (4 * 1024)
+#endif
+
+#ifndef AZX_LOG_FILE_FLUSH_MS
+#define AZX_LOG_FILE_FLUSH_MS 2000
+#endif
+
+#ifndef AZX_LOG_ASYNC_BUFFER_SIZE
+#define AZX_LOG_ASYNC_BUFFER_SIZE (8 * 1024)
+#endif
+
+#ifndef AZX_LOG_ASYNC_TASK_PRIORITY
+#define AZX_LOG_ASYNC_TASK_PRIORITY 250
+#endif
+
+#define ASYNC_TASK_STACK_SIZE (4 * 1024)
+#define ASYNC_TASK_NAME_SIZE 16
+/* Task names are looked up again after a second, in case a handle gets reused */
+#define TASK_NAME_CACHE_ENTRIES 8
+#define TASK_NAME_CACHE_SIZE 32
+#define ASYNC_RECORD_ALIGN 8
+#define ASYNC_ALIGN_UP(n) (((n) + ASYNC_RECORD_ALIGN - 1) & ~(UINT32)(ASYNC_RECORD_ALIGN - 1))
+/* How long the writer waits before looking again at a record that is still being written */
+#define ASYNC_RETRY_MS 10
+
+#ifndef AZX_LOG_RATE_SITES
+#define AZX_LOG_RATE_SITES 16
+#endif
+
+/* How many slots are looked at for a call site before one is taken over */
+#define RATE_PROBES 4
+/* How often a run of repeated logs is reported while it goes on */
+#define REPEAT_REPORT_MS 10000
+#define LEVEL_SLOTS (AZX_LOG_LEVEL_CRITICAL + 1)
+/* Refilling at per_minute tokens every 60000 ms is then exactly per_minute units every ms */
+#define TOKEN 60000
+/* How long disabling the async mode waits at most for the writer to catch up */
+#define ASYNC_DRAIN_TIMEOUT_MS 1000
+/* Captured string arguments are cut to this length */
+#define ASYNC_MAX_STRING 255
+
+/* Binary log frames start with these two bytes, see tools/azx_log_decode.py */
+#define FRAME_SYNC_0 0xA5
+#define FRAME_SYNC_1 0x5A
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 28
+/* Key/value frames: sync, length (2), level, version, event id (2), uptime in ms (4), CBOR map */
+#define KV_FRAME_VERSION 2
+#define KV_FRAME_HEADER_SIZE 12
+/* A CBOR map header of a single byte holds up to 23 pairs */
+#define KV_MAX_FIELDS 23
+
+#ifndef AZX_LOG_KV_MAX_SIZE
+#define AZX_LOG_KV_MAX_SIZE 256
+#endif
+
 #define NO_COLOUR "\033[0m"
 #define BOLD      "\033[1m"
 #define DARK      "\033[2m"
@@ -63,23 +121,86 @@
     offset = snprintf(log_buffer, LOG_BUFFER_SIZE, \
         (log_cfg.colouredLogs)? prefix_fmt_colour : prefix_fmt_no_colour, \
             (log_cfg.colouredLogs)? LOG_##tag##_COLOR: "", #tag, (log_cfg.colouredLogs)? NO_COLOUR :"", \
-                now / 1000.0, \
+                now / 1000, (now / 10) % 100, \
                 get_file_title(file), line, \
                 function, \
-                get_current_task_name(task_name) \
+                task \
     ); \
     break
 
 #define LOG_FILE_PREFIX(tag) \
     case AZX_LOG_LEVEL_##tag: \
       offset = snprintf(log_buffer, LOG_BUFFER_SIZE, \
-          prefix_fmt_file, get_date_time(), \
+          prefix_fmt_file, get_date_time(now), \
           ((now / 10) % 100), #tag, \
           get_file_title(file), line \
       ); \
     break
 
 /* Local typedefs ============================================================*/
+
+/* Positions are free running, so the ring must divide 2^32 for them to wrap consistently */
+typedef char azx_log_async_buffer_size_must_be_a_power_of_2[
+    ((AZX_LOG_ASYNC_BUFFER_SIZE & (AZX_LOG_ASYNC_BUFFER_SIZE - 1)) == 0) ? 1 : -1];
+
+/* Like text logs, a key/value record must stay well below the ring size */
+typedef char azx_log_kv_max_size_must_be_at_most_an_eighth_of_the_async_buffer[
+    (AZX_LOG_KV_MAX_SIZE <= AZX_LOG_ASYNC_BUFFER_SIZE / 8) ? 1 : -1];
+
+typedef enum
+{
+  RECORD_TEXT,
+  /* msg holds the raw arguments of fmt rather than the formatted text */
+  RECORD_ARGS,
+  /* msg holds a key/value frame ready to be written out */
+  RECORD_KV
+} RecordKind;
+
+/*
+ * A log waiting in the async ring. The producer sets the tag last, to the position of the record
+ * with the lowest bit set. A level of 0 marks the padding that skips the end of the ring.
+ */
+typedef struct
+{
+  volatile UINT32 tag;
+  UINT16 size;
+  UINT8 level;
+  UINT8 kind;
+  UINT32 now;
+  const CHAR* function;
+  const CHAR* file;
+  INT32 line;
+  const CHAR* fmt;
+  M2MB_OS_TASK_HANDLE task_id;
+  UINT16 msg_len;
+  CHAR task[ASYNC_TASK_NAME_SIZE];
+  CHAR msg[1];
+} LogRecord;
+
+typedef enum
+{
+  ARG_NONE,
+  ARG_INT32,
+  ARG_INT64,
+  ARG_DOUBLE,
+  ARG_LONG_DOUBLE,
+  ARG_STRING,
+  ARG_POINTER
+} ArgType;
+
+/* One conversion of a format string */
+typedef struct
+{
+  /* The conversion without its length modifier, which is implied by the type */
+  CHAR spec[24];
+  ArgType type;
+  /* How many '*' (int arguments before the value) it has */
+  UINT8 stars;
+  /* The precision, -1 if there is none or it is the last '*' argument (see precision_star) */
+  INT32 precision;
+  BOOLEAN precision_star;
+} Conversion;
+
 /* Local statics =============================================================*/
 static struct
 {
@@ -93,9 +214,75 @@ static struct
 
 
 
+static struct
+{
+  volatile BOOLEAN enabled;
+  /* Free running end of the last reservation */
+  volatile UINT32 head;
+  /* Free running position of the next record to be written out */
+  volatile UINT32 tail;
+  volatile UINT32 dropped;
+  volatile UINT32 sleeping;
+  volatile AZX_LOG_FORMAT_E format;
+  M2MB_OS_SEM_HANDLE wake;
+  M2MB_OS_TASK_HANDLE writer;
+  /* Asks the writer task to exit, which clears running on its way out */
+  volatile BOOLEAN stopping;
+  volatile BOOLEAN running;
+} logAsync = { FALSE, 0, 0, 0, 0, AZX_LOG_FORMAT_TEXT, NULL, M2MB_OS_TASK_INVALID, FALSE, FALSE };
+
+static UINT64 asyncRing[AZX_LOG_ASYNC_BUFFER_SIZE / sizeof(UINT64)];
+
+/* Token buckets of the call sites, a token is TOKEN units */
+typedef struct
+{
+  const CHAR* file;
+  INT32 line;
+  UINT32 tokens;
+  UINT32 refilled;
+  UINT32 suppressed;
+} RateSite;
+
+static struct
+{
+  UINT16 burst[LEVEL_SLOTS];
+  UINT16 per_minute[LEVEL_SLOTS];
+  /* The table is only ever try-locked, a log that finds it busy is let through */
+  volatile UINT32 busy;
+  RateSite sites[AZX_LOG_RATE_SITES];
+} logRate;
+
+/* The last log written out, to collapse repeats of it. Protected by CSSemHandle */
+static struct
+{
+  BOOLEAN collapse[LEVEL_SLOTS];
+  AZX_LOG_LEVEL_E level;
+  const CHAR* file;
+  INT32 line;
+  UINT32 hash;
+  UINT32 count;
+  UINT32 since;
+} logRepeat;
+
+volatile UINT8 _azx_log_levels[AZX_LOG_MODULES] =
+    { [0 ... AZX_LOG_MODULES - 1] = AZX_LOG_LEVEL_NONE };
+/* Levels set with azx_log_setModuleLevel(), 0 for the modules following the global level */
+static UINT8 moduleLevels[AZX_LOG_MODULES] = { 0 };
+
 static CHAR log_buffer[LOG_BUFFER_SIZE] = { 0 };
 static CHAR task_name[64];
 static CHAR dateTime[32] = { 0 };
+/* The uptime second dateTime was read in, plus 1 so that 0 means never */
+static UINT32 dateTimeSecond = 0;
+
+/* Each entry is guarded by a sequence number, odd while it is being updated */
+static struct
+{
+  volatile UINT32 seq;
+  M2MB_OS_TASK_HANDLE handle;
+  UINT32 second;
+  CHAR name[TASK_NAME_CACHE_SIZE];
+} taskNames[TASK_NAME_CACHE_ENTRIES];
 
 static struct
 {
@@ -105,6 +292,11 @@ static struct
   UINT32 circular_chunks;
   UINT32 max_size_kb;
   AZX_LOG_LEVEL_E min_level;
+  UINT32 segment;
+  UINT32 size;
+  UINT32 cache_since;
+  AZX_LOG_ROTATE_CB rotate_cb;
+  volatile UINT32 rotated;
   UINT32 cache_idx;
   CHAR cache[MAX_FILE_LOG_CACHE];
 } logFile = {
@@ -120,6 +312,16 @@ static struct
   0,
   /*.min_level */
   AZX_LOG_LEVEL_CRITICAL,
+  /*.segment */
+  0,
+  /*.size */
+  0,
+  /*.cache_since */
+  0,
+  /*.rotate_cb */
+  NULL,
+  /*.rotated */
+  0,
   /*.cache_idx */
   0,
   /*.cache */
@@ -127,10 +329,10 @@ static struct
 };
 
 
-static const CHAR* prefix_fmt_colour = "[%s%-5s%s] %3.2f  " CYAN "%s" NO_COLOUR
+static const CHAR* prefix_fmt_colour = "[%s%-5s%s] %u.%02u  " CYAN "%s" NO_COLOUR
     ":" BOLD CYAN "%d" NO_COLOUR
     " - %s{" BOLD WHITE "%s" NO_COLOUR "}$ ";
-static const CHAR* prefix_fmt_no_colour = "[%s%-5s%s] %3.2f  %s:%d - %s{%s}$ ";
+static const CHAR* prefix_fmt_no_colour = "[%s%-5s%s] %u.%02u  %s:%d - %s{%s}$ ";
 static const CHAR* prefix_fmt_file = "%s.%.2u [%-5s] %s:%d ";
 
 
@@ -141,21 +343,23 @@ static const CHAR* prefix_fmt_file = "%s.%.2u [%-5s] %s:%d ";
   \brief Print directly on the main UART
 
   \param [in] message: the string to print
+  \param [in] len: the number of bytes to print
   \return sent bytes
  */
 /*----------------------------------------------------------------------------*/
-static INT32 log_print_to_UART(const CHAR *message);
+static INT32 log_print_to_UART(const CHAR *message, UINT32 len);
 
 /*----------------------------------------------------------------------------*/
 /*!
   \brief Print directly on the auxiliary UART
 
   \param [in] message: the string to print
+  \param [in] len: the number of bytes to print
   \return sent bytes
 
  */
 /*----------------------------------------------------------------------------*/
-static INT32 log_print_to_AUX_UART(const CHAR *message);
+static INT32 log_print_to_AUX_UART(const CHAR *message, UINT32 len);
 
 /*----------------------------------------------------------------------------*/
 /*!
@@ -163,24 +367,31 @@ static INT32 log_print_to_AUX_UART(const CHAR *message);
 
   \param [in] path:     USB resource path where to print (e.g. /dev/USB0
   \param [in] message : Message to print
+  \param [in] len:      the number of bytes to print
   \return sent bytes, negative in case of error
 
   \details Using channel:USB_CH_DEFAULT uses channel assigned to instance
   USER_USB_INSTANCE_0
  */
 /*----------------------------------------------------------------------------*/
-static INT32  log_print_to_USB (const CHAR *path, const CHAR *message );
+static INT32  log_print_to_USB (const CHAR *path, const CHAR *message, UINT32 len );
 
 static UINT32 get_uptime(void);
 static const char* get_file_title(const CHAR* path);
-static char* get_current_task_name(CHAR *name);
-static BOOLEAN check_file_size(const CHAR* filename, UINT32 max_size_kb);
+static char* get_task_name(M2MB_OS_TASK_HANDLE taskHandle, CHAR *name, UINT32 size);
+static char* get_current_task_name(CHAR *name, UINT32 size);
+static UINT32 get_file_size(const CHAR* filename);
 static void flush_log_to_file(void);
-static void file_log_or_cache(const CHAR* buffer);
-static const CHAR* get_next_log_filename(const CHAR* filename,
-    UINT32 circular_chunks, UINT32 max_size_kb);
-static BOOLEAN rotate_log_files(const CHAR* filename, UINT32 circular_chunks);
-static const char* get_date_time(void);
+static void file_log_or_cache(const CHAR* buffer, UINT32 size);
+static void flush_stale_file_cache(void);
+static void notify_rotation(void);
+static BOOLEAN open_log_segment(UINT32 segment, BOOLEAN truncate);
+static const char* get_date_time(UINT32 now);
+static void wait_for_log_writer(void);
+static void stop_log_writer(void);
+static void write_frame(AZX_LOG_LEVEL_E level, UINT32 now, const CHAR* function,
+    const CHAR* file, int line, M2MB_OS_TASK_HANDLE task_id, const CHAR* fmt,
+    const void* payload, UINT32 payload_len);
 
 /* Static functions ==========================================================*/
 
@@ -189,11 +400,12 @@ static const char* get_date_time(void);
   \brief Print directly on the main UART
 
   \param [in] message: the string to print
+  \param [in] len: the number of bytes to print
   \return sent bytes
 
  */
 /*----------------------------------------------------------------------------*/
-static INT32 log_print_to_UART(const CHAR *message)
+static INT32 log_print_to_UART(const CHAR *message, UINT32 len)
 {
   INT32 sent = 0;
 
@@ -205,7 +417,7 @@ static INT32 log_print_to_UART(const CHAR *message)
 
   if ( -1 != log_cfg.ch_fd)
   {
-    sent = m2mb_uart_write(log_cfg.ch_fd, (char*) message, strlen(message));
+    sent = m2mb_uart_write(log_cfg.ch_fd, (char*) message, len);
 
   }
   return sent;
@@ -216,11 +428,12 @@ static INT32 log_print_to_UART(const CHAR *message)
   \brief Print directly on the auxiliary UART
 
   \param [in] message: the string to print
+  \param [in] len: the number of bytes to print
   \return sent bytes
 
  */
 /*----------------------------------------------------------------------------*/
-static INT32 log_print_to_AUX_UART(const CHAR *message)
+static INT32 log_print_to_AUX_UART(const CHAR *message, UINT32 len)
 {
   INT32 sent = 0;
 
@@ -232,7 +445,7 @@ static INT32 log_print_to_AUX_UART(const CHAR *message)
 
   if ( -1 != log_cfg.ch_fd)
   {
-    sent = m2mb_uart_write(log_cfg.ch_fd, (char*) message, strlen(message));
+    sent = m2mb_uart_write(log_cfg.ch_fd, (char*) message, len);
 
     //m2mb_uart_close(g_AUX_fd);
   }
@@ -245,11 +458,12 @@ static INT32 log_print_to_AUX_UART(const CHAR *message)
 
   \param [in] path:    USB resource path where to print (e.g. /dev/USB0
   \param [in] message: Message to print
+  \param [in] len:     the number of bytes to print
   \return sent bytes, negative in case of error
 
  */
 /*-----------------------------------------------------------------------------*/
-static INT32 log_print_to_USB (const CHAR *path, const CHAR *message )
+static INT32 log_print_to_USB (const CHAR *path, const CHAR *message, UINT32 len )
 {
   INT32 ch;
   INT32 result;
@@ -273,7 +487,7 @@ static INT32 log_print_to_USB (const CHAR *path, const CHAR *message )
   {
     return AZX_LOG_CANNOT_OPEN_USB_CHANNEL;
   }
-  sent = m2mb_usb_write( log_cfg.ch_fd, (const void*) message, strlen(message));
+  sent = m2mb_usb_write( log_cfg.ch_fd, (const void*) message, len);
 
   /* in case of concurrency using m2m_hw_usb...
    * Comment the next API to avoid closing */
@@ -302,6 +516,7 @@ static UINT32 get_uptime(void)
 
 
 static CHAR fileTitle[12] = "";
+static const CHAR* fileTitlePath = NULL;
 
 /*-----------------------------------------------------------------------------------------------*/
 /*!
@@ -318,6 +533,12 @@ static const char* get_file_title(const CHAR* path)
   const CHAR* start = path;
   const CHAR* end = path;
 
+  /* __FILE__ is the same pointer for all the logs of a file */
+  if(path == fileTitlePath)
+  {
+    return fileTitle;
+  }
+
   while (*p) {
     if (*p == '/' || *p == '\\') {
       start = p + 1;
@@ -335,40 +556,97 @@ static const char* get_file_title(const CHAR* path)
   }
 
   snprintf(fileTitle, sizeof(fileTitle), "%.*s", (INT32)(end - start), start);
+  fileTitlePath = path;
   return fileTitle;
 }
 
 
 /*-----------------------------------------------------------------------------------------------*/
 /*!
-  \brief Returns the current task name
+  \brief Returns the name of a task. Names are cached for a second, so most
+  logs do not need to ask the kernel. Safe to call from any task.
 
+  \param [in] taskHandle: the task
   \param [in] name: the buffer where the task name will be saved
-  \return a reference to name variable
+  \param [in] size: the size of the buffer
+  \return a reference to name variable, NULL if the task has no name
 
  */
 /*-----------------------------------------------------------------------------------------------*/
-static char* get_current_task_name(CHAR *name)
+static char* get_task_name(M2MB_OS_TASK_HANDLE taskHandle, CHAR *name, UINT32 size)
 {
   MEM_W out;
-  M2MB_OS_TASK_HANDLE taskHandle = m2mb_os_taskGetId();
+  UINT32 second = get_uptime() / 1000;
+  UINT32 idx = ((UINT32)(MEM_W)taskHandle >> 3) % TASK_NAME_CACHE_ENTRIES;
+  UINT32 seq = taskNames[idx].seq;
+
+  if(!(seq & 1) && taskNames[idx].handle == taskHandle && taskNames[idx].second == second)
+  {
+    __sync_synchronize();
+    snprintf(name, size, "%s", taskNames[idx].name);
+    __sync_synchronize();
+    if(taskNames[idx].seq == seq)
+    {
+      return name;
+    }
+  }
 
   if(M2MB_OS_SUCCESS !=
       m2mb_os_taskGetItem(taskHandle, M2MB_OS_TASK_SEL_CMD_NAME, &out, NULL))
   {
     return NULL;
   }
-  else
+  snprintf(name, size, "%s", (CHAR*)out);
+
+  /* Another task updating the entry has it, this one is not cached then */
+  if(!(seq & 1) && __sync_bool_compare_and_swap(&taskNames[idx].seq, seq, seq + 1))
   {
-    strcpy(name, (CHAR*)out);
-    return name;
+    taskNames[idx].handle = taskHandle;
+    taskNames[idx].second = second;
+    snprintf(taskNames[idx].name, TASK_NAME_CACHE_SIZE, "%s", (CHAR*)out);
+    __sync_synchronize();
+    taskNames[idx].seq = seq + 2;
   }
+  return name;
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/*!
+  \brief Returns the current task name
+
+  \param [in] name: the buffer where the task name will be saved
+  \param [in] size: the size of the buffer
+  \return a reference to name variable
+
+ */
+/*-----------------------------------------------------------------------------------------------*/
+static char* get_current_task_name(CHAR *name, UINT32 size)
+{
+  return get_task_name(m2mb_os_taskGetId(), name, size);
 }
 
-static const char* get_date_time(void)
+/*-----------------------------------------------------------------------------------------------*/
+/*!
+  \brief Returns the date and time from the RTC, which is only read once per
+  second of uptime. The caller must hold CSSemHandle.
+
+  \param [in] now: the uptime in milliseconds
+  \return the formatted date and time
+
+ */
+/*-----------------------------------------------------------------------------------------------*/
+static const char* get_date_time(UINT32 now)
 {
-  INT32 fd = m2mb_rtc_open( "/dev/rtc0", 0 );
+  INT32 fd;
   M2MB_RTC_TIME_T ts = { 0 };
+
+  if(dateTimeSecond == now / 1000 + 1)
+  {
+    return dateTime;
+  }
+  dateTimeSecond = now / 1000 + 1;
+
+  fd = m2mb_rtc_open( "/dev/rtc0", 0 );
   if(fd == -1)
   {
     dateTime[0] = '\0';
@@ -388,6 +666,23 @@ static const char* get_date_time(void)
   return dateTime;
 }
 
+/* Works out the level the log macros check for each module */
+static void update_module_levels(void)
+{
+  UINT32 i;
+  for(i = 0; i < AZX_LOG_MODULES; ++i)
+  {
+    if(!log_cfg.isInit)
+    {
+      _azx_log_levels[i] = AZX_LOG_LEVEL_NONE;
+    }
+    else
+    {
+      _azx_log_levels[i] = moduleLevels[i] ? moduleLevels[i] : log_cfg.level;
+    }
+  }
+}
+
 /* Global functions ==========================================================*/
 
 
@@ -415,6 +710,7 @@ void azx_log_init(AZX_LOG_CFG_T *cfg)
     m2mb_os_sem_init( &log_cfg.CSSemHandle, &semAttrHandle );
   }
   log_cfg.isInit = TRUE;
+  update_module_levels();
 }
 
 
@@ -426,6 +722,10 @@ INT32 azx_log_deinit(void)
     return AZX_LOG_NOT_INIT;
   }
 
+  /* Let the writer task print what is pending and exit before the channel and the lock go away */
+  logAsync.enabled = FALSE;
+  stop_log_writer();
+
   switch(log_cfg.channel)
   {
   case AZX_LOG_TO_MAIN_UART:
@@ -463,6 +763,7 @@ INT32 azx_log_deinit(void)
   log_cfg.CSSemHandle = NULL;
 
   log_cfg.isInit = FALSE;
+  update_module_levels();
   return rc;
 }
 
@@ -470,6 +771,34 @@ void azx_log_setLevel(AZX_LOG_LEVEL_E level)
 {
 
   log_cfg.level = level;
+  update_module_levels();
+}
+
+void azx_log_setModuleLevel(AZX_LOG_MODULE_E module, AZX_LOG_LEVEL_E level)
+{
+  if(module < AZX_LOG_MODULES)
+  {
+    moduleLevels[module] = (UINT8)level;
+    update_module_levels();
+  }
+}
+
+void azx_log_resetModuleLevel(AZX_LOG_MODULE_E module)
+{
+  if(module < AZX_LOG_MODULES)
+  {
+    moduleLevels[module] = 0;
+    update_module_levels();
+  }
+}
+
+AZX_LOG_LEVEL_E azx_log_getModuleLevel(AZX_LOG_MODULE_E module)
+{
+  if(module >= AZX_LOG_MODULES)
+  {
+    return AZX_LOG_LEVEL_NONE;
+  }
+  return (AZX_LOG_LEVEL_E)_azx_log_levels[module];
 }
 
 AZX_LOG_LEVEL_E azx_log_getLevel(void)
@@ -487,11 +816,12 @@ AZX_LOG_LEVEL_E azx_log_getLevel(void)
   \brief Prints on the requested log channel (USB, UART, AUX)
 
   \param [in] msg: message to be printed on output
+  \param [in] len: the number of bytes to print
   \return amount of printed bytes, negative value in case of error
 
  */
 /*----------------------------------------------------------------------------*/
-static INT32 log_base_function(const char *msg)
+static INT32 log_base_write(const char *msg, UINT32 len)
 {
   INT32 result;
 
@@ -504,16 +834,16 @@ static INT32 log_base_function(const char *msg)
   switch(log_cfg.channel)
   {
   case AZX_LOG_TO_MAIN_UART:
-    result = log_print_to_UART(msg);
+    result = log_print_to_UART(msg, len);
     break;
   case AZX_LOG_TO_AUX_UART:
-    result = log_print_to_AUX_UART(msg);
+    result = log_print_to_AUX_UART(msg, len);
     break;
   case AZX_LOG_TO_USB0:
-    result = log_print_to_USB("/dev/USB0", msg);
+    result = log_print_to_USB("/dev/USB0", msg, len);
     break;
   case AZX_LOG_TO_USB1:
-    result = log_print_to_USB("/dev/USB1", msg);
+    result = log_print_to_USB("/dev/USB1", msg, len);
     break;
   default:
     //TODO return some error
@@ -525,258 +855,1711 @@ static INT32 log_base_function(const char *msg)
 
 /*----------------------------------------------------------------------------*/
 /*!
-  \brief Prints on the defined stream (UART or USB channel)
- *
-  \param [in] level:    Logging level. see AZX_LOG_LEVEL_E enum
-  \param [in] function: source function name to add to the output if log is verbose
-  \param [in] file:     source file path to add to the output if log is verbose
-  \param [in] line:     source file line to add to the output if log is verbose
-  \param [in] fmt :     string format with parameters to print
-  \param [in] ... :     ...
-  \return the number of sent bytes.
-    0 if logging level is not enabled, negative in case of error
-
+  \brief Reports how many times the last log was repeated, if it was. The
+  caller must hold CSSemHandle.
  */
 /*----------------------------------------------------------------------------*/
-INT32 azx_log_formatted(AZX_LOG_LEVEL_E level,
-    const char* function, const char* file, int line, const CHAR *fmt, ... )
+static void write_repeats(void)
 {
-  INT32  sent = 0;
-  va_list arg;
-  INT32   offset = 0;
-  UINT32 now;
+  CHAR msg[48];
+  INT32 len;
 
-  /* If the selected log level is set */
-  if(level >= azx_log_getLevel())
+  if(logRepeat.count == 0)
   {
-    m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+    return;
+  }
+  len = snprintf(msg, sizeof(msg), "=== Last log repeated %u times\r\n", logRepeat.count);
+  logRepeat.count = 0;
+
+  if(logAsync.format == AZX_LOG_FORMAT_BINARY)
+  {
+    write_frame(logRepeat.level, get_uptime(), NULL, NULL, 0, NULL, NULL, msg, len);
+    return;
+  }
+  log_base_write(msg, len);
+  if(logFile.fd && logRepeat.level >= logFile.min_level)
+  {
+    file_log_or_cache(msg, len);
+  }
+}
 
-    now = get_uptime();
-    /*Prepare buffer*/
-    memset(log_buffer,0,LOG_BUFFER_SIZE);
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Checks if a log repeats the last one written out. The caller must
+  hold CSSemHandle.
 
-    switch(level)
+  \param [in] level: level of the log
+  \param [in] file:  source file of the log
+  \param [in] line:  source line of the log
+  \param [in] msg:   the message, or the arguments it is made of
+  \param [in] len:   the size of msg
+
+  \return TRUE if the log is a repeat and must not be written out
+ */
+/*----------------------------------------------------------------------------*/
+static BOOLEAN collapse_repeat(AZX_LOG_LEVEL_E level, const CHAR* file, int line,
+    const void* msg, UINT32 len)
+{
+  const UINT8* p = (const UINT8*)msg;
+  UINT32 hash = 2166136261u;
+  UINT32 i;
+
+  /* FNV-1a */
+  for(i = 0; i < len; ++i)
+  {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+
+  if(level < LEVEL_SLOTS && logRepeat.collapse[level] && logRepeat.level == level &&
+      logRepeat.file == file && logRepeat.line == line && logRepeat.hash == hash)
+  {
+    if(++logRepeat.count == 1)
     {
-    LOG_PREFIX(TRACE);
-    LOG_PREFIX(DEBUG);
-    LOG_PREFIX(WARN);
-    LOG_PREFIX(ERROR);
-    LOG_PREFIX(CRITICAL);
-    default:
-      break;
+      logRepeat.since = get_uptime();
+    }
+    else if(get_uptime() - logRepeat.since >= REPEAT_REPORT_MS)
+    {
+      write_repeats();
     }
+    return TRUE;
+  }
 
-    va_start(arg, fmt);
-    vsnprintf(log_buffer + offset, LOG_BUFFER_SIZE-offset, fmt, arg);
-    va_end(arg);
+  write_repeats();
+  logRepeat.level = level;
+  logRepeat.file = file;
+  logRepeat.line = line;
+  logRepeat.hash = hash;
+  return FALSE;
+}
 
-    /* Print the message on the selected output stream */
-    sent = log_base_function(log_buffer);
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes a log to the output channel and to the log file. The caller
+  must hold CSSemHandle.
 
-    if(logFile.fd && level >= logFile.min_level)
-    {
-      if(!check_file_size(logFile.current_name, logFile.max_size_kb))
-      {
-        /* Log limit reached, so we'll need to open the next file in the rotation. Log in the file
-         * that this limit is reached and then get the next filename */
-        m2mb_fs_fputs("=== Log file size limit reached\r\n", logFile.fd);
-        m2mb_fs_fclose(logFile.fd);
-        logFile.fd = 0;
+  \param [in] level:    Logging level. see AZX_LOG_LEVEL_E enum
+  \param [in] now:      uptime in milliseconds when the log was issued
+  \param [in] function: source function name
+  \param [in] file:     source file path
+  \param [in] line:     source file line
+  \param [in] task:     name of the task that issued the log
+  \param [in] fmt:      string format with parameters to print
+  \param [in] arg:      the parameters
+  \return the number of sent bytes, negative in case of error
+ */
+/*----------------------------------------------------------------------------*/
+static INT32 write_log(AZX_LOG_LEVEL_E level, UINT32 now, const char* function,
+    const char* file, int line, const CHAR* task, const CHAR *fmt, va_list arg)
+{
+  INT32 sent;
+  INT32 offset = 0;
+  va_list file_arg;
 
-        snprintf(logFile.current_name, sizeof(logFile.current_name), "%s",
-            get_next_log_filename(logFile.name, logFile.circular_chunks,
-              logFile.max_size_kb));
+  /*Prepare buffer*/
+  memset(log_buffer,0,LOG_BUFFER_SIZE);
 
-        if(logFile.current_name[0] == '\0')
-        {
-          goto end;
-        }
+  switch(level)
+  {
+  LOG_PREFIX(TRACE);
+  LOG_PREFIX(DEBUG);
+  LOG_PREFIX(WARN);
+  LOG_PREFIX(ERROR);
+  LOG_PREFIX(CRITICAL);
+  default:
+    break;
+  }
 
-        logFile.fd = m2mb_fs_fopen(logFile.current_name, "a");
+  va_copy(file_arg, arg);
+  vsnprintf(log_buffer + offset, LOG_BUFFER_SIZE-offset, fmt, arg);
 
-        if(!logFile.fd)
-        {
-          goto end;
-        }
-      }
+  if(collapse_repeat(level, file, line, log_buffer + offset, strlen(log_buffer + offset)))
+  {
+    va_end(file_arg);
+    return 0;
+  }
 
-      switch(level)
-      {
-        LOG_FILE_PREFIX(TRACE);
-        LOG_FILE_PREFIX(DEBUG);
-        LOG_FILE_PREFIX(INFO);
-        LOG_FILE_PREFIX(WARN);
-        LOG_FILE_PREFIX(ERROR);
-        LOG_FILE_PREFIX(CRITICAL);
-        default:
-          break;
-      }
+  /* Print the message on the selected output stream */
+  sent = log_base_write(log_buffer, strlen(log_buffer));
 
-      va_start(arg, fmt);
-      vsnprintf(log_buffer + offset, LOG_BUFFER_SIZE - offset, fmt, arg);
-      va_end(arg);
-      file_log_or_cache(log_buffer);
+  if(logFile.fd && level >= logFile.min_level)
+  {
+    switch(level)
+    {
+      LOG_FILE_PREFIX(TRACE);
+      LOG_FILE_PREFIX(DEBUG);
+      LOG_FILE_PREFIX(INFO);
+      LOG_FILE_PREFIX(WARN);
+      LOG_FILE_PREFIX(ERROR);
+      LOG_FILE_PREFIX(CRITICAL);
+      default:
+        break;
     }
 
-end:
-    m2mb_os_sem_put(log_cfg.CSSemHandle);
+    vsnprintf(log_buffer + offset, LOG_BUFFER_SIZE - offset, fmt, file_arg);
+    file_log_or_cache(log_buffer, strlen(log_buffer));
   }
+  va_end(file_arg);
 
   return sent;
 }
 
-static BOOLEAN check_file_size(const CHAR* filename, UINT32 max_size_kb)
+static INT32 write_log_fmt(AZX_LOG_LEVEL_E level, UINT32 now, const char* function,
+    const char* file, int line, const CHAR* task, const CHAR *fmt, ...)
 {
-  struct M2MB_STAT stat;
-  if(-1 == m2mb_fs_stat(filename, &stat))
-  {
-    /* Most likely the file doesn't exist, so return true */
-    return TRUE;
-  }
-  return ((stat.st_size >> 10) < max_size_kb);
-}
+  INT32 sent;
+  va_list arg;
 
-static void flush_log_to_file(void)
-{
-  logFile.cache[logFile.cache_idx] = '\0';
-  m2mb_fs_fwrite(logFile.cache, logFile.cache_idx, 1, logFile.fd);
-  logFile.cache_idx = 0;
+  va_start(arg, fmt);
+  sent = write_log(level, now, function, file, line, task, fmt, arg);
+  va_end(arg);
+  return sent;
 }
 
-static void file_log_or_cache(const CHAR* buffer)
+static LogRecord* get_record(UINT32 pos)
 {
-  const UINT32 size = strlen(buffer);
-
-  if(MAX_FILE_LOG_CACHE - 1 - size < logFile.cache_idx)
-  {
-    flush_log_to_file();
-  }
-
-  memcpy(&logFile.cache[logFile.cache_idx], buffer, size);
-  logFile.cache_idx += size;
+  return (LogRecord*)((UINT8*)asyncRing + (pos & (AZX_LOG_ASYNC_BUFFER_SIZE - 1)));
 }
 
-static CHAR filenameInUse[40] = "";
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Reserves a contiguous record in the async ring
 
-static BOOLEAN rotate_log_files(const CHAR* filename, UINT32 circular_chunks)
+  \param [in] size: the aligned size of the record
+  \param [out] pos: the position of the record, to be used for its tag
+  \return the record, NULL if the ring is full
+ */
+/*----------------------------------------------------------------------------*/
+static LogRecord* reserve_record(UINT32 size, UINT32* pos)
 {
-  CHAR from[40] = "";
-  CHAR to[40] = "";
-  UINT32 i = 0;
-
-  /* This will move log.1 to log.2, log.2 to log.3 and so on until the last one */
-  snprintf(from, sizeof(from), "%s.%u", filename, circular_chunks);
+  UINT32 head;
+  UINT32 pad;
 
-  m2mb_fs_remove(from);
-
-  for(i = circular_chunks - 1; i > 0; --i)
+  do
   {
-    snprintf(from, sizeof(from), "%s.%u", filename, i);
-    snprintf(to, sizeof(to), "%s.%u", filename, i+1);
-    if(-1 == m2mb_fs_rename(from, to))
+    head = logAsync.head;
+    pad = 0;
+    if((head & (AZX_LOG_ASYNC_BUFFER_SIZE - 1)) + size > AZX_LOG_ASYNC_BUFFER_SIZE)
     {
-      /* Only return FALSE when the final file cannot be renamed - the other renames could be
-       * failing if there are no files there */
-      if(i == 1)
-      {
-        return FALSE;
-      }
+      /* Records never wrap, the end of the ring is skipped instead */
+      pad = AZX_LOG_ASYNC_BUFFER_SIZE - (head & (AZX_LOG_ASYNC_BUFFER_SIZE - 1));
     }
-  }
-  return TRUE;
-}
-
-static const CHAR* get_next_log_filename(const CHAR* filename,
-    UINT32 circular_chunks, UINT32 max_size_kb)
-{
-  filenameInUse[0] = '\0';
-
-  if(!filename)
-  {
-    goto end;
-  }
-
-  /* First try the original file */
-  snprintf(filenameInUse, sizeof(filenameInUse), "%s", filename);
-
-  if(check_file_size(filenameInUse, max_size_kb))
-  {
-    goto end;
-  }
+    if(head + pad + size - logAsync.tail > AZX_LOG_ASYNC_BUFFER_SIZE)
+    {
+      __sync_fetch_and_add(&logAsync.dropped, 1);
+      return NULL;
+    }
+  } while(!__sync_bool_compare_and_swap(&logAsync.head, head, head + pad + size));
 
-  /* If there is no circular logging and the original file is full, just return empty string */
-  if(circular_chunks == 0)
+  if(pad)
   {
-    filenameInUse[0] = '\0';
-    goto end;
+    LogRecord* padding = get_record(head);
+    padding->size = pad;
+    padding->level = 0;
+    __sync_synchronize();
+    padding->tag = head | 1;
   }
 
-  /* We should log to filename.1, but if that's full we need to rotate logs and then still use
-   * filename.1 (since the old one got moved to filename.2) */
-  snprintf(filenameInUse, sizeof(filenameInUse), "%s.1", filename);
-
-  if(check_file_size(filenameInUse, max_size_kb))
-  {
-    goto end;
-  }
+  *pos = head + pad;
+  return get_record(*pos);
+}
 
-  if(!rotate_log_files(filename, circular_chunks))
+static void wake_writer(void)
+{
+  if(logAsync.sleeping && __sync_bool_compare_and_swap(&logAsync.sleeping, 1, 0))
   {
-    /* Since we failed to rotate, just wipe filename.1 so it can be reused */
-    m2mb_fs_remove(filenameInUse);
-    goto end;
+    m2mb_os_sem_put(logAsync.wake);
   }
-
-end:
-  return filenameInUse;
 }
 
-BOOLEAN azx_log_send_to_file(const CHAR* filename, UINT32 circular_chunks,
-    AZX_LOG_LEVEL_E min_level, UINT32 max_size_kb)
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Parses a conversion of a format string
 
+  \param [in] p: the format string, just after the '%'
+  \param [out] conv: the parsed conversion
+  \return the format string after the conversion
+ */
+/*----------------------------------------------------------------------------*/
+static const CHAR* parse_conversion(const CHAR* p, Conversion* conv)
 {
-  if(!filename)
+  UINT32 n = 0;
+  UINT32 int_size = sizeof(int);
+  BOOLEAN long_double = FALSE;
+  CHAR c;
+
+  conv->spec[n++] = '%';
+  conv->stars = 0;
+  conv->precision = -1;
+  conv->precision_star = FALSE;
+  while(*p && strchr("-+ #0123456789.*", *p))
   {
-    return FALSE;
+    if(*p == '*')
+    {
+      conv->stars++;
+      conv->precision_star = (conv->precision == 0);
+      conv->precision = -1;
+    }
+    else if(*p == '.')
+    {
+      conv->precision = 0;
+    }
+    else if(conv->precision >= 0 && *p >= '0' && *p <= '9')
+    {
+      conv->precision = conv->precision * 10 + (*p - '0');
+    }
+    if(n < sizeof(conv->spec) - 4)
+    {
+      conv->spec[n++] = *p;
+    }
+    p++;
   }
 
-  if(circular_chunks == 0 && !check_file_size(filename, max_size_kb))
+  while(*p && strchr("hlLqjzt", *p))
   {
-    return FALSE;
+    switch(*p)
+    {
+    case 'l':
+      int_size = (int_size == sizeof(long)) ? sizeof(long long) : sizeof(long);
+      break;
+    case 'q':
+    case 'j':
+      int_size = sizeof(long long);
+      break;
+    case 'z':
+      int_size = sizeof(size_t);
+      break;
+    case 't':
+      int_size = sizeof(ptrdiff_t);
+      break;
+    case 'L':
+      long_double = TRUE;
+      break;
+    default:
+      break;
+    }
+    p++;
   }
 
-  if(logFile.fd)
+  c = *p;
+  switch(c)
   {
-    m2mb_fs_fclose(logFile.fd);
-    logFile.fd = 0;
+  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+    conv->type = (int_size > sizeof(INT32)) ? ARG_INT64 : ARG_INT32;
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+    conv->type = long_double ? ARG_LONG_DOUBLE : ARG_DOUBLE;
+    break;
+  case 's':
+    conv->type = ARG_STRING;
+    break;
+  case 'p': case 'n':
+    conv->type = ARG_POINTER;
+    break;
+  default:
+    conv->type = ARG_NONE;
+    break;
   }
 
-  snprintf(logFile.current_name, sizeof(logFile.current_name), "%s",
-      get_next_log_filename(filename, circular_chunks, max_size_kb));
-
-  if(logFile.current_name[0] == '\0')
+  if(conv->type == ARG_INT64)
   {
-    return FALSE;
+    conv->spec[n++] = 'l';
+    conv->spec[n++] = 'l';
   }
-
-  logFile.fd = m2mb_fs_fopen(logFile.current_name, "a");
-
-  if(!logFile.fd)
+  if(c)
   {
-    return FALSE;
+    conv->spec[n++] = c;
+    p++;
   }
+  conv->spec[n] = '\0';
+  return p;
+}
 
-  snprintf(logFile.name, sizeof(logFile.name), "%s", filename);
-  logFile.circular_chunks = circular_chunks;
-  logFile.min_level = min_level;
-  logFile.max_size_kb = max_size_kb;
-  logFile.cache_idx = 0;
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Stores the arguments of a format string as raw bytes: 4 bytes for
+  ints, 8 for long longs and doubles, the pointer size for pointers and a
+  length byte followed by the characters for strings.
+
+  \param [in] fmt: the format string
+  \param [in] arg: the arguments
+  \param [out] out: where to store them, NULL to only compute the size
+  \return the number of bytes needed
+ */
+/*----------------------------------------------------------------------------*/
+static UINT32 capture_args(const CHAR* fmt, va_list arg, UINT8* out)
+{
+  UINT32 size = 0;
+  INT32 star = 0;
+  Conversion conv;
+
+#define STORE(value) do { \
+    if(out) \
+    { \
+      memcpy(out + size, &(value), sizeof(value)); \
+    } \
+    size += sizeof(value); \
+  } while(0)
+
+  while(*fmt)
+  {
+    if(*fmt++ != '%')
+    {
+      continue;
+    }
+    fmt = parse_conversion(fmt, &conv);
+
+    while(conv.stars--)
+    {
+      INT32 v = va_arg(arg, int);
+      STORE(v);
+      star = v;
+    }
+    if(conv.precision_star)
+    {
+      /* A negative precision is taken as if there was none */
+      conv.precision = (star >= 0) ? star : -1;
+    }
+
+    switch(conv.type)
+    {
+    case ARG_INT32:
+    {
+      INT32 v = va_arg(arg, int);
+      STORE(v);
+      break;
+    }
+    case ARG_INT64:
+    {
+      long long v = va_arg(arg, long long);
+      STORE(v);
+      break;
+    }
+    case ARG_DOUBLE:
+    {
+      double v = va_arg(arg, double);
+      STORE(v);
+      break;
+    }
+    case ARG_LONG_DOUBLE:
+    {
+      double v = (double)va_arg(arg, long double);
+      STORE(v);
+      break;
+    }
+    case ARG_POINTER:
+    {
+      void* v = va_arg(arg, void*);
+      STORE(v);
+      break;
+    }
+    case ARG_STRING:
+    {
+      const CHAR* v = va_arg(arg, const CHAR*);
+      UINT32 max = ASYNC_MAX_STRING;
+      UINT8 len = 0;
+      if(!v)
+      {
+        v = "(null)";
+      }
+      /* With a precision the string need not be NUL terminated, so nothing past it is read */
+      if(conv.precision >= 0 && (UINT32)conv.precision < max)
+      {
+        max = (UINT32)conv.precision;
+      }
+      while(len < max && v[len] != '\0')
+      {
+        ++len;
+      }
+      if(out)
+      {
+        out[size] = len;
+        memcpy(out + size + 1, v, len);
+      }
+      size += 1 + len;
+      break;
+    }
+    default:
+      break;
+    }
+  }
+#undef STORE
+  return size;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Formats arguments stored by capture_args()
+
+  \param [out] out: where to write the text
+  \param [in] out_size: the size of out
+  \param [in] fmt: the format string
+  \param [in] args: the stored arguments
+ */
+/*----------------------------------------------------------------------------*/
+static void render_args(CHAR* out, UINT32 out_size, const CHAR* fmt, const UINT8* args)
+{
+  UINT32 n = 0;
+  Conversion conv;
+
+  while(*fmt && n < out_size - 1)
+  {
+    CHAR spec[48];
+    INT32 stars[2] = { 0, 0 };
+    UINT8 i;
+    UINT32 s = 0;
+    UINT32 k = 0;
+    INT32 written = 0;
+
+    if(*fmt != '%')
+    {
+      out[n++] = *fmt++;
+      continue;
+    }
+    fmt = parse_conversion(fmt + 1, &conv);
+    if(conv.spec[1] == '%')
+    {
+      out[n++] = '%';
+      continue;
+    }
+
+    for(i = 0; i < conv.stars; ++i)
+    {
+      INT32 v;
+      memcpy(&v, args, sizeof(v));
+      args += sizeof(v);
+      if(i < 2)
+      {
+        stars[i] = v;
+      }
+    }
+    /* The stored widths and precisions replace the '*' */
+    for(i = 0; conv.spec[s] && k < sizeof(spec) - 12; ++s)
+    {
+      if(conv.spec[s] == '*')
+      {
+        if(k > 0 && spec[k - 1] == '.' && (i >= 2 || stars[i] < 0))
+        {
+          /* A negative precision is taken as if there was none */
+          k--;
+        }
+        else
+        {
+          k += sprintf(spec + k, "%d", (i < 2) ? stars[i] : 0);
+        }
+        i++;
+      }
+      else
+      {
+        spec[k++] = conv.spec[s];
+      }
+    }
+    spec[k] = '\0';
+
+    switch(conv.type)
+    {
+    case ARG_INT32:
+    {
+      INT32 v;
+      memcpy(&v, args, sizeof(v));
+      args += sizeof(v);
+      written = snprintf(out + n, out_size - n, spec, v);
+      break;
+    }
+    case ARG_INT64:
+    {
+      long long v;
+      memcpy(&v, args, sizeof(v));
+      args += sizeof(v);
+      written = snprintf(out + n, out_size - n, spec, v);
+      break;
+    }
+    case ARG_DOUBLE:
+    case ARG_LONG_DOUBLE:
+    {
+      double v;
+      memcpy(&v, args, sizeof(v));
+      args += sizeof(v);
+      written = snprintf(out + n, out_size - n, spec, v);
+      break;
+    }
+    case ARG_POINTER:
+    {
+      void* v;
+      memcpy(&v, args, sizeof(v));
+      args += sizeof(v);
+      if(spec[k - 1] == 'p')
+      {
+        written = snprintf(out + n, out_size - n, spec, v);
+      }
+      break;
+    }
+    case ARG_STRING:
+    {
+      UINT8 len = *args++;
+      /* The string is not NUL terminated, so its length caps the precision */
+      spec[k - 1] = '\0';
+      if(!strchr(spec, '.'))
+      {
+        CHAR with_len[sizeof(spec) + 4];
+        snprintf(with_len, sizeof(with_len), "%s.*s", spec);
+        written = snprintf(out + n, out_size - n, with_len, (int)len, (const CHAR*)args);
+      }
+      else
+      {
+        CHAR tmp[ASYNC_MAX_STRING + 1];
+        memcpy(tmp, args, len);
+        tmp[len] = '\0';
+        spec[k - 1] = 's';
+        written = snprintf(out + n, out_size - n, spec, tmp);
+      }
+      args += len;
+      break;
+    }
+    default:
+      break;
+    }
+
+    if(written > 0)
+    {
+      n += written;
+      if(n >= out_size)
+      {
+        n = out_size - 1;
+      }
+    }
+  }
+  out[n] = '\0';
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Queues a log into the async ring, to be written out by the writer task.
+  Depending on the log format, either the formatted text or the raw arguments
+  are stored.
+
+  \return the length of the stored message, 0 if it was dropped
+ */
+/*----------------------------------------------------------------------------*/
+static INT32 log_async(AZX_LOG_LEVEL_E level, const char* function, const char* file,
+    int line, const CHAR *fmt, va_list arg)
+{
+  va_list measure;
+  INT32 len;
+  UINT32 size;
+  UINT32 pos;
+  LogRecord* rec;
+  /* A format without conversions may well be a buffer that is about to change, so copy it */
+  const RecordKind kind = (logAsync.format == AZX_LOG_FORMAT_TEXT || !strchr(fmt, '%')) ?
+      RECORD_TEXT : RECORD_ARGS;
+
+  va_copy(measure, arg);
+  if(kind == RECORD_TEXT)
+  {
+    len = vsnprintf(NULL, 0, fmt, measure);
+  }
+  else
+  {
+    len = capture_args(fmt, measure, NULL);
+  }
+  va_end(measure);
+  if(len < 0)
+  {
+    return 0;
+  }
+  if(len > LOG_BUFFER_SIZE - 1)
+  {
+    len = LOG_BUFFER_SIZE - 1;
+  }
+  /* Keep a single record well below the ring size, so it can always fit once drained */
+  if(offsetof(LogRecord, msg) + len + 1 > AZX_LOG_ASYNC_BUFFER_SIZE / 4)
+  {
+    if(kind == RECORD_ARGS)
+    {
+      /* The arguments cannot be cut */
+      __sync_fetch_and_add(&logAsync.dropped, 1);
+      return 0;
+    }
+    len = AZX_LOG_ASYNC_BUFFER_SIZE / 4 - offsetof(LogRecord, msg) - 1;
+  }
+
+  size = ASYNC_ALIGN_UP(offsetof(LogRecord, msg) + len + 1);
+  rec = reserve_record(size, &pos);
+  if(!rec)
+  {
+    return 0;
+  }
+
+  rec->size = size;
+  rec->level = (UINT8)level;
+  rec->kind = (UINT8)kind;
+  rec->now = get_uptime();
+  rec->function = function;
+  rec->file = file;
+  rec->line = line;
+  rec->fmt = fmt;
+  rec->msg_len = (UINT16)len;
+  if(kind == RECORD_TEXT)
+  {
+    if(!get_current_task_name(rec->task, sizeof(rec->task)))
+    {
+      rec->task[0] = '\0';
+    }
+    vsnprintf(rec->msg, len + 1, fmt, arg);
+  }
+  else
+  {
+    /* The name is looked up by the writer, only when needed */
+    rec->task_id = m2mb_os_taskGetId();
+    capture_args(fmt, arg, (UINT8*)rec->msg);
+  }
+
+  __sync_synchronize();
+  rec->tag = pos | 1;
+
+  wake_writer();
+  return len;
+}
+
+static void put_le(UINT8* out, UINT32 value, UINT32 bytes)
+{
+  UINT32 i;
+  for(i = 0; i < bytes; ++i)
+  {
+    out[i] = (UINT8)(value >> (8 * i));
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes a binary frame to the output channel and to the log file. The
+  caller must hold CSSemHandle.
+
+  A frame is: sync (A5 5A), payload length (2), level (1), version (1),
+  line (2), uptime in ms (4), task id (4), format string address (4), file
+  address (4), function address (4) and then the arguments as stored by
+  capture_args(). A format address of 0 means the payload is plain text.
+ */
+/*----------------------------------------------------------------------------*/
+static void write_frame(AZX_LOG_LEVEL_E level, UINT32 now, const CHAR* function,
+    const CHAR* file, int line, M2MB_OS_TASK_HANDLE task_id, const CHAR* fmt,
+    const void* payload, UINT32 payload_len)
+{
+  UINT8* frame = (UINT8*)log_buffer;
+  UINT32 len;
+
+  if(FRAME_HEADER_SIZE + payload_len > LOG_BUFFER_SIZE)
+  {
+    payload_len = LOG_BUFFER_SIZE - FRAME_HEADER_SIZE;
+  }
+  len = FRAME_HEADER_SIZE + payload_len;
+
+  frame[0] = FRAME_SYNC_0;
+  frame[1] = FRAME_SYNC_1;
+  put_le(frame + 2, len - 4, 2);
+  frame[4] = (UINT8)level;
+  frame[5] = FRAME_VERSION;
+  put_le(frame + 6, (UINT32)line, 2);
+  put_le(frame + 8, now, 4);
+  put_le(frame + 12, (UINT32)(MEM_W)task_id, 4);
+  put_le(frame + 16, (UINT32)(MEM_W)fmt, 4);
+  put_le(frame + 20, (UINT32)(MEM_W)file, 4);
+  put_le(frame + 24, (UINT32)(MEM_W)function, 4);
+  memcpy(frame + FRAME_HEADER_SIZE, payload, payload_len);
+
+  log_base_write(log_buffer, len);
+  if(logFile.fd && level >= logFile.min_level)
+  {
+    file_log_or_cache(log_buffer, len);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes a key/value frame to the log file, and to the output channel
+  in binary format. The caller must hold CSSemHandle.
+ */
+/*----------------------------------------------------------------------------*/
+static void write_kv(AZX_LOG_LEVEL_E level, const UINT8* frame, UINT32 len)
+{
+  if(logAsync.format == AZX_LOG_FORMAT_BINARY)
+  {
+    log_base_write((const CHAR*)frame, len);
+  }
+  if(logFile.fd && level >= logFile.min_level)
+  {
+    file_log_or_cache((const CHAR*)frame, len);
+  }
+}
+
+/* Writes the head of a CBOR data item, returns its size or 0 if it does not fit */
+static UINT32 cbor_head(UINT8* out, UINT32 room, UINT8 major, UINT64 value)
+{
+  UINT32 bytes;
+  UINT32 i;
+
+  if(value < 24)
+  {
+    if(room < 1)
+    {
+      return 0;
+    }
+    out[0] = (UINT8)((major << 5) | value);
+    return 1;
+  }
+  bytes = (value <= 0xFF) ? 1 : (value <= 0xFFFF) ? 2 : (value <= 0xFFFFFFFF) ? 4 : 8;
+  if(room < 1 + bytes)
+  {
+    return 0;
+  }
+  /* 24, 25, 26 and 27 for 1, 2, 4 and 8 bytes */
+  out[0] = (UINT8)((major << 5) | (24 + __builtin_ctz(bytes)));
+  for(i = 0; i < bytes; ++i)
+  {
+    out[bytes - i] = (UINT8)(value >> (8 * i));
+  }
+  return 1 + bytes;
+}
+
+static UINT32 cbor_text(UINT8* out, UINT32 room, const CHAR* text, UINT32 max_len)
+{
+  UINT32 len = strlen(text);
+  UINT32 head;
+
+  if(len > max_len)
+  {
+    len = max_len;
+  }
+  head = cbor_head(out, room, 3, len);
+  if(head == 0 || room < head + len)
+  {
+    return 0;
+  }
+  memcpy(out + head, text, len);
+  return head + len;
+}
+
+static UINT32 cbor_double(UINT8* out, UINT32 room, double value)
+{
+  union
+  {
+    FLOAT32 f;
+    UINT32 u;
+  } single;
+  union
+  {
+    double d;
+    UINT64 u;
+  } wide;
+  UINT32 i;
+
+  /* Values that a float holds exactly take half the space */
+  single.f = (FLOAT32)value;
+  if((double)single.f == value)
+  {
+    if(room < 5)
+    {
+      return 0;
+    }
+    out[0] = 0xFA;
+    for(i = 0; i < 4; ++i)
+    {
+      out[4 - i] = (UINT8)(single.u >> (8 * i));
+    }
+    return 5;
+  }
+  if(room < 9)
+  {
+    return 0;
+  }
+  wide.d = value;
+  out[0] = 0xFB;
+  for(i = 0; i < 8; ++i)
+  {
+    out[8 - i] = (UINT8)(wide.u >> (8 * i));
+  }
+  return 9;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Encodes the fields of a key/value log as a CBOR map
+
+  \param [out] out: where to encode the map
+  \param [in] room: the size of out
+  \param [in] arg:  the fields, see AZX_LOG_KV
+
+  \return the size of the map. Fields that do not fit are left out.
+ */
+/*----------------------------------------------------------------------------*/
+static UINT32 encode_kv_fields(UINT8* out, UINT32 room, va_list arg)
+{
+  UINT32 len = 1;
+  UINT32 fields = 0;
+  AZX_LOG_KV_TYPE_E type;
+
+  while((type = (AZX_LOG_KV_TYPE_E)va_arg(arg, int)) != AZX_LOG_KV_TYPE_END)
+  {
+    const CHAR* key = va_arg(arg, const CHAR*);
+    UINT32 key_len = cbor_text(out + len, room - len, key, ASYNC_MAX_STRING);
+    UINT32 value_len = 0;
+
+    switch(type)
+    {
+    case AZX_LOG_KV_TYPE_INT:
+    {
+      INT64 value = va_arg(arg, INT64);
+      if(key_len)
+      {
+        value_len = (value >= 0) ?
+            cbor_head(out + len + key_len, room - len - key_len, 0, (UINT64)value) :
+            cbor_head(out + len + key_len, room - len - key_len, 1, (UINT64)(-1 - value));
+      }
+      break;
+    }
+    case AZX_LOG_KV_TYPE_UINT:
+    {
+      UINT64 value = va_arg(arg, UINT64);
+      if(key_len)
+      {
+        value_len = cbor_head(out + len + key_len, room - len - key_len, 0, value);
+      }
+      break;
+    }
+    case AZX_LOG_KV_TYPE_FLOAT:
+    {
+      double value = va_arg(arg, double);
+      if(key_len)
+      {
+        value_len = cbor_double(out + len + key_len, room - len - key_len, value);
+      }
+      break;
+    }
+    case AZX_LOG_KV_TYPE_STR:
+    {
+      const CHAR* value = va_arg(arg, const CHAR*);
+      if(key_len)
+      {
+        value_len = cbor_text(out + len + key_len, room - len - key_len,
+            value ? value : "", ASYNC_MAX_STRING);
+      }
+      break;
+    }
+    case AZX_LOG_KV_TYPE_BOOL:
+    {
+      INT32 value = va_arg(arg, INT32);
+      if(key_len && room - len - key_len >= 1)
+      {
+        out[len + key_len] = value ? 0xF5 : 0xF4;
+        value_len = 1;
+      }
+      break;
+    }
+    default:
+      /* Anything after an unknown type cannot be read */
+      goto end;
+    }
+
+    if(key_len && value_len && fields < KV_MAX_FIELDS)
+    {
+      len += key_len + value_len;
+      ++fields;
+    }
+  }
+
+end:
+  out[0] = (UINT8)(0xA0 | fields);
+  return len;
+}
+
+INT32 azx_log_kv(AZX_LOG_LEVEL_E level, UINT16 event_id, ...)
+{
+  UINT8 frame[AZX_LOG_KV_MAX_SIZE];
+  UINT32 len;
+  UINT32 size;
+  UINT32 pos;
+  LogRecord* rec;
+  va_list arg;
+
+  if(!log_cfg.isInit)
+  {
+    return AZX_LOG_NOT_INIT;
+  }
+  /* Nowhere to go */
+  if(logAsync.format != AZX_LOG_FORMAT_BINARY && (!logFile.fd || level < logFile.min_level))
+  {
+    return 0;
+  }
+
+  va_start(arg, event_id);
+  len = KV_FRAME_HEADER_SIZE +
+      encode_kv_fields(frame + KV_FRAME_HEADER_SIZE, sizeof(frame) - KV_FRAME_HEADER_SIZE, arg);
+  va_end(arg);
+
+  frame[0] = FRAME_SYNC_0;
+  frame[1] = FRAME_SYNC_1;
+  put_le(frame + 2, len - 4, 2);
+  frame[4] = (UINT8)level;
+  frame[5] = KV_FRAME_VERSION;
+  put_le(frame + 6, event_id, 2);
+  put_le(frame + 8, get_uptime(), 4);
+
+  if(!logAsync.enabled)
+  {
+    m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+    write_kv(level, frame, len);
+    m2mb_os_sem_put(log_cfg.CSSemHandle);
+    notify_rotation();
+    return len;
+  }
+
+  size = ASYNC_ALIGN_UP(offsetof(LogRecord, msg) + len);
+  rec = reserve_record(size, &pos);
+  if(!rec)
+  {
+    return 0;
+  }
+  rec->size = size;
+  rec->level = (UINT8)level;
+  rec->kind = RECORD_KV;
+  rec->msg_len = (UINT16)len;
+  memcpy(rec->msg, frame, len);
+
+  __sync_synchronize();
+  rec->tag = pos | 1;
+
+  wake_writer();
+  return len;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes out a record of the async ring. The caller must hold
+  CSSemHandle.
+ */
+/*----------------------------------------------------------------------------*/
+static void write_record(const LogRecord* rec)
+{
+  static CHAR render_buffer[LOG_BUFFER_SIZE];
+  CHAR* task = (CHAR*)rec->task;
+
+  if(rec->kind == RECORD_KV)
+  {
+    write_kv((AZX_LOG_LEVEL_E)rec->level, (const UINT8*)rec->msg, rec->msg_len);
+    return;
+  }
+
+  if(logAsync.format == AZX_LOG_FORMAT_BINARY)
+  {
+    if(collapse_repeat((AZX_LOG_LEVEL_E)rec->level, rec->file, rec->line, rec->msg, rec->msg_len))
+    {
+      return;
+    }
+    if(rec->kind == RECORD_ARGS)
+    {
+      write_frame((AZX_LOG_LEVEL_E)rec->level, rec->now, rec->function, rec->file, rec->line,
+          rec->task_id, rec->fmt, rec->msg, rec->msg_len);
+    }
+    else
+    {
+      write_frame((AZX_LOG_LEVEL_E)rec->level, rec->now, rec->function, rec->file, rec->line,
+          NULL, NULL, rec->msg, rec->msg_len);
+    }
+    return;
+  }
+
+  if(rec->kind == RECORD_ARGS)
+  {
+    render_args(render_buffer, sizeof(render_buffer), rec->fmt, (const UINT8*)rec->msg);
+    task = task_name;
+    if(!get_task_name(rec->task_id, task, sizeof(task_name)))
+    {
+      task[0] = '\0';
+    }
+    write_log_fmt((AZX_LOG_LEVEL_E)rec->level, rec->now, rec->function, rec->file, rec->line,
+        task, "%s", render_buffer);
+  }
+  else
+  {
+    write_log_fmt((AZX_LOG_LEVEL_E)rec->level, rec->now, rec->function, rec->file, rec->line,
+        task, "%s", rec->msg);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes out all the committed records of the async ring
+ */
+/*----------------------------------------------------------------------------*/
+static void drain_records(void)
+{
+  static UINT32 reportedDrops = 0;
+  UINT32 tail = logAsync.tail;
+  UINT32 dropped;
+
+  if(tail == logAsync.head && reportedDrops == logAsync.dropped)
+  {
+    return;
+  }
+
+  m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+  while(tail != logAsync.head)
+  {
+    LogRecord* rec = get_record(tail);
+    if(rec->tag != (tail | 1))
+    {
+      /* Still being written, it will be picked up on the next round */
+      break;
+    }
+
+    if(rec->level)
+    {
+      write_record(rec);
+    }
+
+    tail += rec->size;
+    __sync_synchronize();
+    logAsync.tail = tail;
+  }
+
+  dropped = logAsync.dropped;
+  if(dropped != reportedDrops)
+  {
+    CHAR msg[40];
+    INT32 len = snprintf(msg, sizeof(msg), "=== %u logs dropped\r\n", dropped - reportedDrops);
+    if(logAsync.format == AZX_LOG_FORMAT_BINARY)
+    {
+      write_frame(AZX_LOG_LEVEL_INFO, get_uptime(), NULL, NULL, 0, NULL, NULL, msg, len);
+    }
+    else
+    {
+      write_log_fmt(AZX_LOG_LEVEL_INFO, get_uptime(), "", "", 0, "", "%s", msg);
+    }
+    reportedDrops = dropped;
+  }
+  m2mb_os_sem_put(log_cfg.CSSemHandle);
+  notify_rotation();
+}
+
+static void log_writer_task(void* arg)
+{
+  (void)arg;
+
+  while(!logAsync.stopping)
+  {
+    drain_records();
+
+    if(logFile.cache_idx > 0)
+    {
+      m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+      flush_stale_file_cache();
+      m2mb_os_sem_put(log_cfg.CSSemHandle);
+    }
+
+    logAsync.sleeping = 1;
+    __sync_synchronize();
+    /* A record still being written gets no wake up when done, so look again shortly. Logs
+     * waiting in the file cache are flushed once they get old enough. */
+    m2mb_os_sem_get(logAsync.wake, (logAsync.tail != logAsync.head) ?
+        M2MB_OS_MS2TICKS(ASYNC_RETRY_MS) : (logFile.cache_idx > 0) ?
+        M2MB_OS_MS2TICKS(AZX_LOG_FILE_FLUSH_MS) : M2MB_OS_WAIT_FOREVER);
+    logAsync.sleeping = 0;
+  }
+  logAsync.running = FALSE;
+}
+
+static BOOLEAN start_log_writer(void)
+{
+  M2MB_OS_SEM_ATTR_HANDLE semAttrHandle;
+  M2MB_OS_TASK_ATTR_HANDLE taskAttrHandle;
+
+  if(logAsync.writer != M2MB_OS_TASK_INVALID)
+  {
+    return TRUE;
+  }
+
+  if(NULL == logAsync.wake)
+  {
+    m2mb_os_sem_setAttrItem(&semAttrHandle,
+        CMDS_ARGS(M2MB_OS_SEM_SEL_CMD_CREATE_ATTR, NULL,
+            M2MB_OS_SEM_SEL_CMD_COUNT, 0,
+            M2MB_OS_SEM_SEL_CMD_TYPE, M2MB_OS_SEM_GEN,
+            M2MB_OS_SEM_SEL_CMD_NAME, "LogWake"));
+    if(M2MB_OS_SUCCESS != m2mb_os_sem_init(&logAsync.wake, &semAttrHandle))
+    {
+      logAsync.wake = NULL;
+      return FALSE;
+    }
+  }
+
+  if(M2MB_OS_SUCCESS != m2mb_os_taskSetAttrItem(&taskAttrHandle,
+      CMDS_ARGS(
+          M2MB_OS_TASK_SEL_CMD_CREATE_ATTR, NULL,
+          M2MB_OS_TASK_SEL_CMD_STACK_SIZE, (void*)ASYNC_TASK_STACK_SIZE,
+          M2MB_OS_TASK_SEL_CMD_NAME, "LogWriter",
+          M2MB_OS_TASK_SEL_CMD_PRIORITY, AZX_LOG_ASYNC_TASK_PRIORITY,
+          M2MB_OS_TASK_SEL_CMD_PREEMPTIONTH, AZX_LOG_ASYNC_TASK_PRIORITY,
+          M2MB_OS_TASK_SEL_CMD_AUTOSTART, M2MB_OS_TASK_AUTOSTART,
+          M2MB_OS_TASK_SEL_CMD_USRNAME, "LogWriter")))
+  {
+    return FALSE;
+  }
+
+  logAsync.stopping = FALSE;
+  logAsync.running = TRUE;
+  if(M2MB_OS_SUCCESS != m2mb_os_taskCreate(&logAsync.writer, &taskAttrHandle,
+      &log_writer_task, NULL))
+  {
+    m2mb_os_taskSetAttrItem(&taskAttrHandle, 1, M2MB_OS_TASK_SEL_CMD_DEL_ATTR, NULL);
+    logAsync.writer = M2MB_OS_TASK_INVALID;
+    logAsync.running = FALSE;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Gives the writer task some time to write out what is in the ring */
+static void wait_for_log_writer(void)
+{
+  UINT32 waited = 0;
+
+  if(logAsync.writer == M2MB_OS_TASK_INVALID)
+  {
+    return;
+  }
+
+  while(logAsync.tail != logAsync.head && waited < ASYNC_DRAIN_TIMEOUT_MS)
+  {
+    wake_writer();
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(ASYNC_RETRY_MS));
+    waited += ASYNC_RETRY_MS;
+  }
+}
+
+/* Writes out what is in the ring, then waits for the writer task to exit and deletes it */
+static void stop_log_writer(void)
+{
+  if(logAsync.writer == M2MB_OS_TASK_INVALID)
+  {
+    return;
+  }
+
+  wait_for_log_writer();
+  logAsync.stopping = TRUE;
+  __sync_synchronize();
+  /* Whether it is asleep or about to be, the writer sees the flag right after this */
+  m2mb_os_sem_put(logAsync.wake);
+  while(logAsync.running)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(ASYNC_RETRY_MS));
+  }
+
+  m2mb_os_taskTerminate(logAsync.writer);
+  m2mb_os_taskDelete(logAsync.writer);
+  logAsync.writer = M2MB_OS_TASK_INVALID;
+  m2mb_os_sem_deinit(logAsync.wake);
+  logAsync.wake = NULL;
+  logAsync.sleeping = 0;
+}
+
+BOOLEAN azx_log_setAsync(BOOLEAN enable)
+{
+  if(!log_cfg.isInit)
+  {
+    return FALSE;
+  }
+
+  if(!enable)
+  {
+    logAsync.enabled = FALSE;
+    wait_for_log_writer();
+    return TRUE;
+  }
+
+  if(!start_log_writer())
+  {
+    return FALSE;
+  }
+  logAsync.enabled = TRUE;
+  return TRUE;
+}
+
+BOOLEAN azx_log_setFormat(AZX_LOG_FORMAT_E format)
+{
+  if(format != AZX_LOG_FORMAT_TEXT && !logAsync.enabled && !azx_log_setAsync(TRUE))
+  {
+    return FALSE;
+  }
+  logAsync.format = format;
+  return TRUE;
+}
+
+UINT32 azx_log_getDropped(void)
+{
+  return logAsync.dropped;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Takes a token from the bucket of a call site
+
+  \param [in] level:      level of the log
+  \param [in] file:       source file of the call site
+  \param [in] line:       source line of the call site
+  \param [out] suppressed: how many logs of the call site were suppressed
+  since the last one let through
+
+  \return TRUE if the log can go through
+ */
+/*----------------------------------------------------------------------------*/
+static BOOLEAN take_rate_token(AZX_LOG_LEVEL_E level, const CHAR* file, int line,
+    UINT32* suppressed)
+{
+  UINT32 burst = logRate.burst[level] * TOKEN;
+  UINT32 slot = ((UINT32)(MEM_W)file ^ ((UINT32)line * 2654435761u)) % AZX_LOG_RATE_SITES;
+  UINT32 now = get_uptime();
+  RateSite* site = NULL;
+  BOOLEAN allowed = TRUE;
+  UINT32 i;
+
+  if(!__sync_bool_compare_and_swap(&logRate.busy, 0, 1))
+  {
+    return TRUE;
+  }
+
+  for(i = 0; i < RATE_PROBES; ++i)
+  {
+    RateSite* s = &logRate.sites[(slot + i) % AZX_LOG_RATE_SITES];
+    if(s->file == file && s->line == line)
+    {
+      site = s;
+      break;
+    }
+    if(!site || s->file == NULL)
+    {
+      site = s;
+    }
+  }
+
+  if(site->file != file || site->line != line)
+  {
+    /* New call site, or it takes over one that may have been quiet for a while */
+    site->file = file;
+    site->line = line;
+    site->tokens = burst;
+    site->refilled = now;
+    site->suppressed = 0;
+  }
+  else
+  {
+    UINT32 elapsed = now - site->refilled;
+    UINT32 refill = ((elapsed < 60000) ? elapsed : 60000) * logRate.per_minute[level];
+    site->refilled = now;
+    site->tokens = (site->tokens >= burst || refill > burst - site->tokens) ?
+        burst : site->tokens + refill;
+  }
+
+  if(site->tokens >= TOKEN)
+  {
+    site->tokens -= TOKEN;
+    *suppressed = site->suppressed;
+    site->suppressed = 0;
+  }
+  else
+  {
+    ++site->suppressed;
+    allowed = FALSE;
+  }
+
+  __sync_lock_release(&logRate.busy);
+  return allowed;
+}
+
+static INT32 dispatch_log(AZX_LOG_LEVEL_E level, const char* function, const char* file,
+    int line, const CHAR *fmt, va_list arg)
+{
+  INT32 sent;
+
+  if(logAsync.enabled)
+  {
+    return log_async(level, function, file, line, fmt, arg);
+  }
+
+  m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+  sent = write_log(level, get_uptime(), function, file, line,
+      get_current_task_name(task_name, sizeof(task_name)), fmt, arg);
+  m2mb_os_sem_put(log_cfg.CSSemHandle);
+  notify_rotation();
+  return sent;
+}
+
+static INT32 dispatch_log_fmt(AZX_LOG_LEVEL_E level, const char* function, const char* file,
+    int line, const CHAR *fmt, ...)
+{
+  INT32 sent;
+  va_list arg;
+
+  va_start(arg, fmt);
+  sent = dispatch_log(level, function, file, line, fmt, arg);
+  va_end(arg);
+  return sent;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Prints on the defined stream (UART or USB channel)
+ *
+  \param [in] level:    Logging level. see AZX_LOG_LEVEL_E enum
+  \param [in] function: source function name to add to the output if log is verbose
+  \param [in] file:     source file path to add to the output if log is verbose
+  \param [in] line:     source file line to add to the output if log is verbose
+  \param [in] fmt :     string format with parameters to print
+  \param [in] ... :     ...
+  \return the number of sent bytes.
+    0 if the log was rate limited, negative in case of error
+
+ */
+/*----------------------------------------------------------------------------*/
+INT32 azx_log_formatted(AZX_LOG_LEVEL_E level,
+    const char* function, const char* file, int line, const CHAR *fmt, ... )
+{
+  INT32  sent = 0;
+  UINT32 suppressed = 0;
+  va_list arg;
+
+  /* The level has been checked by the log macros */
+  if(!log_cfg.isInit)
+  {
+    return AZX_LOG_NOT_INIT;
+  }
+
+  if(level < LEVEL_SLOTS && logRate.burst[level] &&
+      !take_rate_token(level, file, line, &suppressed))
+  {
+    return 0;
+  }
+  if(suppressed)
+  {
+    dispatch_log_fmt(level, function, file, line, "=== %u logs from here suppressed\r\n",
+        suppressed);
+  }
+
+  va_start(arg, fmt);
+  sent = dispatch_log(level, function, file, line, fmt, arg);
+  va_end(arg);
+
+  return sent;
+}
+
+void azx_log_setRateLimit(AZX_LOG_LEVEL_E level, UINT16 burst, UINT16 per_minute)
+{
+  if(level >= LEVEL_SLOTS)
+  {
+    return;
+  }
+  /* Old buckets are refilled on the old rate, which is not worth the locking to avoid */
+  logRate.per_minute[level] = per_minute;
+  logRate.burst[level] = burst;
+}
+
+void azx_log_setCollapseRepeats(AZX_LOG_LEVEL_E level, BOOLEAN collapse)
+{
+  if(level >= LEVEL_SLOTS)
+  {
+    return;
+  }
+  logRepeat.collapse[level] = collapse;
+}
+
+static UINT32 get_file_size(const CHAR* filename)
+{
+  struct M2MB_STAT stat;
+  if(-1 == m2mb_fs_stat(filename, &stat))
+  {
+    /* Most likely the file doesn't exist */
+    return 0;
+  }
+  return stat.st_size;
+}
+
+static void flush_log_to_file(void)
+{
+  if(logFile.cache_idx == 0 || !logFile.fd)
+  {
+    return;
+  }
+  m2mb_fs_fwrite(logFile.cache, logFile.cache_idx, 1, logFile.fd);
+  m2mb_fs_fflush(logFile.fd);
+  logFile.cache_idx = 0;
+}
+
+static void cache_log(const CHAR* buffer, UINT32 size)
+{
+  if(MAX_FILE_LOG_CACHE - size < logFile.cache_idx)
+  {
+    flush_log_to_file();
+  }
+  if(logFile.cache_idx == 0)
+  {
+    logFile.cache_since = get_uptime();
+  }
+
+  memcpy(&logFile.cache[logFile.cache_idx], buffer, size);
+  logFile.cache_idx += size;
+  logFile.size += size;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Makes sure the current segment can take a log of the given size,
+  moving to the next segment in the rotation when it cannot
+
+  \param [in] size: the size of the log to be written
+
+  \return TRUE if logFile.fd can be written to
+ */
+/*----------------------------------------------------------------------------*/
+static BOOLEAN prepare_log_file(UINT32 size)
+{
+  static const CHAR limit_msg[] = "=== Log file size limit reached\r\n";
+  static const CHAR busy_msg[] =
+      "=== Previous segment overwritten, its last hand over is not processed yet\r\n";
+  struct M2MB_STAT stat;
+  BOOLEAN overwritten = FALSE;
+
+  /* A log larger than a whole segment still goes into an empty one */
+  if(logFile.size == 0 || logFile.size + size <= (logFile.max_size_kb << 10))
+  {
+    return TRUE;
+  }
+
+  /* Log limit reached, so we'll need to open the next segment in the rotation. Log in the file
+   * that this limit is reached first */
+  cache_log(limit_msg, sizeof(limit_msg) - 1);
+  flush_log_to_file();
+  m2mb_fs_fclose(logFile.fd);
+  logFile.fd = 0;
+
+  if(logFile.rotate_cb && logFile.segment < 32)
+  {
+    /* Hand the full segment over before the rotation gets back to it. The callback is called
+     * once the log lock is released, see notify_rotation() */
+    CHAR old_name[sizeof(logFile.current_name) + 4];
+    snprintf(old_name, sizeof(old_name), "%s.old", logFile.current_name);
+    if(0 == m2mb_fs_stat(old_name, &stat))
+    {
+      /* The callback has not processed the last hand over of this segment yet. It must not be
+       * replaced under it, so this one is overwritten by the rotation like without a callback. */
+      overwritten = TRUE;
+    }
+    else if(0 == m2mb_fs_rename(logFile.current_name, old_name))
+    {
+      __sync_fetch_and_or(&logFile.rotated, 1u << logFile.segment);
+    }
+  }
+
+  if(logFile.circular_chunks == 0)
+  {
+    return FALSE;
+  }
+
+  /* The original file is kept, the rotation is among the numbered segments */
+  if(!open_log_segment(logFile.segment % logFile.circular_chunks + 1, TRUE))
+  {
+    return FALSE;
+  }
+  if(overwritten)
+  {
+    /* Logging from here would take the log lock again, so the warning goes in the file */
+    cache_log(busy_msg, sizeof(busy_msg) - 1);
+  }
   return TRUE;
 }
 
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Writes a log to the file cache, flushing it when it holds
+  AZX_LOG_FILE_FLUSH_BYTES or its oldest log is AZX_LOG_FILE_FLUSH_MS old.
+  The caller must hold CSSemHandle.
+ */
+/*----------------------------------------------------------------------------*/
+static void file_log_or_cache(const CHAR* buffer, UINT32 size)
+{
+  if(size > MAX_FILE_LOG_CACHE)
+  {
+    size = MAX_FILE_LOG_CACHE;
+  }
+  if(!prepare_log_file(size))
+  {
+    return;
+  }
+
+  cache_log(buffer, size);
+
+  if(logFile.cache_idx >= AZX_LOG_FILE_FLUSH_BYTES ||
+      get_uptime() - logFile.cache_since >= AZX_LOG_FILE_FLUSH_MS)
+  {
+    flush_log_to_file();
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Flushes the file cache if its oldest log is AZX_LOG_FILE_FLUSH_MS old.
+  The caller must hold CSSemHandle.
+ */
+/*----------------------------------------------------------------------------*/
+static void flush_stale_file_cache(void)
+{
+  if(logFile.cache_idx > 0 && get_uptime() - logFile.cache_since >= AZX_LOG_FILE_FLUSH_MS)
+  {
+    flush_log_to_file();
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Opens a segment of the log file: 0 is the original file, 1 to
+  circular_chunks are the numbered ones.
+
+  \param [in] segment:  the segment to open
+  \param [in] truncate: whether to discard the old contents of the segment
+
+  \return TRUE if the segment was opened
+ */
+/*----------------------------------------------------------------------------*/
+static BOOLEAN open_log_segment(UINT32 segment, BOOLEAN truncate)
+{
+  if(segment == 0)
+  {
+    snprintf(logFile.current_name, sizeof(logFile.current_name), "%s", logFile.name);
+  }
+  else
+  {
+    snprintf(logFile.current_name, sizeof(logFile.current_name), "%s.%u", logFile.name, segment);
+  }
+
+  logFile.segment = segment;
+  logFile.size = truncate ? 0 : get_file_size(logFile.current_name);
+  logFile.fd = m2mb_fs_fopen(logFile.current_name, truncate ? "w" : "a");
+
+  return logFile.fd != 0;
+}
+
+BOOLEAN azx_log_send_to_file(const CHAR* filename, UINT32 circular_chunks,
+    AZX_LOG_LEVEL_E min_level, UINT32 max_size_kb)
+
+{
+  CHAR name[40];
+  struct M2MB_STAT stat;
+  UINT32 max_size = max_size_kb << 10;
+  UINT32 segment = 0;
+  UINT32 i;
+  BOOLEAN rotated = FALSE;
+
+  if(!filename)
+  {
+    return FALSE;
+  }
+
+  if(circular_chunks == 0 && get_file_size(filename) >= max_size)
+  {
+    return FALSE;
+  }
+
+  if(logFile.fd)
+  {
+    flush_log_to_file();
+    m2mb_fs_fclose(logFile.fd);
+    logFile.fd = 0;
+  }
+
+  /* Once the original file is full, the numbered segments are written in turn and a new one is
+   * emptied when opened, so the one in use is the first that is not full. A missing one was handed
+   * over to the rotation callback, which for the original file means it was full. This is the
+   * only time the file system is asked for sizes, after that they are tracked as logs are
+   * written. */
+  for(i = 1; i <= circular_chunks; ++i)
+  {
+    snprintf(name, sizeof(name), "%s.%u", filename, i);
+    if(0 == m2mb_fs_stat(name, &stat))
+    {
+      rotated = TRUE;
+      if(segment == 0 && stat.st_size < max_size)
+      {
+        segment = i;
+      }
+    }
+  }
+  if(0 == m2mb_fs_stat(filename, &stat) ? stat.st_size < max_size : !rotated)
+  {
+    segment = 0;
+  }
+  else if(segment == 0)
+  {
+    segment = circular_chunks + 1;
+  }
+
+  snprintf(logFile.name, sizeof(logFile.name), "%s", filename);
+  logFile.circular_chunks = circular_chunks;
+  logFile.min_level = min_level;
+  logFile.max_size_kb = max_size_kb;
+  logFile.cache_idx = 0;
+
+  if(segment > circular_chunks)
+  {
+    /* All full, most likely stopped right before a new segment was emptied */
+    return open_log_segment(1, TRUE);
+  }
+  return open_log_segment(segment, FALSE);
+}
+
 void azx_log_flush_to_file(void)
 {
+  wait_for_log_writer();
   m2mb_os_sem_get(log_cfg.CSSemHandle, M2MB_OS_WAIT_FOREVER );
+  write_repeats();
   flush_log_to_file();
   m2mb_os_sem_put(log_cfg.CSSemHandle);
 }
+
+void azx_log_setRotateCallback(AZX_LOG_ROTATE_CB cb)
+{
+  logFile.rotate_cb = cb;
+}
+
+/*----------------------------------------------------------------------------*/
+/*!
+  \brief Calls the rotation callback for the segments handed over while the
+  log lock was held. Must be called without holding CSSemHandle, so the
+  callback can log.
+ */
+/*----------------------------------------------------------------------------*/
+static void notify_rotation(void)
+{
+  CHAR name[sizeof(logFile.current_name) + 4];
+  UINT32 rotated;
+  UINT32 segment;
+  AZX_LOG_ROTATE_CB cb = logFile.rotate_cb;
+
+  if(!cb || logFile.rotated == 0)
+  {
+    return;
+  }
+
+  rotated = __sync_fetch_and_and(&logFile.rotated, 0);
+  for(segment = 0; rotated != 0; ++segment, rotated >>= 1)
+  {
+    if(rotated & 1)
+    {
+      if(segment == 0)
+      {
+        snprintf(name, sizeof(name), "%s.old", logFile.name);
+      }
+      else
+      {
+        snprintf(name, sizeof(name), "%s.%u.old", logFile.name, segment);
+      }
+      cb(name, segment);
+    }
+  }
+}
@@ -0,0 +1,338 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#define AZX_LOG_MODULE AZX_LOG_MODULE_POOL
+
+#include <string.h>
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+
+#include "app_cfg.h"
+#include "azx_log.h"
+
+#include "azx_pool.h"
+
+/* Blocks of the 16, 32, 64, 128, 256, 512, 1024 and 2048 byte classes */
+#ifndef AZX_POOL_CLASS_BLOCKS
+#define AZX_POOL_CLASS_BLOCKS 64, 64, 32, 32, 16, 8, 4, 2
+#endif
+
+#define MIN_BLOCK_SHIFT 4
+#define MAP_WORDS (AZX_POOL_MAX_CLASS_BLOCKS / 32)
+
+#define SLAB_BYTES_(b0, b1, b2, b3, b4, b5, b6, b7) \
+  ((b0) * 16 + (b1) * 32 + (b2) * 64 + (b3) * 128 + \
+   (b4) * 256 + (b5) * 512 + (b6) * 1024 + (b7) * 2048)
+#define SLAB_BYTES_X(...) SLAB_BYTES_(__VA_ARGS__)
+#define SLAB_BYTES SLAB_BYTES_X(AZX_POOL_CLASS_BLOCKS)
+
+typedef enum
+{
+  POOL_UNINIT = 0,
+  POOL_INITIALISING,
+  POOL_READY,
+  POOL_HEAP_ONLY
+} PoolState;
+
+/*
+ * The free blocks of a class are tracked with a bitmap (a set bit is a block in use), which can
+ * be updated with a single compare-and-swap and, unlike a linked free list, does not suffer from
+ * the ABA problem without locking.
+ */
+typedef struct
+{
+  UINT8* base;
+  UINT32 block_size;
+  UINT32 blocks;
+  volatile UINT32 used[MAP_WORDS];
+  volatile UINT32 in_use;
+  volatile UINT32 high_water;
+  volatile UINT32 allocs;
+  volatile UINT32 failures;
+} PoolClass;
+
+static const UINT16 classBlocks[AZX_POOL_CLASSES] = { AZX_POOL_CLASS_BLOCKS };
+
+static PoolClass classes[AZX_POOL_CLASSES];
+static UINT8* slabStart = NULL;
+static UINT8* slabEnd = NULL;
+static volatile UINT32 oversized = 0;
+static volatile UINT32 heapFailures = 0;
+static volatile UINT32 state = POOL_UNINIT;
+
+#ifdef AZX_POOL_STATIC_BACKING
+static UINT64 slabMemory[(SLAB_BYTES + sizeof(UINT64) - 1) / sizeof(UINT64)];
+#endif
+
+static void setup_classes(UINT8* memory)
+{
+  UINT32 i, b;
+  for(i = 0; i < AZX_POOL_CLASSES; ++i)
+  {
+    PoolClass* c = &classes[i];
+    c->base = memory;
+    c->block_size = 1 << (MIN_BLOCK_SHIFT + i);
+    c->blocks = classBlocks[i];
+    if(c->blocks > AZX_POOL_MAX_CLASS_BLOCKS)
+    {
+      AZX_LOG_ERROR("Pool class %u has too many blocks, using %u\r\n",
+          c->block_size, AZX_POOL_MAX_CLASS_BLOCKS);
+      c->blocks = AZX_POOL_MAX_CLASS_BLOCKS;
+    }
+    /* Blocks past the end of the class are marked as used, so they are never handed out */
+    for(b = 0; b < MAP_WORDS * 32; ++b)
+    {
+      if(b >= c->blocks)
+      {
+        c->used[b / 32] |= 1u << (b % 32);
+      }
+    }
+    memory += classBlocks[i] * c->block_size;
+  }
+}
+
+BOOLEAN azx_pool_init(void)
+{
+  UINT8* memory;
+
+  while(state == POOL_INITIALISING)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(1));
+  }
+  if(!__sync_bool_compare_and_swap(&state, POOL_UNINIT, POOL_INITIALISING))
+  {
+    return state == POOL_READY;
+  }
+
+#ifdef AZX_POOL_STATIC_BACKING
+  memory = (UINT8*)slabMemory;
+#else
+  memory = (UINT8*)m2mb_os_malloc(SLAB_BYTES);
+  if(!memory)
+  {
+    AZX_LOG_ERROR("Cannot allocate %u bytes for the pool, using the heap\r\n", SLAB_BYTES);
+    state = POOL_HEAP_ONLY;
+    return FALSE;
+  }
+#endif
+  setup_classes(memory);
+  slabStart = memory;
+  slabEnd = memory + SLAB_BYTES;
+  __sync_synchronize();
+  state = POOL_READY;
+  AZX_LOG_DEBUG("Pool of %u bytes ready\r\n", SLAB_BYTES);
+  return TRUE;
+}
+
+static INT32 get_class(UINT32 size)
+{
+  INT32 i;
+  for(i = 0; i < AZX_POOL_CLASSES; ++i)
+  {
+    if(size <= classes[i].block_size)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void* take_block(PoolClass* c)
+{
+  UINT32 w;
+  for(w = 0; w < MAP_WORDS; ++w)
+  {
+    UINT32 used = c->used[w];
+    while(used != 0xFFFFFFFF)
+    {
+      UINT32 bit = __builtin_ctz(~used);
+      if(__sync_bool_compare_and_swap(&c->used[w], used, used | (1u << bit)))
+      {
+        UINT32 in_use = __sync_add_and_fetch(&c->in_use, 1);
+        UINT32 high = c->high_water;
+        while(in_use > high && !__sync_bool_compare_and_swap(&c->high_water, high, in_use))
+        {
+          high = c->high_water;
+        }
+        __sync_fetch_and_add(&c->allocs, 1);
+        return c->base + (w * 32 + bit) * c->block_size;
+      }
+      used = c->used[w];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Heap allocations are preceded by their size, so they can be resized without reading past their
+ * end. The header is as large as the alignment the heap guarantees.
+ */
+typedef union
+{
+  UINT32 size;
+  UINT64 align;
+} HeapHeader;
+
+static void* heap_alloc(UINT32 size)
+{
+  HeapHeader* header;
+
+  if(size > (UINT32)~0 - sizeof(HeapHeader))
+  {
+    __sync_fetch_and_add(&heapFailures, 1);
+    return NULL;
+  }
+  header = (HeapHeader*)m2mb_os_malloc(sizeof(HeapHeader) + size);
+  if(!header)
+  {
+    __sync_fetch_and_add(&heapFailures, 1);
+    return NULL;
+  }
+  header->size = size;
+  return header + 1;
+}
+
+/* Returns the class owning the block, or NULL if it did not come from the pool */
+static PoolClass* find_owner(const void* ptr)
+{
+  UINT32 i;
+  const UINT8* p = (const UINT8*)ptr;
+  if(p < slabStart || p >= slabEnd)
+  {
+    return NULL;
+  }
+  for(i = AZX_POOL_CLASSES - 1; p < classes[i].base; --i)
+  {
+  }
+  return &classes[i];
+}
+
+void* azx_pool_malloc(UINT32 size)
+{
+  INT32 cls;
+  void* ptr;
+
+  if(state != POOL_READY && !azx_pool_init())
+  {
+    return heap_alloc(size);
+  }
+
+  cls = get_class(size);
+  if(cls < 0)
+  {
+    __sync_fetch_and_add(&oversized, 1);
+    return heap_alloc(size);
+  }
+
+  ptr = take_block(&classes[cls]);
+  if(!ptr)
+  {
+    __sync_fetch_and_add(&classes[cls].failures, 1);
+    return heap_alloc(size);
+  }
+  return ptr;
+}
+
+void* azx_pool_calloc(UINT32 size)
+{
+  void* ptr = azx_pool_malloc(size);
+  if(ptr)
+  {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+void* azx_pool_realloc(void* ptr, UINT32 size)
+{
+  PoolClass* owner;
+  void* new_ptr;
+  UINT32 old_size;
+
+  if(size == 0)
+  {
+    azx_pool_free(ptr);
+    return NULL;
+  }
+  if(!ptr)
+  {
+    return azx_pool_malloc(size);
+  }
+
+  owner = find_owner(ptr);
+  if(owner)
+  {
+    if(size <= owner->block_size)
+    {
+      return ptr;
+    }
+    old_size = owner->block_size;
+  }
+  else
+  {
+    old_size = ((HeapHeader*)ptr - 1)->size;
+  }
+
+  new_ptr = azx_pool_malloc(size);
+  if(new_ptr)
+  {
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  }
+  azx_pool_free(ptr);
+  return new_ptr;
+}
+
+M2MB_OS_RESULT_E azx_pool_free(void* ptr)
+{
+  PoolClass* c;
+  UINT32 idx;
+
+  if(!ptr)
+  {
+    return M2MB_OS_SUCCESS;
+  }
+
+  c = find_owner(ptr);
+  if(!c)
+  {
+    return m2mb_os_free((HeapHeader*)ptr - 1);
+  }
+
+  idx = ((UINT8*)ptr - c->base) / c->block_size;
+  __sync_fetch_and_sub(&c->in_use, 1);
+  __sync_fetch_and_and(&c->used[idx / 32], ~(1u << (idx % 32)));
+  return M2MB_OS_SUCCESS;
+}
+
+void azx_pool_getStats(AZX_POOL_STATS_T* stats)
+{
+  UINT32 i;
+  for(i = 0; i < AZX_POOL_CLASSES; ++i)
+  {
+    AZX_POOL_CLASS_STATS_T* s = &stats->classes[i];
+    s->block_size = 1 << (MIN_BLOCK_SHIFT + i);
+    s->blocks = classBlocks[i];
+    s->in_use = classes[i].in_use;
+    s->high_water = classes[i].high_water;
+    s->allocs = classes[i].allocs;
+    s->failures = classes[i].failures;
+  }
+  stats->oversized = oversized;
+  stats->heap_failures = heapFailures;
+}
+
+void azx_pool_logStats(void)
+{
+  UINT32 i;
+  AZX_POOL_STATS_T stats;
+
+  azx_pool_getStats(&stats);
+  for(i = 0; i < AZX_POOL_CLASSES; ++i)
+  {
+    AZX_POOL_CLASS_STATS_T* s = &stats.classes[i];
+    AZX_LOG_INFO("Pool %4u: %u/%u in use, high water %u, %u allocs, %u exhausted\r\n",
+        s->block_size, s->in_use, s->blocks, s->high_water, s->allocs, s->failures);
+  }
+  AZX_LOG_INFO("Pool: %u oversized, %u heap failures\r\n",
+      stats.oversized, stats.heap_failures);
+}
@@ -1,6 +1,8 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_TASKS
+
 #include <stdio.h>
 #include <string.h>
 
@@ -8,14 +10,90 @@
 #include "m2mb_os_types.h"
 #include "m2mb_os_api.h"
 #include "m2mb_os.h"
+#include "m2mb_os_mtx.h"
 
+#include "app_cfg.h"
 #include "azx_log.h"
 
 #include "azx_tasks.h"
 
 
+#ifndef AZX_TASKS_MSG_LEAK_MS
+#define AZX_TASKS_MSG_LEAK_MS 10000
+#endif
+
+#define POOL_ALIGN(x) (((x) + 7) & ~7u)
+
+typedef enum
+{
+  BUFFER_FREE = 0,
+  BUFFER_OWNED,   /* Allocated, the sender fills it */
+  BUFFER_QUEUED,  /* Sent, released when the callback returns */
+  BUFFER_KEPT     /* Kept by the callback */
+} PoolBufferState;
+
+/* What goes through the task queues */
+typedef struct
+{
+  AZX_TASKS_MESSAGE_T msg;
+  UINT32 sent_at;
+} TaskQueueMsg;
+
+/* A circular queue of messages of one lane */
+typedef struct
+{
+  TaskQueueMsg* msgs;
+  UINT8 size;
+  UINT8 head;
+  UINT8 count;
+} TaskLane;
+
+/*
+ * The messages of a task with lanes wait here, and the task queue only carries one wake-up for
+ * each of them. Whichever message a wake-up is for, the task takes the most urgent one.
+ */
+struct AZX_TASKS_LANES_S
+{
+  M2MB_OS_MTX_HANDLE lock;
+  TaskLane lane[AZX_TASKS_LANES];
+  INT32 coalesced[AZX_TASKS_MAX_COALESCED_TYPES];
+  UINT8 coalesced_count;
+};
+
+typedef enum
+{
+  PUSH_FAILED = 0,
+  PUSH_QUEUED,
+  PUSH_COALESCED
+} LanePushResult;
+
+/* Placed right before each payload */
+typedef struct
+{
+  UINT8 slot;
+  volatile UINT8 state;
+  UINT16 index;
+  UINT32 size;
+  UINT32 since;
+} PoolBufferHeader;
+
+struct AZX_TASKS_POOL_S
+{
+  UINT8* base;
+  UINT32 stride;
+  UINT32 payload_size;
+  UINT32 buffers;
+  /* A set bit is a buffer in use, so a buffer is taken with a single compare-and-swap */
+  volatile UINT32 used;
+  volatile UINT32 in_use;
+  volatile UINT32 high_water;
+  volatile UINT32 sent;
+  volatile UINT32 exhausted;
+};
+
 /* Global variables =============================================================================*/
 _AZX_TASKS_PARAMS m2mb_tasks;
+static FLOAT32 tickMs = 0;
 
 INT32 azx_tasks_init(void)
 {
@@ -27,9 +105,12 @@ INT32 azx_tasks_init(void)
     m2mb_tasks.task_slots[i].Task_Queue_H = M2MB_OS_Q_INVALID;
     m2mb_tasks.task_slots[i].Task_NameBuf[0] = '\0';
     m2mb_tasks.task_slots[i].SlotInUse = 0;
+    m2mb_tasks.task_slots[i].Msg_Pool = NULL;
+    m2mb_tasks.task_slots[i].Lanes = NULL;
   }
 
   m2mb_tasks.M2MMain_Handle = m2mb_os_taskGetId(); //store
+  tickMs = m2mb_os_getSysTickDuration_ms();
   m2mb_tasks.isInit = 1;
 
   ret = M2MB_OS_SUCCESS;
@@ -105,11 +186,115 @@ INT32 azx_tasks_getCurrentTaskId(void)
 }
 
 
-INT32 azx_tasks_sendMessageToTask( INT8 TaskProcID, INT32 type, INT32 param1, INT32 param2 )
+static UINT32 ticks_to_ms(UINT32 ticks)
+{
+  return (UINT32)(ticks * tickMs);
+}
+
+static UINT32 get_time_bucket(UINT32 ms)
+{
+  UINT32 bucket = (ms == 0) ? 0 : 32 - __builtin_clz(ms);
+  return (bucket < AZX_TASKS_TIME_BUCKETS) ? bucket : AZX_TASKS_TIME_BUCKETS - 1;
+}
+
+static BOOLEAN is_coalesced(AZX_TASKS_LANES_T* lanes, INT32 type)
+{
+  UINT32 i;
+  for(i = 0; i < lanes->coalesced_count; ++i)
+  {
+    if(lanes->coalesced[i] == type)
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static PoolBufferHeader* find_buffer_header(AZX_TASKS_POOL_T* pool, const void* payload);
+static void release_buffer(AZX_TASKS_POOL_T* pool, PoolBufferHeader* h);
+
+static LanePushResult push_to_lane(AZX_TASKS_SLOT_T* task, AZX_TASKS_LANE_E lane,
+    const TaskQueueMsg* msg)
+{
+  AZX_TASKS_LANES_T* lanes = task->Lanes;
+  TaskLane* l = &lanes->lane[lane];
+  PoolBufferHeader* replaced;
+  M2MB_OS_RESULT_E osRes;
+  UINT32 i;
+
+  m2mb_os_mtx_get(lanes->lock, M2MB_OS_WAIT_FOREVER);
+  if(is_coalesced(lanes, msg->msg.type))
+  {
+    for(i = 0; i < l->count; ++i)
+    {
+      TaskQueueMsg* queued = &l->msgs[(l->head + i) % l->size];
+      if(queued->msg.type == msg->msg.type)
+      {
+        /* The payload of the replaced message will never reach the callback, so it goes back to
+         * the pool here */
+        replaced = find_buffer_header(task->Msg_Pool, (void*)(MEM_W)queued->msg.param1);
+        if(replaced && replaced->state == BUFFER_QUEUED && queued->msg.param1 != msg->msg.param1)
+        {
+          release_buffer(task->Msg_Pool, replaced);
+        }
+        /* It keeps its place (and its send time) in the lane */
+        queued->msg = msg->msg;
+        m2mb_os_mtx_put(lanes->lock);
+        return PUSH_COALESCED;
+      }
+    }
+  }
+  if(l->count == l->size)
+  {
+    m2mb_os_mtx_put(lanes->lock);
+    AZX_LOG_ERROR("Lane %d of task %s is full\r\n", lane, task->Task_NameBuf);
+    return PUSH_FAILED;
+  }
+
+  l->msgs[(l->head + l->count) % l->size] = *msg;
+  ++l->count;
+  osRes = m2mb_os_q_tx(task->Task_Queue_H, (void*)msg, M2MB_OS_NO_WAIT, 0);
+  if(osRes != M2MB_OS_SUCCESS)
+  {
+    --l->count;
+    m2mb_os_mtx_put(lanes->lock);
+    AZX_LOG_ERROR("Cannot wake task %s up; error %d\r\n", task->Task_NameBuf, osRes);
+    return PUSH_FAILED;
+  }
+  m2mb_os_mtx_put(lanes->lock);
+  return PUSH_QUEUED;
+}
+
+static BOOLEAN pop_from_lanes(AZX_TASKS_LANES_T* lanes, TaskQueueMsg* msg)
 {
-  AZX_TASKS_MESSAGE_T tmpMsg;
+  UINT32 i;
+
+  m2mb_os_mtx_get(lanes->lock, M2MB_OS_WAIT_FOREVER);
+  for(i = 0; i < AZX_TASKS_LANES; ++i)
+  {
+    TaskLane* l = &lanes->lane[i];
+    if(l->count > 0)
+    {
+      *msg = l->msgs[l->head];
+      l->head = (l->head + 1) % l->size;
+      --l->count;
+      m2mb_os_mtx_put(lanes->lock);
+      return TRUE;
+    }
+  }
+  m2mb_os_mtx_put(lanes->lock);
+  return FALSE;
+}
+
+static INT32 send_message( INT8 TaskProcID, AZX_TASKS_LANE_E lane, INT32 type, INT32 param1,
+    INT32 param2 )
+{
+  TaskQueueMsg tmpMsg;
   M2MB_OS_RESULT_E osRes;
   M2MB_OS_Q_HANDLE Queue_H;
+  AZX_TASKS_SLOT_T* task;
+  LanePushResult pushed;
+  UINT32 queued, high;
 
   INT8 slot = TaskProcID - 1;
 
@@ -132,28 +317,132 @@ INT32 azx_tasks_sendMessageToTask( INT8 TaskProcID, INT32 type, INT32 param1, IN
     return AZX_TASKS_ID_NOT_DEFINED_ERR;
   }
 
-  Queue_H = m2mb_tasks.task_slots[slot].Task_Queue_H;
+  if ((UINT32)lane >= AZX_TASKS_LANES)
+  {
+    AZX_LOG_ERROR("lane %d not valid!\r\n", lane);
+    return AZX_TASKS_MSG_SEND_ERR;
+  }
 
+  task = &m2mb_tasks.task_slots[slot];
+  Queue_H = task->Task_Queue_H;
 
-  tmpMsg.type = type;
-  tmpMsg.param1 = param1;
-  tmpMsg.param2 = param2;
 
-  AZX_LOG_TRACE( "message ==> type=%d; par1=%d; par2=%d\r\n", tmpMsg.type, tmpMsg.param1, tmpMsg.param2 );
-  osRes = m2mb_os_q_tx( Queue_H, (void*)&tmpMsg, M2MB_OS_NO_WAIT, 0 );
+  tmpMsg.msg.type = type;
+  tmpMsg.msg.param1 = param1;
+  tmpMsg.msg.param2 = param2;
+  tmpMsg.sent_at = m2mb_os_getSysTicks();
 
-  if( osRes != M2MB_OS_SUCCESS )
+  AZX_LOG_TRACE( "message ==> type=%d; par1=%d; par2=%d\r\n", type, param1, param2 );
+  /* Counted before it is sent, so the task never sees the count go below 0 */
+  queued = __sync_add_and_fetch(&task->Queued, 1);
+  if(task->Lanes)
   {
-    AZX_LOG_ERROR( "Send message to Task %d failed; error %d\r\n", TaskProcID, osRes );
+    pushed = push_to_lane(task, lane, &tmpMsg);
+  }
+  else
+  {
+    osRes = m2mb_os_q_tx( Queue_H, (void*)&tmpMsg, M2MB_OS_NO_WAIT, 0 );
+    if( osRes != M2MB_OS_SUCCESS )
+    {
+      AZX_LOG_ERROR( "Send message to Task %d failed; error %d\r\n", TaskProcID, osRes );
+    }
+    pushed = (osRes == M2MB_OS_SUCCESS) ? PUSH_QUEUED : PUSH_FAILED;
+  }
+
+  if( pushed == PUSH_FAILED )
+  {
+    __sync_fetch_and_sub(&task->Queued, 1);
+    __sync_fetch_and_add(&task->Stats.send_failures, 1);
     return AZX_TASKS_MSG_SEND_ERR;  // failure
   }
+  else if( pushed == PUSH_COALESCED )
+  {
+    __sync_fetch_and_sub(&task->Queued, 1);
+    __sync_fetch_and_add(&task->Stats.coalesced, 1);
+    AZX_LOG_TRACE("Message coalesced.\r\n");
+    return AZX_TASKS_OK;
+  }
   else
   {
+    high = task->Stats.queue_high_water;
+    while(queued > high &&
+        !__sync_bool_compare_and_swap(&task->Stats.queue_high_water, high, queued))
+    {
+      high = task->Stats.queue_high_water;
+    }
     AZX_LOG_TRACE("Message sent.\r\n");
     return AZX_TASKS_OK;  // success
   }
 }
 
+INT32 azx_tasks_sendMessageToTask( INT8 TaskProcID, INT32 type, INT32 param1, INT32 param2 )
+{
+  return send_message(TaskProcID, AZX_TASKS_LANE_NORMAL, type, param1, param2);
+}
+
+INT32 azx_tasks_sendMessageToLane( INT8 TaskProcID, AZX_TASKS_LANE_E lane, INT32 type,
+    INT32 param1, INT32 param2 )
+{
+  return send_message(TaskProcID, lane, type, param1, param2);
+}
+
+
+static PoolBufferHeader* get_buffer_header(AZX_TASKS_POOL_T* pool, UINT32 index)
+{
+  return (PoolBufferHeader*)(pool->base + index * pool->stride);
+}
+
+/* Returns the header of a payload, or NULL if it is not a buffer of the pool */
+static PoolBufferHeader* find_buffer_header(AZX_TASKS_POOL_T* pool, const void* payload)
+{
+  const UINT8* p = (const UINT8*)payload - POOL_ALIGN(sizeof(PoolBufferHeader));
+  if(!pool || p < pool->base || p >= pool->base + pool->buffers * pool->stride ||
+      (p - pool->base) % pool->stride != 0)
+  {
+    return NULL;
+  }
+  return (PoolBufferHeader*)p;
+}
+
+/* Returns the header of a payload from any pool, or NULL */
+static PoolBufferHeader* find_payload_header(const void* payload)
+{
+  const PoolBufferHeader* h = (const PoolBufferHeader*)
+      ((const UINT8*)payload - POOL_ALIGN(sizeof(PoolBufferHeader)));
+  if(!payload || h->slot >= AZX_TASKS_MAX_TASKS)
+  {
+    return NULL;
+  }
+  return find_buffer_header(m2mb_tasks.task_slots[h->slot].Msg_Pool, payload);
+}
+
+static INT32 take_buffer(AZX_TASKS_POOL_T* pool)
+{
+  UINT32 used = pool->used;
+  while(used != 0xFFFFFFFF)
+  {
+    UINT32 bit = __builtin_ctz(~used);
+    if(__sync_bool_compare_and_swap(&pool->used, used, used | (1u << bit)))
+    {
+      UINT32 in_use = __sync_add_and_fetch(&pool->in_use, 1);
+      UINT32 high = pool->high_water;
+      while(in_use > high && !__sync_bool_compare_and_swap(&pool->high_water, high, in_use))
+      {
+        high = pool->high_water;
+      }
+      return bit;
+    }
+    used = pool->used;
+  }
+  return -1;
+}
+
+static void release_buffer(AZX_TASKS_POOL_T* pool, PoolBufferHeader* h)
+{
+  h->state = BUFFER_FREE;
+  __sync_fetch_and_sub(&pool->in_use, 1);
+  __sync_fetch_and_and(&pool->used, ~(1u << h->index));
+}
 
 /*
  *  Task --> EntryFn
@@ -161,7 +450,10 @@ INT32 azx_tasks_sendMessageToTask( INT8 TaskProcID, INT32 type, INT32 param1, IN
 void Task_EntryFn( void *arg )
 {
   M2MB_OS_TASK_HANDLE taskHandle = m2mb_os_taskGetId();
+  TaskQueueMsg rxMsg;
   AZX_TASKS_MESSAGE_T inPars;
+  AZX_TASKS_STATS_T* stats;
+  UINT32 started, ms;
 
   INT32 slot = (INT32)arg;
   MEM_W  task_name = 0;
@@ -173,6 +465,7 @@ void Task_EntryFn( void *arg )
   }
 
   AZX_LOG_TRACE("slot: %d\r\n", slot);
+  stats = &m2mb_tasks.task_slots[slot].Stats;
 
 
   m2mb_os_taskGetItem( taskHandle, M2MB_OS_TASK_SEL_CMD_NAME, &task_name, NULL );
@@ -181,10 +474,25 @@ void Task_EntryFn( void *arg )
 
   while( 1 )
   {
-     if(M2MB_OS_SUCCESS != m2mb_os_q_rx( m2mb_tasks.task_slots[slot].Task_Queue_H, (void*)&inPars, M2MB_OS_WAIT_FOREVER ))
+     if(M2MB_OS_SUCCESS != m2mb_os_q_rx( m2mb_tasks.task_slots[slot].Task_Queue_H, (void*)&rxMsg, M2MB_OS_WAIT_FOREVER ))
      {
        break;
      }
+     /* With lanes, what was received is only a wake-up */
+     if(m2mb_tasks.task_slots[slot].Lanes &&
+         !pop_from_lanes(m2mb_tasks.task_slots[slot].Lanes, &rxMsg))
+     {
+       continue;
+     }
+     inPars = rxMsg.msg;
+     __sync_fetch_and_sub(&m2mb_tasks.task_slots[slot].Queued, 1);
+     started = m2mb_os_getSysTicks();
+     ms = ticks_to_ms(started - rxMsg.sent_at);
+     ++stats->latency_ms[get_time_bucket(ms)];
+     if(ms > stats->latency_max_ms)
+     {
+       stats->latency_max_ms = ms;
+     }
 
      AZX_LOG_TRACE( "%s received a message: \r\n"
              "- type   = %d\r\n"
@@ -192,6 +500,26 @@ void Task_EntryFn( void *arg )
              "- param2 = %d\r\n\r\n",
              (char*) task_name, inPars.type, inPars.param1, inPars.param2 );
      m2mb_tasks.task_slots[slot].Task_UserCB( inPars.type, inPars.param1, inPars.param2 );
+
+     ms = ticks_to_ms(m2mb_os_getSysTicks() - started);
+     ++stats->exec_ms[get_time_bucket(ms)];
+     stats->exec_total_ms += ms;
+     if(ms > stats->exec_max_ms)
+     {
+       stats->exec_max_ms = ms;
+     }
+     ++stats->handled;
+
+     /* Payloads go back to the pool, unless the callback kept them */
+     if(m2mb_tasks.task_slots[slot].Msg_Pool)
+     {
+       PoolBufferHeader* h = find_buffer_header(m2mb_tasks.task_slots[slot].Msg_Pool,
+           (void*)(MEM_W)inPars.param1);
+       if(h && h->state == BUFFER_QUEUED)
+       {
+         release_buffer(m2mb_tasks.task_slots[slot].Msg_Pool, h);
+       }
+     }
    }
 
   AZX_LOG_TRACE("exiting entry function. \r\n");
@@ -239,7 +567,7 @@ INT32 azx_tasks_createTask( char *task_name, INT32 stack_size, INT32 priority, I
     return AZX_TASKS_MSG_Q_SIZE_ERR;
   }
 
-  queue_area_size = msg_q_size * BYTES_FOR_MSG(AZX_TASKS_MESSAGE_T);
+  queue_area_size = msg_q_size * BYTES_FOR_MSG(TaskQueueMsg);
 
   //input parameters are valid, now get a free slot.
   slot = find_free_task_slot();
@@ -264,6 +592,10 @@ INT32 azx_tasks_createTask( char *task_name, INT32 stack_size, INT32 priority, I
   AZX_LOG_TRACE("task_name_buf: %s\r\n", m2mb_tasks.task_slots[slot].Task_NameBuf);
 
   m2mb_tasks.task_slots[slot].Task_UserCB = cb;
+  m2mb_tasks.task_slots[slot].Queue_Size = msg_q_size;
+  m2mb_tasks.task_slots[slot].Lanes = NULL;
+  m2mb_tasks.task_slots[slot].Queued = 0;
+  memset(&m2mb_tasks.task_slots[slot].Stats, 0, sizeof(AZX_TASKS_STATS_T));
 
   AZX_LOG_TRACE( "Create task messages queue\r\n" );
   if ( m2mb_os_q_setAttrItem( &Task_Queue_Attr_H, 1,M2MB_OS_Q_SEL_CMD_CREATE_ATTR,NULL) != M2MB_OS_SUCCESS )
@@ -277,7 +609,7 @@ INT32 azx_tasks_createTask( char *task_name, INT32 stack_size, INT32 priority, I
     os_res = m2mb_os_q_setAttrItem( &Task_Queue_Attr_H,
         CMDS_ARGS
         (
-            M2MB_OS_Q_SEL_CMD_MSG_SIZE, WORD32_FOR_MSG(AZX_TASKS_MESSAGE_T),
+            M2MB_OS_Q_SEL_CMD_MSG_SIZE, WORD32_FOR_MSG(TaskQueueMsg),
             M2MB_OS_Q_SEL_CMD_QSIZE, queue_area_size
         ));
     if ( M2MB_OS_SUCCESS != os_res )
@@ -358,6 +690,69 @@ INT32 azx_tasks_createTask( char *task_name, INT32 stack_size, INT32 priority, I
 
 
 
+static BOOLEAN create_lanes_lock(AZX_TASKS_LANES_T* lanes)
+{
+  M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
+  UINT32 inheritVal = 1;
+
+  if(M2MB_OS_SUCCESS != m2mb_os_mtx_setAttrItem_(&mtxAttrHandle,
+      M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
+      M2MB_OS_MTX_SEL_CMD_NAME, "LanesMtx",
+      M2MB_OS_MTX_SEL_CMD_USRNAME, "LanesMtx",
+      M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal))
+  {
+    return FALSE;
+  }
+  return M2MB_OS_SUCCESS == m2mb_os_mtx_init(&lanes->lock, &mtxAttrHandle) && lanes->lock;
+}
+
+INT32 azx_tasks_createTaskWithLanes(CHAR *task_name, INT32 stack_size, INT32 priority,
+    const UINT8 lane_sizes[AZX_TASKS_LANES], USER_TASK_CB cb)
+{
+  AZX_TASKS_LANES_T* lanes;
+  TaskQueueMsg* msgs;
+  INT32 total = 0;
+  INT32 task_id;
+  UINT32 i;
+
+  for(i = 0; i < AZX_TASKS_LANES; ++i)
+  {
+    total += lane_sizes[i];
+  }
+
+  lanes = (AZX_TASKS_LANES_T*)m2mb_os_malloc(sizeof(AZX_TASKS_LANES_T) + total * sizeof(TaskQueueMsg));
+  if(!lanes)
+  {
+    AZX_LOG_ERROR("Cannot allocate the task lanes\r\n");
+    return AZX_TASKS_ALLOC_ERR;
+  }
+  memset(lanes, 0, sizeof(AZX_TASKS_LANES_T));
+  msgs = (TaskQueueMsg*)(lanes + 1);
+  for(i = 0; i < AZX_TASKS_LANES; ++i)
+  {
+    lanes->lane[i].msgs = msgs;
+    lanes->lane[i].size = lane_sizes[i];
+    msgs += lane_sizes[i];
+  }
+  if(!create_lanes_lock(lanes))
+  {
+    AZX_LOG_ERROR("Cannot create the task lanes lock\r\n");
+    m2mb_os_free(lanes);
+    return AZX_TASKS_ALLOC_ERR;
+  }
+
+  /* Nothing can be sent to the task before its id is returned, so the lanes are in place first */
+  task_id = azx_tasks_createTask(task_name, stack_size, priority, total, cb);
+  if(task_id <= 0)
+  {
+    m2mb_os_mtx_deinit(lanes->lock);
+    m2mb_os_free(lanes);
+    return task_id;
+  }
+  m2mb_tasks.task_slots[task_id - 1].Lanes = lanes;
+  return task_id;
+}
+
 INT32 azx_tasks_destroyTask(INT8 TaskProcID)
 {
   INT8 slot = TaskProcID - 1;
@@ -418,6 +813,28 @@ INT32 azx_tasks_destroyTask(INT8 TaskProcID)
     return res;
   }
 
+  if(m2mb_tasks.task_slots[slot].Msg_Pool)
+  {
+    AZX_TASKS_POOL_T* pool = m2mb_tasks.task_slots[slot].Msg_Pool;
+    UINT32 i;
+    for(i = 0; i < pool->buffers; ++i)
+    {
+      UINT8 state = get_buffer_header(pool, i)->state;
+      if(state == BUFFER_OWNED || state == BUFFER_KEPT)
+      {
+        AZX_LOG_WARN("Task %d destroyed while message %u is still in use\r\n", TaskProcID, i);
+      }
+    }
+    m2mb_tasks.task_slots[slot].Msg_Pool = NULL;
+    m2mb_os_free(pool);
+  }
+  if(m2mb_tasks.task_slots[slot].Lanes)
+  {
+    m2mb_os_mtx_deinit(m2mb_tasks.task_slots[slot].Lanes->lock);
+    m2mb_os_free(m2mb_tasks.task_slots[slot].Lanes);
+    m2mb_tasks.task_slots[slot].Lanes = NULL;
+  }
+
   m2mb_tasks.task_slots[slot].Task_H = M2MB_OS_TASK_INVALID;
   m2mb_tasks.task_slots[slot].Task_Queue_H = M2MB_OS_Q_INVALID;
   m2mb_tasks.task_slots[slot].SlotInUse = 0;
@@ -439,3 +856,294 @@ INT32 azx_tasks_getEnqueuedCount( INT8 task_id )
 
   return (INT32)out;
 }
+
+static INT32 check_task_id(INT8 task_id)
+{
+  INT8 slot = task_id - 1;
+
+  if (! m2mb_tasks.isInit)
+  {
+    AZX_LOG_ERROR("m2m task first init not performed yet\r\n");
+    return AZX_TASKS_NOTINIT_ERR;
+  }
+  if (slot < 0 || slot > AZX_TASKS_MAX_TASKS  -1 )
+  {
+    AZX_LOG_ERROR("task id %d not valid!\r\n", task_id);
+    return AZX_TASKS_INVALID_ID_ERR;
+  }
+  if(m2mb_tasks.task_slots[slot].SlotInUse == 0)
+  {
+    AZX_LOG_ERROR("task id %d not existing\r\n", task_id);
+    return AZX_TASKS_ID_NOT_DEFINED_ERR;
+  }
+  return AZX_TASKS_OK;
+}
+
+INT32 azx_tasks_getStats(INT8 task_id, AZX_TASKS_STATS_T* stats)
+{
+  AZX_TASKS_SLOT_T* task;
+  INT32 ret = check_task_id(task_id);
+
+  if(ret != AZX_TASKS_OK)
+  {
+    return ret;
+  }
+  task = &m2mb_tasks.task_slots[task_id - 1];
+  *stats = task->Stats;
+  stats->queued = task->Queued;
+  stats->queue_size = task->Queue_Size;
+  return AZX_TASKS_OK;
+}
+
+void azx_tasks_resetStats(INT8 task_id)
+{
+  if(check_task_id(task_id) == AZX_TASKS_OK)
+  {
+    memset(&m2mb_tasks.task_slots[task_id - 1].Stats, 0, sizeof(AZX_TASKS_STATS_T));
+  }
+}
+
+static void print_histogram(CHAR* out, UINT32 size, const UINT32* buckets)
+{
+  UINT32 i, len = 0;
+  for(i = 0; i < AZX_TASKS_TIME_BUCKETS && len < size; ++i)
+  {
+    if(i + 1 < AZX_TASKS_TIME_BUCKETS)
+    {
+      len += snprintf(out + len, size - len, " <%u:%u", 1u << i, buckets[i]);
+    }
+    else
+    {
+      len += snprintf(out + len, size - len, " >=%u:%u", 1u << (i - 1), buckets[i]);
+    }
+  }
+}
+
+void azx_tasks_logStats(void)
+{
+  AZX_TASKS_STATS_T stats;
+  CHAR histogram[AZX_TASKS_TIME_BUCKETS * 14];
+  INT32 i;
+
+  for(i = 1; i <= AZX_TASKS_MAX_TASKS; ++i)
+  {
+    if(m2mb_tasks.task_slots[i - 1].SlotInUse == 0 || azx_tasks_getStats(i, &stats) != AZX_TASKS_OK)
+    {
+      continue;
+    }
+    AZX_LOG_INFO("Task %d %s: %u handled, queue %u/%u (high water %u), %u send failures, "
+        "%u coalesced\r\n", i, m2mb_tasks.task_slots[i - 1].Task_NameBuf, stats.handled,
+        stats.queued, stats.queue_size, stats.queue_high_water, stats.send_failures,
+        stats.coalesced);
+    print_histogram(histogram, sizeof(histogram), stats.exec_ms);
+    AZX_LOG_INFO("  exec ms: max %u, total %u,%s\r\n", stats.exec_max_ms, stats.exec_total_ms,
+        histogram);
+    print_histogram(histogram, sizeof(histogram), stats.latency_ms);
+    AZX_LOG_INFO("  wait ms: max %u,%s\r\n", stats.latency_max_ms, histogram);
+  }
+}
+
+INT32 azx_tasks_createMessagePool(INT8 task_id, UINT32 payload_size, UINT32 buffers)
+{
+  AZX_TASKS_POOL_T* pool;
+  INT8 slot = task_id - 1;
+  UINT32 stride;
+  UINT32 i;
+  INT32 ret = check_task_id(task_id);
+
+  if(ret != AZX_TASKS_OK)
+  {
+    return ret;
+  }
+  if(buffers == 0 || buffers > AZX_TASKS_MAX_POOL_BUFFERS || m2mb_tasks.task_slots[slot].Msg_Pool)
+  {
+    AZX_LOG_ERROR("message pool size out of bounds\r\n");
+    return AZX_TASKS_MSG_Q_SIZE_ERR;
+  }
+
+  stride = POOL_ALIGN(sizeof(PoolBufferHeader)) + POOL_ALIGN(payload_size);
+  pool = (AZX_TASKS_POOL_T*)m2mb_os_malloc(POOL_ALIGN(sizeof(AZX_TASKS_POOL_T)) + buffers * stride);
+  if(!pool)
+  {
+    AZX_LOG_ERROR("Cannot allocate the message pool of task %d\r\n", task_id);
+    return AZX_TASKS_ALLOC_ERR;
+  }
+  memset(pool, 0, sizeof(AZX_TASKS_POOL_T));
+  pool->base = (UINT8*)pool + POOL_ALIGN(sizeof(AZX_TASKS_POOL_T));
+  pool->stride = stride;
+  pool->payload_size = payload_size;
+  pool->buffers = buffers;
+  /* Buffers past the end of the pool are marked as used, so they are never handed out */
+  pool->used = (buffers == 32) ? 0 : ~((1u << buffers) - 1);
+  for(i = 0; i < buffers; ++i)
+  {
+    PoolBufferHeader* h = get_buffer_header(pool, i);
+    h->slot = slot;
+    h->state = BUFFER_FREE;
+    h->index = i;
+  }
+  m2mb_tasks.task_slots[slot].Msg_Pool = pool;
+  return AZX_TASKS_OK;
+}
+
+void* azx_tasks_allocMessage(INT8 task_id, UINT32 size)
+{
+  AZX_TASKS_POOL_T* pool;
+  PoolBufferHeader* h;
+  INT32 index;
+
+  if(task_id < 1 || task_id > AZX_TASKS_MAX_TASKS)
+  {
+    return NULL;
+  }
+  pool = m2mb_tasks.task_slots[task_id - 1].Msg_Pool;
+  if(!pool || size > pool->payload_size)
+  {
+    return NULL;
+  }
+
+  index = take_buffer(pool);
+  if(index < 0)
+  {
+    __sync_fetch_and_add(&pool->exhausted, 1);
+    return NULL;
+  }
+
+  h = get_buffer_header(pool, index);
+  h->size = size;
+  h->since = m2mb_os_getSysTicks();
+  h->state = BUFFER_OWNED;
+  return (UINT8*)h + POOL_ALIGN(sizeof(PoolBufferHeader));
+}
+
+INT32 azx_tasks_sendPayloadToTask(INT8 task_id, INT32 type, void* payload)
+{
+  AZX_TASKS_POOL_T* pool;
+  PoolBufferHeader* h;
+  INT32 ret;
+
+  h = find_payload_header(payload);
+  if(!h || h->state != BUFFER_OWNED)
+  {
+    AZX_LOG_ERROR("payload %p does not belong to a message pool\r\n", payload);
+    return AZX_TASKS_POOL_ERR;
+  }
+  pool = m2mb_tasks.task_slots[h->slot].Msg_Pool;
+  if(h->slot != task_id - 1)
+  {
+    AZX_LOG_ERROR("payload %p does not belong to task %d\r\n", payload, task_id);
+    azx_tasks_freeMessage(payload);
+    return AZX_TASKS_POOL_ERR;
+  }
+
+  h->state = BUFFER_QUEUED;
+  ret = azx_tasks_sendMessageToTask(task_id, type, (INT32)(MEM_W)payload, (INT32)h->size);
+  if(ret != AZX_TASKS_OK)
+  {
+    release_buffer(pool, h);
+    return ret;
+  }
+  __sync_fetch_and_add(&pool->sent, 1);
+  return AZX_TASKS_OK;
+}
+
+void azx_tasks_keepMessage(void* payload)
+{
+  PoolBufferHeader* h = find_payload_header(payload);
+  if(h && h->state == BUFFER_QUEUED)
+  {
+    h->since = m2mb_os_getSysTicks();
+    h->state = BUFFER_KEPT;
+  }
+}
+
+void azx_tasks_freeMessage(void* payload)
+{
+  PoolBufferHeader* h = find_payload_header(payload);
+  if(!h || (h->state != BUFFER_OWNED && h->state != BUFFER_KEPT))
+  {
+    if(payload)
+    {
+      AZX_LOG_ERROR("payload %p cannot be freed\r\n", payload);
+    }
+    return;
+  }
+  release_buffer(m2mb_tasks.task_slots[h->slot].Msg_Pool, h);
+}
+
+INT32 azx_tasks_getMessagePoolStats(INT8 task_id, AZX_TASKS_POOL_STATS_T* stats)
+{
+  AZX_TASKS_POOL_T* pool;
+  UINT32 now = m2mb_os_getSysTicks();
+  UINT32 i;
+
+  if(task_id < 1 || task_id > AZX_TASKS_MAX_TASKS ||
+      !(pool = m2mb_tasks.task_slots[task_id - 1].Msg_Pool))
+  {
+    return AZX_TASKS_POOL_ERR;
+  }
+
+  stats->payload_size = pool->payload_size;
+  stats->buffers = pool->buffers;
+  stats->in_use = pool->in_use;
+  stats->high_water = pool->high_water;
+  stats->sent = pool->sent;
+  stats->exhausted = pool->exhausted;
+  stats->leaked = 0;
+  /* Queued buffers are not counted, the task may just be slow to get to them */
+  for(i = 0; i < pool->buffers; ++i)
+  {
+    PoolBufferHeader* h = get_buffer_header(pool, i);
+    UINT8 state = h->state;
+    if((state == BUFFER_OWNED || state == BUFFER_KEPT) &&
+        now - h->since >= M2MB_OS_MS2TICKS(AZX_TASKS_MSG_LEAK_MS))
+    {
+      ++stats->leaked;
+    }
+  }
+  return AZX_TASKS_OK;
+}
+
+INT32 azx_tasks_setCoalescing( INT8 task_id, INT32 type, BOOLEAN coalesce )
+{
+  AZX_TASKS_LANES_T* lanes;
+  INT32 ret = check_task_id(task_id);
+  UINT32 i;
+
+  if(ret != AZX_TASKS_OK)
+  {
+    return ret;
+  }
+  lanes = m2mb_tasks.task_slots[task_id - 1].Lanes;
+  if(!lanes)
+  {
+    return AZX_TASKS_NO_LANES_ERR;
+  }
+
+  ret = AZX_TASKS_OK;
+  m2mb_os_mtx_get(lanes->lock, M2MB_OS_WAIT_FOREVER);
+  if(coalesce && !is_coalesced(lanes, type))
+  {
+    if(lanes->coalesced_count < AZX_TASKS_MAX_COALESCED_TYPES)
+    {
+      lanes->coalesced[lanes->coalesced_count++] = type;
+    }
+    else
+    {
+      ret = AZX_TASKS_NO_LANES_ERR;
+    }
+  }
+  else if(!coalesce)
+  {
+    for(i = 0; i < lanes->coalesced_count; ++i)
+    {
+      if(lanes->coalesced[i] == type)
+      {
+        lanes->coalesced[i] = lanes->coalesced[--lanes->coalesced_count];
+        break;
+      }
+    }
+  }
+  m2mb_os_mtx_put(lanes->lock);
+  return ret;
+}
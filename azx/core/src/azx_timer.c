@@ -1,42 +1,139 @@
 /*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
 /*    See LICENSE file in the project root for full license information.     */
 
+#define AZX_LOG_MODULE AZX_LOG_MODULE_TIMER
+
 #include "m2mb_types.h"
+#include "m2mb_os_types.h"
+#include "m2mb_os_api.h"
+#include "m2mb_os_mtx.h"
 #include "m2mb_hwTmr.h"
+
+#include "app_cfg.h"
 #include "azx_log.h"
 #include "azx_tasks.h"
 #include "azx_utils.h"
 
 #include "azx_timer.h"
 
-typedef struct {
+#ifndef AZX_TIMER_MAX_TIMERS
+#define AZX_TIMER_MAX_TIMERS 64
+#endif
+
+#ifndef AZX_TIMER_TICK_MS
+#define AZX_TIMER_TICK_MS 10
+#endif
+
+/*
+ * The timers are kept in a hierarchical timing wheel: the root level has a slot
+ * for each of the next 256 ticks, and each slot of the upper levels holds the
+ * timers expiring during a whole turn of the level below. When the root level
+ * wraps, the current slot of the level above is spread over the levels below
+ * it (cascaded). With 10 ms ticks the wheel spans about 7.7 days, timers that
+ * are longer than that are cascaded again until they are due.
+ */
+#define ROOT_BITS 8
+#define LEVEL_BITS 6
+#define LEVELS 3
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(level) (ROOT_BITS + (level) * LEVEL_BITS)
+#define MAX_DELTA ((1u << LEVEL_SHIFT(LEVELS)) - 1)
+
+/* IDs are the index of the timer (plus one) in the low bits and a generation
+ * in the high ones, so the ID of a deleted timer does not match its reuse */
+#define ID_INDEX_BITS 16
+#define ID_INDEX_MASK ((1 << ID_INDEX_BITS) - 1)
+#define ID_GENERATION_MASK 0x7FFF
+
+#if AZX_TIMER_MAX_TIMERS > ID_INDEX_MASK
+#error "AZX_TIMER_MAX_TIMERS is too large"
+#endif
+
+enum
+{
+  TIMER_TICK = 1
+};
+
+typedef enum
+{
+  TIMER_FREE = 0,
+  TIMER_IDLE,
+  TIMER_RUNNING,
+  TIMER_FIRING
+} TimerState;
+
+typedef enum
+{
+  WHEEL_UNINIT = 0,
+  WHEEL_PREPARING,
+  WHEEL_READY
+} WheelState;
+
+typedef struct Timer_s {
   INT32 id;
   INT32 task_id;
   INT32 type;
-  M2MB_HWTMR_HANDLE hnd;
   UINT32 duration_ms;
   azx_expiration_cb cb;
   void* ctx;
+  UINT32 expires;
+  UINT16 generation;
+  UINT8 state;
+  struct Timer_s** list;
+  struct Timer_s* prev;
+  struct Timer_s* next;
 } Timer;
 
-#define MAX_TIMERS 10
-
-static Timer allTimers[MAX_TIMERS] = {0};
+static Timer allTimers[AZX_TIMER_MAX_TIMERS];
+static Timer* freeTimers = NULL;
+
+static Timer* rootWheel[ROOT_SIZE];
+static Timer* levelWheels[LEVELS][LEVEL_SIZE];
+/* Expired, waiting to be notified by the timer task */
+static Timer* firedTimers = NULL;
+static UINT32 runningTimers = 0;
+/* The next tick of the wheel to be processed */
+static UINT32 wheelTick = 0;
+
+static UINT32 clockTick = 0;
+static UINT32 clockSysTicks = 0;
+static UINT32 sysTicksPerTick = 1;
+static FLOAT32 tickMs = AZX_TIMER_TICK_MS;
+
+static volatile UINT32 wheelState = WHEEL_UNINIT;
+static M2MB_OS_MTX_HANDLE wheelLock = 0;
+static M2MB_HWTMR_HANDLE hwTimer = 0;
+static BOOLEAN hwTimerArmed = FALSE;
+static UINT32 hwTimerTick = 0;
+static volatile UINT32 tickPending = 0;
 
 static INT32 timerTaskId = -1;
 
 
+static void list_add(Timer** list, Timer* tim);
+static void list_remove(Timer* tim);
+static void wheel_add(Timer* tim);
+static BOOLEAN cascade(UINT32 level);
+static void run_tick(void);
+static UINT32 update_clock(void);
+static UINT32 ms_to_ticks(UINT32 ms);
+static UINT32 next_cascade_tick(void);
+static void arm_hw_timer(UINT32 now, UINT32 tick);
+static void arm_for_next_tick(UINT32 now);
+static void process_ticks(void);
+
 static Timer* get_next_available(void);
-static BOOLEAN are_timers_unused(void);
-static void close_timer(Timer* tim);
-static BOOLEAN is_timer_running(Timer* tim);
-static Timer* do_init(Timer* tim, UINT32 duration_ms);
-static void do_deinit(Timer* tim);
 static Timer* get_timer(AZX_TIMER_ID id);
+static void do_deinit(Timer* tim);
 
-static INT32 timer_task(INT32 unused_type, INT32 timer_id, INT32 unused_param);
+static INT32 timer_task(INT32 type, INT32 param1, INT32 param2);
 static BOOLEAN create_internal_task_if_needed(void);
-static BOOLEAN destroy_internal_task_if_not_needed();
+static BOOLEAN create_wheel_lock(void);
+static BOOLEAN create_hw_timer(void);
+static BOOLEAN prepare_wheel(void);
 
 static void do_start(Timer* tim, UINT32 duration_ms, BOOLEAN restart);
 static void do_stop(Timer* tim);
@@ -44,182 +141,338 @@ static void do_stop(Timer* tim);
 static UINT32 time_now(void);
 
 
-static Timer* get_next_available(void)
+static void list_add(Timer** list, Timer* tim)
 {
-  UINT32 i = 0;
-  for(i = 0; i < MAX_TIMERS; ++i)
+  tim->list = list;
+  tim->prev = NULL;
+  tim->next = *list;
+  if(*list)
   {
-    if(allTimers[i].id == NO_AZX_TIMER_ID)
-    {
-      allTimers[i].id = i+1;
-      return &allTimers[i];
-    }
+    (*list)->prev = tim;
   }
-  return 0;
+  *list = tim;
 }
 
-static BOOLEAN are_timers_unused(void)
+static void list_remove(Timer* tim)
 {
-  UINT32 i = 0;
-  for(i = 0; i < MAX_TIMERS; ++i)
+  if(tim->prev)
   {
-    if(allTimers[i].id != NO_AZX_TIMER_ID)
-    {
-      return FALSE;
-    }
+    tim->prev->next = tim->next;
   }
-  return TRUE;
+  else
+  {
+    *tim->list = tim->next;
+  }
+  if(tim->next)
+  {
+    tim->next->prev = tim->prev;
+  }
+  tim->list = NULL;
+  tim->prev = NULL;
+  tim->next = NULL;
 }
 
-static void timer_cb(M2MB_HWTMR_HANDLE handle, void *arg)
+static void wheel_add(Timer* tim)
 {
-  Timer* tim = (Timer*)arg;
-  if(!arg)
+  UINT32 delta = tim->expires - wheelTick;
+  UINT32 at = tim->expires;
+  UINT32 level;
+
+  if((INT32)delta < 0)
   {
-    AZX_LOG_WARN("NULL timer info in callback\r\n");
+    /* Already due, on the next tick processed */
+    list_add(&rootWheel[wheelTick & ROOT_MASK], tim);
     return;
   }
-  AZX_LOG_TRACE("Timer %d expired\r\n", tim->id);
-  if(tim->hnd != handle)
+  if(delta < ROOT_SIZE)
   {
-    AZX_LOG_WARN("Timer handle %p different from callback handle %p\r\n", tim->hnd, handle);
+    list_add(&rootWheel[at & ROOT_MASK], tim);
     return;
   }
-  if(tim->id == 0 || tim->id > MAX_TIMERS || &allTimers[tim->id-1] != tim)
+  if(delta > MAX_DELTA)
   {
-    AZX_LOG_WARN("Timer ID %d doesn't match timer structure in callback\n", tim->id);
-    return;
+    at = wheelTick + MAX_DELTA;
+  }
+  for(level = 0; level < LEVELS - 1; ++level)
+  {
+    if(delta < (1u << LEVEL_SHIFT(level + 1)))
+    {
+      break;
+    }
   }
-  AZX_LOG_TRACE("Sending message to task %d\r\n", tim->task_id);
-  azx_tasks_sendMessageToTask( tim->task_id, tim->type, tim->id, 0 );
+  list_add(&levelWheels[level][(at >> LEVEL_SHIFT(level)) & LEVEL_MASK], tim);
 }
 
-static void close_timer(Timer* tim)
+/* Moves the timers of the current slot of a level to the levels below. Returns TRUE if
+ * the level wrapped as well, so the level above has to be cascaded too. */
+static BOOLEAN cascade(UINT32 level)
 {
-  if(tim)
+  UINT32 index = (wheelTick >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+  Timer* tim = levelWheels[level][index];
+  Timer* next;
+
+  levelWheels[level][index] = NULL;
+  while(tim)
   {
-    if(tim->hnd)
-    {
-      m2mb_hwTmr_deinit(tim->hnd);
-      tim->hnd = 0;
-    }
-    tim->id = NO_AZX_TIMER_ID;
+    next = tim->next;
+    wheel_add(tim);
+    tim = next;
   }
+  return index == 0;
 }
 
-static BOOLEAN is_timer_running(Timer* tim)
+static void run_tick(void)
 {
-  UINT32 state = 0xDEADBEEF;
-  M2MB_HWTMR_RESULT_E res;
+  UINT32 index = wheelTick & ROOT_MASK;
+  UINT32 level;
+  Timer* tim;
 
-  if(!tim || !tim->hnd)
+  if(index == 0)
   {
-    return FALSE;
+    for(level = 0; level < LEVELS && cascade(level); ++level)
+    {
+    }
   }
 
-  res = m2mb_hwTmr_getItem( tim->hnd, M2MB_HWTMR_SEL_CMD_STATE, &state, NULL );
-  if( res != M2MB_HWTMR_SUCCESS )
+  while(NULL != (tim = rootWheel[index]))
   {
-    AZX_LOG_WARN("Unable to read the state of timer %d\r\n", tim->id);
-    return FALSE;
+    list_remove(tim);
+    if((INT32)(tim->expires - wheelTick) > 0)
+    {
+      /* Longer than the wheel spans, not due yet */
+      wheel_add(tim);
+      continue;
+    }
+    tim->state = TIMER_FIRING;
+    --runningTimers;
+    list_add(&firedTimers, tim);
   }
-  if( state != M2MB_HWTMR_STATE_RUN  )
+  ++wheelTick;
+}
+
+/* The wheel clock counts whole ticks from the system ticks elapsed, so it does not
+ * drift and it is not affected by the system ticks wrapping around */
+static UINT32 update_clock(void)
+{
+  UINT32 ticks = (m2mb_os_getSysTicks() - clockSysTicks) / sysTicksPerTick;
+  clockSysTicks += ticks * sysTicksPerTick;
+  clockTick += ticks;
+  return clockTick;
+}
+
+static UINT32 ms_to_ticks(UINT32 ms)
+{
+  UINT32 ticks = (UINT32)(ms / tickMs);
+  if(ticks * tickMs < ms)
   {
-    return FALSE;
+    ++ticks;
   }
-  return TRUE;
+  return ticks;
 }
 
-static Timer* do_init(Timer* tim, UINT32 duration_ms)
+/* The next tick processed at the start of a root level turn, which may be the next one */
+static UINT32 next_cascade_tick(void)
+{
+  return (wheelTick + ROOT_MASK) & ~(UINT32)ROOT_MASK;
+}
+
+/* Makes the hardware timer fire once the clock reaches the tick, unless it is
+ * already going to fire before that */
+static void arm_hw_timer(UINT32 now, UINT32 tick)
 {
   M2MB_HWTMR_RESULT_E res;
-  M2MB_HWTMR_ATTR_HANDLE attr;
+  UINT32 ticks;
+  UINT32 timeDuration;
 
-  res = m2mb_hwTmr_setAttrItem(&attr, 1, M2MB_HWTMR_SEL_CMD_CREATE_ATTR, NULL);
+  if(hwTimerArmed && (INT32)(hwTimerTick - tick) <= 0)
+  {
+    return;
+  }
+  ticks = ((INT32)(tick - now) > 0) ? tick - now : 1;
+  timeDuration = M2MB_HWTMR_TIME_MS((UINT32)(ticks * tickMs));
+
+  m2mb_hwTmr_stop(hwTimer);
+  res = m2mb_hwTmr_setItem(hwTimer, M2MB_HWTMR_SEL_CMD_TIME_DURATION, (void*)timeDuration);
+  if(res == M2MB_HWTMR_SUCCESS)
+  {
+    res = m2mb_hwTmr_start(hwTimer);
+  }
   if(res != M2MB_HWTMR_SUCCESS)
   {
-    AZX_LOG_ERROR("Failed to init hwTmr attributes. Error %d\r\n", res);
-    goto err;
+    AZX_LOG_ERROR("Failed to start the wheel timer. Error %d\r\n", res);
+    hwTimerArmed = FALSE;
+    return;
   }
+  hwTimerArmed = TRUE;
+  hwTimerTick = tick;
+}
 
-  tim->duration_ms = (duration_ms > 0 ? duration_ms : 1000);
-  res = m2mb_hwTmr_setAttrItem( &attr,
-      CMDS_ARGS(
-        M2MB_HWTMR_SEL_CMD_CB_FUNC, &timer_cb,
-        M2MB_HWTMR_SEL_CMD_ARG_CB, tim,
-        M2MB_HWTMR_SEL_CMD_TIME_DURATION, M2MB_HWTMR_TIME_MS(tim->duration_ms),
-        M2MB_HWTMR_SEL_CMD_PERIODIC, M2MB_HWTMR_ONESHOT_TMR,
-        M2MB_HWTMR_SEL_CMD_AUTOSTART, M2MB_HWTMR_NOT_START
-        )
-      );
-  if( res != M2MB_HWTMR_SUCCESS )
+/* Sleeps until the next tick that has timers in the root level. If it has none, until
+ * it wraps, when the upper levels are cascaded. */
+static void arm_for_next_tick(UINT32 now)
+{
+  UINT32 tick = wheelTick;
+  UINT32 wrap = next_cascade_tick();
+
+  while(tick != wrap && !rootWheel[tick & ROOT_MASK])
   {
-    AZX_LOG_ERROR("Failed to init hwTmr attributes. Error %d\r\n", res);
-    goto err;
+    ++tick;
   }
+  arm_hw_timer(now, tick);
+}
 
-  res = m2mb_hwTmr_init(&tim->hnd, &attr);
+static void process_ticks(void)
+{
+  UINT32 now;
+  Timer* tim;
+  AZX_TIMER_ID id;
+  INT32 task_id;
+  INT32 type;
+  azx_expiration_cb cb;
+  void* ctx;
 
-  if( res != M2MB_HWTMR_SUCCESS )
+  tickPending = 0;
+  m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
+  hwTimerArmed = FALSE;
+  for(;;)
   {
-    AZX_LOG_ERROR("Failed to init hwTmr. Error %d\r\n", res);
-    m2mb_hwTmr_setAttrItem( &attr, 1, M2MB_HWTMR_SEL_CMD_DEL_ATTR, NULL );
-    goto err;
+    now = update_clock();
+    while(!firedTimers && runningTimers > 0 && (INT32)(now - wheelTick) >= 0)
+    {
+      run_tick();
+    }
+    if(!firedTimers)
+    {
+      break;
+    }
+
+    /* Notified one at a time without the lock, so a callback can start and stop timers,
+     * even the ones that are still waiting to be notified */
+    tim = firedTimers;
+    list_remove(tim);
+    tim->state = TIMER_IDLE;
+    id = tim->id;
+    task_id = tim->task_id;
+    type = tim->type;
+    cb = tim->cb;
+    ctx = tim->ctx;
+    m2mb_os_mtx_put(wheelLock);
+
+    AZX_LOG_TRACE("Timer %d expired\r\n", id);
+    if(cb)
+    {
+      cb(ctx, id);
+    }
+    else if(AZX_TASKS_OK != azx_tasks_sendMessageToTask(task_id, type, id, 0))
+    {
+      AZX_LOG_WARN("Cannot notify task %d that timer %d expired\r\n", task_id, id);
+    }
+
+    m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
   }
 
-  if(is_timer_running(tim))
+  if(runningTimers > 0)
   {
-    AZX_LOG_TRACE("Timer is initialized in running mode\r\n");
+    arm_for_next_tick(now);
   }
   else
   {
-    AZX_LOG_TRACE("Timer is initialized in idle mode\r\n");
+    m2mb_hwTmr_stop(hwTimer);
   }
+  m2mb_os_mtx_put(wheelLock);
+}
 
-  return tim;
+static void hw_timer_cb(M2MB_HWTMR_HANDLE handle, void *arg)
+{
+  (void)handle;
+  (void)arg;
+  /* One tick message at a time, the timer task catches up with the clock anyway */
+  if(__sync_bool_compare_and_swap(&tickPending, 0, 1) &&
+      AZX_TASKS_OK != azx_tasks_sendMessageToTask(timerTaskId, TIMER_TICK, 0, 0))
+  {
+    tickPending = 0;
+  }
+}
 
-err:
-  close_timer(tim);
-  return 0;
+static Timer* get_next_available(void)
+{
+  Timer* tim = freeTimers;
+  if(tim)
+  {
+    freeTimers = tim->next;
+    tim->next = NULL;
+    tim->id = (INT32)(((tim->generation & ID_GENERATION_MASK) << ID_INDEX_BITS) |
+        (tim - allTimers + 1));
+    tim->state = TIMER_IDLE;
+  }
+  return tim;
 }
 
-static void do_deinit(Timer* tim)
+static Timer* get_timer(AZX_TIMER_ID id)
 {
-  if(is_timer_running(tim))
+  Timer* tim;
+  UINT32 index = (UINT32)id & ID_INDEX_MASK;
+  if(id <= 0 || index == 0 || index > AZX_TIMER_MAX_TIMERS)
   {
-    AZX_LOG_TRACE("Stopping timer before deinit\r\n");
-    do_stop(tim);
+    AZX_LOG_WARN("Timer ID %d out of bounds\r\n", id);
+    return 0;
   }
 
-  close_timer(tim);
-  return;
+  tim = &allTimers[index-1];
+
+  if(tim->id != id)
+  {
+    AZX_LOG_WARN("Timer ID %d not matching %d\r\n", id, tim->id);
+    return 0;
+  }
+
+  return tim;
+}
+
+static void do_deinit(Timer* tim)
+{
+  do_stop(tim);
+
+  m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
+  tim->id = NO_AZX_TIMER_ID;
+  tim->state = TIMER_FREE;
+  tim->cb = NULL;
+  tim->ctx = NULL;
+  ++tim->generation;
+  tim->next = freeTimers;
+  freeTimers = tim;
+  m2mb_os_mtx_put(wheelLock);
 }
 
 
 AZX_TIMER_ID azx_timer_init(INT32 task_id, INT32 type, UINT32 duration_ms)
 {
-  Timer* tim = get_next_available();
-  if(!tim)
+  Timer* tim;
+
+  if(!prepare_wheel())
   {
-    AZX_LOG_DEBUG("Unable to add a new timer, no more space\r\n");
-    goto err;
+    AZX_LOG_DEBUG("Unable to initialise a new timer\r\n");
+    return NO_AZX_TIMER_ID;
+  }
+
+  m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
+  tim = get_next_available();
+  if(tim)
+  {
+    tim->task_id = task_id;
+    tim->type = type;
+    tim->duration_ms = (duration_ms > 0 ? duration_ms : 1000);
   }
+  m2mb_os_mtx_put(wheelLock);
 
-  tim = do_init(tim, duration_ms);
   if(!tim)
   {
-    AZX_LOG_DEBUG("Unable to initialise a new timer\r\n");
-    goto err;
+    AZX_LOG_DEBUG("Unable to add a new timer, no more space\r\n");
+    return NO_AZX_TIMER_ID;
   }
 
-  tim->task_id = task_id;
-  tim->type = type;
   AZX_LOG_TRACE("Initialized timer with ID %d successfully\r\n", tim->id);
   return tim->id;
-
-err:
-  close_timer(tim);
-  return NO_AZX_TIMER_ID;
 }
 
 BOOLEAN azx_timer_deinit(AZX_TIMER_ID timer_id)
@@ -228,48 +481,21 @@ BOOLEAN azx_timer_deinit(AZX_TIMER_ID timer_id)
   if(!tim)
   {
     AZX_LOG_DEBUG("Timer is not initialized\r\n");
-    goto err;
+    return FALSE;
   }
 
   do_deinit(tim);
-
-  destroy_internal_task_if_not_needed();
   return TRUE;
-
-err:
-  destroy_internal_task_if_not_needed();
-  return FALSE;
-}
-
-static Timer* get_timer(AZX_TIMER_ID id)
-{
-  Timer* tim;
-  if(id == 0 || id > MAX_TIMERS)
-  {
-    AZX_LOG_WARN("Timer ID %d out of bounds\r\n", id);
-    return 0;
-  }
-
-  tim = &allTimers[id-1];
-
-  if(tim->id != id)
-  {
-    AZX_LOG_WARN("Timer ID %d not matching %d\r\n", id, tim->id);
-    return 0;
-  }
-
-  return tim;
 }
 
-static INT32 timer_task(INT32 unused_type, INT32 timer_id, INT32 unused_param)
+static INT32 timer_task(INT32 type, INT32 param1, INT32 param2)
 {
-  (void)unused_type;
-  (void)unused_param;
-  const Timer* timer = get_timer(timer_id);
+  (void)param1;
+  (void)param2;
 
-  if(timer && timer->cb)
+  if(type == TIMER_TICK)
   {
-    timer->cb(timer->ctx, timer_id);
+    process_ticks();
   }
   return 0;
 }
@@ -293,58 +519,133 @@ static BOOLEAN create_internal_task_if_needed(void)
   return FALSE;
 }
 
-static BOOLEAN destroy_internal_task_if_not_needed()
+static BOOLEAN create_wheel_lock(void)
 {
-  BOOLEAN res = FALSE;
-  if (0 < timerTaskId)
+  M2MB_OS_MTX_ATTR_HANDLE mtxAttrHandle;
+  UINT32 inheritVal = 1;
+
+  if(M2MB_OS_SUCCESS != m2mb_os_mtx_setAttrItem_(&mtxAttrHandle,
+      M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, NULL,
+      M2MB_OS_MTX_SEL_CMD_NAME, "TimerMtx",
+      M2MB_OS_MTX_SEL_CMD_USRNAME, "TimerMtx",
+      M2MB_OS_MTX_SEL_CMD_INHERIT, inheritVal))
   {
-    return TRUE;
+    return FALSE;
   }
+  return M2MB_OS_SUCCESS == m2mb_os_mtx_init(&wheelLock, &mtxAttrHandle) && wheelLock;
+}
+
+static BOOLEAN create_hw_timer(void)
+{
+  M2MB_HWTMR_RESULT_E res;
+  M2MB_HWTMR_ATTR_HANDLE attr;
 
-  if(are_timers_unused())
+  res = m2mb_hwTmr_setAttrItem(&attr, 1, M2MB_HWTMR_SEL_CMD_CREATE_ATTR, NULL);
+  if(res != M2MB_HWTMR_SUCCESS)
   {
-    AZX_LOG_DEBUG("Destroy timer task\r\n");
+    AZX_LOG_ERROR("Failed to init hwTmr attributes. Error %d\r\n", res);
+    return FALSE;
+  }
 
-    if(0 < azx_tasks_destroyTask(timerTaskId))
-    {
-      res =  TRUE;
-    }
-    else
-    {
-      AZX_LOG_ERROR("Unable to destroy timer helper task\r\n");
-    }
+  res = m2mb_hwTmr_setAttrItem( &attr,
+      CMDS_ARGS(
+        M2MB_HWTMR_SEL_CMD_CB_FUNC, &hw_timer_cb,
+        M2MB_HWTMR_SEL_CMD_ARG_CB, NULL,
+        M2MB_HWTMR_SEL_CMD_TIME_DURATION, M2MB_HWTMR_TIME_MS(AZX_TIMER_TICK_MS),
+        M2MB_HWTMR_SEL_CMD_PERIODIC, M2MB_HWTMR_ONESHOT_TMR,
+        M2MB_HWTMR_SEL_CMD_AUTOSTART, M2MB_HWTMR_NOT_START
+        )
+      );
+  if( res != M2MB_HWTMR_SUCCESS )
+  {
+    AZX_LOG_ERROR("Failed to init hwTmr attributes. Error %d\r\n", res);
+    m2mb_hwTmr_setAttrItem( &attr, 1, M2MB_HWTMR_SEL_CMD_DEL_ATTR, NULL );
+    return FALSE;
   }
-  else
+
+  res = m2mb_hwTmr_init(&hwTimer, &attr);
+  if( res != M2MB_HWTMR_SUCCESS )
+  {
+    AZX_LOG_ERROR("Failed to init hwTmr. Error %d\r\n", res);
+    m2mb_hwTmr_setAttrItem( &attr, 1, M2MB_HWTMR_SEL_CMD_DEL_ATTR, NULL );
+    hwTimer = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* The timer task and the hardware timer are kept once created, the hardware
+ * timer is only running while there are timers running */
+static BOOLEAN prepare_wheel(void)
+{
+  FLOAT32 ms_per_tick;
+  UINT32 i;
+
+  /* Only the first caller prepares the wheel, tasks racing with it wait until it is done */
+  while(wheelState == WHEEL_PREPARING)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(1));
+  }
+  if(!__sync_bool_compare_and_swap(&wheelState, WHEEL_UNINIT, WHEEL_PREPARING))
   {
-    res = FALSE;
+    return wheelState == WHEEL_READY;
   }
 
+  if(!create_internal_task_if_needed() || (!hwTimer && !create_hw_timer()))
+  {
+    wheelState = WHEEL_UNINIT;
+    return FALSE;
+  }
 
-  return res;
+  ms_per_tick = m2mb_os_getSysTickDuration_ms();
+  sysTicksPerTick = (ms_per_tick > 0) ? (UINT32)(AZX_TIMER_TICK_MS / ms_per_tick + 0.5f) : 1;
+  if(sysTicksPerTick == 0)
+  {
+    sysTicksPerTick = 1;
+  }
+  tickMs = (ms_per_tick > 0) ? sysTicksPerTick * ms_per_tick : AZX_TIMER_TICK_MS;
+  clockSysTicks = m2mb_os_getSysTicks();
+
+  freeTimers = NULL;
+  for(i = AZX_TIMER_MAX_TIMERS; i > 0; --i)
+  {
+    allTimers[i-1].next = freeTimers;
+    freeTimers = &allTimers[i-1];
+  }
+
+  if(!create_wheel_lock())
+  {
+    AZX_LOG_ERROR("Unable to create the timer lock\r\n");
+    wheelLock = 0;
+    wheelState = WHEEL_UNINIT;
+    return FALSE;
+  }
+  __sync_synchronize();
+  wheelState = WHEEL_READY;
+  return TRUE;
 }
 
 AZX_TIMER_ID azx_timer_initWithCb(azx_expiration_cb cb, void* ctx, UINT32 duration_ms)
 {
   AZX_TIMER_ID id;
   Timer* timer = 0;
-  if(!create_internal_task_if_needed())
+
+  /* Creates the timer task, which calls the callbacks */
+  if(!prepare_wheel())
   {
-    goto error;
+    return NO_AZX_TIMER_ID;
   }
 
   id = azx_timer_init(timerTaskId, 0, duration_ms);
   if(id == NO_AZX_TIMER_ID || 0 == (timer = get_timer(id)))
   {
-    goto error;
+    return NO_AZX_TIMER_ID;
   }
 
   timer->cb = cb;
   timer->ctx = ctx;
 
   return id;
-error:
-  close_timer(timer);
-  return NO_AZX_TIMER_ID;
 }
 
 
@@ -364,45 +665,53 @@ void azx_timer_start(AZX_TIMER_ID id, UINT32 duration_ms, BOOLEAN restart)
 
 static void do_start(Timer* tim, UINT32 duration_ms, BOOLEAN restart)
 {
-  M2MB_HWTMR_RESULT_E res = M2MB_HWTMR_SUCCESS;
+  UINT32 now;
 
-  if(is_timer_running(tim))
+  m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
+  if(tim->state == TIMER_RUNNING)
   {
     if(!restart)
     {
+      m2mb_os_mtx_put(wheelLock);
       AZX_LOG_TRACE("Timer %d already running, won't restart\r\n", tim->id);
       return;
     }
     AZX_LOG_TRACE("Restarting timer %d\r\n", tim->id);
-    do_stop(tim);
+    list_remove(tim);
+    --runningTimers;
   }
-  else
+  else if(tim->state == TIMER_FIRING)
   {
-    AZX_LOG_TRACE("Timer %d idle\r\n", tim->id);
+    /* Started again before its expiry was notified */
+    list_remove(tim);
   }
 
-  if(duration_ms != tim->duration_ms && duration_ms > 0)
+  if(duration_ms > 0)
   {
-    UINT32 timeDuration = M2MB_HWTMR_TIME_MS(duration_ms);
     tim->duration_ms = duration_ms;
-    res = m2mb_hwTmr_setItem(tim->hnd, M2MB_HWTMR_SEL_CMD_TIME_DURATION, (void*)timeDuration);
-    if(res != M2MB_HWTMR_SUCCESS)
-    {
-      AZX_LOG_ERROR("Failed to set timer duration. Error %d\r\n", res);
-      return;
-    }
-    else
-    {
-      AZX_LOG_TRACE("Have set the duration\r\n");
-    }
   }
 
-  res = m2mb_hwTmr_start(tim->hnd);
-  if(res != M2MB_HWTMR_SUCCESS)
+  now = update_clock();
+  if(runningTimers == 0)
   {
-    AZX_LOG_ERROR("Failed to start timer. Error %d\r\n", res);
-    return;
+    /* Nothing in the wheel, no need to go through the ticks since it last ran */
+    wheelTick = now;
+  }
+  /* One more tick, as the current one has already partly elapsed */
+  tim->expires = now + ms_to_ticks(tim->duration_ms) + 1;
+  wheel_add(tim);
+  tim->state = TIMER_RUNNING;
+  ++runningTimers;
+
+  if((INT32)(tim->expires - wheelTick) < ROOT_SIZE)
+  {
+    arm_hw_timer(now, tim->expires);
+  }
+  else
+  {
+    arm_hw_timer(now, next_cascade_tick());
   }
+  m2mb_os_mtx_put(wheelLock);
   AZX_LOG_TRACE("Timer %d started\r\n", tim->id);
 }
 
@@ -419,13 +728,25 @@ void azx_timer_stop(AZX_TIMER_ID id)
   do_stop(tim);
 }
 
+/* The hardware timer is left alone, if nothing is due when it fires it is just
+ * stopped or armed again */
 static void do_stop(Timer* tim)
 {
-  M2MB_HWTMR_RESULT_E res = m2mb_hwTmr_stop(tim->hnd);
-  if(res != M2MB_HWTMR_SUCCESS)
+  m2mb_os_mtx_get(wheelLock, M2MB_OS_WAIT_FOREVER);
+  if(tim->state == TIMER_RUNNING)
+  {
+    list_remove(tim);
+    --runningTimers;
+  }
+  else if(tim->state == TIMER_FIRING)
+  {
+    list_remove(tim);
+  }
+  if(tim->state != TIMER_FREE)
   {
-    AZX_LOG_WARN("Failed to stop timer. Error %d\r\n", res);
+    tim->state = TIMER_IDLE;
   }
+  m2mb_os_mtx_put(wheelLock);
 }
 
 static UINT32 time_now(void)
@@ -56,6 +56,7 @@
 
 #include "m2mb_types.h"
 #include "m2mb_os_api.h"
+#include "azx_pool.h"
 
 #include "azx_cjson.h"
 
@@ -81,8 +82,8 @@ static int cJSON_strcasecmp(const char *s1, const char *s2)
       - tolower(*(const unsigned char *) s2);
 }
 
-#define cJSON_malloc m2mb_os_malloc
-#define cJSON_free m2mb_os_free
+#define cJSON_malloc AZX_MALLOC
+#define cJSON_free AZX_FREE
 
 static char* cJSON_strdup(const char* str)
 {
@@ -373,7 +373,7 @@ AZX_CJSON_T* azx_cjson_parse(const char *value);
 
  @details
  This function will render a AZX_CJSON_T entity to text for transfer/storage, formatting it with tabs/ new lines.
- Free the char* when finished.
+ Free the char* with AZX_FREE() when finished.
 
  @param[in] item
  AZX_CJSON_T object
@@ -402,7 +402,7 @@ char *azx_cjson_print(AZX_CJSON_T *item);
 
  @details
  This function will render a AZX_CJSON_T entity to text for transfer/storage without any formatting.
- Free the char* when finished.
+ Free the char* with AZX_FREE() when finished.
 
  @param[in] item
  AZX_CJSON_T object
@@ -432,7 +432,7 @@ char *azx_cjson_printUnformatted(AZX_CJSON_T *item);
  @details
  This function will render a AZX_CJSON_T entity to text using a buffered strategy. Prebuffer is a
  guess at the final size. Guessing well reduces reallocation. fmt=0 gives unformatted, =1 gives formatted.
- Free the char* when finished.
+ Free the char* with AZX_FREE() when finished.
 
  @param[in] item
  AZX_CJSON_T object
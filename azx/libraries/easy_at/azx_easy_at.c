@@ -38,6 +38,7 @@
 #include "m2mb_atp.h"
 
 #include "azx_log.h"
+#include "azx_pool.h"
 #include "app_cfg.h"
 
 #include "azx_easy_at.h"
@@ -429,7 +430,7 @@ static void _azx_easy_at_task_group_callback( M2MB_ATP_HANDLE atpHandle,
     Message.atpEvent = atpEvent;
     Message.resp_size = resp_size;
     /*copy the message resp struct*/
-    Message.resp_struct = m2mb_os_malloc( resp_size );
+    Message.resp_struct = AZX_MALLOC( resp_size );
 
     if( Message.resp_struct != NULL )
     {
@@ -503,7 +504,7 @@ static void _azx_easy_at_task_entry( void *pArg )
 
     if( Message.resp_struct )
     {
-      m2mb_os_free( Message.resp_struct );
+      AZX_FREE( Message.resp_struct );
     }
   }
 }
@@ -38,6 +38,7 @@
 #include "azx_gnu_stdio.h"
 
 #include "azx_log.h"
+#include "azx_pool.h"
 
 /* Function prototypes and Local defines ========================================================*/
 #include "azx_gnu_stdlib.h"
@@ -47,30 +48,33 @@
 
 void *azx_gnu_malloc(size_t size)
 {
-	return m2mb_os_malloc(size);
+	return AZX_MALLOC(size);
 }
 
 void *azx_gnu_calloc(size_t nitems, size_t size)
 {
 #ifdef APP_NAME /*Emulator*/
-  void* p = m2mb_os_calloc(nitems * size);
+  void* p = AZX_CALLOC(nitems * size);
   if(p)
   {
     memset(p, 0, nitems * size);
   }
   return p;
 #else
-	return m2mb_os_calloc(nitems * size);
+	return AZX_CALLOC(nitems * size);
 #endif
 }
 
 void azx_gnu_free(void *ptr)
 {
-	m2mb_os_free(ptr);
+	AZX_FREE(ptr);
 }
 
 void * azx_gnu_realloc(void * ptr, size_t size)
 {
+#ifdef AZX_POOL_HOOK
+	return azx_pool_realloc(ptr, (UINT32) size);
+#else
 	if (0 == size)
 	{
 		if (NULL != ptr)
@@ -106,5 +110,6 @@ void * azx_gnu_realloc(void * ptr, size_t size)
 			return NULL;
 		}
 	}
+#endif
 }
 
@@ -29,6 +29,7 @@
 #include "m2mb_types.h"
 #include "azx_utils.h"
 #include "m2mb_os_api.h"
+#include "azx_pool.h"
 #include "azx_log.h"
 
 #include "azx_lfs_utils.h"
@@ -94,7 +95,7 @@ LFS2_ERROR_T azx_ram_initialize(AZX_RAM_DISK_S** ptr_ram,
 
 	/* Each row should only contain an char*, not an char**,
 	 * because each row will be an array of char */
-	ptr = (char**) m2mb_os_malloc(rows * sizeof(char*));
+	ptr = (char**) AZX_MALLOC(rows * sizeof(char*));
 	if (!ptr)
 	{
 		AZX_LOG_ERROR("Error rows memory allocation!!\r\n");
@@ -104,14 +105,14 @@ LFS2_ERROR_T azx_ram_initialize(AZX_RAM_DISK_S** ptr_ram,
 	uint32_t i;
 	for(i = 0; i < rows; i++)
     {
-		ptr[i] = (char*) m2mb_os_malloc(cols * sizeof(char));
+		ptr[i] = (char*) AZX_MALLOC(cols * sizeof(char));
 		if (!ptr[i])
 		{
 			AZX_LOG_ERROR("Error cols memory allocation!!\r\n");
 			uint32_t j;
 			for(j = 0; j<i;j++)
 			{
-				if (m2mb_os_free(ptr[j]) < 0)
+				if (AZX_FREE(ptr[j]) < 0)
 				{
 					AZX_LOG_ERROR("Error release allocation!!\r\n");
 				}
@@ -141,14 +142,14 @@ LFS2_ERROR_T azx_ram_releaseResources(AZX_RAM_DISK_S* ptr_ram, char** disk)
 
 	for(i = 0; i < rows; i++)
     {
-		if (m2mb_os_free(disk[i]) != M2MB_OS_SUCCESS)
+		if (AZX_FREE(disk[i]) != M2MB_OS_SUCCESS)
 		{
 			AZX_LOG_ERROR("Error releasing row %d!!\r\n", i);
 			res = LFS2_ERR_GENERIC;
 			//keep releasing the other
 		}
     }
-	if (m2mb_os_free(disk) != M2MB_OS_SUCCESS)
+	if (AZX_FREE(disk) != M2MB_OS_SUCCESS)
 	{
 		AZX_LOG_ERROR("Error releasing disk memory!!\r\n", i);
 		res = LFS2_ERR_GENERIC;
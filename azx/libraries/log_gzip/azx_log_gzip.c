@@ -0,0 +1,249 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#include <stdio.h>
+#include <string.h>
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+#include "m2mb_fs_posix.h"
+#include "m2mb_fs_stdio.h"
+
+#include "app_cfg.h"
+#include "azx_log.h"
+#include "azx_tasks.h"
+#include "azx_zlib.h"
+
+#include "azx_log_gzip.h"
+
+#ifndef AZX_LOG_GZIP_WINDOW_BITS
+#define AZX_LOG_GZIP_WINDOW_BITS 10
+#endif
+
+#ifndef AZX_LOG_GZIP_MEM_LEVEL
+#define AZX_LOG_GZIP_MEM_LEVEL 3
+#endif
+
+#ifndef AZX_LOG_GZIP_LEVEL
+#define AZX_LOG_GZIP_LEVEL 6
+#endif
+
+/* Adding 16 to the window bits makes deflate write a gzip header and trailer */
+#define GZIP_WINDOW_BITS (AZX_LOG_GZIP_WINDOW_BITS + 16)
+#define CHUNK_SIZE 512
+#define TASK_STACK_SIZE (4 * 1024)
+#define TASK_QUEUE_SIZE 8
+
+enum
+{
+  GZIP_COMPRESS_SEGMENT = 1
+};
+
+static INT32 gzipTask = 0;
+static CHAR baseName[AZX_LOG_GZIP_NAME_SIZE] = "";
+static UINT32 chunks = 0;
+static volatile UINT32 lastSegment = 0;
+
+static void get_segment_name(CHAR* name, UINT32 size, UINT32 segment, const CHAR* suffix)
+{
+  if(segment == 0)
+  {
+    snprintf(name, size, "%s%s", baseName, suffix);
+  }
+  else
+  {
+    snprintf(name, size, "%s.%u%s", baseName, segment, suffix);
+  }
+}
+
+static BOOLEAN file_exists(const CHAR* name)
+{
+  struct M2MB_STAT stat;
+  return 0 == m2mb_fs_stat(name, &stat);
+}
+
+static voidpf gzip_alloc(voidpf opaque, uInt items, uInt size)
+{
+  (void)opaque;
+  return m2mb_os_malloc(items * size);
+}
+
+static void gzip_free(voidpf opaque, voidpf ptr)
+{
+  (void)opaque;
+  m2mb_os_free(ptr);
+}
+
+static BOOLEAN compress_file(const CHAR* from, const CHAR* to)
+{
+  static UINT8 in[CHUNK_SIZE];
+  static UINT8 out[CHUNK_SIZE];
+  azx_zlib_z_stream strm;
+  M2MB_FILE_T* src;
+  M2MB_FILE_T* dst;
+  INT32 flush;
+  UINT32 have;
+  BOOLEAN ok = TRUE;
+
+  memset(&strm, 0, sizeof(strm));
+  strm.zalloc = gzip_alloc;
+  strm.zfree = gzip_free;
+  if(Z_OK != azx_zlib_deflateInit2(&strm, AZX_LOG_GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS,
+      AZX_LOG_GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+  {
+    AZX_LOG_ERROR("Cannot allocate the deflate state\r\n");
+    return FALSE;
+  }
+
+  src = m2mb_fs_fopen(from, "r");
+  dst = src ? m2mb_fs_fopen(to, "w") : NULL;
+  if(!src || !dst)
+  {
+    AZX_LOG_ERROR("Cannot open %s or %s\r\n", from, to);
+    ok = FALSE;
+    goto end;
+  }
+
+  do
+  {
+    strm.avail_in = m2mb_fs_fread(in, 1, CHUNK_SIZE, src);
+    strm.next_in = in;
+    flush = (strm.avail_in < CHUNK_SIZE) ? Z_FINISH : Z_NO_FLUSH;
+    do
+    {
+      strm.avail_out = CHUNK_SIZE;
+      strm.next_out = out;
+      azx_zlib_deflate(&strm, flush);
+      have = CHUNK_SIZE - strm.avail_out;
+      if(m2mb_fs_fwrite(out, 1, have, dst) != have)
+      {
+        AZX_LOG_ERROR("Cannot write %s\r\n", to);
+        ok = FALSE;
+        goto end;
+      }
+    } while(strm.avail_out == 0);
+  } while(flush != Z_FINISH);
+
+end:
+  azx_zlib_deflateEnd(&strm);
+  if(dst)
+  {
+    m2mb_fs_fclose(dst);
+  }
+  if(src)
+  {
+    m2mb_fs_fclose(src);
+  }
+  return ok;
+}
+
+static void compress_segment(UINT32 segment)
+{
+  CHAR from[AZX_LOG_GZIP_NAME_SIZE + 8];
+  CHAR tmp[AZX_LOG_GZIP_NAME_SIZE + 8];
+  CHAR to[AZX_LOG_GZIP_NAME_SIZE + 8];
+
+  get_segment_name(from, sizeof(from), segment, ".old");
+  get_segment_name(tmp, sizeof(tmp), segment, ".gz.tmp");
+  get_segment_name(to, sizeof(to), segment, ".gz");
+
+  /* Written under a temporary name, so a half written file is never listed */
+  if(!compress_file(from, tmp))
+  {
+    m2mb_fs_remove(tmp);
+    return;
+  }
+  m2mb_fs_remove(to);
+  if(-1 == m2mb_fs_rename(tmp, to))
+  {
+    AZX_LOG_ERROR("Cannot rename %s\r\n", tmp);
+    return;
+  }
+  m2mb_fs_remove(from);
+  lastSegment = segment;
+  AZX_LOG_DEBUG("Compressed %s\r\n", to);
+}
+
+static INT32 gzip_task_cb(INT32 type, INT32 param1, INT32 param2)
+{
+  (void)param2;
+  if(type == GZIP_COMPRESS_SEGMENT)
+  {
+    compress_segment((UINT32)param1);
+  }
+  return 0;
+}
+
+static void on_rotate(const CHAR* path, UINT32 segment)
+{
+  (void)path;
+  if(segment >= AZX_LOG_GZIP_MAX_SEGMENTS ||
+      AZX_TASKS_OK != azx_tasks_sendMessageToTask(gzipTask, GZIP_COMPRESS_SEGMENT, segment, 0))
+  {
+    AZX_LOG_WARN("Segment %u of the log file left uncompressed\r\n", segment);
+  }
+}
+
+BOOLEAN azx_log_gzip_sendToFile(const CHAR* filename, UINT32 circular_chunks,
+    AZX_LOG_LEVEL_E min_level, UINT32 max_size_kb)
+{
+  CHAR name[AZX_LOG_GZIP_NAME_SIZE + 8];
+  UINT32 segment;
+
+  if(!filename || circular_chunks >= AZX_LOG_GZIP_MAX_SEGMENTS)
+  {
+    return FALSE;
+  }
+
+  if(gzipTask <= 0)
+  {
+    gzipTask = azx_tasks_createTask((CHAR*)"LogGzip", TASK_STACK_SIZE, AZX_TASKS_PRIORITY_MIN,
+        TASK_QUEUE_SIZE, gzip_task_cb);
+    if(gzipTask <= 0)
+    {
+      AZX_LOG_ERROR("Cannot create the log compression task: %d\r\n", gzipTask);
+      return FALSE;
+    }
+  }
+
+  snprintf(baseName, sizeof(baseName), "%s", filename);
+  chunks = circular_chunks;
+  lastSegment = 0;
+  azx_log_setRotateCallback(on_rotate);
+
+  if(!azx_log_send_to_file(filename, circular_chunks, min_level, max_size_kb))
+  {
+    azx_log_setRotateCallback(NULL);
+    return FALSE;
+  }
+
+  /* Segments handed over before a reset */
+  for(segment = 0; segment <= chunks; ++segment)
+  {
+    get_segment_name(name, sizeof(name), segment, ".old");
+    if(file_exists(name))
+    {
+      on_rotate(name, segment);
+    }
+  }
+  return TRUE;
+}
+
+UINT32 azx_log_gzip_getSegments(CHAR names[][AZX_LOG_GZIP_NAME_SIZE], UINT32 max)
+{
+  UINT32 count = 0;
+  UINT32 i;
+  UINT32 segment;
+
+  /* The original file is never rotated back to, so it is always the oldest. The numbered
+   * segments are oldest right after the last one compressed. */
+  for(i = 0; i <= chunks && count < max; ++i)
+  {
+    segment = (i == 0) ? 0 : (lastSegment + i - 1) % chunks + 1;
+    get_segment_name(names[count], AZX_LOG_GZIP_NAME_SIZE, segment, ".gz");
+    if(file_exists(names[count]))
+    {
+      ++count;
+    }
+  }
+  return count;
+}
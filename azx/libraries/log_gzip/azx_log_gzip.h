@@ -0,0 +1,88 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#ifndef HDR_AZX_LOG_GZIP_H_
+#define HDR_AZX_LOG_GZIP_H_
+/**
+ * @file azx_log_gzip.h
+ * @version 1.0.0
+ * @dependencies core/azx_log core/azx_tasks libraries/zlib
+ * @date 17/10/2026
+ *
+ * @brief Compression of the rotated log file segments
+ *
+ * Log files are kept as plain text while they are written, but shipping them
+ * that way costs several times the data a compressed copy would. With this
+ * library every segment of the log file (see azx_log_send_to_file()) is
+ * compressed to a gzip file once it is full, by a low priority task, so the
+ * logging itself is not slowed down.
+ *
+ * The compressed segments are named after the segment (`filename.gz` for the
+ * original file, `filename.<segment>.gz` for the numbered ones) and can be
+ * read back with any gzip tool. They replace the plain text ones, so the
+ * application only needs to upload (and then remove) the files listed by
+ * azx_log_gzip_getSegments().
+ *
+ * The memory deflate takes is bounded by `AZX_LOG_GZIP_WINDOW_BITS` (10, a
+ * 1 KB window, if not defined in `app_cfg.h`) and `AZX_LOG_GZIP_MEM_LEVEL`
+ * (3 if not defined): about `(1 << (WINDOW_BITS + 2)) + (1 << (MEM_LEVEL + 9))`
+ * bytes (8 KB with the defaults) plus 6 KB of state, allocated only while a
+ * segment is being compressed. `AZX_LOG_GZIP_LEVEL` (6 if not defined) trades
+ * speed for size.
+ *
+ * azx_tasks_init() must have been called before this library is used.
+ */
+#include "m2mb_types.h"
+#include "azx_log.h"
+
+/** @brief The size of the buffers passed to azx_log_gzip_getSegments(). */
+#define AZX_LOG_GZIP_NAME_SIZE 40
+
+/** @brief The most segments that can be compressed (the original file and 31 others). */
+#define AZX_LOG_GZIP_MAX_SEGMENTS 32
+
+/**
+ * @brief Sends the logs to a file and compresses its segments once they are full.
+ *
+ * This takes the same parameters as azx_log_send_to_file(), which it calls.
+ * Segments left uncompressed by an earlier run (for example because of a reset)
+ * are compressed too.
+ *
+ * @param filename The name of the file to log to.
+ * @param circular_chunks The number of chunks to store circularly, at most
+ *     #AZX_LOG_GZIP_MAX_SEGMENTS - 1.
+ * @param min_level The minimum level of the logs to be stored.
+ * @param max_size_kb The maximum size in KB of each segment before it is compressed.
+ *
+ * @return TRUE if the file could be opened and the compression task started,
+ *     FALSE otherwise
+ */
+BOOLEAN azx_log_gzip_sendToFile(const CHAR* filename, UINT32 circular_chunks,
+    AZX_LOG_LEVEL_E min_level, UINT32 max_size_kb);
+
+/**
+ * @brief Lists the compressed segments that are ready to be uploaded.
+ *
+ * The oldest segment comes first. The segment that is currently being
+ * compressed is not listed.
+ *
+ * @param[out] names Where to store the names of the files
+ * @param[in] max The number of entries in @p names
+ *
+ * @return The number of names stored
+ *
+ * **Example**
+ *
+ *     CHAR names[4][AZX_LOG_GZIP_NAME_SIZE];
+ *     UINT32 i, count = azx_log_gzip_getSegments(names, 4);
+ *     for(i = 0; i < count; ++i)
+ *     {
+ *       if(upload(names[i]))
+ *       {
+ *         m2mb_fs_remove(names[i]);
+ *       }
+ *     }
+ */
+UINT32 azx_log_gzip_getSegments(CHAR names[][AZX_LOG_GZIP_NAME_SIZE], UINT32 max);
+
+#endif /* HDR_AZX_LOG_GZIP_H_ */
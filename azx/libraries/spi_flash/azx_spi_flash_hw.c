@@ -23,6 +23,8 @@
 
 /* Include files ================================================================================*/
 //------------- include NAND JSC dependancies
+#define AZX_LOG_MODULE AZX_LOG_MODULE_SPI_FLASH
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -22,6 +22,8 @@
  */
 
 /* Include files ================================================================================*/
+#define AZX_LOG_MODULE AZX_LOG_MODULE_SPI_FLASH
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,18 +6,133 @@
 #include "m2mb_os_api.h"
 #include "m2mb_fs_stdio.h"
 #include "m2mb_fs_posix.h"
+#include "m2mb_ati.h"
 
 #include "app_cfg.h"
 
 #include "azx_log.h"
+#include "azx_tasks.h"
 
 #include "azx_ati.h"
 
+#define BENCHMARK_ROUNDS 100
+
+static UINT32 lastSendTick = 0;
+static UINT32 lastRcvTick = 0;
+static UINT32 failingSends = 0;
+static volatile UINT32 asyncDone = 0;
+static volatile UINT32 asyncFailed = 0;
+
+/* Overrides the weak hooks in azx_ati.c to timestamp the traffic seen by the modem */
+M2MB_RESULT_E ati_send_cmd( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
+{
+  lastSendTick = m2mb_os_getSysTicks();
+  if(failingSends > 0)
+  {
+    --failingSends;
+    return M2MB_RESULT_FAIL;
+  }
+  return m2mb_ati_send_cmd(handle, buf, nbyte);
+}
+
+SSIZE_T ati_rcv_resp( M2MB_ATI_HANDLE handle, void *buf, SIZE_T nbyte )
+{
+  lastRcvTick = m2mb_os_getSysTicks();
+  return m2mb_ati_rcv_resp(handle, buf, nbyte);
+}
+
 void creg_event_cb(const CHAR* msg)
 {
  AZX_LOG_INFO("received data from CREG command: <%s>\r\n", msg);
 }
 
+/* Sends the same command repeatedly and reports how long each synchronous call took, compared to
+ * the time the modem took to deliver the last chunk of the response */
+static void run_round_trip_benchmark(const CHAR* cmd)
+{
+  const FLOAT32 ms_per_tick = m2mb_os_getSysTickDuration_ms();
+  UINT32 min = 0xFFFFFFFF;
+  UINT32 max = 0;
+  UINT32 total = 0;
+  UINT32 modem = 0;
+  UINT32 failed = 0;
+  UINT32 i;
+
+  for(i = 0; i < BENCHMARK_ROUNDS; ++i)
+  {
+    UINT32 start = m2mb_os_getSysTicks();
+    UINT32 elapsed;
+
+    if(!azx_ati_sendCommandExpectOk(AZX_ATI_DEFAULT_TIMEOUT, cmd))
+    {
+      ++failed;
+      continue;
+    }
+    elapsed = m2mb_os_getSysTicks() - start;
+    modem += lastRcvTick - lastSendTick;
+    total += elapsed;
+    min = (elapsed < min ? elapsed : min);
+    max = (elapsed > max ? elapsed : max);
+  }
+
+  if(failed == BENCHMARK_ROUNDS)
+  {
+    AZX_LOG_ERROR("%s: all %u rounds failed\r\n", cmd, BENCHMARK_ROUNDS);
+    return;
+  }
+
+  AZX_LOG_INFO("%s: %u rounds, %u failed, round trip min/avg/max %.1f/%.1f/%.1f ms, modem %.1f ms\r\n",
+      cmd, BENCHMARK_ROUNDS, failed,
+      min * ms_per_tick,
+      (total * ms_per_tick) / (BENCHMARK_ROUNDS - failed),
+      max * ms_per_tick,
+      (modem * ms_per_tick) / (BENCHMARK_ROUNDS - failed));
+}
+
+static void async_done_cb(void* ctx, const struct AzxBinaryData* response)
+{
+  (void)ctx;
+  if(!response)
+  {
+    ++asyncFailed;
+  }
+  ++asyncDone;
+}
+
+/* Queues async commands whose send fails. They must be completed with a NULL response well
+ * before their own timeout, and leave the instance free for the next synchronous command */
+static void run_async_send_failure_test(void)
+{
+  const UINT32 start = m2mb_os_getSysTicks();
+  UINT32 waited = 0;
+
+  asyncDone = 0;
+  asyncFailed = 0;
+  failingSends = 2;
+  azx_ati_sendCommandAsync(AZX_ATI_DEFAULT_TIMEOUT, &async_done_cb, NULL, "AT");
+  azx_ati_sendCommandAsync(AZX_ATI_DEFAULT_TIMEOUT, &async_done_cb, NULL, "AT+CSQ");
+  azx_ati_sendCommandAsync(AZX_ATI_DEFAULT_TIMEOUT, &async_done_cb, NULL, "AT");
+
+  while(asyncDone < 3 && waited < 2 * AZX_ATI_DEFAULT_TIMEOUT)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(10));
+    waited += 10;
+  }
+  if(asyncDone != 3 || asyncFailed != 2)
+  {
+    AZX_LOG_ERROR("Async send failure: %u/3 completed, %u/2 failed\r\n", asyncDone, asyncFailed);
+  }
+  else if(!azx_ati_sendCommandExpectOk(AZX_ATI_DEFAULT_TIMEOUT, "AT"))
+  {
+    AZX_LOG_ERROR("Async send failure: the instance is not usable afterwards\r\n");
+  }
+  else
+  {
+    AZX_LOG_INFO("Async send failure: all completed in %.1f ms\r\n",
+        (m2mb_os_getSysTicks() - start) * m2mb_os_getSysTickDuration_ms());
+  }
+  failingSends = 0;
+}
 
 void M2MB_main( int argc, char **argv )
 {
@@ -27,6 +142,8 @@ void M2MB_main( int argc, char **argv )
     m2mb_os_taskSleep(M2MB_OS_MS2TICKS(4000));
 
     AZX_LOG_INIT();
+    /* The timeouts of async commands run on azx_timer */
+    azx_tasks_init();
     
     AZX_LOG_INFO("Azx-ati demo. Default AT instance 0 will be used.\r\n");
     AZX_LOG_INFO("To use a specific instance, please refer to azx_ati_*Ex functions\r\n");
@@ -46,6 +163,17 @@ void M2MB_main( int argc, char **argv )
     AZX_LOG_INFO("Sending AT#MONI...\r\n");
     azx_ati_sendCommandExpectOk(AZX_ATI_DEFAULT_TIMEOUT, "AT#MONI\r");
     
+    AZX_LOG_INFO("Measuring AT round trip latency...\r\n");
+    run_round_trip_benchmark("AT");
+    run_round_trip_benchmark("AT+CSQ");
+    run_round_trip_benchmark("AT+CCLK?");
+    /* Long, multi-line responses arriving in several RX events */
+    run_round_trip_benchmark("AT&V");
+    run_round_trip_benchmark("AT#MONI");
+
+    AZX_LOG_INFO("Checking async commands whose send fails...\r\n");
+    run_async_send_failure_test();
+
     AZX_LOG_INFO("Now wait for registration events from CREG...\r\n");
 
 }
@@ -19,6 +19,11 @@
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
 /** @endcond*/
 
+/**
+ * @brief Size in bytes of the azx_buffer ring. Must be a power of 2, 16 KB if not defined.
+ */
+#define AZX_BUFFER_SIZE (16 * 1024)
+
 
 
 
@@ -12,7 +12,14 @@
 #include "azx_log.h"
 
 #include "azx_buffer.h"
+#include "azx_tasks.h"
 
+#define BENCHMARK_TASKS 4
+#define BENCHMARK_OPS 5000
+
+static volatile UINT32 benchmarkDone = 0;
+static volatile UINT32 benchmarkExpired = 0;
+static volatile UINT32 benchmarkCorrupted = 0;
 
 typedef struct
 {
@@ -49,6 +56,72 @@ void struct_consumer(INT32 buf_id)
   }
 }
 
+/* Each producer adds records and reads them straight back, while the others do the same */
+static INT32 benchmark_task(INT32 type, INT32 param1, INT32 param2)
+{
+  CHAR msg[48];
+  CHAR copy[48];
+  INT32 len = 0;
+  INT32 id = 0;
+  INT32 i = 0;
+  (void)type;
+  (void)param2;
+
+  for(i = 0; i < BENCHMARK_OPS; ++i)
+  {
+    len = snprintf(msg, sizeof(msg), "producer %d message %d", (int)param1, (int)i);
+    id = azx_buffer_addObj(msg, len);
+    len = azx_buffer_copyObj(id, copy, sizeof(copy));
+    if(len < 0)
+    {
+      __sync_fetch_and_add(&benchmarkExpired, 1);
+    }
+    else if(memcmp(copy, msg, len) != 0)
+    {
+      __sync_fetch_and_add(&benchmarkCorrupted, 1);
+    }
+  }
+  __sync_fetch_and_add(&benchmarkDone, 1);
+  return 0;
+}
+
+static void run_contention_benchmark(void)
+{
+  INT32 tasks[BENCHMARK_TASKS];
+  UINT32 start = 0;
+  UINT32 elapsed_ms = 0;
+  INT32 i = 0;
+
+  AZX_LOG_INFO("Contention benchmark: %d tasks, %d records each\r\n", BENCHMARK_TASKS,
+      BENCHMARK_OPS);
+  for(i = 0; i < BENCHMARK_TASKS; ++i)
+  {
+    tasks[i] = azx_tasks_createTask((CHAR*)"bufBench", AZX_TASKS_STACK_M, 5, AZX_TASKS_MBOX_S,
+        benchmark_task);
+  }
+
+  start = m2mb_os_getSysTicks();
+  for(i = 0; i < BENCHMARK_TASKS; ++i)
+  {
+    azx_tasks_sendMessageToTask(tasks[i], 0, i, 0);
+  }
+  while(benchmarkDone < BENCHMARK_TASKS)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(10));
+  }
+  elapsed_ms = (UINT32)((m2mb_os_getSysTicks() - start) * m2mb_os_getSysTickDuration_ms());
+
+  AZX_LOG_INFO("%d records in %u ms (%u per second), %u expired, %u corrupted\r\n",
+      BENCHMARK_TASKS * BENCHMARK_OPS, elapsed_ms,
+      elapsed_ms ? (UINT32)(BENCHMARK_TASKS * BENCHMARK_OPS * 1000 / elapsed_ms) : 0,
+      benchmarkExpired, benchmarkCorrupted);
+
+  for(i = 0; i < BENCHMARK_TASKS; ++i)
+  {
+    azx_tasks_destroyTask(tasks[i]);
+  }
+}
+
 void M2MB_main( int argc, char **argv )
 {
   (void)argc;
@@ -57,6 +130,8 @@ void M2MB_main( int argc, char **argv )
   INT32 id;
   MY_TEST_STRUCT test;
 
+  azx_tasks_init();
+
   AZX_LOG_INIT();
 
   m2mb_os_taskSleep(M2MB_OS_MS2TICKS(4000));
@@ -88,4 +163,6 @@ void M2MB_main( int argc, char **argv )
   {
     AZX_LOG_ERROR("Could not allocate structure buffer!\r\n");
   }
+
+  run_contention_benchmark();
 }
@@ -0,0 +1,125 @@
+/* Copyright (C) 2021 Telit Technologies. All Rights Reserved.*/
+#include <stdio.h>
+#include <string.h>
+
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+
+#include "app_cfg.h"
+
+#include "azx_log.h"
+#include "azx_tasks.h"
+
+#define MSG_HOLD 1
+#define MSG_SAMPLE 2
+
+static volatile BOOLEAN holding = FALSE;
+static volatile BOOLEAN released = FALSE;
+static volatile UINT32 samples = 0;
+static volatile INT32 lastSample = 0;
+
+static INT32 sampler_cb(INT32 type, INT32 param1, INT32 param2)
+{
+  switch(type)
+  {
+    case MSG_HOLD:
+      /* Keeps the task busy, so the next messages stay queued */
+      holding = TRUE;
+      while(!released)
+      {
+        m2mb_os_taskSleep(M2MB_OS_MS2TICKS(10));
+      }
+      break;
+    case MSG_SAMPLE:
+      lastSample = *(const INT32*)(MEM_W)param1;
+      ++samples;
+      AZX_LOG_INFO("Sample %d (%d bytes)\r\n", lastSample, param2);
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+static BOOLEAN send_sample(INT32 task_id, INT32 value)
+{
+  INT32* payload = (INT32*)azx_tasks_allocMessage(task_id, sizeof(INT32));
+  if(!payload)
+  {
+    AZX_LOG_ERROR("No buffer for sample %d\r\n", value);
+    return FALSE;
+  }
+  *payload = value;
+  return azx_tasks_sendPayloadToTask(task_id, MSG_SAMPLE, payload) == AZX_TASKS_OK;
+}
+
+/* Two payload messages of a coalesced type are queued back to back. Only the second one must be
+ * handled, and the buffer of the first one must go back to the pool straight away */
+static void run_payload_coalescing_test(void)
+{
+  UINT8 lanes[AZX_TASKS_LANES] = { 2, 4, 2 };
+  AZX_TASKS_POOL_STATS_T stats;
+  INT32 id;
+  UINT32 waited = 0;
+
+  id = azx_tasks_createTaskWithLanes((CHAR*)"Sampler", AZX_TASKS_STACK_M, 5, lanes, &sampler_cb);
+  if(id < 1 || azx_tasks_createMessagePool(id, sizeof(INT32), 4) != AZX_TASKS_OK ||
+      azx_tasks_setCoalescing(id, MSG_SAMPLE, TRUE) != AZX_TASKS_OK)
+  {
+    AZX_LOG_ERROR("Cannot set up the sampler task\r\n");
+    return;
+  }
+
+  azx_tasks_sendMessageToTask(id, MSG_HOLD, 0, 0);
+  while(!holding)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(10));
+  }
+
+  if(!send_sample(id, 1) || !send_sample(id, 2))
+  {
+    AZX_LOG_ERROR("Cannot send the samples\r\n");
+  }
+  azx_tasks_getMessagePoolStats(id, &stats);
+  if(stats.in_use != 1)
+  {
+    AZX_LOG_ERROR("Coalescing: %u buffers in use while queued, expected 1\r\n", stats.in_use);
+  }
+
+  released = TRUE;
+  while(samples == 0 && waited < 1000)
+  {
+    m2mb_os_taskSleep(M2MB_OS_MS2TICKS(10));
+    waited += 10;
+  }
+  m2mb_os_taskSleep(M2MB_OS_MS2TICKS(100));
+
+  azx_tasks_getMessagePoolStats(id, &stats);
+  if(samples != 1 || lastSample != 2 || stats.in_use != 0 || stats.sent != 2)
+  {
+    AZX_LOG_ERROR("Coalescing: %u samples handled, last %d, %u buffers in use, %u sent\r\n",
+        samples, lastSample, stats.in_use, stats.sent);
+  }
+  else
+  {
+    AZX_LOG_INFO("Coalescing: only the latest sample was handled, no buffer left in use\r\n");
+  }
+}
+
+void M2MB_main( int argc, char **argv )
+{
+  (void)argc;
+  (void)argv;
+  m2mb_os_taskSleep(M2MB_OS_MS2TICKS(4000));
+
+  azx_tasks_init();
+
+  AZX_LOG_INIT();
+
+  AZX_LOG_INFO("Azx-tasks demo. \r\n");
+
+  AZX_LOG_INFO("Coalescing payload messages...\r\n");
+  run_payload_coalescing_test();
+
+  azx_tasks_logStats();
+}
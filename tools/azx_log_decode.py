@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+# Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.
+#    See LICENSE file in the project root for full license information.
+"""Decodes the binary log frames written by azx_log.
+
+Log frames (AZX_LOG_FORMAT_BINARY) only carry the addresses of the format
+strings, file and function names, which are read from the application ELF file
+(the one that was flashed). Key/value frames (AZX_LOG_KV) carry their fields as
+a CBOR map and need no ELF file. Text between frames, as found in log files, is
+copied as it is.
+
+Usage:
+    azx_log_decode.py [--json] [APP.elf] [CAPTURE]
+
+Without APP.elf the strings of log frames show as addresses.
+
+CAPTURE is a raw capture of the log channel or a log file, stdin if omitted.
+With --json only the key/value events are written out, one JSON object a line.
+"""
+
+import json
+import re
+import struct
+import sys
+
+FRAME_SYNC = b"\xa5\x5a"
+FRAME_HEADER = struct.Struct("<2sHBBHIIIII")
+KV_HEADER = struct.Struct("<2sHBBHI")
+LEVELS = {1: "TRACE", 2: "DEBUG", 3: "INFO", 4: "WARN", 5: "ERROR", 6: "CRITICAL"}
+POINTER_SIZE = 4
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?([hlLqjzt]*)([diouxXcfFeEgGaAspn%])")
+
+
+class Elf(object):
+    """Reads NUL terminated strings at given addresses of an ELF file."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            fmt = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            fmt = endian + "IIIIII"
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, flags, addr, offset, size = struct.unpack_from(
+                fmt, self.data, shoff + i * shentsize)
+            # Allocated sections that have contents in the file (not NOBITS)
+            if flags & 0x2 and sh_type != 8 and addr:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        if not address:
+            return ""
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.find(b"\0", start, offset + size)
+                return self.data[start:end].decode("utf-8", "replace")
+        return "<0x%08x>" % address
+
+
+class NoElf(object):
+    """Stands in for the ELF file when there is none, strings show as addresses."""
+
+    def string(self, address):
+        return "<0x%08x>" % address if address else ""
+
+
+def render(fmt, args):
+    """Formats the arguments stored by capture_args() in azx_log.c."""
+    pos = [0]
+
+    def take(size, code):
+        value, = struct.unpack_from("<" + code, args, pos[0])
+        pos[0] += size
+        return value
+
+    def convert(match):
+        flags, width, precision, length, conv = match.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = str(take(4, "i"))
+        if precision == "*":
+            precision = str(take(4, "i"))
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "")
+        if conv in "diouxXc":
+            wide = "ll" in length or "q" in length or "j" in length
+            value = take(8, "q") if wide else take(4, "i")
+            if conv in "uoxX" and value < 0:
+                value += 1 << (64 if wide else 32)
+            if conv == "c":
+                return (spec + "c") % chr(value & 0xFF)
+            return (spec + ("d" if conv in "iu" else conv)) % value
+        if conv in "fFeEgGaA":
+            value = take(8, "d")
+            return (spec + ("f" if conv in "aA" else conv)) % value
+        if conv == "s":
+            size = args[pos[0]]
+            value = args[pos[0] + 1:pos[0] + 1 + size].decode("utf-8", "replace")
+            pos[0] += 1 + size
+            return (spec + "s") % value
+        value = take(POINTER_SIZE, "I")
+        return "" if conv == "n" else "0x%x" % value
+
+    try:
+        return CONVERSION.sub(convert, fmt)
+    except (struct.error, IndexError, TypeError, ValueError):
+        return fmt + " <bad arguments>"
+
+
+class Cbor(object):
+    """Reads the CBOR (RFC 8949) items written by azx_log_kv()."""
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def _argument(self, info):
+        if info < 24:
+            return info
+        size = {24: 1, 25: 2, 26: 4, 27: 8}[info]
+        value = int.from_bytes(self.data[self.pos:self.pos + size], "big")
+        self.pos += size
+        return value
+
+    def item(self):
+        first = self.data[self.pos]
+        self.pos += 1
+        major, info = first >> 5, first & 0x1F
+        if major == 7:
+            simple = {20: False, 21: True, 22: None}
+            if info in simple:
+                return simple[info]
+            code = {25: ">e", 26: ">f", 27: ">d"}[info]
+            value, = struct.unpack_from(code, self.data, self.pos)
+            self.pos += struct.calcsize(code)
+            return value
+        value = self._argument(info)
+        if major == 0:
+            return value
+        if major == 1:
+            return -1 - value
+        if major in (2, 3):
+            raw = self.data[self.pos:self.pos + value]
+            self.pos += value
+            return raw.decode("utf-8", "replace") if major == 3 else raw.hex()
+        if major == 4:
+            return [self.item() for _ in range(value)]
+        if major == 5:
+            return dict((self.item(), self.item()) for _ in range(value))
+        raise ValueError("unsupported CBOR item 0x%02x" % first)
+
+
+def decode_kv(data, start, end):
+    _, _, level, _, event, now = KV_HEADER.unpack_from(data, start)
+    fields = Cbor(data[start + KV_HEADER.size:end]).item()
+    return {"uptime_ms": now, "level": LEVELS[level], "event": event, "fields": fields}
+
+
+def decode(elf, data, out, as_json=False):
+    pos = 0
+    search = 0
+    while True:
+        start = data.find(FRAME_SYNC, search)
+        if start < 0 or start + KV_HEADER.size > len(data):
+            break
+        _, length, level, version = struct.unpack_from("<2sHBB", data, start)
+        end = start + 4 + length
+        header = FRAME_HEADER.size if version == 1 else KV_HEADER.size
+        if version not in (1, 2) or level not in LEVELS or start + header > end or \
+                end > len(data):
+            search = start + 1
+            continue
+        if not as_json:
+            # Text around the frames, as found in log files
+            out.write(data[pos:start].decode("utf-8", "replace"))
+        pos = search = end
+
+        if version == 2:
+            try:
+                event = decode_kv(data, start, end)
+            except (IndexError, KeyError, ValueError, struct.error):
+                continue
+            if as_json:
+                out.write(json.dumps(event) + "\n")
+            else:
+                now = event["uptime_ms"]
+                out.write("[%-5s] %u.%02u  event %u %s\n" % (
+                    event["level"], now // 1000, now // 10 % 100, event["event"],
+                    json.dumps(event["fields"])))
+            continue
+        if as_json:
+            continue
+
+        (_, _, _, _, line, now, task, fmt, file, function) = \
+            FRAME_HEADER.unpack_from(data, start)
+        payload = data[start + FRAME_HEADER.size:end]
+        if fmt and isinstance(elf, NoElf):
+            msg = "%s (%d bytes of arguments)\n" % (elf.string(fmt), len(payload))
+        elif fmt:
+            msg = render(elf.string(fmt), payload)
+        else:
+            msg = payload.decode("utf-8", "replace")
+        if level == 3:
+            out.write(msg)
+        else:
+            name = elf.string(file).replace("\\", "/").split("/")[-1]
+            out.write("[%-5s] %u.%02u  %s:%d - %s{%08x}$ %s" % (
+                LEVELS[level], now // 1000, now // 10 % 100, name.rsplit(".", 1)[0], line,
+                elf.string(function), task, msg))
+    if not as_json:
+        out.write(data[pos:].decode("utf-8", "replace"))
+
+
+def is_elf(path):
+    with open(path, "rb") as f:
+        return f.read(4) == b"\x7fELF"
+
+
+def main(argv):
+    args = argv[1:]
+    as_json = "--json" in args
+    args = [a for a in args if a != "--json"]
+    if args and is_elf(args[0]):
+        elf = Elf(args.pop(0))
+    else:
+        elf = NoElf()
+    if args:
+        with open(args[0], "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    decode(elf, data, sys.stdout, as_json)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,216 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+/*
+ * Times the reception of long AT responses that arrive in many RX events.
+ *
+ * Usage: ati_bench [COMMANDS] [FRAGMENT...]
+ *
+ * A scripted modem answers each command with a canned response, handing it to
+ * the ATI callback in FRAGMENT byte RX events (16, 64, 256 and 2048 by
+ * default), the way the modem delivers long responses. Each of the responses
+ * below is requested COMMANDS times (5000 by default) for each fragment size:
+ *
+ *  - AT+COPS=?  about 1.4 KB of operator list on a single line
+ *  - AT#SRECV   a 1500 byte socket payload in the middle of the response
+ *
+ * The RX events are delivered from within m2mb_ati_send_cmd(), on the task
+ * sending the command. On the module they come from the ATI task, but on a PC
+ * the task switches would cost far more than the reception being measured.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+#include "m2mb_ati.h"
+#include "azx_log.h"
+#include "azx_timer.h"
+#include "azx_ati.h"
+
+#define SRECV_PAYLOAD 1500
+#define SCRIPT_SIZE 2000
+
+typedef struct
+{
+  const CHAR* cmd;
+  CHAR response[SCRIPT_SIZE];
+  UINT32 size;
+} Script;
+
+typedef struct
+{
+  m2mb_ati_callback cb;
+  void* userdata;
+  const UINT8* rx;
+  UINT32 rx_size;
+  UINT32 fragment;
+} FakeModem;
+
+static Script scripts[2];
+static const Script okScript = { "", "\r\nOK\r\n", 6 };
+static FakeModem modem;
+
+static void build_scripts(void)
+{
+  Script* cops = &scripts[0];
+  Script* srecv = &scripts[1];
+  UINT32 i;
+
+  cops->cmd = "AT+COPS=?";
+  cops->size = sprintf(cops->response, "\r\n+COPS: ");
+  for(i = 0; cops->size < 1350; ++i)
+  {
+    cops->size += sprintf(cops->response + cops->size,
+        "(%u,\"Operator %02u\",\"Op%02u\",\"222%02u\",%u),", 1 + i % 3, i, i, i, (i % 2) * 7);
+  }
+  cops->size += sprintf(cops->response + cops->size, ",(0,1,2,3,4),(0,1,2)\r\n\r\nOK\r\n");
+
+  /* Lower case letters, so that no result code can be found in the payload by mistake */
+  srecv->cmd = "AT#SRECV";
+  srecv->size = sprintf(srecv->response, "\r\n#SRECV: 1,%u\r\n", SRECV_PAYLOAD);
+  for(i = 0; i < SRECV_PAYLOAD; ++i)
+  {
+    srecv->response[srecv->size++] = (CHAR)('a' + (i * 7919) % 26);
+  }
+  srecv->size += sprintf(srecv->response + srecv->size, "\r\n\r\nOK\r\n");
+}
+
+M2MB_RESULT_E m2mb_ati_init(M2MB_ATI_HANDLE* handle, UINT16 instance, m2mb_ati_callback cb,
+    void* userdata)
+{
+  modem.cb = cb;
+  modem.userdata = userdata;
+  *handle = &modem;
+  return M2MB_RESULT_SUCCESS;
+}
+
+M2MB_RESULT_E m2mb_ati_deinit(M2MB_ATI_HANDLE handle)
+{
+  return M2MB_RESULT_SUCCESS;
+}
+
+M2MB_RESULT_E m2mb_ati_send_cmd(M2MB_ATI_HANDLE handle, void* buf, SIZE_T nbyte)
+{
+  const Script* script = &okScript;
+  UINT32 pos = 0;
+  UINT32 i;
+
+  for(i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+  {
+    if(strncmp((const CHAR*)buf, scripts[i].cmd, strlen(scripts[i].cmd)) == 0)
+    {
+      script = &scripts[i];
+    }
+  }
+  while(pos < script->size)
+  {
+    UINT16 size = (UINT16)(script->size - pos < modem.fragment ?
+        script->size - pos : modem.fragment);
+    modem.rx = (const UINT8*)script->response + pos;
+    modem.rx_size = size;
+    modem.cb(&modem, M2MB_RX_DATA_EVT, sizeof(size), &size, modem.userdata);
+    if(modem.rx_size == size)
+    {
+      fprintf(stderr, "The RX event was not read\n");
+      exit(1);
+    }
+    pos += size - modem.rx_size;
+  }
+  return M2MB_RESULT_SUCCESS;
+}
+
+SSIZE_T m2mb_ati_rcv_resp(M2MB_ATI_HANDLE handle, void* buf, SIZE_T nbyte)
+{
+  SIZE_T size = nbyte < modem.rx_size ? nbyte : modem.rx_size;
+  memcpy(buf, modem.rx, size);
+  modem.rx += size;
+  modem.rx_size -= size;
+  return (SSIZE_T)size;
+}
+
+/* The commands are sent with a timeout, but the modem always answers */
+AZX_TIMER_ID azx_timer_initWithCb(azx_expiration_cb cb, void* ctx, UINT32 duration_ms)
+{
+  return 1;
+}
+
+void azx_timer_start(AZX_TIMER_ID id, UINT32 duration_ms, BOOLEAN restart)
+{
+}
+
+void azx_timer_stop(AZX_TIMER_ID id)
+{
+}
+
+BOOLEAN azx_timer_deinit(AZX_TIMER_ID timer_id)
+{
+  return TRUE;
+}
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static BOOLEAN run(const Script* script, long commands, UINT32 fragment)
+{
+  double start, elapsed;
+  long i;
+
+  modem.fragment = fragment;
+  start = now_seconds();
+  for(i = 0; i < commands; ++i)
+  {
+    const struct AzxBinaryData* rsp = azx_ati_sendCommandBinaryEx(0, 5000, script->cmd);
+    if(!rsp || rsp->size < (SSIZE_T)script->size - 8)
+    {
+      fprintf(stderr, "%s: short response (%ld bytes)\n", script->cmd, rsp ? (long)rsp->size : -1L);
+      return FALSE;
+    }
+  }
+  elapsed = now_seconds() - start;
+  printf("%-10s %4u B responses in %4u B fragments: %7.1f us/command\n",
+      script->cmd, script->size, fragment, elapsed * 1e6 / commands);
+  return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+  static const UINT32 defaultFragments[] = { 16, 64, 256, 2048 };
+  AZX_LOG_CFG_T cfg = { AZX_LOG_LEVEL_INFO, AZX_LOG_TO_USB1, FALSE };
+  long commands = argc > 1 ? atol(argv[1]) : 5000;
+  UINT32 i, s;
+
+  azx_log_init(&cfg);
+  build_scripts();
+
+  for(s = 0; s < sizeof(scripts) / sizeof(scripts[0]); ++s)
+  {
+    if(argc > 2)
+    {
+      for(i = 2; i < (UINT32)argc; ++i)
+      {
+        if(!run(&scripts[s], commands, (UINT32)atoi(argv[i])))
+        {
+          return 1;
+        }
+      }
+    }
+    else
+    {
+      for(i = 0; i < sizeof(defaultFragments) / sizeof(defaultFragments[0]); ++i)
+      {
+        if(!run(&scripts[s], commands, defaultFragments[i]))
+        {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
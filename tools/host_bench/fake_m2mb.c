@@ -0,0 +1,413 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+/*
+ * Host fakes of the m2mb API, backed by pthreads and stdio, so that the AZX
+ * sources can be timed on a PC.
+ *
+ * The RTC and task name lookups make one system call each, standing in for the
+ * kernel transition they take on the module. Data written to USB and UART is
+ * only counted.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "m2mb_types.h"
+#include "m2mb_os_api.h"
+#include "m2mb_usb.h"
+#include "m2mb_uart.h"
+#include "m2mb_rtc.h"
+#include "m2mb_fs_posix.h"
+#include "m2mb_fs_stdio.h"
+
+#include "fake_m2mb.h"
+
+UINT64 fake_channel_bytes = 0;
+UINT32 fake_channel_writes = 0;
+
+/* Semaphores ================================================================*/
+
+typedef struct
+{
+  UINT32 count;
+} FakeSemAttr;
+
+M2MB_OS_RESULT_E m2mb_os_sem_setAttrItem(M2MB_OS_SEM_ATTR_HANDLE* attr, UINT32 n, ...)
+{
+  va_list ap;
+  UINT32 cmd;
+  FakeSemAttr* a;
+
+  va_start(ap, n);
+  cmd = va_arg(ap, UINT32);
+  if(cmd == M2MB_OS_SEM_SEL_CMD_CREATE_ATTR)
+  {
+    a = calloc(1, sizeof(*a));
+    (void)va_arg(ap, void*);
+    /* The name always comes last */
+    while((cmd = va_arg(ap, UINT32)) != M2MB_OS_SEM_SEL_CMD_NAME)
+    {
+      UINT32 value = va_arg(ap, UINT32);
+      if(cmd == M2MB_OS_SEM_SEL_CMD_COUNT)
+      {
+        a->count = value;
+      }
+    }
+    *attr = (M2MB_OS_SEM_ATTR_HANDLE)a;
+  }
+  else if(cmd == M2MB_OS_SEM_SEL_CMD_DEL_ATTR)
+  {
+    free(*attr);
+    *attr = NULL;
+  }
+  va_end(ap);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_sem_init(M2MB_OS_SEM_HANDLE* handle, M2MB_OS_SEM_ATTR_HANDLE* attr)
+{
+  sem_t* s = malloc(sizeof(*s));
+  FakeSemAttr* a = (FakeSemAttr*)*attr;
+
+  sem_init(s, 0, a ? a->count : 0);
+  free(a);
+  *attr = NULL;
+  *handle = (M2MB_OS_SEM_HANDLE)s;
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_sem_get(M2MB_OS_SEM_HANDLE handle, UINT32 timeout)
+{
+  struct timespec ts;
+
+  if(timeout == M2MB_OS_WAIT_FOREVER)
+  {
+    sem_wait((sem_t*)handle);
+    return M2MB_OS_SUCCESS;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)timeout * 10000000L;
+  ts.tv_sec += ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+  while(sem_timedwait((sem_t*)handle, &ts) != 0)
+  {
+    if(errno != EINTR)
+    {
+      return M2MB_OS_WAIT_ABORTED;
+    }
+  }
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_sem_put(M2MB_OS_SEM_HANDLE handle)
+{
+  sem_post((sem_t*)handle);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_sem_deinit(M2MB_OS_SEM_HANDLE handle)
+{
+  sem_destroy((sem_t*)handle);
+  free(handle);
+  return M2MB_OS_SUCCESS;
+}
+
+/* Mutexes ===================================================================*/
+
+M2MB_OS_RESULT_E m2mb_os_mtx_setAttrItem_(M2MB_OS_MTX_ATTR_HANDLE* attr, ...)
+{
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_mtx_init(M2MB_OS_MTX_HANDLE* handle, M2MB_OS_MTX_ATTR_HANDLE* attr)
+{
+  pthread_mutex_t* m = malloc(sizeof(*m));
+  pthread_mutexattr_t a;
+
+  /* m2mb mutexes can be taken again by their owner */
+  pthread_mutexattr_init(&a);
+  pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(m, &a);
+  pthread_mutexattr_destroy(&a);
+  *handle = (M2MB_OS_MTX_HANDLE)m;
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_mtx_get(M2MB_OS_MTX_HANDLE handle, UINT32 timeout)
+{
+  pthread_mutex_lock((pthread_mutex_t*)handle);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_mtx_put(M2MB_OS_MTX_HANDLE handle)
+{
+  pthread_mutex_unlock((pthread_mutex_t*)handle);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_mtx_deinit(M2MB_OS_MTX_HANDLE handle)
+{
+  pthread_mutex_destroy((pthread_mutex_t*)handle);
+  free(handle);
+  return M2MB_OS_SUCCESS;
+}
+
+/* Tasks =====================================================================*/
+
+typedef struct
+{
+  pthread_t thread;
+  void (*entry)(void*);
+  void* arg;
+  CHAR name[32];
+} FakeTask;
+
+static __thread FakeTask* currentTask = NULL;
+static FakeTask mainTask = { .name = "main" };
+
+static void* task_main(void* arg)
+{
+  FakeTask* t = (FakeTask*)arg;
+  currentTask = t;
+  t->entry(t->arg);
+  return NULL;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskSetAttrItem(M2MB_OS_TASK_ATTR_HANDLE* attr, UINT32 n, ...)
+{
+  va_list ap;
+  UINT32 cmd;
+  FakeTask* t;
+
+  va_start(ap, n);
+  cmd = va_arg(ap, UINT32);
+  if(cmd == M2MB_OS_TASK_SEL_CMD_CREATE_ATTR)
+  {
+    t = calloc(1, sizeof(*t));
+    (void)va_arg(ap, void*);
+    while((cmd = va_arg(ap, UINT32)) <= M2MB_OS_TASK_SEL_CMD_STATE)
+    {
+      void* value = va_arg(ap, void*);
+      if(cmd == M2MB_OS_TASK_SEL_CMD_NAME)
+      {
+        strncpy(t->name, (const CHAR*)value, sizeof(t->name) - 1);
+        break;
+      }
+    }
+    *attr = (M2MB_OS_TASK_ATTR_HANDLE)t;
+  }
+  else if(cmd == M2MB_OS_TASK_SEL_CMD_DEL_ATTR)
+  {
+    free(*attr);
+    *attr = NULL;
+  }
+  va_end(ap);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskCreate(M2MB_OS_TASK_HANDLE* handle, M2MB_OS_TASK_ATTR_HANDLE* attr,
+    void (*entry)(void*), void* arg)
+{
+  FakeTask* t = (FakeTask*)*attr;
+
+  *attr = NULL;
+  t->entry = entry;
+  t->arg = arg;
+  if(pthread_create(&t->thread, NULL, task_main, t) != 0)
+  {
+    free(t);
+    return M2MB_OS_NO_MEMORY;
+  }
+  *handle = (M2MB_OS_TASK_HANDLE)t;
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskTerminate(M2MB_OS_TASK_HANDLE handle)
+{
+  FakeTask* t = (FakeTask*)handle;
+  pthread_cancel(t->thread);
+  pthread_join(t->thread, NULL);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskDelete(M2MB_OS_TASK_HANDLE handle)
+{
+  free(handle);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskGetItem(M2MB_OS_TASK_HANDLE handle, UINT32 sel, MEM_W* out, void* x)
+{
+  FakeTask* t = (FakeTask*)handle;
+
+  syscall(SYS_getpid);
+  *out = (sel == M2MB_OS_TASK_SEL_CMD_NAME) ? (MEM_W)t->name : 0;
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_RESULT_E m2mb_os_taskSleep(UINT32 ticks)
+{
+  usleep(ticks * 10000);
+  return M2MB_OS_SUCCESS;
+}
+
+M2MB_OS_TASK_HANDLE m2mb_os_taskGetId(void)
+{
+  return (M2MB_OS_TASK_HANDLE)(currentTask ? currentTask : &mainTask);
+}
+
+/* Time and memory ===========================================================*/
+
+UINT32 m2mb_os_getSysTicks(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (UINT32)(ts.tv_sec * 100 + ts.tv_nsec / 10000000);
+}
+
+FLOAT32 m2mb_os_getSysTickDuration_ms(void)
+{
+  return 10;
+}
+
+void* m2mb_os_malloc(UINT32 size)
+{
+  return malloc(size);
+}
+
+void* m2mb_os_calloc(UINT32 size)
+{
+  return calloc(1, size);
+}
+
+M2MB_OS_RESULT_E m2mb_os_free(void* ptr)
+{
+  free(ptr);
+  return M2MB_OS_SUCCESS;
+}
+
+/* Log channels ==============================================================*/
+
+INT32 m2mb_usb_open(const CHAR* path, INT32 flags)
+{
+  return 3;
+}
+
+INT32 m2mb_usb_close(INT32 fd)
+{
+  return 0;
+}
+
+SSIZE_T m2mb_usb_write(INT32 fd, const void* buf, SIZE_T len)
+{
+  fake_channel_writes++;
+  fake_channel_bytes += len;
+  return (SSIZE_T)len;
+}
+
+INT32 m2mb_uart_open(const CHAR* path, INT32 flags)
+{
+  return 4;
+}
+
+INT32 m2mb_uart_close(INT32 fd)
+{
+  return 0;
+}
+
+SSIZE_T m2mb_uart_write(INT32 fd, const void* buf, SIZE_T len)
+{
+  return m2mb_usb_write(fd, buf, len);
+}
+
+/* RTC =======================================================================*/
+
+INT32 m2mb_rtc_open(const CHAR* path, INT32 flags)
+{
+  return open("/dev/null", O_RDONLY);
+}
+
+INT32 m2mb_rtc_close(INT32 fd)
+{
+  return close(fd);
+}
+
+INT32 m2mb_rtc_ioctl(INT32 fd, INT32 cmd, ...)
+{
+  va_list ap;
+  M2MB_RTC_TIME_T* t;
+  time_t now = time(NULL);
+  struct tm tm;
+
+  va_start(ap, cmd);
+  t = va_arg(ap, M2MB_RTC_TIME_T*);
+  va_end(ap);
+  localtime_r(&now, &tm);
+  t->year = (UINT8)(tm.tm_year % 100);
+  t->mon = (UINT8)(tm.tm_mon + 1);
+  t->day = (UINT8)tm.tm_mday;
+  t->hour = (UINT8)tm.tm_hour;
+  t->min = (UINT8)tm.tm_min;
+  t->sec = (UINT8)tm.tm_sec;
+  t->msec = 0;
+  return 0;
+}
+
+/* File system ===============================================================*/
+
+INT32 m2mb_fs_stat(const CHAR* path, struct M2MB_STAT* st)
+{
+  struct stat s;
+  if(stat(path, &s) != 0)
+  {
+    return -1;
+  }
+  st->st_size = (UINT32)s.st_size;
+  st->st_mode = (UINT32)s.st_mode;
+  return 0;
+}
+
+M2MB_FILE_T* m2mb_fs_fopen(const CHAR* path, const CHAR* mode)
+{
+  return (M2MB_FILE_T*)fopen(path, mode);
+}
+
+INT32 m2mb_fs_fclose(M2MB_FILE_T* f)
+{
+  return fclose((FILE*)f);
+}
+
+SIZE_T m2mb_fs_fwrite(const void* buf, SIZE_T size, SIZE_T n, M2MB_FILE_T* f)
+{
+  return fwrite(buf, size, n, (FILE*)f);
+}
+
+INT32 m2mb_fs_fputs(const CHAR* str, M2MB_FILE_T* f)
+{
+  return fputs(str, (FILE*)f);
+}
+
+INT32 m2mb_fs_fflush(M2MB_FILE_T* f)
+{
+  return fflush((FILE*)f);
+}
+
+INT32 m2mb_fs_remove(const CHAR* path)
+{
+  return remove(path);
+}
+
+INT32 m2mb_fs_rename(const CHAR* from, const CHAR* to)
+{
+  return rename(from, to);
+}
@@ -0,0 +1,13 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+#ifndef FAKE_M2MB_H
+#define FAKE_M2MB_H
+
+#include "m2mb_types.h"
+
+/* What was written to the USB and UART log channels */
+extern UINT64 fake_channel_bytes;
+extern UINT32 fake_channel_writes;
+
+#endif
@@ -0,0 +1,55 @@
+/*Copyright (C) 2020 Telit Communications S.p.A. Italy - All Rights Reserved.*/
+/*    See LICENSE file in the project root for full license information.     */
+
+/*
+ * Times synchronous azx_log lines, which spend most of their time building the
+ * prefix (date and time, task name, file title).
+ *
+ * Usage: log_bench [LINES] [FILE]
+ *
+ * Every line goes to the console channel and to FILE (log_bench.log by default),
+ * the way an application logging to USB and to a file would.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "m2mb_types.h"
+#include "azx_log.h"
+
+#include "fake_m2mb.h"
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+  AZX_LOG_CFG_T cfg = { AZX_LOG_LEVEL_DEBUG, AZX_LOG_TO_USB1, FALSE };
+  long lines = argc > 1 ? atol(argv[1]) : 300000;
+  const char* file = argc > 2 ? argv[2] : "log_bench.log";
+  double start, elapsed;
+  long i;
+
+  azx_log_init(&cfg);
+  if(!azx_log_send_to_file(file, 0, AZX_LOG_LEVEL_DEBUG, 1024 * 1024))
+  {
+    fprintf(stderr, "Cannot log to %s\n", file);
+    return 1;
+  }
+
+  start = now_seconds();
+  for(i = 0; i < lines; ++i)
+  {
+    AZX_LOG_DEBUG("bench %ld value %s\r\n", i, "abc");
+  }
+  elapsed = now_seconds() - start;
+  azx_log_flush_to_file();
+
+  printf("%ld lines in %.3f s: %.0f lines/s, %llu bytes to the console\n",
+      lines, elapsed, lines / elapsed, (unsigned long long)fake_channel_bytes);
+  return 0;
+}
@@ -0,0 +1,17 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#include "m2mb_types.h"
+
+typedef void* M2MB_ATI_HANDLE;
+
+typedef enum
+{
+  M2MB_RX_DATA_EVT,
+  M2MB_STATE_IDLE_EVT
+} M2MB_ATI_EVENTS_E;
+
+typedef void (*m2mb_ati_callback)(M2MB_ATI_HANDLE, M2MB_ATI_EVENTS_E, UINT16, void*, void*);
+
+M2MB_RESULT_E m2mb_ati_init(M2MB_ATI_HANDLE*, UINT16, m2mb_ati_callback, void*);
+M2MB_RESULT_E m2mb_ati_deinit(M2MB_ATI_HANDLE);
+M2MB_RESULT_E m2mb_ati_send_cmd(M2MB_ATI_HANDLE, void*, SIZE_T);
+SSIZE_T m2mb_ati_rcv_resp(M2MB_ATI_HANDLE, void*, SIZE_T);
@@ -0,0 +1,10 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#include "m2mb_types.h"
+
+struct M2MB_STAT
+{
+  UINT32 st_size;
+  UINT32 st_mode;
+};
+
+INT32 m2mb_fs_stat(const CHAR*, struct M2MB_STAT*);
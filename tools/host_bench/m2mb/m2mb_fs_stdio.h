@@ -0,0 +1,12 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#include "m2mb_types.h"
+
+typedef struct M2MB_FILE_S M2MB_FILE_T;
+
+M2MB_FILE_T* m2mb_fs_fopen(const CHAR*, const CHAR*);
+INT32 m2mb_fs_fclose(M2MB_FILE_T*);
+SIZE_T m2mb_fs_fwrite(const void*, SIZE_T, SIZE_T, M2MB_FILE_T*);
+INT32 m2mb_fs_fputs(const CHAR*, M2MB_FILE_T*);
+INT32 m2mb_fs_fflush(M2MB_FILE_T*);
+INT32 m2mb_fs_remove(const CHAR*);
+INT32 m2mb_fs_rename(const CHAR*, const CHAR*);
@@ -0,0 +1,53 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#ifndef M2MB_OS_API_H
+#define M2MB_OS_API_H
+
+#include "m2mb_os_types.h"
+
+M2MB_OS_RESULT_E m2mb_os_sem_setAttrItem(M2MB_OS_SEM_ATTR_HANDLE*, UINT32, ...);
+M2MB_OS_RESULT_E m2mb_os_sem_init(M2MB_OS_SEM_HANDLE*, M2MB_OS_SEM_ATTR_HANDLE*);
+M2MB_OS_RESULT_E m2mb_os_sem_get(M2MB_OS_SEM_HANDLE, UINT32);
+M2MB_OS_RESULT_E m2mb_os_sem_put(M2MB_OS_SEM_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_sem_deinit(M2MB_OS_SEM_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_sem_getItem(M2MB_OS_SEM_HANDLE, UINT32, MEM_W*, void*);
+
+M2MB_OS_RESULT_E m2mb_os_mtx_setAttrItem_(M2MB_OS_MTX_ATTR_HANDLE*, ...);
+M2MB_OS_RESULT_E m2mb_os_mtx_init(M2MB_OS_MTX_HANDLE*, M2MB_OS_MTX_ATTR_HANDLE*);
+M2MB_OS_RESULT_E m2mb_os_mtx_get(M2MB_OS_MTX_HANDLE, UINT32);
+M2MB_OS_RESULT_E m2mb_os_mtx_put(M2MB_OS_MTX_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_mtx_deinit(M2MB_OS_MTX_HANDLE);
+
+M2MB_OS_RESULT_E m2mb_os_q_setAttrItem(M2MB_OS_Q_ATTR_HANDLE*, UINT32, ...);
+M2MB_OS_RESULT_E m2mb_os_q_init(M2MB_OS_Q_HANDLE*, M2MB_OS_Q_ATTR_HANDLE*);
+M2MB_OS_RESULT_E m2mb_os_q_tx(M2MB_OS_Q_HANDLE, void*, UINT32, UINT8);
+M2MB_OS_RESULT_E m2mb_os_q_rx(M2MB_OS_Q_HANDLE, void*, UINT32);
+M2MB_OS_RESULT_E m2mb_os_q_clear(M2MB_OS_Q_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_q_deinit(M2MB_OS_Q_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_q_getItem(M2MB_OS_Q_HANDLE, UINT32, MEM_W*, void*);
+
+M2MB_OS_RESULT_E m2mb_os_taskSetAttrItem(M2MB_OS_TASK_ATTR_HANDLE*, UINT32, ...);
+M2MB_OS_RESULT_E m2mb_os_taskCreate(M2MB_OS_TASK_HANDLE*, M2MB_OS_TASK_ATTR_HANDLE*,
+    void (*)(void*), void*);
+M2MB_OS_RESULT_E m2mb_os_taskTerminate(M2MB_OS_TASK_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_taskDelete(M2MB_OS_TASK_HANDLE);
+M2MB_OS_RESULT_E m2mb_os_taskGetItem(M2MB_OS_TASK_HANDLE, UINT32, MEM_W*, void*);
+M2MB_OS_RESULT_E m2mb_os_taskSleep(UINT32);
+M2MB_OS_TASK_HANDLE m2mb_os_taskGetId(void);
+
+M2MB_OS_RESULT_E m2mb_os_ev_setAttrItem(M2MB_OS_EV_ATTR_HANDLE*, UINT32, ...);
+M2MB_OS_RESULT_E m2mb_os_ev_init(M2MB_OS_EV_HANDLE*, M2MB_OS_EV_ATTR_HANDLE*);
+M2MB_OS_RESULT_E m2mb_os_ev_set(M2MB_OS_EV_HANDLE, UINT32, UINT32);
+M2MB_OS_RESULT_E m2mb_os_ev_get(M2MB_OS_EV_HANDLE, UINT32, UINT32, UINT32*, UINT32);
+M2MB_OS_RESULT_E m2mb_os_ev_deinit(M2MB_OS_EV_HANDLE);
+
+UINT32 m2mb_os_getSysTicks(void);
+FLOAT32 m2mb_os_getSysTickDuration_ms(void);
+
+void* m2mb_os_malloc(UINT32);
+void* m2mb_os_calloc(UINT32);
+M2MB_OS_RESULT_E m2mb_os_free(void*);
+
+UINT32 m2mb_os_enterCritSec(void);
+void m2mb_os_exitCritSec(UINT32);
+
+#endif
@@ -0,0 +1,2 @@
+/* Host stand-in for the m2mb SDK header. */
+#include "m2mb_os_api.h"
@@ -0,0 +1,71 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#ifndef M2MB_OS_TYPES_H
+#define M2MB_OS_TYPES_H
+
+#include "m2mb_types.h"
+
+typedef enum
+{
+  M2MB_OS_SUCCESS = 0,
+  M2MB_OS_DELETED,
+  M2MB_OS_NO_MEMORY,
+  M2MB_OS_QUEUE_EMPTY,
+  M2MB_OS_QUEUE_FULL,
+  M2MB_OS_WAIT_ABORTED,
+  M2MB_OS_NO_INSTANCE
+} M2MB_OS_RESULT_E;
+
+typedef struct M2MB_OS_TASK_S* M2MB_OS_TASK_HANDLE;
+typedef struct M2MB_OS_TASK_ATTR_S* M2MB_OS_TASK_ATTR_HANDLE;
+typedef struct M2MB_OS_Q_S* M2MB_OS_Q_HANDLE;
+typedef struct M2MB_OS_Q_ATTR_S* M2MB_OS_Q_ATTR_HANDLE;
+typedef struct M2MB_OS_SEM_S* M2MB_OS_SEM_HANDLE;
+typedef struct M2MB_OS_SEM_ATTR_S* M2MB_OS_SEM_ATTR_HANDLE;
+typedef struct M2MB_OS_MTX_S* M2MB_OS_MTX_HANDLE;
+typedef struct M2MB_OS_MTX_ATTR_S* M2MB_OS_MTX_ATTR_HANDLE;
+typedef struct M2MB_OS_EV_S* M2MB_OS_EV_HANDLE;
+typedef struct M2MB_OS_EV_ATTR_S* M2MB_OS_EV_ATTR_HANDLE;
+
+#define M2MB_OS_TASK_INVALID NULL
+#define M2MB_OS_Q_INVALID NULL
+#define M2MB_OS_SEM_INVALID NULL
+#define M2MB_OS_MTX_INVALID NULL
+#define M2MB_OS_EV_INVALID NULL
+
+#define M2MB_OS_WAIT_FOREVER 0xFFFFFFFF
+#define M2MB_OS_NO_WAIT 0
+/* One tick is 10 ms, as on the modules */
+#define M2MB_OS_MS2TICKS(ms) ((ms) / 10)
+#define M2MB_OS_TASK_AUTOSTART 1
+
+#define BYTES_FOR_MSG(t) (sizeof(t))
+#define WORD32_FOR_MSG(t) ((sizeof(t) + 3) / 4)
+#define CMDS_ARGS(...) 0, __VA_ARGS__
+
+enum
+{
+  M2MB_OS_SEM_SEL_CMD_CREATE_ATTR, M2MB_OS_SEM_SEL_CMD_COUNT, M2MB_OS_SEM_SEL_CMD_TYPE,
+  M2MB_OS_SEM_SEL_CMD_NAME, M2MB_OS_SEM_SEL_CMD_USRNAME, M2MB_OS_SEM_SEL_CMD_DEL_ATTR,
+  M2MB_OS_SEM_SEL_CMD_CURR_COUNT
+};
+enum { M2MB_OS_SEM_GEN, M2MB_OS_SEM_BINARY, M2MB_OS_SEM_COUNTING };
+enum
+{
+  M2MB_OS_MTX_SEL_CMD_CREATE_ATTR, M2MB_OS_MTX_SEL_CMD_NAME, M2MB_OS_MTX_SEL_CMD_USRNAME,
+  M2MB_OS_MTX_SEL_CMD_INHERIT
+};
+enum
+{
+  M2MB_OS_Q_SEL_CMD_CREATE_ATTR, M2MB_OS_Q_SEL_CMD_DEL_ATTR, M2MB_OS_Q_SEL_CMD_MSG_SIZE,
+  M2MB_OS_Q_SEL_CMD_QSIZE, M2MB_OS_Q_SEL_CMD_ENQUEUED, M2MB_OS_Q_SEL_CMD_NAME
+};
+enum
+{
+  M2MB_OS_TASK_SEL_CMD_CREATE_ATTR, M2MB_OS_TASK_SEL_CMD_DEL_ATTR, M2MB_OS_TASK_SEL_CMD_STACK_SIZE,
+  M2MB_OS_TASK_SEL_CMD_NAME, M2MB_OS_TASK_SEL_CMD_PRIORITY, M2MB_OS_TASK_SEL_CMD_PREEMPTIONTH,
+  M2MB_OS_TASK_SEL_CMD_AUTOSTART, M2MB_OS_TASK_SEL_CMD_USRNAME, M2MB_OS_TASK_SEL_CMD_STATE
+};
+enum { M2MB_OS_EV_SEL_CMD_CREATE_ATTR, M2MB_OS_EV_SEL_CMD_NAME, M2MB_OS_EV_SEL_CMD_USRNAME };
+enum { M2MB_OS_EV_GET_ANY, M2MB_OS_EV_GET_ANY_AND_CLEAR, M2MB_OS_EV_GET_ALL_AND_CLEAR };
+
+#endif
@@ -0,0 +1,14 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#include "m2mb_types.h"
+
+typedef struct
+{
+  UINT8 year, mon, day, hour, min, sec;
+  UINT16 msec;
+} M2MB_RTC_TIME_T;
+
+enum { M2MB_RTC_IOCTL_GET_SYSTEM_TIME };
+
+INT32 m2mb_rtc_open(const CHAR*, INT32);
+INT32 m2mb_rtc_close(INT32);
+INT32 m2mb_rtc_ioctl(INT32, INT32, ...);
@@ -0,0 +1,33 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#ifndef M2MB_TYPES_H
+#define M2MB_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef char CHAR;
+typedef unsigned char UINT8;
+typedef signed char INT8;
+typedef unsigned short UINT16;
+typedef short INT16;
+typedef unsigned int UINT32;
+typedef int INT32;
+typedef unsigned long long UINT64;
+typedef long long INT64;
+typedef float FLOAT32;
+typedef double FLOAT64;
+typedef UINT8 BOOLEAN;
+typedef size_t SIZE_T;
+typedef long SSIZE_T;
+typedef uintptr_t MEM_W;
+
+#define TRUE 1
+#define FALSE 0
+
+typedef enum
+{
+  M2MB_RESULT_SUCCESS = 0,
+  M2MB_RESULT_FAIL = 1
+} M2MB_RESULT_E;
+
+#endif
@@ -0,0 +1,6 @@
+/* Host stand-in for the m2mb SDK header, only what the benchmarks need. */
+#include "m2mb_types.h"
+
+INT32 m2mb_uart_open(const CHAR*, INT32);
+INT32 m2mb_uart_close(INT32);
+SSIZE_T m2mb_uart_write(INT32, const void*, SIZE_T);